@@ -0,0 +1,518 @@
+
+// utils_bench - throughput of the parse, file and bitmap functions on synthetic input
+//
+// usage: utils_bench [text megabytes, 16 by default] [bitmap side, 2048 by default]
+//
+// every function runs for about BENCH_TIME seconds on each input and gets one line
+// with MB/s, lines/s or pixels/s and the allocations per call. the allocations are
+// only counted when utils.c is built with UTILS_MEMORY_STATS (the cmake target does)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define BENCH_TIME 0.5
+#define BENCH_TEXT_FILE "utils_bench.txt"
+#define BENCH_BITMAP_FILE "utils_bench.bmp"
+#define BENCH_QOI_FILE "utils_bench.qoi"
+
+typedef struct benchcase_s
+{
+	const char* pszInput;
+	char* pText; // master copy, the parse functions cut a work copy
+	char* pWork;
+	int iSize;
+	int nLines;
+	bitmap_t* pbmp;
+	bitmap_t* pbmpDst;
+	int nTokens;
+} benchcase_t;
+
+typedef double (*PFBENCHRUN)(benchcase_t* pbc); // seconds spent in the function
+
+
+//
+// helpers
+//
+
+static unsigned int g_iRandom = 12345;
+
+static int _Random(int n)
+{
+	g_iRandom = g_iRandom * 1103515245 + 12345;
+
+	return (int)((g_iRandom >> 8) % (unsigned int)n);
+}
+
+
+static double _Now(void)
+{
+	LARGE_INTEGER t;
+	LARGE_INTEGER f;
+
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+
+	return (double)t.QuadPart / (double)f.QuadPart;
+}
+
+
+static void _AppendWord(char* p, int* pi, int iMaxSize)
+{
+	static const char* apszWords[] = { "alpha", "beta", "x", "value", "0.125", "item_name", "#10", "zeta-omega" };
+	const char* psz = apszWords[_Random(sizeof(apszWords) / sizeof(apszWords[0]))];
+	int n = (int)strlen(psz);
+
+	if (*pi + n < iMaxSize)
+	{
+		memcpy(&p[*pi], psz, n);
+		*pi += n;
+	}
+}
+
+
+//
+// synthetic text, iSize bytes plus the 0 ReadFileToBuffer() would add
+//
+
+#define TEXT_SHORT		0 // short key value lines
+#define TEXT_LONG		1 // lines of a few hundred chars
+#define TEXT_QUOTED		2 // most args quoted, with spaces inside
+#define TEXT_COMMENTS	3 // large block comments and line comments around short lines
+
+static const char* g_apszTextNames[] = { "short lines", "long lines", "quoted", "comments" };
+
+static char* _MakeText(int iKind, int iSize, int* pnLines)
+{
+	char* p;
+	int nLines;
+	int iLineEnd;
+	int i, j;
+
+	p = (char*)AllocMemory(iSize + 1);
+	nLines = 0;
+	i = 0;
+
+	while (i < iSize - 1)
+	{
+		switch (iKind)
+		{
+		case TEXT_SHORT:
+			_AppendWord(p, &i, iSize);
+			if (i < iSize) p[i++] = ' ';
+			if (i < iSize) p[i++] = '=';
+			if (i < iSize) p[i++] = ' ';
+			_AppendWord(p, &i, iSize);
+			break;
+
+		case TEXT_LONG:
+			// min() evaluates its args twice, draw the length first
+			iLineEnd = i + 200 + _Random(400);
+			iLineEnd = min(iLineEnd, iSize - 1);
+			while (i < iLineEnd)
+			{
+				_AppendWord(p, &i, iLineEnd);
+				if (i < iLineEnd) p[i++] = (_Random(4) == 0)? '\t': ' ';
+			}
+			break;
+
+		case TEXT_QUOTED:
+			for (j = 0; j < 6; j++)
+			{
+				if (i < iSize) p[i++] = '\"';
+				_AppendWord(p, &i, iSize);
+				if (i < iSize) p[i++] = ' ';
+				_AppendWord(p, &i, iSize);
+				if (i < iSize) p[i++] = '\"';
+				if (i < iSize) p[i++] = ' ';
+			}
+			break;
+
+		case TEXT_COMMENTS:
+			if (_Random(8) == 0)
+			{
+				// a block comment of a few kb
+				iLineEnd = i + 1024 + _Random(4096);
+				iLineEnd = min(iLineEnd, iSize - 3);
+				if (i + 2 < iLineEnd) { p[i++] = '/'; p[i++] = '*'; }
+				while (i < iLineEnd)
+				{
+					_AppendWord(p, &i, iLineEnd);
+					if (i < iLineEnd) p[i++] = (_Random(8) == 0)? '\n': ' ';
+				}
+				if (i + 2 <= iSize) { p[i++] = '*'; p[i++] = '/'; }
+			}
+			else
+			{
+				_AppendWord(p, &i, iSize);
+				if (i < iSize) p[i++] = ' ';
+				_AppendWord(p, &i, iSize);
+				if (i + 3 < iSize) { p[i++] = ' '; p[i++] = '/'; p[i++] = '/'; }
+				_AppendWord(p, &i, iSize);
+			}
+			break;
+		}
+
+		if (i < iSize)
+		{
+			p[i++] = '\n';
+			nLines++;
+		}
+	}
+
+	// pad to the exact size
+	while (i < iSize)
+	{
+		p[i++] = '\n';
+		nLines++;
+	}
+
+	p[iSize] = '\0';
+	*pnLines = nLines;
+
+	return p;
+}
+
+
+//
+// text functions
+//
+
+static int _CountLine(char* pszLine, void* param)
+{
+	(*(int*)param)++;
+
+	return 1;
+}
+
+
+static int _ParseLineCallback(char* pszLine, void* param)
+{
+	char* argv[64];
+
+	*(int*)param += ParseLine(64, argv, pszLine, " \t", NULL);
+
+	return 1;
+}
+
+
+static double _RunParseBuffer(benchcase_t* pbc)
+{
+	double t;
+	int nLines = 0;
+
+	memcpy(pbc->pWork, pbc->pText, pbc->iSize + 1);
+
+	t = _Now();
+	ParseBuffer(pbc->pWork, pbc->iSize, _CountLine, &nLines);
+
+	return _Now() - t;
+}
+
+
+static double _RunParseLine(benchcase_t* pbc)
+{
+	double t;
+
+	memcpy(pbc->pWork, pbc->pText, pbc->iSize + 1);
+	pbc->nTokens = 0;
+
+	t = _Now();
+	ParseBuffer(pbc->pWork, pbc->iSize, _ParseLineCallback, &pbc->nTokens);
+
+	return _Now() - t;
+}
+
+
+static double _RunCutComments(benchcase_t* pbc)
+{
+	double t;
+
+	memcpy(pbc->pWork, pbc->pText, pbc->iSize + 1);
+
+	t = _Now();
+	CutComments(pbc->pWork, "/*", "*/");
+	CutComments(pbc->pWork, "//", "\n");
+
+	return _Now() - t;
+}
+
+
+static double _RunReadFile(benchcase_t* pbc)
+{
+	double t;
+	char* buffer;
+	int iSize;
+
+	t = _Now();
+	buffer = ReadFileToBuffer(BENCH_TEXT_FILE, &iSize);
+	t = _Now() - t;
+
+	FreeMemory(buffer);
+
+	return t;
+}
+
+
+static double _RunParseFile(benchcase_t* pbc)
+{
+	double t;
+	int nLines = 0;
+
+	t = _Now();
+	ParseFile(BENCH_TEXT_FILE, _CountLine, &nLines);
+
+	return _Now() - t;
+}
+
+
+//
+// bitmap functions
+//
+
+static bitmap_t* _MakeBitmap(int iSide, int nBPP)
+{
+	bitmap_t* pbmp;
+	int x, y, i;
+
+	pbmp = AllocBitmap(iSide, iSide, nBPP, (nBPP == 1)? 256: 0);
+
+	// smooth gradients with some noise, not too kind to the encoders
+	for (y = 0; y < pbmp->iHeight; y++)
+	{
+		byte_t* p = &pbmp->pixels[y * pbmp->iPitch];
+
+		for (x = 0; x < pbmp->iWidth * nBPP; x++)
+		{
+			p[x] = (byte_t)((x / nBPP + y) / 8 + ((_Random(16) == 0)? _Random(256): 0));
+		}
+	}
+
+	for (i = 0; i < pbmp->nColors; i++)
+	{
+		pbmp->pal[i].rgbRed = pbmp->pal[i].rgbGreen = pbmp->pal[i].rgbBlue = (byte_t)i;
+		pbmp->pal[i].rgbReserved = 0;
+	}
+
+	return pbmp;
+}
+
+
+static double _RunSaveBitmap(benchcase_t* pbc)
+{
+	double t = _Now();
+
+	SaveBitmap(BENCH_BITMAP_FILE, pbc->pbmp);
+
+	return _Now() - t;
+}
+
+
+static double _RunLoadBitmap(benchcase_t* pbc)
+{
+	double t;
+	bitmap_t* pbmp;
+
+	t = _Now();
+	pbmp = LoadBitmapFromFile(BENCH_BITMAP_FILE);
+	t = _Now() - t;
+
+	if (pbmp != NULL)
+	{
+		FreeBitmap(pbmp);
+	}
+
+	return t;
+}
+
+
+static double _RunSaveBitmapQOI(benchcase_t* pbc)
+{
+	double t = _Now();
+
+	SaveBitmapQOI(BENCH_QOI_FILE, pbc->pbmp);
+
+	return _Now() - t;
+}
+
+
+static double _RunConvertBitmap(benchcase_t* pbc)
+{
+	double t = _Now();
+
+	ConvertBitmap(pbc->pbmpDst, pbc->pbmp);
+
+	return _Now() - t;
+}
+
+
+static double _RunFlipBitmap(benchcase_t* pbc)
+{
+	double t = _Now();
+
+	FlipBitmapHorizontal(pbc->pbmp);
+
+	return _Now() - t;
+}
+
+
+static double _RunScaleBox(benchcase_t* pbc)
+{
+	double t = _Now();
+
+	ScaleBitmap(pbc->pbmpDst, pbc->pbmp, SCALE_BOX);
+
+	return _Now() - t;
+}
+
+
+static double _RunScaleBilinear(benchcase_t* pbc)
+{
+	double t = _Now();
+
+	ScaleBitmap(pbc->pbmpDst, pbc->pbmp, SCALE_BILINEAR);
+
+	return _Now() - t;
+}
+
+
+//
+// runner
+//
+
+// iBytes and nUnits are per call, pszUnit is "lines" or "pixels"
+
+static void _Bench(benchcase_t* pbc, const char* pszFunc, PFBENCHRUN pfnRun, double iBytes, double nUnits, const char* pszUnit)
+{
+	memstats_t msStart;
+	memstats_t msEnd;
+	double tTotal;
+	int nRuns;
+
+	GetMemoryStats(&msStart);
+
+	tTotal = 0.0;
+	nRuns = 0;
+
+	while ((nRuns < 3) || (tTotal < BENCH_TIME))
+	{
+		tTotal += pfnRun(pbc);
+		nRuns++;
+	}
+
+	GetMemoryStats(&msEnd);
+
+	tTotal = max(tTotal, 1e-9);
+
+	printf("%-14s %-22s %10.1f MB/s %14.0f %s/s %8.1f allocs/call\n", pbc->pszInput, pszFunc,
+		iBytes * nRuns / tTotal / (1024.0 * 1024.0), nUnits * nRuns / tTotal, pszUnit,
+		(double)(msEnd.nAllocs - msStart.nAllocs) / nRuns);
+}
+
+
+static void _BenchText(int iKind, int iSize)
+{
+	benchcase_t bc;
+
+	memset(&bc, 0, sizeof(bc));
+	bc.pszInput = g_apszTextNames[iKind];
+	bc.iSize = iSize;
+	bc.pText = _MakeText(iKind, iSize, &bc.nLines);
+	bc.pWork = (char*)AllocMemory(iSize + 1);
+
+	_Bench(&bc, "ParseBuffer", _RunParseBuffer, iSize, bc.nLines, "lines");
+	_Bench(&bc, "ParseBuffer+ParseLine", _RunParseLine, iSize, bc.nLines, "lines");
+	_Bench(&bc, "CutComments", _RunCutComments, iSize, bc.nLines, "lines");
+
+	if (SaveToFile(BENCH_TEXT_FILE, bc.pText, iSize))
+	{
+		_Bench(&bc, "ReadFileToBuffer", _RunReadFile, iSize, bc.nLines, "lines");
+		_Bench(&bc, "ParseFile", _RunParseFile, iSize, bc.nLines, "lines");
+		remove(BENCH_TEXT_FILE);
+	}
+
+	FreeMemory(bc.pWork);
+	FreeMemory(bc.pText);
+}
+
+
+static void _BenchBitmap(int nBPP, int iSide)
+{
+	static const char* apszNames[] = { "", "8 bit", "", "24 bit", "32 bit" };
+	benchcase_t bc;
+	double iBytes;
+	double nPixels;
+
+	memset(&bc, 0, sizeof(bc));
+	bc.pszInput = apszNames[nBPP];
+	bc.pbmp = _MakeBitmap(iSide, nBPP);
+	nPixels = (double)iSide * iSide;
+	iBytes = nPixels * nBPP;
+
+	_Bench(&bc, "SaveBitmap", _RunSaveBitmap, iBytes, nPixels, "pixels");
+	_Bench(&bc, "LoadBitmapFromFile", _RunLoadBitmap, iBytes, nPixels, "pixels");
+	remove(BENCH_BITMAP_FILE);
+
+	if (nBPP != 1)
+	{
+		_Bench(&bc, "SaveBitmapQOI", _RunSaveBitmapQOI, iBytes, nPixels, "pixels");
+		remove(BENCH_QOI_FILE);
+	}
+
+	bc.pbmpDst = AllocBitmap(iSide, iSide, (nBPP == 4)? 3: 4, 0);
+
+	if (bc.pbmpDst != NULL)
+	{
+		_Bench(&bc, (nBPP == 4)? "ConvertBitmap to 24": "ConvertBitmap to 32", _RunConvertBitmap, iBytes, nPixels, "pixels");
+		FreeBitmap(bc.pbmpDst);
+	}
+
+	_Bench(&bc, "FlipBitmapHorizontal", _RunFlipBitmap, iBytes, nPixels, "pixels");
+
+	if (nBPP != 1)
+	{
+		bc.pbmpDst = AllocBitmap(iSide / 3, iSide / 3, nBPP, 0);
+		_Bench(&bc, "ScaleBitmap box 1/3", _RunScaleBox, iBytes, nPixels, "pixels");
+		FreeBitmap(bc.pbmpDst);
+
+		bc.pbmpDst = AllocBitmap(iSide * 3 / 2, iSide * 3 / 2, nBPP, 0);
+		_Bench(&bc, "ScaleBitmap bilinear", _RunScaleBilinear, iBytes, nPixels, "pixels");
+		FreeBitmap(bc.pbmpDst);
+	}
+
+	FreeBitmap(bc.pbmp);
+}
+
+
+int main(int argc, char* argv[])
+{
+	int iTextSize;
+	int iSide;
+	int i;
+
+	iTextSize = ((argc > 1)? atoi(argv[1]): 16) * 1024 * 1024;
+	iSide = (argc > 2)? atoi(argv[2]): 2048;
+
+	if ((iTextSize <= 0) || (iSide <= 0))
+	{
+		printf("usage: utils_bench [text megabytes] [bitmap side]\n");
+		return 1;
+	}
+
+	printf("%d MB of text, %dx%d bitmaps, %d threads\n\n", iTextSize / (1024 * 1024), iSide, iSide, GetWorkerThreadCount());
+
+	for (i = TEXT_SHORT; i <= TEXT_COMMENTS; i++)
+	{
+		_BenchText(i, iTextSize);
+	}
+
+	_BenchBitmap(1, iSide);
+	_BenchBitmap(3, iSide);
+	_BenchBitmap(4, iSide);
+
+	ShutdownWorkerThreads();
+
+	return 0;
+}
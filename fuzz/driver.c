@@ -0,0 +1,232 @@
+
+// main() for the fuzz targets without libfuzzer: runs the seed files, then -runs=N inputs
+// mutated from them, the same ones each time for the same -seed=S
+//   fuzz_xxx [-runs=N] [-seed=S] file|dir...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define MAX_INPUT_SIZE 65536
+
+int LLVMFuzzerTestOneInput(const byte_t* data, size_t iSize);
+
+typedef struct seed_s
+{
+	byte_t* p;
+	int iSize;
+} seed_t;
+
+static seed_t* g_aSeeds;
+static int g_nSeeds;
+static unsigned int g_iRandom = 1;
+
+
+static unsigned int _Random(void)
+{
+	// xorshift32
+	g_iRandom ^= g_iRandom << 13;
+	g_iRandom ^= g_iRandom >> 17;
+	g_iRandom ^= g_iRandom << 5;
+
+	return g_iRandom;
+}
+
+
+static void _AddSeed(const char* pszFileName)
+{
+	seed_t* aGrown;
+	char* buffer;
+	int iSize;
+
+	buffer = ReadFileToBuffer(pszFileName, &iSize);
+
+	if (buffer == NULL)
+	{
+		fprintf(stderr, "can't read %s\n", pszFileName);
+		return;
+	}
+
+	aGrown = (seed_t*)realloc(g_aSeeds, (g_nSeeds + 1) * sizeof(seed_t));
+
+	if (aGrown == NULL)
+	{
+		FreeMemory(buffer);
+		return;
+	}
+
+	g_aSeeds = aGrown;
+	g_aSeeds[g_nSeeds].p = (byte_t*)buffer;
+	g_aSeeds[g_nSeeds].iSize = min(iSize, MAX_INPUT_SIZE);
+	g_nSeeds++;
+}
+
+
+static void _AddSeedFile(char* pszFileName, WIN32_FIND_DATA* pfd, void* param)
+{
+	(void)pfd;
+	(void)param;
+
+	_AddSeed(pszFileName);
+}
+
+
+// a few byte level edits of p[0, iSize), returns the new size
+
+static int _Mutate(byte_t* p, int iSize)
+{
+	int nEdits;
+	int iPos;
+	int iLength;
+	int i;
+
+	nEdits = 1 + _Random() % 4;
+
+	for (i = 0; i < nEdits; i++)
+	{
+		iPos = (iSize != 0)? _Random() % iSize: 0;
+
+		switch (_Random() % 7)
+		{
+		case 0: // flip a bit
+			if (iSize != 0)
+			{
+				p[iPos] ^= (byte_t)(1 << (_Random() & 7));
+			}
+			break;
+		case 1: // random byte
+			if (iSize != 0)
+			{
+				p[iPos] = (byte_t)_Random();
+			}
+			break;
+		case 2: // interesting byte
+			if (iSize != 0)
+			{
+				static const byte_t ab[] = { 0, 1, 0x7F, 0x80, 0xFF, '\n', '\r', '"', ' ', '/', '*', 0xC2, 0xE2, 0xF0 };
+
+				p[iPos] = ab[_Random() % sizeof(ab)];
+			}
+			break;
+		case 3: // insert a byte
+			if (iSize < MAX_INPUT_SIZE)
+			{
+				memmove(&p[iPos + 1], &p[iPos], iSize - iPos);
+				p[iPos] = (byte_t)_Random();
+				iSize++;
+			}
+			break;
+		case 4: // delete a run
+			iLength = (iSize != 0)? 1 + _Random() % min(iSize - iPos, 8): 0;
+			memmove(&p[iPos], &p[iPos + iLength], iSize - iPos - iLength);
+			iSize -= iLength;
+			break;
+		case 5: // truncate
+			iSize = iPos;
+			break;
+		default: // copy a run over another
+			if (iSize != 0)
+			{
+				iLength = 1 + _Random() % min(iSize - iPos, 16);
+				memmove(&p[_Random() % (iSize - iLength + 1)], &p[iPos], iLength);
+			}
+			break;
+		}
+	}
+
+	return iSize;
+}
+
+
+// each input in a block of its own size, so reads past it are caught by the sanitizers
+
+static void _RunInput(const byte_t* p, int iSize)
+{
+	byte_t* pInput = (byte_t*)malloc(max(iSize, 1));
+
+	memcpy(pInput, p, iSize);
+	LLVMFuzzerTestOneInput(pInput, iSize);
+	free(pInput);
+}
+
+
+static bool_t _IsDirectory(const char* pszPath)
+{
+	DWORD iAttributes = GetFileAttributes(pszPath);
+
+	return (iAttributes != INVALID_FILE_ATTRIBUTES) && (iAttributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+
+int main(int argc, char* argv[])
+{
+	byte_t* p;
+	int nRuns;
+	int iSize;
+	int i;
+
+	nRuns = 0;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "-runs=", 6) == 0)
+		{
+			nRuns = atoi(&argv[i][6]);
+		}
+		else if (strncmp(argv[i], "-seed=", 6) == 0)
+		{
+			g_iRandom = (unsigned int)atoi(&argv[i][6]) | 1;
+		}
+		else if (argv[i][0] == '-')
+		{
+			// other libfuzzer options
+		}
+		else if (_IsDirectory(argv[i]))
+		{
+			ParseDirectory(argv[i], true, _AddSeedFile, NULL);
+		}
+		else
+		{
+			_AddSeed(argv[i]);
+		}
+	}
+
+	p = (byte_t*)malloc(MAX_INPUT_SIZE);
+
+	for (i = 0; i < g_nSeeds; i++)
+	{
+		_RunInput(g_aSeeds[i].p, g_aSeeds[i].iSize);
+	}
+
+	for (i = 0; i < nRuns; i++)
+	{
+		iSize = 0;
+
+		if (g_nSeeds != 0)
+		{
+			seed_t* pSeed = &g_aSeeds[_Random() % g_nSeeds];
+
+			memcpy(p, pSeed->p, pSeed->iSize);
+			iSize = pSeed->iSize;
+		}
+
+		iSize = _Mutate(p, iSize);
+		_RunInput(p, iSize);
+	}
+
+	printf("%d seeds, %d runs\n", g_nSeeds, nRuns);
+
+	for (i = 0; i < g_nSeeds; i++)
+	{
+		FreeMemory(g_aSeeds[i].p);
+	}
+
+	free(g_aSeeds);
+	free(p);
+
+	ShutdownWorkerThreads();
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+
+// LoadBitmapFromFileEx() on untrusted files, the input is written to a temp file first,
+// what loads is converted and saved again to touch every pixel
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+
+int LLVMFuzzerTestOneInput(const byte_t* data, size_t iSize)
+{
+	static char szFileName[64];
+	bitmap_t* pbmp;
+	bitmap_t* pbmp32;
+	FILE* stream;
+	int iError;
+
+	if (iSize > (1 << 20))
+	{
+		return 0;
+	}
+
+	if (szFileName[0] == '\0')
+	{
+		sprintf(szFileName, "fuzz_bitmap_%u.bmp", (unsigned int)GetCurrentProcessId());
+	}
+
+	stream = fopen(szFileName, "wb");
+
+	if (stream == NULL)
+	{
+		return 0;
+	}
+
+	fwrite(data, 1, iSize, stream);
+	fclose(stream);
+
+	pbmp = LoadBitmapFromFileEx(szFileName, &iError);
+
+	if ((pbmp == NULL) != (iError != UERR_OK))
+	{
+		abort();
+	}
+
+	if (pbmp != NULL)
+	{
+		if ((pbmp->iWidth <= 0) || (pbmp->iHeight <= 0) || (pbmp->iPitch < pbmp->iWidth * pbmp->nBPP) ||
+			((pbmp->nBPP == 1) && ((pbmp->nColors <= 0) || (pbmp->pal == NULL))))
+		{
+			abort();
+		}
+
+		pbmp32 = AllocConvertedBitmap(pbmp, 4);
+
+		if (pbmp32 != NULL)
+		{
+			SaveBitmapQOI(szFileName, pbmp32);
+			FreeBitmap(pbmp32);
+		}
+
+		FreeBitmap(pbmp);
+	}
+
+	remove(szFileName);
+
+	return 0;
+}
@@ -0,0 +1,60 @@
+
+// CutCommentsN() on untrusted text, and against CutComments() where the text has no '\0'
+// the first byte picks the comment markers
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+
+int LLVMFuzzerTestOneInput(const byte_t* data, size_t iSize)
+{
+	static const char* apszStart[] = { "//", "/*", "#", "<!--", "(*", "'" };
+	static const char* apszEnd[] = { NULL, "*/", NULL, "-->", "*)", "'" };
+	char* psz;
+	char* pszRef;
+	int iMarkers;
+	int n;
+
+	if ((iSize == 0) || (iSize > 65536))
+	{
+		return 0;
+	}
+
+	iMarkers = data[0] % 6;
+	data++;
+	iSize--;
+
+	// not terminated, one byte of slack for the '\0'
+	psz = (char*)malloc(iSize + 1);
+	memcpy(psz, data, iSize);
+	psz[iSize] = 'Z';
+
+	n = CutCommentsN(psz, (int)iSize, apszStart[iMarkers], apszEnd[iMarkers]);
+
+	if ((n < 0) || (n > (int)iSize) || (psz[n] != '\0'))
+	{
+		abort();
+	}
+
+	if (memchr(data, '\0', iSize) == NULL)
+	{
+		pszRef = (char*)malloc(iSize + 1);
+		memcpy(pszRef, data, iSize);
+		pszRef[iSize] = '\0';
+
+		CutComments(pszRef, apszStart[iMarkers], apszEnd[iMarkers]);
+
+		if (strcmp(psz, pszRef) != 0)
+		{
+			abort();
+		}
+
+		free(pszRef);
+	}
+
+	free(psz);
+
+	return 0;
+}
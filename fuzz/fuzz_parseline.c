@@ -0,0 +1,88 @@
+
+// ParseLineN() on untrusted text, and against ParseLine() where the text has no '\0'
+// the first byte picks argcMax and the delimiters
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+
+int LLVMFuzzerTestOneInput(const byte_t* data, size_t iSize)
+{
+	static const char* apszDelimiters[] = { " ", " \t", ",", ";= \t" };
+	char* argv[8];
+	char* argvRef[8];
+	char* psz;
+	char* pszRef;
+	char* pszEnd;
+	char* pszEndRef;
+	const char* pszDelimiters;
+	int argcMax;
+	int n;
+	int nRef;
+	int i;
+
+	if ((iSize == 0) || (iSize > 4096))
+	{
+		return 0;
+	}
+
+	argcMax = data[0] & 7;
+	pszDelimiters = apszDelimiters[(data[0] >> 3) & 3];
+	data++;
+	iSize--;
+
+	// not terminated, one byte of slack for the '\0' of the last arg
+	psz = (char*)malloc(iSize + 1);
+	memcpy(psz, data, iSize);
+	psz[iSize] = 'Z';
+
+	n = ParseLineN(argcMax, (argcMax != 0)? argv: NULL, psz, (int)iSize, pszDelimiters, (data[-1] & 0x80)? &pszEnd: NULL);
+
+	if ((n < 0) && (n != UERR_FORMAT) && (n != UERR_OVERFLOW))
+	{
+		abort();
+	}
+
+	for (i = 0; (argcMax != 0) && (i < min(n, argcMax)); i++)
+	{
+		if ((argv[i] < psz) || (argv[i] > psz + iSize) || (strlen(argv[i]) > iSize))
+		{
+			abort();
+		}
+	}
+
+	if ((memchr(data, '\0', iSize) == NULL) && (argcMax != 0))
+	{
+		pszRef = (char*)malloc(iSize + 1);
+		memcpy(pszRef, data, iSize);
+		pszRef[iSize] = '\0';
+		memcpy(psz, data, iSize);
+
+		n = ParseLineN(argcMax, argv, psz, (int)iSize, pszDelimiters, &pszEnd);
+		nRef = ParseLine(argcMax, argvRef, pszRef, pszDelimiters, &pszEndRef);
+
+		if (n >= 0)
+		{
+			if (n != nRef)
+			{
+				abort();
+			}
+
+			for (i = 0; i < n; i++)
+			{
+				if (strcmp(argv[i], argvRef[i]) != 0)
+				{
+					abort();
+				}
+			}
+		}
+
+		free(pszRef);
+	}
+
+	free(psz);
+
+	return 0;
+}
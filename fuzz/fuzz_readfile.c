@@ -0,0 +1,86 @@
+
+// ReadFileToBuffer(), MapFileToMemory() and ParseFile() on untrusted files, the buffer must
+// hold the file exactly with a '\0' after it, and ParseFile() must see what ParseBuffer() sees
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+
+static int _CountLine(char* pszLine, void* param)
+{
+	(*(int*)param) += 1 + (int)strlen(pszLine);
+
+	return 1;
+}
+
+
+int LLVMFuzzerTestOneInput(const byte_t* data, size_t iSize)
+{
+	static char szFileName[64];
+	mappedfile_t mf;
+	FILE* stream;
+	char* buffer;
+	int iRead;
+	int nChars;
+	int nFileChars;
+
+	if (iSize > (1 << 20))
+	{
+		return 0;
+	}
+
+	if (szFileName[0] == '\0')
+	{
+		sprintf(szFileName, "fuzz_readfile_%u.txt", (unsigned int)GetCurrentProcessId());
+	}
+
+	stream = fopen(szFileName, "wb");
+
+	if (stream == NULL)
+	{
+		return 0;
+	}
+
+	fwrite(data, 1, iSize, stream);
+	fclose(stream);
+
+	buffer = ReadFileToBuffer(szFileName, &iRead);
+
+	if ((buffer == NULL) != (iSize == 0))
+	{
+		abort();
+	}
+
+	if (buffer != NULL)
+	{
+		if ((iRead != (int)iSize) || (memcmp(buffer, data, iSize) != 0) || (buffer[iSize] != '\0'))
+		{
+			abort();
+		}
+
+		nChars = 0;
+		ParseBuffer(buffer, iRead, _CountLine, &nChars);
+		FreeMemory(buffer);
+
+		nFileChars = 0;
+
+		if (!ParseFile(szFileName, _CountLine, &nFileChars) || (nFileChars != nChars))
+		{
+			abort();
+		}
+
+		if (!MapFileToMemory(szFileName, &mf) || (mf.iSize != iSize) || (memcmp(mf.pData, data, iSize) != 0))
+		{
+			abort();
+		}
+
+		UnmapFile(&mf);
+	}
+
+	remove(szFileName);
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+
+// ValidateUtf8() against a byte at a time validator, and the valid prefix through
+// Utf8ToUtf16() and back
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+
+static int _RefValidateUtf8(const byte_t* p, int n)
+{
+	unsigned int c;
+	unsigned int iMin;
+	int iLength;
+	int i;
+	int k;
+
+	for (i = 0; i < n; i += iLength)
+	{
+		c = p[i];
+		iLength = (c < 0x80)? 1: ((c >= 0xC2) && (c <= 0xDF))? 2: ((c >= 0xE0) && (c <= 0xEF))? 3: ((c >= 0xF0) && (c <= 0xF4))? 4: 0;
+
+		if ((iLength == 0) || (i + iLength > n))
+		{
+			return i;
+		}
+
+		if (iLength == 1)
+		{
+			continue;
+		}
+
+		c &= 0x7F >> iLength;
+		iMin = (iLength == 2)? 0x80: (iLength == 3)? 0x800: 0x10000;
+
+		for (k = 1; k < iLength; k++)
+		{
+			if ((p[i + k] & 0xC0) != 0x80)
+			{
+				return i;
+			}
+
+			c = (c << 6) | (p[i + k] & 0x3F);
+		}
+
+		if ((c < iMin) || (c > 0x10FFFF) || ((c >= 0xD800) && (c <= 0xDFFF)))
+		{
+			return i;
+		}
+	}
+
+	return n;
+}
+
+
+int LLVMFuzzerTestOneInput(const byte_t* data, size_t iSize)
+{
+	wchar_t* pszWide;
+	char* pszBack;
+	int iValid;
+	int nWide;
+	int n;
+
+	if (iSize > 65536)
+	{
+		return 0;
+	}
+
+	iValid = ValidateUtf8((const char*)data, (int)iSize);
+
+	if (iValid != _RefValidateUtf8(data, (int)iSize))
+	{
+		abort();
+	}
+
+	n = Utf8ToUtf16((const char*)data, (int)iSize, NULL, 0);
+
+	if ((iValid == (int)iSize) != (n >= 0))
+	{
+		abort();
+	}
+
+	nWide = Utf8ToUtf16((const char*)data, iValid, NULL, 0);
+
+	if (nWide < 0)
+	{
+		abort();
+	}
+
+	pszWide = (wchar_t*)malloc((nWide + 1) * sizeof(wchar_t));
+	pszBack = (char*)malloc(iValid + 1);
+
+	if ((Utf8ToUtf16((const char*)data, iValid, pszWide, nWide + 1) != nWide) ||
+		(Utf16ToUtf8(pszWide, nWide, pszBack, iValid + 1) != iValid) ||
+		(memcmp(pszBack, data, iValid) != 0))
+	{
+		abort();
+	}
+
+	free(pszWide);
+	free(pszBack);
+
+	return 0;
+}
@@ -0,0 +1,330 @@
+
+// the part of the win32 api utils.c uses, on posix, so the tests, fuzz harnesses and
+// the benchmark build and run on linux. not a general emulation:
+// - paths may use '\\' or '/', CP_ACP is taken as latin 1, wide paths as utf-16
+// - ReadDirectoryChangesW only reports what ShimNotifyChange() queues
+// - MessageBox prints to stderr and answers no
+// - malloc and _aligned_malloc can be made to fail with ShimFailAllocations()
+
+#ifndef _WINSHIM_H
+#define _WINSHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <wchar.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef int BOOL;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef void* HANDLE;
+typedef void* LPVOID;
+typedef wchar_t WCHAR;
+typedef char CHAR;
+typedef DWORD* LPDWORD;
+typedef uintptr_t ULONG_PTR;
+typedef ULONG_PTR SIZE_T;
+
+#define __int64 long long
+#define WINAPI
+
+#ifndef min
+#define min(a, b) (((a) < (b))? (a): (b))
+#define max(a, b) (((a) > (b))? (a): (b))
+#endif
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH 260
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define FILE_ATTRIBUTE_DIRECTORY 0x10
+#define FILE_ATTRIBUTE_NORMAL 0x80
+#define MB_YESNOCANCEL 3
+#define IDYES 6
+#define IDNO 7
+#define CP_ACP 0
+#define CP_UTF8 65001
+#define BI_RGB 0
+
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_PATH_NOT_FOUND 3
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_FILENAME_EXCED_RANGE 206
+#define ERROR_IO_PENDING 997
+#define ERROR_NOTIFY_ENUM_DIR 1022
+
+#pragma pack(push, 2)
+typedef struct
+{
+	WORD bfType;
+	DWORD bfSize;
+	WORD bfReserved1;
+	WORD bfReserved2;
+	DWORD bfOffBits;
+} BITMAPFILEHEADER;
+#pragma pack(pop)
+
+typedef struct
+{
+	DWORD biSize;
+	LONG biWidth;
+	LONG biHeight;
+	WORD biPlanes;
+	WORD biBitCount;
+	DWORD biCompression;
+	DWORD biSizeImage;
+	LONG biXPelsPerMeter;
+	LONG biYPelsPerMeter;
+	DWORD biClrUsed;
+	DWORD biClrImportant;
+} BITMAPINFOHEADER;
+
+typedef struct
+{
+	BYTE rgbBlue;
+	BYTE rgbGreen;
+	BYTE rgbRed;
+	BYTE rgbReserved;
+} RGBQUAD;
+
+typedef struct
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+typedef union
+{
+	struct
+	{
+		DWORD LowPart;
+		LONG HighPart;
+	} u;
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct
+{
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	DWORD dwReserved0;
+	DWORD dwReserved1;
+	CHAR cFileName[MAX_PATH];
+	CHAR cAlternateFileName[14];
+} WIN32_FIND_DATAA, WIN32_FIND_DATA;
+
+typedef struct
+{
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	DWORD dwReserved0;
+	DWORD dwReserved1;
+	WCHAR cFileName[MAX_PATH];
+	WCHAR cAlternateFileName[14];
+} WIN32_FIND_DATAW;
+
+typedef struct
+{
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+} WIN32_FILE_ATTRIBUTE_DATA;
+
+typedef enum { GetFileExInfoStandard } GET_FILEEX_INFO_LEVELS;
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+} CRITICAL_SECTION;
+
+typedef struct
+{
+	DWORD dwOemId;
+	DWORD dwPageSize;
+	LPVOID lpMinimumApplicationAddress;
+	LPVOID lpMaximumApplicationAddress;
+	ULONG_PTR dwActiveProcessorMask;
+	DWORD dwNumberOfProcessors;
+	DWORD dwProcessorType;
+	DWORD dwAllocationGranularity;
+	WORD wProcessorLevel;
+	WORD wProcessorRevision;
+} SYSTEM_INFO;
+
+typedef struct
+{
+	ULONG_PTR Internal;
+	ULONG_PTR InternalHigh;
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+} OVERLAPPED;
+
+typedef struct
+{
+	DWORD NextEntryOffset;
+	DWORD Action;
+	DWORD FileNameLength;
+	WCHAR FileName[1];
+} FILE_NOTIFY_INFORMATION;
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+// misc
+int MessageBox(void* hWnd, const char* pszText, const char* pszCaption, int iType);
+#define MessageBoxA MessageBox
+#define __debugbreak() abort()
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+int wcsicmp(const wchar_t* psz1, const wchar_t* psz2);
+#define _wcsicmp wcsicmp
+int _wcsnicmp(const wchar_t* psz1, const wchar_t* psz2, size_t n);
+DWORD GetLastError(void);
+void Sleep(DWORD dwMs);
+DWORD GetTickCount(void);
+void GetSystemInfo(SYSTEM_INFO* psi);
+BOOL QueryPerformanceCounter(LARGE_INTEGER* pi);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* pi);
+DWORD GetCurrentThreadId(void);
+DWORD GetCurrentProcessId(void);
+LONG CompareFileTime(const FILETIME* pft1, const FILETIME* pft2);
+void* _aligned_malloc(size_t iSize, size_t iAlign);
+void _aligned_free(void* p);
+
+// text
+int MultiByteToWideChar(int iCodePage, DWORD dwFlags, const char* psz, int n, wchar_t* pszDst, int nDst);
+int WideCharToMultiByte(int iCodePage, DWORD dwFlags, const wchar_t* psz, int n, char* pszDst, int nDst, const char* pszDefault, BOOL* pbUsedDefault);
+
+// files
+FILE* ShimFopen(const char* pszFileName, const char* pszMode);
+#define fopen ShimFopen
+void* ShimMalloc(size_t iSize);
+#define malloc ShimMalloc
+void ShimFailAllocations(int nAllocs); // the ones after the next nAllocs fail, -1 - never
+FILE* _wfopen(const wchar_t* pszFileName, const wchar_t* pszMode);
+
+DWORD GetFileAttributesA(const char* pszFileName);
+DWORD GetFileAttributesW(const wchar_t* pszFileName);
+#define GetFileAttributes GetFileAttributesA
+BOOL GetFileAttributesExA(const char* pszFileName, GET_FILEEX_INFO_LEVELS iLevel, void* pInfo);
+BOOL GetFileAttributesExW(const wchar_t* pszFileName, GET_FILEEX_INFO_LEVELS iLevel, void* pInfo);
+#define GetFileAttributesEx GetFileAttributesExA
+BOOL CreateDirectoryA(const char* pszPath, void* psa);
+BOOL CreateDirectoryW(const wchar_t* pszPath, void* psa);
+#define CreateDirectory CreateDirectoryA
+BOOL RemoveDirectoryA(const char* pszPath);
+#define RemoveDirectory RemoveDirectoryA
+BOOL DeleteFileA(const char* pszFileName);
+#define DeleteFile DeleteFileA
+BOOL MoveFileA(const char* pszFrom, const char* pszTo);
+#define MoveFile MoveFileA
+DWORD GetFullPathNameW(const wchar_t* pszPath, DWORD nSize, wchar_t* pszDst, wchar_t** ppszFilePart);
+
+HANDLE FindFirstFileA(const char* pszPattern, WIN32_FIND_DATAA* pfd);
+BOOL FindNextFileA(HANDLE hFind, WIN32_FIND_DATAA* pfd);
+HANDLE FindFirstFileW(const wchar_t* pszPattern, WIN32_FIND_DATAW* pfd);
+BOOL FindNextFileW(HANDLE hFind, WIN32_FIND_DATAW* pfd);
+#define FindFirstFile FindFirstFileA
+#define FindNextFile FindNextFileA
+BOOL FindClose(HANDLE hFind);
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 1
+#define FILE_SHARE_WRITE 2
+#define FILE_SHARE_DELETE 4
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define PAGE_READONLY 2
+#define FILE_MAP_READ 4
+#define FILE_LIST_DIRECTORY 1
+#define FILE_FLAG_BACKUP_SEMANTICS 0x02000000
+#define FILE_FLAG_OVERLAPPED 0x40000000
+
+HANDLE CreateFileA(const char* pszFileName, DWORD dwAccess, DWORD dwShare, void* psa, DWORD dwDisposition, DWORD dwFlags, HANDLE hTemplate);
+HANDLE CreateFileW(const wchar_t* pszFileName, DWORD dwAccess, DWORD dwShare, void* psa, DWORD dwDisposition, DWORD dwFlags, HANDLE hTemplate);
+#define CreateFile CreateFileA
+BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* piSize);
+HANDLE CreateFileMappingA(HANDLE hFile, void* psa, DWORD dwProtect, DWORD dwSizeHigh, DWORD dwSizeLow, const char* pszName);
+#define CreateFileMapping CreateFileMappingA
+LPVOID MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh, DWORD dwOffsetLow, SIZE_T iSize);
+BOOL UnmapViewOfFile(const void* p);
+
+// directory changes
+#define FILE_ACTION_ADDED 1
+#define FILE_ACTION_REMOVED 2
+#define FILE_ACTION_MODIFIED 3
+#define FILE_ACTION_RENAMED_OLD_NAME 4
+#define FILE_ACTION_RENAMED_NEW_NAME 5
+#define FILE_NOTIFY_CHANGE_FILE_NAME 1
+#define FILE_NOTIFY_CHANGE_DIR_NAME 2
+#define FILE_NOTIFY_CHANGE_SIZE 8
+#define FILE_NOTIFY_CHANGE_LAST_WRITE 0x10
+
+BOOL ReadDirectoryChangesW(HANDLE hDir, LPVOID buffer, DWORD iSize, BOOL bSubTree, DWORD dwFilter, LPDWORD piReturned, OVERLAPPED* po, void* pfnCompletion);
+BOOL GetOverlappedResult(HANDLE hFile, OVERLAPPED* po, LPDWORD piTransferred, BOOL bWait);
+BOOL CancelIo(HANDLE hFile);
+void ShimNotifyChange(DWORD dwAction, const wchar_t* pszName); // for the tests, queues a change for the pending read
+
+// threads and sync
+void InitializeCriticalSection(CRITICAL_SECTION* pcs);
+void DeleteCriticalSection(CRITICAL_SECTION* pcs);
+void EnterCriticalSection(CRITICAL_SECTION* pcs);
+BOOL TryEnterCriticalSection(CRITICAL_SECTION* pcs);
+void LeaveCriticalSection(CRITICAL_SECTION* pcs);
+
+HANDLE CreateThread(void* psa, SIZE_T iStackSize, LPTHREAD_START_ROUTINE pfn, LPVOID param, DWORD dwFlags, DWORD* pdwId);
+HANDLE CreateSemaphoreA(void* psa, LONG nInitial, LONG nMax, const char* pszName);
+#define CreateSemaphore CreateSemaphoreA
+BOOL ReleaseSemaphore(HANDLE hSemaphore, LONG n, LONG* pnPrevious);
+HANDLE CreateEventA(void* psa, BOOL bManualReset, BOOL bInitialState, const char* pszName);
+#define CreateEvent CreateEventA
+BOOL SetEvent(HANDLE hEvent);
+BOOL ResetEvent(HANDLE hEvent);
+DWORD WaitForSingleObject(HANDLE h, DWORD dwMs);
+BOOL CloseHandle(HANDLE h);
+
+#define InterlockedIncrement(p) __sync_add_and_fetch((p), 1)
+#define InterlockedDecrement(p) __sync_sub_and_fetch((p), 1)
+#define InterlockedIncrement64(p) __sync_add_and_fetch((p), 1)
+#define InterlockedExchangeAdd(p, v) __sync_fetch_and_add((p), (v))
+#define InterlockedExchangeAdd64(p, v) __sync_fetch_and_add((p), (v))
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchange64(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define InterlockedCompareExchangePointer(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#define MemoryBarrier() __sync_synchronize()
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _WINSHIM_H
@@ -0,0 +1,1301 @@
+
+// posix implementation of the win32 subset in windows.h
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "windows.h"
+
+#undef fopen
+#undef malloc
+
+static __thread DWORD g_dwLastError;
+static int g_nAllocsLeft = -1;
+
+
+// counts down the allocations ShimFailAllocations() lets through
+static BOOL _AllocFails(void)
+{
+	if (g_nAllocsLeft == 0)
+	{
+		return TRUE;
+	}
+
+	if (g_nAllocsLeft > 0)
+	{
+		g_nAllocsLeft--;
+	}
+
+	return FALSE;
+}
+
+
+static void _SetError(void)
+{
+	g_dwLastError = (errno == EEXIST)? ERROR_ALREADY_EXISTS:
+		(errno == ENAMETOOLONG)? ERROR_FILENAME_EXCED_RANGE:
+		(errno == ENOTDIR)? ERROR_PATH_NOT_FOUND: ERROR_FILE_NOT_FOUND;
+}
+
+
+DWORD GetLastError(void)
+{
+	return g_dwLastError;
+}
+
+
+int MessageBox(void* hWnd, const char* pszText, const char* pszCaption, int iType)
+{
+	// quiet while the tests make allocations fail
+	if (g_nAllocsLeft != 0)
+	{
+		fprintf(stderr, "%s: %s\n", (pszCaption != NULL)? pszCaption: "MessageBox", pszText);
+	}
+
+	return IDNO;
+}
+
+
+int wcsicmp(const wchar_t* psz1, const wchar_t* psz2)
+{
+	return wcscasecmp(psz1, psz2);
+}
+
+
+int _wcsnicmp(const wchar_t* psz1, const wchar_t* psz2, size_t n)
+{
+	return wcsncasecmp(psz1, psz2, n);
+}
+
+
+void Sleep(DWORD dwMs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = dwMs / 1000;
+	ts.tv_nsec = (long)(dwMs % 1000) * 1000000L;
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+	{
+	}
+}
+
+
+DWORD GetTickCount(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (DWORD)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+void GetSystemInfo(SYSTEM_INFO* psi)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	memset(psi, 0, sizeof(SYSTEM_INFO));
+	psi->dwPageSize = (DWORD)sysconf(_SC_PAGESIZE);
+	psi->dwAllocationGranularity = 65536;
+	psi->dwNumberOfProcessors = (n > 0)? (DWORD)n: 1;
+}
+
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* pi)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pi->QuadPart = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	return TRUE;
+}
+
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* pi)
+{
+	pi->QuadPart = 1000000000LL;
+
+	return TRUE;
+}
+
+
+DWORD GetCurrentThreadId(void)
+{
+	return (DWORD)gettid();
+}
+
+
+DWORD GetCurrentProcessId(void)
+{
+	return (DWORD)getpid();
+}
+
+
+LONG CompareFileTime(const FILETIME* pft1, const FILETIME* pft2)
+{
+	ULONGLONG i1 = ((ULONGLONG)pft1->dwHighDateTime << 32) | pft1->dwLowDateTime;
+	ULONGLONG i2 = ((ULONGLONG)pft2->dwHighDateTime << 32) | pft2->dwLowDateTime;
+
+	return (i1 < i2)? -1: (i1 > i2);
+}
+
+
+void* _aligned_malloc(size_t iSize, size_t iAlign)
+{
+	void* p;
+
+	if (_AllocFails())
+	{
+		return NULL;
+	}
+
+	if (posix_memalign(&p, max(iAlign, sizeof(void*)), (iSize != 0)? iSize: 1) != 0)
+	{
+		return NULL;
+	}
+
+	return p;
+}
+
+
+void _aligned_free(void* p)
+{
+	free(p);
+}
+
+
+//
+// text, CP_ACP is latin 1 and wide strings hold utf-16 units
+//
+
+static int _DecodeUtf8(const unsigned char* psz, int n, int* piUsed)
+{
+	int c = psz[0];
+	int nExtra;
+	int iMin;
+	int i;
+
+	if (c < 0x80)
+	{
+		*piUsed = 1;
+		return c;
+	}
+
+	nExtra = (c >= 0xF0)? 3: (c >= 0xE0)? 2: (c >= 0xC0)? 1: 0;
+	iMin = (nExtra == 3)? 0x10000: (nExtra == 2)? 0x800: 0x80;
+	c &= 0x3F >> nExtra;
+	*piUsed = 1;
+
+	if ((nExtra == 0) || (c > 0x10 && nExtra == 3) || (nExtra >= n))
+	{
+		return -1;
+	}
+
+	for (i = 1; i <= nExtra; i++)
+	{
+		if ((psz[i] & 0xC0) != 0x80)
+		{
+			return -1;
+		}
+
+		c = (c << 6) | (psz[i] & 0x3F);
+	}
+
+	*piUsed = nExtra + 1;
+
+	if ((c < iMin) || (c > 0x10FFFF) || ((c >= 0xD800) && (c < 0xE000)))
+	{
+		return -1;
+	}
+
+	return c;
+}
+
+
+int MultiByteToWideChar(int iCodePage, DWORD dwFlags, const char* psz, int n, wchar_t* pszDst, int nDst)
+{
+	const unsigned char* pb = (const unsigned char*)psz;
+	int iUsed;
+	int nOut;
+	int c;
+	int i;
+
+	if (n < 0)
+	{
+		n = (int)strlen(psz) + 1;
+	}
+
+	for (i = 0, nOut = 0; i < n; i += iUsed)
+	{
+		if (iCodePage == CP_UTF8)
+		{
+			c = _DecodeUtf8(&pb[i], n - i, &iUsed);
+			c = (c < 0)? 0xFFFD: c;
+		}
+		else
+		{
+			c = pb[i];
+			iUsed = 1;
+		}
+
+		if (pszDst != NULL)
+		{
+			if (nOut + ((c >= 0x10000)? 2: 1) > nDst)
+			{
+				return 0;
+			}
+
+			if (c >= 0x10000)
+			{
+				pszDst[nOut++] = 0xD800 + ((c - 0x10000) >> 10);
+				c = 0xDC00 + ((c - 0x10000) & 0x3FF);
+			}
+
+			pszDst[nOut] = (wchar_t)c;
+		}
+		else if (c >= 0x10000)
+		{
+			nOut++;
+		}
+
+		nOut++;
+	}
+
+	return nOut;
+}
+
+
+int WideCharToMultiByte(int iCodePage, DWORD dwFlags, const wchar_t* psz, int n, char* pszDst, int nDst, const char* pszDefault, BOOL* pbUsedDefault)
+{
+	unsigned char ab[4];
+	int nBytes;
+	int nOut;
+	int c;
+	int i;
+
+	if (n < 0)
+	{
+		for (n = 0; psz[n] != 0; n++)
+		{
+		}
+
+		n++;
+	}
+
+	for (i = 0, nOut = 0; i < n; i++)
+	{
+		c = (int)psz[i];
+
+		if ((c >= 0xD800) && (c < 0xDC00) && (i + 1 < n) && (psz[i + 1] >= 0xDC00) && (psz[i + 1] < 0xE000))
+		{
+			c = 0x10000 + ((c - 0xD800) << 10) + ((int)psz[++i] - 0xDC00);
+		}
+
+		if (iCodePage != CP_UTF8)
+		{
+			ab[0] = (c < 0x100)? (unsigned char)c: '?';
+			nBytes = 1;
+		}
+		else if (c < 0x80)
+		{
+			ab[0] = (unsigned char)c;
+			nBytes = 1;
+		}
+		else if (c < 0x800)
+		{
+			ab[0] = 0xC0 | (c >> 6);
+			ab[1] = 0x80 | (c & 0x3F);
+			nBytes = 2;
+		}
+		else if (c < 0x10000)
+		{
+			ab[0] = 0xE0 | (c >> 12);
+			ab[1] = 0x80 | ((c >> 6) & 0x3F);
+			ab[2] = 0x80 | (c & 0x3F);
+			nBytes = 3;
+		}
+		else
+		{
+			ab[0] = 0xF0 | (c >> 18);
+			ab[1] = 0x80 | ((c >> 12) & 0x3F);
+			ab[2] = 0x80 | ((c >> 6) & 0x3F);
+			ab[3] = 0x80 | (c & 0x3F);
+			nBytes = 4;
+		}
+
+		if (pszDst != NULL)
+		{
+			if (nOut + nBytes > nDst)
+			{
+				return 0;
+			}
+
+			memcpy(&pszDst[nOut], ab, nBytes);
+		}
+
+		nOut += nBytes;
+	}
+
+	return nOut;
+}
+
+
+//
+// files, '\\' is taken as '/'
+//
+
+static char* _FixPath(const char* psz)
+{
+	char* pszFixed = strdup(psz);
+	char* pc;
+
+	for (pc = pszFixed; *pc != '\0'; pc++)
+	{
+		if (*pc == '\\')
+		{
+			*pc = '/';
+		}
+	}
+
+	return pszFixed;
+}
+
+
+// narrows a wide path to utf-8, drops a \\?\ prefix
+
+static char* _FixPathW(const wchar_t* psz)
+{
+	char* pszNarrow;
+	char* pszFixed;
+	int n;
+
+	if (wcsncmp(psz, L"\\\\?\\", 4) == 0)
+	{
+		psz += 4;
+	}
+
+	n = WideCharToMultiByte(CP_UTF8, 0, psz, -1, NULL, 0, NULL, NULL);
+	pszNarrow = (char*)malloc(n);
+	WideCharToMultiByte(CP_UTF8, 0, psz, -1, pszNarrow, n, NULL, NULL);
+	pszFixed = _FixPath(pszNarrow);
+	free(pszNarrow);
+
+	return pszFixed;
+}
+
+
+static void _FileTimeFromTimespec(FILETIME* pft, struct timespec ts)
+{
+	ULONGLONG i = (ULONGLONG)ts.tv_sec * 10000000ULL + ts.tv_nsec / 100 + 116444736000000000ULL;
+
+	pft->dwLowDateTime = (DWORD)i;
+	pft->dwHighDateTime = (DWORD)(i >> 32);
+}
+
+
+static void _AttributeDataFromStat(WIN32_FILE_ATTRIBUTE_DATA* pad, const struct stat* pst)
+{
+	memset(pad, 0, sizeof(WIN32_FILE_ATTRIBUTE_DATA));
+	pad->dwFileAttributes = S_ISDIR(pst->st_mode)? FILE_ATTRIBUTE_DIRECTORY: FILE_ATTRIBUTE_NORMAL;
+	_FileTimeFromTimespec(&pad->ftCreationTime, pst->st_ctim);
+	_FileTimeFromTimespec(&pad->ftLastAccessTime, pst->st_atim);
+	_FileTimeFromTimespec(&pad->ftLastWriteTime, pst->st_mtim);
+	pad->nFileSizeLow = (DWORD)pst->st_size;
+	pad->nFileSizeHigh = (DWORD)((ULONGLONG)pst->st_size >> 32);
+}
+
+
+static int _Stat(char* pszPath, struct stat* pst)
+{
+	int r = stat((*pszPath != '\0')? pszPath: "/", pst);
+
+	if (r != 0)
+	{
+		_SetError();
+	}
+
+	free(pszPath);
+
+	return r;
+}
+
+
+void* ShimMalloc(size_t iSize)
+{
+	if (_AllocFails())
+	{
+		return NULL;
+	}
+
+	return malloc(iSize);
+}
+
+
+void ShimFailAllocations(int nAllocs)
+{
+	g_nAllocsLeft = nAllocs;
+}
+
+
+FILE* ShimFopen(const char* pszFileName, const char* pszMode)
+{
+	char* pszPath = _FixPath(pszFileName);
+	FILE* stream = fopen(pszPath, pszMode);
+
+	free(pszPath);
+
+	return stream;
+}
+
+
+FILE* _wfopen(const wchar_t* pszFileName, const wchar_t* pszMode)
+{
+	char* pszPath = _FixPathW(pszFileName);
+	char* pszNarrowMode = _FixPathW(pszMode);
+	FILE* stream = fopen(pszPath, pszNarrowMode);
+
+	free(pszPath);
+	free(pszNarrowMode);
+
+	return stream;
+}
+
+
+DWORD GetFileAttributesA(const char* pszFileName)
+{
+	struct stat st;
+
+	if (_Stat(_FixPath(pszFileName), &st) != 0)
+	{
+		return INVALID_FILE_ATTRIBUTES;
+	}
+
+	return S_ISDIR(st.st_mode)? FILE_ATTRIBUTE_DIRECTORY: FILE_ATTRIBUTE_NORMAL;
+}
+
+
+DWORD GetFileAttributesW(const wchar_t* pszFileName)
+{
+	struct stat st;
+
+	if (_Stat(_FixPathW(pszFileName), &st) != 0)
+	{
+		return INVALID_FILE_ATTRIBUTES;
+	}
+
+	return S_ISDIR(st.st_mode)? FILE_ATTRIBUTE_DIRECTORY: FILE_ATTRIBUTE_NORMAL;
+}
+
+
+BOOL GetFileAttributesExA(const char* pszFileName, GET_FILEEX_INFO_LEVELS iLevel, void* pInfo)
+{
+	struct stat st;
+
+	if (_Stat(_FixPath(pszFileName), &st) != 0)
+	{
+		return FALSE;
+	}
+
+	_AttributeDataFromStat((WIN32_FILE_ATTRIBUTE_DATA*)pInfo, &st);
+
+	return TRUE;
+}
+
+
+BOOL GetFileAttributesExW(const wchar_t* pszFileName, GET_FILEEX_INFO_LEVELS iLevel, void* pInfo)
+{
+	struct stat st;
+
+	if (_Stat(_FixPathW(pszFileName), &st) != 0)
+	{
+		return FALSE;
+	}
+
+	_AttributeDataFromStat((WIN32_FILE_ATTRIBUTE_DATA*)pInfo, &st);
+
+	return TRUE;
+}
+
+
+static BOOL _CreateDirectory(char* pszPath)
+{
+	int r = mkdir(pszPath, 0777);
+
+	if (r != 0)
+	{
+		_SetError();
+	}
+
+	free(pszPath);
+
+	return r == 0;
+}
+
+
+BOOL CreateDirectoryA(const char* pszPath, void* psa)
+{
+	return _CreateDirectory(_FixPath(pszPath));
+}
+
+
+BOOL CreateDirectoryW(const wchar_t* pszPath, void* psa)
+{
+	return _CreateDirectory(_FixPathW(pszPath));
+}
+
+
+static BOOL _Remove(char* pszPath, BOOL bDir)
+{
+	int r = bDir? rmdir(pszPath): unlink(pszPath);
+
+	if (r != 0)
+	{
+		_SetError();
+	}
+
+	free(pszPath);
+
+	return r == 0;
+}
+
+
+BOOL RemoveDirectoryA(const char* pszPath)
+{
+	return _Remove(_FixPath(pszPath), TRUE);
+}
+
+
+BOOL DeleteFileA(const char* pszFileName)
+{
+	return _Remove(_FixPath(pszFileName), FALSE);
+}
+
+
+BOOL MoveFileA(const char* pszFrom, const char* pszTo)
+{
+	char* pszFromFixed = _FixPath(pszFrom);
+	char* pszToFixed = _FixPath(pszTo);
+	int r = rename(pszFromFixed, pszToFixed);
+
+	if (r != 0)
+	{
+		_SetError();
+	}
+
+	free(pszFromFixed);
+	free(pszToFixed);
+
+	return r == 0;
+}
+
+
+DWORD GetFullPathNameW(const wchar_t* pszPath, DWORD nSize, wchar_t* pszDst, wchar_t** ppszFilePart)
+{
+	char szCwd[4096];
+	DWORD nCwd;
+	DWORD n;
+
+	nCwd = 0;
+
+	if ((pszPath[0] != '/') && (pszPath[0] != '\\'))
+	{
+		if (getcwd(szCwd, sizeof(szCwd)) == NULL)
+		{
+			return 0;
+		}
+
+		nCwd = (DWORD)MultiByteToWideChar(CP_UTF8, 0, szCwd, -1, NULL, 0);
+	}
+
+	n = nCwd + (DWORD)wcslen(pszPath);
+
+	if (n + 1 > nSize)
+	{
+		return n + 1;
+	}
+
+	if (nCwd != 0)
+	{
+		MultiByteToWideChar(CP_UTF8, 0, szCwd, -1, pszDst, nCwd);
+		pszDst[nCwd - 1] = '/';
+	}
+
+	wcscpy(&pszDst[nCwd], pszPath);
+
+	return n;
+}
+
+
+//
+// find
+//
+
+typedef struct finddata_s
+{
+	DIR* pDir;
+	char* pszDir;
+	char* pszPattern;
+} finddata_t;
+
+
+static BOOL _FindNext(finddata_t* pfind, WIN32_FIND_DATAA* pfd)
+{
+	WIN32_FILE_ATTRIBUTE_DATA ad;
+	struct dirent* pde;
+	struct stat st;
+	char* pszPath;
+
+	while ((pde = readdir(pfind->pDir)) != NULL)
+	{
+		if (fnmatch(pfind->pszPattern, pde->d_name, 0) != 0)
+		{
+			continue;
+		}
+
+		if (asprintf(&pszPath, "%s/%s", pfind->pszDir, pde->d_name) < 0)
+		{
+			return FALSE;
+		}
+
+		if (_Stat(pszPath, &st) != 0)
+		{
+			continue;
+		}
+
+		_AttributeDataFromStat(&ad, &st);
+		memset(pfd, 0, sizeof(WIN32_FIND_DATAA));
+		memcpy(pfd, &ad, sizeof(ad));
+		strncpy(pfd->cFileName, pde->d_name, MAX_PATH - 1);
+
+		return TRUE;
+	}
+
+	g_dwLastError = ERROR_FILE_NOT_FOUND;
+
+	return FALSE;
+}
+
+
+HANDLE FindFirstFileA(const char* pszPattern, WIN32_FIND_DATAA* pfd)
+{
+	finddata_t* pfind;
+	char* pszPath;
+	char* pszSlash;
+
+	pfind = (finddata_t*)calloc(1, sizeof(finddata_t));
+	pszPath = _FixPath(pszPattern);
+	pszSlash = strrchr(pszPath, '/');
+
+	if (pszSlash != NULL)
+	{
+		*pszSlash = '\0';
+		pfind->pszDir = strdup((*pszPath != '\0')? pszPath: "/");
+		pfind->pszPattern = strdup(pszSlash + 1);
+	}
+	else
+	{
+		pfind->pszDir = strdup(".");
+		pfind->pszPattern = strdup(pszPath);
+	}
+
+	free(pszPath);
+
+	// *.* also matches names without a dot
+	if (strcmp(pfind->pszPattern, "*.*") == 0)
+	{
+		pfind->pszPattern[1] = '\0';
+	}
+
+	pfind->pDir = opendir(pfind->pszDir);
+
+	if (pfind->pDir == NULL)
+	{
+		_SetError();
+	}
+
+	if ((pfind->pDir == NULL) || !_FindNext(pfind, pfd))
+	{
+		FindClose(pfind);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	return pfind;
+}
+
+
+BOOL FindNextFileA(HANDLE hFind, WIN32_FIND_DATAA* pfd)
+{
+	return _FindNext((finddata_t*)hFind, pfd);
+}
+
+
+static void _FindDataToW(const WIN32_FIND_DATAA* pfd, WIN32_FIND_DATAW* pfdw)
+{
+	memset(pfdw, 0, sizeof(WIN32_FIND_DATAW));
+	pfdw->dwFileAttributes = pfd->dwFileAttributes;
+	pfdw->ftCreationTime = pfd->ftCreationTime;
+	pfdw->ftLastAccessTime = pfd->ftLastAccessTime;
+	pfdw->ftLastWriteTime = pfd->ftLastWriteTime;
+	pfdw->nFileSizeHigh = pfd->nFileSizeHigh;
+	pfdw->nFileSizeLow = pfd->nFileSizeLow;
+
+	if (MultiByteToWideChar(CP_UTF8, 0, pfd->cFileName, -1, pfdw->cFileName, MAX_PATH) == 0)
+	{
+		pfdw->cFileName[0] = '?';
+	}
+}
+
+
+HANDLE FindFirstFileW(const wchar_t* pszPattern, WIN32_FIND_DATAW* pfdw)
+{
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind;
+	char* pszPath;
+
+	pszPath = _FixPathW(pszPattern);
+	hFind = FindFirstFileA(pszPath, &fd);
+	free(pszPath);
+
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		_FindDataToW(&fd, pfdw);
+	}
+
+	return hFind;
+}
+
+
+BOOL FindNextFileW(HANDLE hFind, WIN32_FIND_DATAW* pfdw)
+{
+	WIN32_FIND_DATAA fd;
+
+	if (!FindNextFileA(hFind, &fd))
+	{
+		return FALSE;
+	}
+
+	_FindDataToW(&fd, pfdw);
+
+	return TRUE;
+}
+
+
+BOOL FindClose(HANDLE hFind)
+{
+	finddata_t* pfind = (finddata_t*)hFind;
+
+	if (pfind->pDir != NULL)
+	{
+		closedir(pfind->pDir);
+	}
+
+	free(pfind->pszDir);
+	free(pfind->pszPattern);
+	free(pfind);
+
+	return TRUE;
+}
+
+
+//
+// handles
+//
+
+enum
+{
+	HANDLE_FILE = 1,
+	HANDLE_MAPPING,
+	HANDLE_THREAD,
+	HANDLE_SEMAPHORE,
+	HANDLE_EVENT
+};
+
+typedef struct object_s
+{
+	int iKind;
+	int fd;
+	long long iSize; // of a mapping
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	sem_t sem;
+	BOOL bSignaled; // a set event or a finished thread
+	BOOL bManualReset;
+	LPTHREAD_START_ROUTINE pfnThread;
+	LPVOID param;
+} object_t;
+
+
+static object_t* _NewObject(int iKind)
+{
+	object_t* po = (object_t*)calloc(1, sizeof(object_t));
+
+	po->iKind = iKind;
+	po->fd = -1;
+	pthread_mutex_init(&po->mutex, NULL);
+	pthread_cond_init(&po->cond, NULL);
+
+	return po;
+}
+
+
+static void _SignalObject(object_t* po)
+{
+	pthread_mutex_lock(&po->mutex);
+	po->bSignaled = TRUE;
+	pthread_cond_broadcast(&po->cond);
+	pthread_mutex_unlock(&po->mutex);
+}
+
+
+static HANDLE _OpenFile(char* pszPath, DWORD dwAccess, DWORD dwDisposition)
+{
+	object_t* po;
+	int fd;
+
+	if (dwAccess & GENERIC_WRITE)
+	{
+		fd = open(pszPath, (dwDisposition == CREATE_ALWAYS)? (O_RDWR | O_CREAT | O_TRUNC): O_RDWR, 0666);
+	}
+	else
+	{
+		fd = open(pszPath, O_RDONLY);
+	}
+
+	if (fd < 0)
+	{
+		_SetError();
+	}
+
+	free(pszPath);
+
+	if (fd < 0)
+	{
+		return INVALID_HANDLE_VALUE;
+	}
+
+	po = _NewObject(HANDLE_FILE);
+	po->fd = fd;
+
+	return po;
+}
+
+
+HANDLE CreateFileA(const char* pszFileName, DWORD dwAccess, DWORD dwShare, void* psa, DWORD dwDisposition, DWORD dwFlags, HANDLE hTemplate)
+{
+	return _OpenFile(_FixPath(pszFileName), dwAccess, dwDisposition);
+}
+
+
+HANDLE CreateFileW(const wchar_t* pszFileName, DWORD dwAccess, DWORD dwShare, void* psa, DWORD dwDisposition, DWORD dwFlags, HANDLE hTemplate)
+{
+	return _OpenFile(_FixPathW(pszFileName), dwAccess, dwDisposition);
+}
+
+
+BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* piSize)
+{
+	struct stat st;
+
+	if (fstat(((object_t*)hFile)->fd, &st) != 0)
+	{
+		return FALSE;
+	}
+
+	piSize->QuadPart = st.st_size;
+
+	return TRUE;
+}
+
+
+HANDLE CreateFileMappingA(HANDLE hFile, void* psa, DWORD dwProtect, DWORD dwSizeHigh, DWORD dwSizeLow, const char* pszName)
+{
+	object_t* po;
+	LARGE_INTEGER iSize;
+
+	if (!GetFileSizeEx(hFile, &iSize) || (iSize.QuadPart == 0))
+	{
+		return NULL;
+	}
+
+	po = _NewObject(HANDLE_MAPPING);
+	po->fd = dup(((object_t*)hFile)->fd);
+	po->iSize = iSize.QuadPart;
+
+	return po;
+}
+
+
+// views are whole files, their sizes are kept for munmap()
+
+typedef struct view_s
+{
+	struct view_s* pNext;
+	void* p;
+	size_t iSize;
+} view_t;
+
+static view_t* g_pViews;
+static pthread_mutex_t g_viewMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+LPVOID MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh, DWORD dwOffsetLow, SIZE_T iSize)
+{
+	object_t* po = (object_t*)hMapping;
+	view_t* pv;
+	void* p;
+
+	p = mmap(NULL, (size_t)po->iSize, PROT_READ, MAP_PRIVATE, po->fd, 0);
+
+	if (p == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	pv = (view_t*)malloc(sizeof(view_t));
+	pv->p = p;
+	pv->iSize = (size_t)po->iSize;
+
+	pthread_mutex_lock(&g_viewMutex);
+	pv->pNext = g_pViews;
+	g_pViews = pv;
+	pthread_mutex_unlock(&g_viewMutex);
+
+	return p;
+}
+
+
+BOOL UnmapViewOfFile(const void* p)
+{
+	view_t** ppv;
+	view_t* pv;
+
+	pthread_mutex_lock(&g_viewMutex);
+
+	for (ppv = &g_pViews; (*ppv != NULL) && ((*ppv)->p != p); ppv = &(*ppv)->pNext)
+	{
+	}
+
+	pv = *ppv;
+
+	if (pv != NULL)
+	{
+		*ppv = pv->pNext;
+	}
+
+	pthread_mutex_unlock(&g_viewMutex);
+
+	if (pv == NULL)
+	{
+		return FALSE;
+	}
+
+	munmap(pv->p, pv->iSize);
+	free(pv);
+
+	return TRUE;
+}
+
+
+//
+// threads and sync
+//
+
+void InitializeCriticalSection(CRITICAL_SECTION* pcs)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pcs->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+
+void DeleteCriticalSection(CRITICAL_SECTION* pcs)
+{
+	pthread_mutex_destroy(&pcs->mutex);
+}
+
+
+void EnterCriticalSection(CRITICAL_SECTION* pcs)
+{
+	pthread_mutex_lock(&pcs->mutex);
+}
+
+
+BOOL TryEnterCriticalSection(CRITICAL_SECTION* pcs)
+{
+	return pthread_mutex_trylock(&pcs->mutex) == 0;
+}
+
+
+void LeaveCriticalSection(CRITICAL_SECTION* pcs)
+{
+	pthread_mutex_unlock(&pcs->mutex);
+}
+
+
+static void* _ThreadProc(void* param)
+{
+	object_t* po = (object_t*)param;
+
+	po->pfnThread(po->param);
+	_SignalObject(po);
+
+	return NULL;
+}
+
+
+HANDLE CreateThread(void* psa, SIZE_T iStackSize, LPTHREAD_START_ROUTINE pfn, LPVOID param, DWORD dwFlags, DWORD* pdwId)
+{
+	object_t* po = _NewObject(HANDLE_THREAD);
+
+	po->pfnThread = pfn;
+	po->param = param;
+
+	if (pthread_create(&po->thread, NULL, _ThreadProc, po) != 0)
+	{
+		free(po);
+		return NULL;
+	}
+
+	return po;
+}
+
+
+HANDLE CreateSemaphoreA(void* psa, LONG nInitial, LONG nMax, const char* pszName)
+{
+	object_t* po = _NewObject(HANDLE_SEMAPHORE);
+
+	sem_init(&po->sem, 0, (unsigned int)nInitial);
+
+	return po;
+}
+
+
+BOOL ReleaseSemaphore(HANDLE hSemaphore, LONG n, LONG* pnPrevious)
+{
+	object_t* po = (object_t*)hSemaphore;
+
+	while (n-- > 0)
+	{
+		sem_post(&po->sem);
+	}
+
+	return TRUE;
+}
+
+
+HANDLE CreateEventA(void* psa, BOOL bManualReset, BOOL bInitialState, const char* pszName)
+{
+	object_t* po = _NewObject(HANDLE_EVENT);
+
+	po->bManualReset = bManualReset;
+	po->bSignaled = bInitialState;
+
+	return po;
+}
+
+
+BOOL SetEvent(HANDLE hEvent)
+{
+	_SignalObject((object_t*)hEvent);
+
+	return TRUE;
+}
+
+
+BOOL ResetEvent(HANDLE hEvent)
+{
+	object_t* po = (object_t*)hEvent;
+
+	pthread_mutex_lock(&po->mutex);
+	po->bSignaled = FALSE;
+	pthread_mutex_unlock(&po->mutex);
+
+	return TRUE;
+}
+
+
+DWORD WaitForSingleObject(HANDLE h, DWORD dwMs)
+{
+	object_t* po = (object_t*)h;
+	struct timespec ts;
+	int r;
+
+	if (dwMs != INFINITE)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += dwMs / 1000;
+		ts.tv_nsec += (long)(dwMs % 1000) * 1000000L;
+
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	if (po->iKind == HANDLE_SEMAPHORE)
+	{
+		do
+		{
+			r = (dwMs == INFINITE)? sem_wait(&po->sem): sem_timedwait(&po->sem, &ts);
+		}
+		while ((r != 0) && (errno == EINTR));
+
+		return (r == 0)? WAIT_OBJECT_0: WAIT_TIMEOUT;
+	}
+
+	r = 0;
+	pthread_mutex_lock(&po->mutex);
+
+	while (!po->bSignaled && (r == 0))
+	{
+		r = (dwMs == INFINITE)? pthread_cond_wait(&po->cond, &po->mutex): pthread_cond_timedwait(&po->cond, &po->mutex, &ts);
+	}
+
+	r = po->bSignaled? WAIT_OBJECT_0: WAIT_TIMEOUT;
+
+	if ((po->iKind == HANDLE_EVENT) && !po->bManualReset)
+	{
+		po->bSignaled = FALSE;
+	}
+
+	pthread_mutex_unlock(&po->mutex);
+
+	return (DWORD)r;
+}
+
+
+BOOL CloseHandle(HANDLE h)
+{
+	object_t* po = (object_t*)h;
+
+	switch (po->iKind)
+	{
+	case HANDLE_FILE:
+	case HANDLE_MAPPING:
+		close(po->fd);
+		break;
+	case HANDLE_THREAD:
+		pthread_join(po->thread, NULL);
+		break;
+	case HANDLE_SEMAPHORE:
+		sem_destroy(&po->sem);
+		break;
+	}
+
+	pthread_mutex_destroy(&po->mutex);
+	pthread_cond_destroy(&po->cond);
+	free(po);
+
+	return TRUE;
+}
+
+
+//
+// directory changes, nothing is watched, the tests queue the changes with ShimNotifyChange()
+//
+
+static struct
+{
+	BYTE* pBuffer;
+	DWORD iSize;
+	DWORD iUsed;
+	OVERLAPPED* po;
+	FILE_NOTIFY_INFORMATION* pLast;
+} g_read;
+
+
+BOOL ReadDirectoryChangesW(HANDLE hDir, LPVOID buffer, DWORD iSize, BOOL bSubTree, DWORD dwFilter, LPDWORD piReturned, OVERLAPPED* po, void* pfnCompletion)
+{
+	g_read.pBuffer = (BYTE*)buffer;
+	g_read.iSize = iSize;
+	g_read.iUsed = 0;
+	g_read.po = po;
+	g_read.pLast = NULL;
+
+	po->InternalHigh = 0;
+	ResetEvent(po->hEvent);
+
+	return TRUE;
+}
+
+
+// a change that doesn't fit in the buffer completes the read with 0 bytes, as an overflow
+
+void ShimNotifyChange(DWORD dwAction, const wchar_t* pszName)
+{
+	FILE_NOTIFY_INFORMATION* pfni;
+	DWORD iLength;
+	DWORD iSize;
+	DWORD i;
+
+	if ((g_read.po == NULL) || (g_read.po->InternalHigh == (ULONG_PTR)-1))
+	{
+		return;
+	}
+
+	iLength = (DWORD)wcslen(pszName);
+	iSize = (DWORD)(offsetof(FILE_NOTIFY_INFORMATION, FileName) + iLength * sizeof(WCHAR) + 3) & ~3u;
+
+	if (g_read.iUsed + iSize > g_read.iSize)
+	{
+		g_read.po->InternalHigh = (ULONG_PTR)-1;
+		SetEvent(g_read.po->hEvent);
+		return;
+	}
+
+	pfni = (FILE_NOTIFY_INFORMATION*)&g_read.pBuffer[g_read.iUsed];
+	pfni->NextEntryOffset = 0;
+	pfni->Action = dwAction;
+	pfni->FileNameLength = iLength * sizeof(WCHAR);
+
+	for (i = 0; i < iLength; i++)
+	{
+		pfni->FileName[i] = pszName[i];
+	}
+
+	if (g_read.pLast != NULL)
+	{
+		g_read.pLast->NextEntryOffset = (DWORD)((BYTE*)pfni - (BYTE*)g_read.pLast);
+	}
+
+	g_read.pLast = pfni;
+	g_read.iUsed += iSize;
+	g_read.po->InternalHigh = g_read.iUsed;
+
+	SetEvent(g_read.po->hEvent);
+}
+
+
+BOOL GetOverlappedResult(HANDLE hFile, OVERLAPPED* po, LPDWORD piTransferred, BOOL bWait)
+{
+	*piTransferred = (po->InternalHigh == (ULONG_PTR)-1)? 0: (DWORD)po->InternalHigh;
+
+	if (po == g_read.po)
+	{
+		g_read.po = NULL;
+	}
+
+	return TRUE;
+}
+
+
+BOOL CancelIo(HANDLE hFile)
+{
+	return TRUE;
+}
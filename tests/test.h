@@ -0,0 +1,91 @@
+
+// tiny checks for the unit tests, each test is a main() returning the number of failures
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static int g_nFailed;
+static int g_nChecks;
+
+#define CHECK(x) \
+	do \
+	{ \
+		g_nChecks++; \
+		if (!(x)) \
+		{ \
+			printf("%s(%d): failed: %s\n", __FILE__, __LINE__, #x); \
+			g_nFailed++; \
+		} \
+	} \
+	while (0)
+
+#define CHECK_STR(a, b) CHECK(((a) != NULL) && (strcmp((a), (b)) == 0))
+
+#define RUN(fn) \
+	do \
+	{ \
+		int nFailed = g_nFailed; \
+		fn(); \
+		printf("%-40s %s\n", #fn, (g_nFailed == nFailed)? "ok": "FAILED"); \
+	} \
+	while (0)
+
+#define TEST_RESULT() (printf("%d checks, %d failed\n", g_nChecks, g_nFailed), (g_nFailed != 0))
+
+
+// whole file helpers, the tests run in the build directory
+
+static __inline void WriteTestFile(const char* pszFileName, const void* p, size_t iSize)
+{
+	FILE* stream = fopen(pszFileName, "wb");
+
+	if (stream != NULL)
+	{
+		fwrite(p, 1, iSize, stream);
+		fclose(stream);
+	}
+}
+
+
+static __inline void WriteTestText(const char* pszFileName, const char* psz)
+{
+	WriteTestFile(pszFileName, psz, strlen(psz));
+}
+
+
+// malloc()'d, NULL if the file can't be read
+
+static __inline byte_t* ReadTestFile(const char* pszFileName, long* piSize)
+{
+	FILE* stream = fopen(pszFileName, "rb");
+	byte_t* p;
+
+	if (stream == NULL)
+	{
+		return NULL;
+	}
+
+	fseek(stream, 0, SEEK_END);
+	*piSize = ftell(stream);
+	fseek(stream, 0, SEEK_SET);
+
+	p = (byte_t*)malloc(*piSize + 1);
+
+	if ((p != NULL) && (fread(p, 1, *piSize, stream) != (size_t)*piSize))
+	{
+		free(p);
+		p = NULL;
+	}
+
+	fclose(stream);
+
+	return p;
+}
+
+#endif // _TEST_H
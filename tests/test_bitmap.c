@@ -0,0 +1,767 @@
+
+// bitmaps: bmp and qoi files, the loader checks, conversion, blit, flip, views, scaling, pools, the cache
+
+#include "test.h"
+
+#define PIXEL(pbmp, x, y) (&(pbmp)->pixels[(y) * (pbmp)->iPitch + (x) * (pbmp)->nBPP])
+
+
+static bitmap_t* _AllocRandomBitmap(int iWidth, int iHeight, int nBPP)
+{
+	bitmap_t* pbmp;
+	int i;
+
+	pbmp = AllocBitmap(iWidth, iHeight, nBPP, (nBPP == 1)? 256: 0);
+
+	if (pbmp != NULL)
+	{
+		for (i = 0; i < pbmp->iPitch * iHeight; i++)
+		{
+			pbmp->pixels[i] = (byte_t)rand();
+		}
+
+		for (i = 0; i < pbmp->nColors; i++)
+		{
+			pbmp->pal[i].rgbRed = (byte_t)i;
+			pbmp->pal[i].rgbGreen = (byte_t)(i * 3);
+			pbmp->pal[i].rgbBlue = (byte_t)(i * 7);
+			pbmp->pal[i].rgbReserved = 0;
+		}
+	}
+
+	return pbmp;
+}
+
+
+static bool_t _SamePixels(bitmap_t* pbmp1, bitmap_t* pbmp2)
+{
+	int y;
+
+	if ((pbmp1->iWidth != pbmp2->iWidth) || (pbmp1->iHeight != pbmp2->iHeight) || (pbmp1->nBPP != pbmp2->nBPP))
+	{
+		return false;
+	}
+
+	for (y = 0; y < pbmp1->iHeight; y++)
+	{
+		if (memcmp(PIXEL(pbmp1, 0, y), PIXEL(pbmp2, 0, y), pbmp1->iWidth * pbmp1->nBPP) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static void _PatchDword(byte_t* p, int iOffset, DWORD iValue)
+{
+	memcpy(&p[iOffset], &iValue, sizeof(DWORD));
+}
+
+
+static int _LoadBmpError(const byte_t* p, long iSize)
+{
+	bitmap_t* pbmp;
+	int iError;
+
+	WriteTestFile("test_damaged.bmp", p, iSize);
+	pbmp = LoadBitmapFromFileEx("test_damaged.bmp", &iError);
+
+	if (pbmp != NULL)
+	{
+		FreeBitmap(pbmp);
+	}
+
+	return iError;
+}
+
+
+static void TestBmpFiles(void)
+{
+	static const int anBPP[] = { 1, 3, 4 };
+	bitmap_t* pbmp;
+	bitmap_t* pbmpLoaded;
+	byte_t* p;
+	byte_t* pDamaged;
+	long iSize;
+	int iError;
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		pbmp = _AllocRandomBitmap(13, 7, anBPP[i]);
+		CHECK(SaveBitmap("test_bitmap.bmp", pbmp));
+
+		pbmpLoaded = LoadBitmapFromFileEx("test_bitmap.bmp", &iError);
+		CHECK((pbmpLoaded != NULL) && (iError == UERR_OK));
+
+		if (pbmpLoaded != NULL)
+		{
+			CHECK(_SamePixels(pbmp, pbmpLoaded));
+			CHECK((anBPP[i] != 1) || (memcmp(pbmp->pal, pbmpLoaded->pal, 256 * sizeof(RGBQUAD)) == 0));
+			FreeBitmap(pbmpLoaded);
+		}
+
+		FreeBitmap(pbmp);
+	}
+
+	CHECK((LoadBitmapFromFileEx("test_missing.bmp", &iError) == NULL) && (iError == UERR_IO));
+
+	// damaged headers of the last one
+	p = ReadTestFile("test_bitmap.bmp", &iSize);
+	CHECK(p != NULL);
+
+	if (p == NULL)
+	{
+		return;
+	}
+
+	pDamaged = (byte_t*)malloc(iSize);
+
+	memcpy(pDamaged, p, iSize);
+	memcpy(&pDamaged[18], "\xFF\xFF\xFF\x7F\xFF\xFF\xFF\x7F", 8);
+	WriteTestFile("test_damaged.bmp", pDamaged, iSize);
+	CHECK((LoadBitmapFromFileEx("test_damaged.bmp", &iError) == NULL) && (iError == UERR_OVERFLOW));
+
+	memcpy(pDamaged, p, iSize);
+	memcpy(&pDamaged[22], "\x00\x00\x00\x80", 4);
+	WriteTestFile("test_damaged.bmp", pDamaged, iSize);
+	CHECK((LoadBitmapFromFileEx("test_damaged.bmp", &iError) == NULL) && (iError == UERR_FORMAT));
+
+	WriteTestFile("test_damaged.bmp", p, iSize - 1);
+	CHECK((LoadBitmapFromFileEx("test_damaged.bmp", &iError) == NULL) && (iError == UERR_TRUNCATED));
+
+	WriteTestFile("test_damaged.bmp", p, 10);
+	CHECK((LoadBitmapFromFileEx("test_damaged.bmp", &iError) == NULL) && (iError < 0));
+
+	// out of memory for the bitmap, then for its pixels
+	for (i = 0; i < 2; i++)
+	{
+		ShimFailAllocations(i);
+		CHECK((LoadBitmapFromFileEx("test_bitmap.bmp", &iError) == NULL) && (iError == UERR_NOMEM));
+		ShimFailAllocations(-1);
+	}
+
+	free(pDamaged);
+	free(p);
+}
+
+
+// a reference qoi decoder to check SaveBitmapQOI() with, rgba, malloc()'d
+
+static byte_t* _DecodeQOI(const byte_t* p, long iSize, int* piWidth, int* piHeight, int* pnChannels)
+{
+	byte_t aIndex[64][4];
+	byte_t px[4] = { 0, 0, 0, 255 };
+	byte_t* pOut;
+	long iPos;
+	int nPixels;
+	int nRun;
+	int b1;
+	int b2;
+	int vg;
+	int i;
+
+	if ((iSize < 22) || (memcmp(p, "qoif", 4) != 0))
+	{
+		return NULL;
+	}
+
+	*piWidth = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+	*piHeight = (p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+	*pnChannels = p[12];
+
+	memset(aIndex, 0, sizeof(aIndex));
+	nPixels = *piWidth * *piHeight;
+	pOut = (byte_t*)malloc(nPixels * 4 + 1);
+	iPos = 14;
+	nRun = 0;
+
+	for (i = 0; i < nPixels; i++)
+	{
+		if (nRun > 0)
+		{
+			nRun--;
+		}
+		else if (iPos < iSize - 8)
+		{
+			b1 = p[iPos++];
+
+			if (b1 == 0xFE)
+			{
+				px[0] = p[iPos++];
+				px[1] = p[iPos++];
+				px[2] = p[iPos++];
+			}
+			else if (b1 == 0xFF)
+			{
+				memcpy(px, &p[iPos], 4);
+				iPos += 4;
+			}
+			else if ((b1 & 0xC0) == 0x00)
+			{
+				memcpy(px, aIndex[b1], 4);
+			}
+			else if ((b1 & 0xC0) == 0x40)
+			{
+				px[0] += ((b1 >> 4) & 3) - 2;
+				px[1] += ((b1 >> 2) & 3) - 2;
+				px[2] += (b1 & 3) - 2;
+			}
+			else if ((b1 & 0xC0) == 0x80)
+			{
+				b2 = p[iPos++];
+				vg = (b1 & 0x3F) - 32;
+				px[0] += vg - 8 + ((b2 >> 4) & 0x0F);
+				px[1] += vg;
+				px[2] += vg - 8 + (b2 & 0x0F);
+			}
+			else
+			{
+				nRun = b1 & 0x3F;
+			}
+
+			memcpy(aIndex[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+		}
+
+		memcpy(&pOut[i * 4], px, 4);
+	}
+
+	if ((iPos != iSize - 8) || (memcmp(&p[iSize - 8], "\0\0\0\0\0\0\0\1", 8) != 0))
+	{
+		free(pOut);
+		return NULL;
+	}
+
+	return pOut;
+}
+
+
+static void _CheckQOI(bitmap_t* pbmp)
+{
+	byte_t* p;
+	byte_t* pDecoded;
+	byte_t* pSrc;
+	byte_t ac[4];
+	long iSize;
+	int iWidth;
+	int iHeight;
+	int nChannels;
+	int x;
+	int y;
+
+	CHECK(SaveBitmapQOI("test_bitmap.qoi", pbmp));
+
+	p = ReadTestFile("test_bitmap.qoi", &iSize);
+	pDecoded = (p != NULL)? _DecodeQOI(p, iSize, &iWidth, &iHeight, &nChannels): NULL;
+	CHECK(pDecoded != NULL);
+
+	if (pDecoded != NULL)
+	{
+		CHECK((iWidth == pbmp->iWidth) && (iHeight == pbmp->iHeight) && (nChannels == ((pbmp->nBPP == 4)? 4: 3)));
+
+		for (y = 0; y < pbmp->iHeight; y++)
+		{
+			for (x = 0; x < pbmp->iWidth; x++)
+			{
+				pSrc = PIXEL(pbmp, x, y);
+
+				if (pbmp->nBPP == 1)
+				{
+					ac[0] = pbmp->pal[pSrc[0]].rgbRed;
+					ac[1] = pbmp->pal[pSrc[0]].rgbGreen;
+					ac[2] = pbmp->pal[pSrc[0]].rgbBlue;
+					ac[3] = 255;
+				}
+				else
+				{
+					ac[0] = pSrc[2];
+					ac[1] = pSrc[1];
+					ac[2] = pSrc[0];
+					ac[3] = (pbmp->nBPP == 4)? pSrc[3]: 255;
+				}
+
+				if (memcmp(ac, &pDecoded[(y * iWidth + x) * 4], 4) != 0)
+				{
+					CHECK(!"qoi pixel");
+					y = pbmp->iHeight;
+					break;
+				}
+			}
+		}
+
+		free(pDecoded);
+	}
+
+	free(p);
+}
+
+
+// headers whose sizes wrap in 32 bits, or fit an int but not the file, are refused before
+// anything is allocated
+
+static void TestBmpHeaderChecks(void)
+{
+	static const struct
+	{
+		DWORD iWidth;
+		DWORD iHeight;
+		DWORD iOffBits;
+		int iError;
+	} aCases[] =
+	{
+		{ 13, 7, 54, UERR_OK },
+		{ 0x40000000, 1, 54, UERR_OVERFLOW }, // the row size wraps to 0
+		{ 0x20000000, 1, 54, UERR_OVERFLOW }, // row of INT_MAX + 1
+		{ 0x1FFFFFFF, 1, 54, UERR_TRUNCATED }, // fits an int, not the file
+		{ 0x10000, 0x10000, 54, UERR_OVERFLOW }, // the data size wraps to 0
+		{ 0x2000, 0x10000, 54, UERR_OVERFLOW }, // data of INT_MAX + 1
+		{ 0x2000, (DWORD)-0x10000, 54, UERR_OVERFLOW }, // top down
+		{ 0x2000, 0xFFFF, 54, UERR_TRUNCATED },
+		{ 13, 7, 0xFFFFFFF0, UERR_TRUNCATED }, // the offset plus the size wraps
+		{ 13, 7, 10, UERR_FORMAT }, // pixels inside the headers
+	};
+	bitmap_t* pbmp;
+	byte_t* p;
+	byte_t* pDamaged;
+	long iSize;
+	int i;
+
+	pbmp = _AllocRandomBitmap(13, 7, 4);
+	CHECK(SaveBitmap("test_bitmap.bmp", pbmp));
+	FreeBitmap(pbmp);
+
+	p = ReadTestFile("test_bitmap.bmp", &iSize);
+	CHECK(p != NULL);
+
+	if (p == NULL)
+	{
+		return;
+	}
+
+	pDamaged = (byte_t*)malloc(iSize);
+
+	for (i = 0; i < (int)(sizeof(aCases) / sizeof(aCases[0])); i++)
+	{
+		memcpy(pDamaged, p, iSize);
+		_PatchDword(pDamaged, 10, aCases[i].iOffBits);
+		_PatchDword(pDamaged, 18, aCases[i].iWidth);
+		_PatchDword(pDamaged, 22, aCases[i].iHeight);
+		CHECK(_LoadBmpError(pDamaged, iSize) == aCases[i].iError);
+	}
+
+	// an info header larger than the file
+	memcpy(pDamaged, p, iSize);
+	_PatchDword(pDamaged, 14, 0xFFFFFFFF);
+	CHECK(_LoadBmpError(pDamaged, iSize) == UERR_FORMAT);
+
+	free(pDamaged);
+	free(p);
+}
+
+
+static void TestQOI(void)
+{
+	static const int anBPP[] = { 1, 3, 4 };
+	bitmap_t* pbmp;
+	int i;
+	int x;
+	int y;
+
+	// noise, gradients and runs, on the threads and without them
+	for (i = 0; i < 3; i++)
+	{
+		pbmp = AllocBitmap(300, 600, anBPP[i], (anBPP[i] == 1)? 256: 0);
+
+		for (x = 0; x < pbmp->nColors; x++)
+		{
+			pbmp->pal[x].rgbRed = (byte_t)x;
+			pbmp->pal[x].rgbGreen = (byte_t)(x * 3);
+			pbmp->pal[x].rgbBlue = (byte_t)(x * 7);
+		}
+
+		for (y = 0; y < pbmp->iHeight; y++)
+		{
+			for (x = 0; x < pbmp->iWidth * pbmp->nBPP; x++)
+			{
+				pbmp->pixels[y * pbmp->iPitch + x] = (byte_t)((y / 50 % 3 == 0)? rand(): (y / 50 % 3 == 1)? (x / 7 + y / 3): 17);
+			}
+		}
+
+		SetWorkerThreadCount(4);
+		_CheckQOI(pbmp);
+		SetWorkerThreadCount(1);
+		_CheckQOI(pbmp);
+		SetWorkerThreadCount(0);
+
+		FreeBitmap(pbmp);
+	}
+}
+
+
+static void TestAllocBitmap(void)
+{
+	static const int aiAlign[] = { 4, 16, 64, 256 };
+	bitmap_t* pbmp;
+	bmppool_t* pbp;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		pbmp = AllocBitmapEx(37, 5, 3, 0, aiAlign[i]);
+		CHECK(pbmp != NULL);
+		CHECK((pbmp->iPitch >= 37 * 3) && (pbmp->iPitch % aiAlign[i] == 0) && (pbmp->iPitch - 37 * 3 < aiAlign[i]));
+		CHECK(((size_t)pbmp->pixels % max(aiAlign[i], 64)) == 0);
+		FreeBitmap(pbmp);
+	}
+
+	// the alignment must be a power of two
+	CHECK(AllocBitmapEx(37, 5, 3, 0, 0) == NULL);
+	CHECK(AllocBitmapEx(37, 5, 3, 0, 24) == NULL);
+
+	// the bitmap itself fails, then its pixels, then its palette
+	for (i = 0; i < 3; i++)
+	{
+		ShimFailAllocations(i);
+		CHECK(AllocBitmap(16, 16, 1, 256) == NULL);
+		ShimFailAllocations(-1);
+	}
+
+	pbmp = _AllocRandomBitmap(16, 16, 1);
+	pbp = CreateBitmapPool(1 << 20);
+
+	ShimFailAllocations(0);
+	CHECK(AllocConvertedBitmap(pbmp, 4) == NULL);
+	CHECK(AllocBitmapFromPool(pbp, 16, 16, 4, 0) == NULL);
+	CHECK(CreateBitmapPool(1 << 20) == NULL);
+	ShimFailAllocations(1);
+	CHECK(AllocBitmapFromPool(pbp, 16, 16, 4, 0) == NULL);
+	ShimFailAllocations(-1);
+
+	FreeBitmapPool(pbp);
+	FreeBitmap(pbmp);
+}
+
+
+static void TestConvert(void)
+{
+	bitmap_t* pbmp8;
+	bitmap_t* pbmp24;
+	bitmap_t* pbmp32;
+	bitmap_t* pbmpBack;
+	int x;
+	int y;
+
+	pbmp8 = _AllocRandomBitmap(37, 11, 1);
+	pbmp24 = AllocConvertedBitmap(pbmp8, 3);
+	pbmp32 = AllocConvertedBitmap(pbmp24, 4);
+	CHECK((pbmp24 != NULL) && (pbmp32 != NULL));
+
+	if ((pbmp24 != NULL) && (pbmp32 != NULL))
+	{
+		for (y = 0; y < 11; y++)
+		{
+			for (x = 0; x < 37; x++)
+			{
+				RGBQUAD* pc = &pbmp8->pal[*PIXEL(pbmp8, x, y)];
+
+				CHECK((PIXEL(pbmp24, x, y)[0] == pc->rgbBlue) && (PIXEL(pbmp24, x, y)[1] == pc->rgbGreen) && (PIXEL(pbmp24, x, y)[2] == pc->rgbRed));
+				CHECK((memcmp(PIXEL(pbmp32, x, y), PIXEL(pbmp24, x, y), 3) == 0) && (PIXEL(pbmp32, x, y)[3] == 255));
+			}
+		}
+
+		pbmpBack = AllocConvertedBitmap(pbmp32, 3);
+		CHECK((pbmpBack != NULL) && _SamePixels(pbmpBack, pbmp24));
+		FreeBitmap(pbmpBack);
+
+		// only 8 -> 24/32
+		CHECK(AllocConvertedBitmap(pbmp24, 1) == NULL);
+	}
+
+	FreeBitmap(pbmp8);
+	FreeBitmap(pbmp24);
+	FreeBitmap(pbmp32);
+}
+
+
+static void TestBlitFlipScale(void)
+{
+	static const int anBPP[] = { 1, 3, 4 };
+	bitmap_t* pbmp;
+	bitmap_t* pbmpCopy;
+	bitmap_t* pbmpScaled;
+	bitmap_t view;
+	int iWidth;
+	int iHeight = 5;
+	int nBPP;
+	int iSum;
+	int i;
+	int c;
+	int x;
+	int y;
+
+	for (iWidth = 1; iWidth < 80; iWidth++)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			nBPP = anBPP[i];
+			pbmp = _AllocRandomBitmap(iWidth, iHeight, nBPP);
+			pbmpCopy = AllocBitmap(iWidth, iHeight, nBPP, pbmp->nColors);
+
+			CHECK(BlitBitmap(pbmpCopy, 0, 0, pbmp, 0, 0, iWidth, iHeight));
+			CHECK(_SamePixels(pbmpCopy, pbmp));
+
+			FlipBitmapHorizontal(pbmpCopy);
+			FlipBitmapVertical(pbmpCopy);
+
+			for (y = 0; y < iHeight; y++)
+			{
+				for (x = 0; x < iWidth; x++)
+				{
+					if (memcmp(PIXEL(pbmpCopy, x, y), PIXEL(pbmp, iWidth - 1 - x, iHeight - 1 - y), nBPP) != 0)
+					{
+						CHECK(!"flipped pixel");
+						y = iHeight;
+						break;
+					}
+				}
+			}
+
+			if (iWidth > 3)
+			{
+				CHECK(GetBitmapView(&view, pbmp, 1, 1, iWidth - 2, 3));
+				CHECK(PIXEL(&view, 0, 0) == PIXEL(pbmp, 1, 1));
+				CHECK(!GetBitmapView(&view, pbmp, 1, 1, iWidth, 3));
+			}
+
+			// same size scaling is a copy
+			pbmpScaled = AllocBitmap(iWidth, iHeight, nBPP, pbmp->nColors);
+			CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_POINT) && _SamePixels(pbmpScaled, pbmp));
+
+			if (nBPP > 1)
+			{
+				CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_BILINEAR) && _SamePixels(pbmpScaled, pbmp));
+				CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_BOX) && _SamePixels(pbmpScaled, pbmp));
+			}
+
+			FreeBitmap(pbmpScaled);
+			FreeBitmap(pbmpCopy);
+			FreeBitmap(pbmp);
+		}
+	}
+
+	// halving: box is the rounded mean, bilinear samples between the same four pixels
+	pbmp = _AllocRandomBitmap(8, 8, 3);
+	pbmpScaled = AllocBitmap(4, 4, 3, 0);
+
+	CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_BOX));
+
+	for (y = 0; y < 4; y++)
+	{
+		for (x = 0; x < 4; x++)
+		{
+			for (c = 0; c < 3; c++)
+			{
+				iSum = PIXEL(pbmp, 2 * x, 2 * y)[c] + PIXEL(pbmp, 2 * x + 1, 2 * y)[c] + PIXEL(pbmp, 2 * x, 2 * y + 1)[c] + PIXEL(pbmp, 2 * x + 1, 2 * y + 1)[c];
+				CHECK(PIXEL(pbmpScaled, x, y)[c] == (iSum + 2) / 4);
+			}
+		}
+	}
+
+	CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_BILINEAR));
+
+	for (y = 0; y < 4; y++)
+	{
+		for (x = 0; x < 4; x++)
+		{
+			for (c = 0; c < 3; c++)
+			{
+				iSum = PIXEL(pbmp, 2 * x, 2 * y)[c] + PIXEL(pbmp, 2 * x + 1, 2 * y)[c] + PIXEL(pbmp, 2 * x, 2 * y + 1)[c] + PIXEL(pbmp, 2 * x + 1, 2 * y + 1)[c];
+				CHECK(abs(PIXEL(pbmpScaled, x, y)[c] - iSum / 4) <= 1);
+			}
+		}
+	}
+
+	// overlapping blit within one bitmap
+	pbmpCopy = AllocBitmap(8, 8, 3, 0);
+	memcpy(pbmpCopy->pixels, pbmp->pixels, pbmp->iPitch * 8);
+	CHECK(BlitBitmap(pbmp, 1, 2, pbmp, 0, 0, 8, 8));
+
+	for (y = 2; y < 8; y++)
+	{
+		CHECK(memcmp(PIXEL(pbmp, 1, y), PIXEL(pbmpCopy, 0, y - 2), 7 * 3) == 0);
+	}
+
+	FreeBitmap(pbmpCopy);
+	FreeBitmap(pbmpScaled);
+	FreeBitmap(pbmp);
+}
+
+
+static void TestScaleLimits(void)
+{
+	bitmap_t* pbmp;
+	bitmap_t* pbmpScaled;
+
+	// one destination pixel sums 36M source pixels, past 32 bits
+	pbmp = AllocBitmap(6000, 6000, 3, 0);
+	pbmpScaled = AllocBitmap(1, 1, 3, 0);
+	memset(pbmp->pixels, 200, pbmp->iPitch * pbmp->iHeight);
+
+	CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_BOX));
+	CHECK((pbmpScaled->pixels[0] == 200) && (pbmpScaled->pixels[1] == 200) && (pbmpScaled->pixels[2] == 200));
+
+	FreeBitmap(pbmpScaled);
+	FreeBitmap(pbmp);
+
+	// the bands report their failed allocations
+	pbmp = _AllocRandomBitmap(64, 64, 4);
+	pbmpScaled = AllocBitmap(16, 16, 4, 0);
+
+	ShimFailAllocations(0);
+	CHECK(!ScaleBitmap(pbmpScaled, pbmp, SCALE_POINT));
+	CHECK(!ScaleBitmap(pbmpScaled, pbmp, SCALE_BOX));
+	CHECK(!ScaleBitmap(pbmpScaled, pbmp, SCALE_BILINEAR));
+	ShimFailAllocations(-1);
+
+	CHECK(ScaleBitmap(pbmpScaled, pbmp, SCALE_BOX));
+
+	FreeBitmap(pbmpScaled);
+	FreeBitmap(pbmp);
+}
+
+
+static void TestPool(void)
+{
+	bmppool_t* pbp;
+	bitmap_t* pbmp1;
+	bitmap_t* pbmp2;
+	bitmap_t* pbmp3;
+	int i;
+
+	pbp = CreateBitmapPool(1 << 20);
+
+	pbmp1 = AllocBitmapFromPool(pbp, 100, 100, 3, 0);
+	pbmp2 = AllocBitmapFromPool(pbp, 100, 100, 3, 0);
+	CHECK((pbmp1 != NULL) && (pbmp2 != NULL) && (pbmp1 != pbmp2));
+
+	ReleaseBitmapToPool(pbp, pbmp1);
+	pbmp3 = AllocBitmapFromPool(pbp, 100, 100, 3, 0);
+	CHECK(pbmp3 == pbmp1);
+
+	ReleaseBitmapToPool(pbp, pbmp3);
+	pbmp3 = AllocBitmapFromPool(pbp, 100, 100, 4, 0);
+	CHECK((pbmp3 != pbmp1) && (pbmp3->nBPP == 4));
+
+	ReleaseBitmapToPool(pbp, pbmp2);
+	ReleaseBitmapToPool(pbp, pbmp3);
+	CHECK((GetBitmapPoolSize(pbp) > 0) && (GetBitmapPoolSize(pbp) <= (1 << 20)));
+
+	for (i = 0; i < 50; i++)
+	{
+		ReleaseBitmapToPool(pbp, AllocBitmapFromPool(pbp, 200 + i, 200, 4, 0));
+	}
+
+	CHECK(GetBitmapPoolSize(pbp) <= (1 << 20));
+
+	TrimBitmapPool(pbp, 0);
+	CHECK(GetBitmapPoolSize(pbp) == 0);
+
+	FreeBitmapPool(pbp);
+}
+
+
+static void TestCache(void)
+{
+	bitmap_t* pbmp;
+	bitmap_t* pbmp1;
+	bitmap_t* pbmp2;
+	bitmap_t* pbmp3;
+	size_t iOne;
+
+	InvalidateBitmapCache(NULL);
+	CHECK(GetBitmapCacheSize() == 0);
+
+	pbmp = _AllocRandomBitmap(16, 16, 3);
+	CHECK(SaveBitmap("test_cache1.bmp", pbmp) && SaveBitmap("test_cache2.bmp", pbmp) && SaveBitmap("test_cache3.bmp", pbmp));
+
+	pbmp1 = LoadBitmapCached("test_cache1.bmp");
+	pbmp2 = LoadBitmapCached("test_cache1.bmp");
+	CHECK((pbmp1 != NULL) && (pbmp1 == pbmp2) && _SamePixels(pbmp1, pbmp));
+	iOne = GetBitmapCacheSize();
+	CHECK(iOne > 16 * 16 * 3);
+	CHECK(LoadBitmapCached("test_missing.bmp") == NULL);
+
+	// a changed file is loaded again, the holders of the old one keep it
+	FreeBitmap(pbmp);
+	pbmp = _AllocRandomBitmap(8, 8, 3);
+	CHECK(SaveBitmap("test_cache1.bmp", pbmp));
+
+	pbmp3 = LoadBitmapCached("test_cache1.bmp");
+	CHECK((pbmp3 != NULL) && (pbmp3 != pbmp1) && _SamePixels(pbmp3, pbmp));
+	CHECK((pbmp1->iWidth == 16) && (pbmp1->iHeight == 16));
+
+	ReleaseCachedBitmap(pbmp1);
+	ReleaseCachedBitmap(pbmp2);
+	ReleaseCachedBitmap(pbmp3);
+	CHECK(GetBitmapCacheSize() < iOne);
+
+	// held bitmaps are never evicted, released ones go at once
+	InvalidateBitmapCache(NULL);
+	SetBitmapCacheBudget(0);
+
+	pbmp1 = LoadBitmapCached("test_cache2.bmp");
+	CHECK(GetBitmapCacheSize() == iOne);
+
+	pbmp2 = LoadBitmapCached("test_cache3.bmp");
+	ReleaseCachedBitmap(pbmp2);
+	CHECK(GetBitmapCacheSize() == iOne);
+
+	pbmp2 = LoadBitmapCached("test_cache2.bmp");
+	CHECK(pbmp2 == pbmp1);
+	ReleaseCachedBitmap(pbmp2);
+
+	// an invalidated bitmap stays valid for its holder
+	InvalidateBitmapCache("test_cache2.bmp");
+	CHECK(GetBitmapCacheSize() == 0);
+	CHECK((pbmp1->iWidth == 16) && (pbmp1->pixels != NULL));
+	ReleaseCachedBitmap(pbmp1);
+
+	// the budget keeps the most recently used
+	SetBitmapCacheBudget(3 * iOne);
+	ReleaseCachedBitmap(LoadBitmapCached("test_cache2.bmp"));
+	ReleaseCachedBitmap(LoadBitmapCached("test_cache3.bmp"));
+	CHECK(GetBitmapCacheSize() == 2 * iOne);
+
+	SetBitmapCacheBudget(iOne);
+	CHECK(GetBitmapCacheSize() == iOne);
+
+	pbmp1 = LoadBitmapCached("test_cache3.bmp");
+	CHECK(GetBitmapCacheSize() == iOne);
+	ReleaseCachedBitmap(pbmp1);
+
+	SetBitmapCacheBudget(256 << 20);
+	InvalidateBitmapCache(NULL);
+	CHECK(GetBitmapCacheSize() == 0);
+
+	FreeBitmap(pbmp);
+}
+
+
+int main(void)
+{
+	RUN(TestBmpFiles);
+	RUN(TestBmpHeaderChecks);
+	RUN(TestQOI);
+	RUN(TestAllocBitmap);
+	RUN(TestConvert);
+	RUN(TestBlitFlipScale);
+	RUN(TestScaleLimits);
+	RUN(TestPool);
+	RUN(TestCache);
+
+	ShutdownWorkerThreads();
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,790 @@
+
+// files: reading, mapping, line parsing, incremental parsing, tokenized files, line index,
+// paths, directory creation, directory walks, the directory index and the directory watch
+
+#include "test.h"
+
+#define TEST_DIR "test_files_dir"
+
+
+// deletes a tree made by the tests
+
+static void _RemoveTree(const char* pszPath)
+{
+	WIN32_FIND_DATA fd;
+	HANDLE hFind;
+	char szPattern[MAX_PATH];
+	char szFile[2 * MAX_PATH];
+
+	sprintf(szPattern, "%s\\*", pszPath);
+	hFind = FindFirstFile(szPattern, &fd);
+
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if ((strcmp(fd.cFileName, ".") == 0) || (strcmp(fd.cFileName, "..") == 0))
+			{
+				continue;
+			}
+
+			sprintf(szFile, "%s\\%s", pszPath, fd.cFileName);
+
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				_RemoveTree(szFile);
+			}
+			else
+			{
+				DeleteFile(szFile);
+			}
+		}
+		while (FindNextFile(hFind, &fd));
+
+		FindClose(hFind);
+	}
+
+	RemoveDirectory(pszPath);
+}
+
+
+static int _CountLine(char* pszLine, void* param)
+{
+	(*(int*)param)++;
+
+	return 1;
+}
+
+
+static void TestReadFile(void)
+{
+	mappedfile_t mf;
+	lineiter_t it;
+	char* buffer;
+	char* psz;
+	int iSize;
+	int n;
+
+	WriteTestText("test_files.txt", "one\r\ntwo\nthree");
+
+	buffer = ReadFileToBuffer("test_files.txt", &iSize);
+	CHECK((buffer != NULL) && (iSize == 14));
+	CHECK((buffer != NULL) && (buffer[iSize] == '\0'));
+	FreeMemory(buffer);
+
+	CHECK(ReadFileToBuffer("test_missing.txt", &iSize) == NULL);
+
+	// all of the file, '\0's too, and the terminator after it
+	WriteTestFile("test_files.bin", "a\0b\0", 4);
+	buffer = ReadFileToBuffer("test_files.bin", &iSize);
+	CHECK((buffer != NULL) && (iSize == 4) && (memcmp(buffer, "a\0b\0", 5) == 0));
+	FreeMemory(buffer);
+
+	WriteTestFile("test_files.bin", "x", 1);
+	buffer = ReadFileToBuffer("test_files.bin", &iSize);
+	CHECK((buffer != NULL) && (iSize == 1) && (buffer[1] == '\0'));
+	FreeMemory(buffer);
+
+	n = 0;
+	CHECK(ParseFile("test_files.txt", _CountLine, &n));
+	CHECK(n == 3);
+	CHECK(!ParseFile("test_missing.txt", _CountLine, &n));
+
+	CHECK(BeginFileLines(&it, "test_files.txt"));
+
+	for (n = 0; (psz = NextLine(&it)) != NULL; n++)
+	{
+		CHECK_STR(psz, (n == 0)? "one": (n == 1)? "two": "three");
+	}
+
+	CHECK(n == 3);
+	EndLines(&it);
+
+	CHECK(MapFileToMemory("test_files.txt", &mf));
+	CHECK((mf.iSize == 14) && (memcmp(mf.pData, "one\r\n", 5) == 0));
+	UnmapFile(&mf);
+
+	WriteTestText("test_empty.txt", "");
+	CHECK(!MapFileToMemory("test_empty.txt", &mf));
+}
+
+
+// the lines the incremental parse reports, kept as the caller would
+
+typedef struct mirror_s
+{
+	char* apszLines[256];
+	int nLines;
+	int nCalls;
+} mirror_t;
+
+
+static int _MirrorLine(char* pszLine, int iLine, int iChange, void* param)
+{
+	mirror_t* pm = (mirror_t*)param;
+
+	pm->nCalls++;
+
+	if (iChange == LINE_INSERTED)
+	{
+		memmove(&pm->apszLines[iLine + 1], &pm->apszLines[iLine], (pm->nLines - iLine) * sizeof(char*));
+		pm->apszLines[iLine] = AllocString(pszLine);
+		pm->nLines++;
+	}
+	else if (iChange == LINE_CHANGED)
+	{
+		FreeString(pm->apszLines[iLine]);
+		pm->apszLines[iLine] = AllocString(pszLine);
+	}
+	else
+	{
+		CHECK(pszLine == NULL);
+		FreeString(pm->apszLines[iLine]);
+		memmove(&pm->apszLines[iLine], &pm->apszLines[iLine + 1], (pm->nLines - iLine - 1) * sizeof(char*));
+		pm->nLines--;
+	}
+
+	return 1;
+}
+
+
+static int _StopLine(char* pszLine, int iLine, int iChange, void* param)
+{
+	(*(int*)param)++;
+
+	return 0;
+}
+
+
+static void TestParseIncremental(void)
+{
+	parsestate_t* pps;
+	mirror_t m;
+	int n;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	pps = CreateParseState();
+
+	WriteTestText("test_incremental.txt", "a\nb\nc\nd");
+	CHECK(ParseFileIncremental(pps, "test_incremental.txt", _MirrorLine, &m));
+	CHECK((m.nLines == 4) && (m.nCalls == 4));
+
+	WriteTestText("test_incremental.txt", "a\nB\nc\nd\ne");
+	m.nCalls = 0;
+	CHECK(ParseFileIncremental(pps, "test_incremental.txt", _MirrorLine, &m));
+	CHECK((m.nLines == 5) && (m.nCalls == 2));
+	CHECK_STR(m.apszLines[1], "B");
+	CHECK_STR(m.apszLines[4], "e");
+
+	m.nCalls = 0;
+	CHECK(ParseFileIncremental(pps, "test_incremental.txt", _MirrorLine, &m));
+	CHECK(m.nCalls == 0);
+
+	// a stopped run keeps the previous state, the next one reports the changes again
+	WriteTestText("test_incremental.txt", "a\nB\nC\nd\ne");
+	n = 0;
+	CHECK(ParseFileIncremental(pps, "test_incremental.txt", _StopLine, &n));
+	CHECK(n == 1);
+
+	m.nCalls = 0;
+	CHECK(ParseFileIncremental(pps, "test_incremental.txt", _MirrorLine, &m));
+	CHECK((m.nLines == 5) && (m.nCalls == 1));
+	CHECK_STR(m.apszLines[2], "C");
+
+	// emptied, what is left is the one empty line
+	WriteTestText("test_incremental.txt", "");
+	CHECK(ParseFileIncremental(pps, "test_incremental.txt", _MirrorLine, &m));
+	CHECK((m.nLines == 1) && (m.apszLines[0][0] == '\0'));
+
+	CHECK(!ParseFileIncremental(pps, "test_missing.txt", _MirrorLine, &m));
+
+	for (i = 0; i < m.nLines; i++)
+	{
+		FreeString(m.apszLines[i]);
+	}
+
+	FreeParseState(pps);
+}
+
+
+static char g_szTokens[1024];
+
+
+static int _PrintTokens(int argc, char* argv[], int iLine, void* param)
+{
+	char sz[32];
+	int i;
+
+	sprintf(sz, "%d:", iLine);
+	strcat(g_szTokens, sz);
+
+	for (i = 0; i < argc; i++)
+	{
+		strcat(g_szTokens, "[");
+		strcat(g_szTokens, argv[i]);
+		strcat(g_szTokens, "]");
+	}
+
+	CHECK(argv[argc] == NULL);
+	strcat(g_szTokens, "\n");
+
+	return 1;
+}
+
+
+static void TestParseTokens(void)
+{
+	parsespec_t spec = { "//", NULL, " \t", ' ', " ", 3 };
+	static const char szExpected[] = "0:[key][value]\n3:[a b][c][d]\n4:[last]\n";
+
+	WriteTestText("test_tokens.txt", "key  value // c\r\n\n  \t\n\"a b\"  c\td e f\nlast");
+	DeleteFile("test_tokens.cache");
+
+	g_szTokens[0] = '\0';
+	CHECK(ParseFileTokens("test_tokens.txt", &spec, _PrintTokens, NULL));
+	CHECK_STR(g_szTokens, szExpected);
+
+	// written, then replayed
+	g_szTokens[0] = '\0';
+	CHECK(ParseFileCached("test_tokens.txt", "test_tokens.cache", &spec, _PrintTokens, NULL));
+	CHECK_STR(g_szTokens, szExpected);
+
+	g_szTokens[0] = '\0';
+	CHECK(ParseFileCached("test_tokens.txt", "test_tokens.cache", &spec, _PrintTokens, NULL));
+	CHECK_STR(g_szTokens, szExpected);
+
+	CHECK(!ParseFileTokens("test_missing.txt", &spec, _PrintTokens, NULL));
+
+	// the lines after a block comment keep their numbers
+	spec.pszCommentStart = "/*";
+	spec.pszCommentEnd = "*/";
+	WriteTestText("test_tokens.txt", "one /* a\r\nb\n*/ two\n/**/three\n/*\n\n*/\nfour");
+
+	g_szTokens[0] = '\0';
+	CHECK(ParseFileTokens("test_tokens.txt", &spec, _PrintTokens, NULL));
+	CHECK_STR(g_szTokens, "0:[one]\n2:[two]\n3:[three]\n7:[four]\n");
+}
+
+
+static void TestLineIndex(void)
+{
+	static const char szText[] = "first\r\nsecond\n\nlast";
+	lineindex_t* pli;
+	const char* psz;
+	size_t iLength;
+	int iLineLength;
+
+	pli = BuildLineIndex(szText, sizeof(szText) - 1);
+	CHECK(pli != NULL);
+
+	if (pli != NULL)
+	{
+		CHECK(GetLineCount(pli) == 4);
+
+		psz = GetIndexedLine(pli, 0, &iLineLength);
+		CHECK((psz == szText) && (iLineLength == 5));
+
+		psz = GetIndexedLine(pli, 2, &iLineLength);
+		CHECK((psz != NULL) && (iLineLength == 0));
+
+		psz = GetIndexedLine(pli, 3, &iLineLength);
+		CHECK((psz != NULL) && (iLineLength == 4) && (memcmp(psz, "last", 4) == 0));
+
+		CHECK(GetIndexedLine(pli, 4, &iLineLength) == NULL);
+
+		psz = GetIndexedLines(pli, 1, 3, &iLength);
+		CHECK((psz == &szText[7]) && (iLength == sizeof(szText) - 1 - 7));
+
+		FreeLineIndex(pli);
+	}
+
+	WriteTestText("test_lines.txt", szText);
+	DeleteFile("test_lines.lidx");
+
+	pli = OpenLineIndex("test_lines.txt", "test_lines.lidx");
+	CHECK((pli != NULL) && (GetLineCount(pli) == 4));
+	FreeLineIndex(pli);
+
+	// from the kept index
+	pli = OpenLineIndex("test_lines.txt", "test_lines.lidx");
+	CHECK((pli != NULL) && (GetLineCount(pli) == 4));
+	psz = (pli != NULL)? GetIndexedLine(pli, 1, &iLineLength): NULL;
+	CHECK((psz != NULL) && (iLineLength == 6) && (memcmp(psz, "second", 6) == 0));
+	FreeLineIndex(pli);
+}
+
+
+static void TestPaths(void)
+{
+	static const char* apszSamples[] =
+	{
+		"a\\B.TxT", "noext", "dir\\.bashrc", "x.tar.gz", "c:\\dir.x\\name", "pic.bmp", "a.doc", "dir/",
+	};
+	static const int aiClasses[] = { 0, 2, 2, 1, 2, 3, -1, 2 };
+	static const char* apszExts[] = { "txt", "gz", "", "Bmp", "TXT" };
+	const char** apsz;
+	pathview_t* aViews;
+	int* aiClass;
+	pathview_t pv;
+	pathbuf_t pb;
+	int nPaths;
+	int i;
+
+	SplitPath("C:\\dir.x\\name.tar.gz", &pv);
+	CHECK((pv.iDirLength == 9) && (pv.iNameLength == 11) && (pv.iStemLength == 8) && (pv.iExtLength == 2));
+
+	SplitPath("dir/.bashrc", &pv);
+	CHECK((pv.iExtLength == 0) && (pv.iStemLength == 7));
+
+	SplitPath("", &pv);
+	CHECK((pv.iLength == 0) && (pv.iNameLength == 0));
+
+	// past one band, so the batch runs on the workers
+	nPaths = 10000;
+	apsz = (const char**)malloc(nPaths * sizeof(char*));
+	aViews = (pathview_t*)malloc(nPaths * sizeof(pathview_t));
+	aiClass = (int*)malloc(nPaths * sizeof(int));
+
+	for (i = 0; i < nPaths; i++)
+	{
+		apsz[i] = apszSamples[i % 8];
+	}
+
+	SplitPaths(apsz, nPaths, aViews);
+	ClassifyPathsByExtension(aViews, nPaths, apszExts, 5, aiClass);
+
+	for (i = 0; i < nPaths; i++)
+	{
+		SplitPath(apsz[i], &pv);
+
+		if ((pv.psz != aViews[i].psz) || (pv.iLength != aViews[i].iLength) || (pv.iDirLength != aViews[i].iDirLength) ||
+			(pv.iNameLength != aViews[i].iNameLength) || (pv.iStemLength != aViews[i].iStemLength) ||
+			(pv.iExtLength != aViews[i].iExtLength) || (aiClass[i] != aiClasses[i % 8]))
+		{
+			CHECK(!"batch path view or class");
+			break;
+		}
+	}
+
+	free(aiClass);
+	free(aViews);
+	free(apsz);
+
+	CHECK_STR(GetExtension("a\\b.txt"), "txt");
+	CHECK_STR(GetFileName("a\\b.txt"), "b.txt");
+
+	// past MAX_PATH the buffer moves to the heap
+	InitPathBuffer(&pb, "root");
+
+	for (i = 0; i < 40; i++)
+	{
+		CHECK(PushPath(&pb, "directory") >= 0);
+	}
+
+	CHECK(pb.iLength == 4 + 40 * 10);
+	CHECK(pb.iLength == (int)strlen(pb.psz));
+
+	TruncatePath(&pb, 4);
+	CHECK_STR(pb.psz, "root");
+	FreePathBuffer(&pb);
+
+	_RemoveTree(TEST_DIR);
+	CHECK(CreateDirectoryTree(TEST_DIR "\\x\\y"));
+	CHECK(GetFileAttributes(TEST_DIR "\\x\\y") & FILE_ATTRIBUTE_DIRECTORY);
+	_RemoveTree(TEST_DIR);
+}
+
+
+static bool_t _IsDirectory(const char* pszPath)
+{
+	DWORD iAttributes = GetFileAttributes(pszPath);
+
+	return (iAttributes != INVALID_FILE_ATTRIBUTES) && (iAttributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+
+static void TestCreateDirectories(void)
+{
+	static const char* apszFiles[] =
+	{
+		TEST_DIR "\\m\\n\\1.txt",
+		TEST_DIR "\\e\\f\\g\\2.txt", // below an existing dir
+		"3.txt", // no dir
+		TEST_DIR "\\m\\o\\4.txt",
+		TEST_DIR "\\m\\n\\5.txt", // the same parent again
+		TEST_DIR "\\m\\6.txt",
+	};
+	static const char* apszBlocked[] =
+	{
+		TEST_DIR "\\file\\x\\1.txt",
+		TEST_DIR "\\r\\2.txt",
+	};
+	dircache_t* pdc;
+
+	_RemoveTree(TEST_DIR);
+	CHECK(CreateDirectoryTree(TEST_DIR "\\e\\f"));
+	WriteTestText(TEST_DIR "\\file", "x");
+
+	pdc = CreateDirectoryCache();
+	CHECK(pdc != NULL);
+
+	CHECK(CreateDirectoryTreeCached(pdc, TEST_DIR "\\a\\b"));
+	CHECK(_IsDirectory(TEST_DIR "\\a\\b"));
+	CHECK(CreateDirectoryTreeCached(pdc, TEST_DIR "\\a\\b\\"));
+	CHECK(CreateDirectoryTreeCached(pdc, TEST_DIR "\\a\\c"));
+	CHECK(_IsDirectory(TEST_DIR "\\a\\c"));
+	CHECK(CreateDirectoryTreeCached(pdc, TEST_DIR "\\e\\f\\h"));
+	CHECK(_IsDirectory(TEST_DIR "\\e\\f\\h"));
+	CHECK(!CreateDirectoryTreeCached(pdc, TEST_DIR "\\file\\x"));
+	CHECK(!CreateDirectoryTreeCached(pdc, ""));
+
+	CHECK(CreateDirectoryTrees(pdc, apszFiles, 6));
+	CHECK(_IsDirectory(TEST_DIR "\\m\\n") && _IsDirectory(TEST_DIR "\\m\\o") && _IsDirectory(TEST_DIR "\\e\\f\\g"));
+	CHECK(GetFileAttributes("3.txt") == INVALID_FILE_ATTRIBUTES);
+	CHECK(GetFileAttributes(TEST_DIR "\\m\\n\\1.txt") == INVALID_FILE_ATTRIBUTES);
+	CHECK(CreateDirectoryTrees(pdc, apszFiles, 0));
+
+	FreeDirectoryCache(pdc);
+
+	// without a cache, a file in the way fails its parent but not the others
+	CHECK(!CreateDirectoryTrees(NULL, apszBlocked, 2));
+	CHECK(_IsDirectory(TEST_DIR "\\r"));
+	CHECK(CreateDirectoryTrees(NULL, &apszFiles[2], 1));
+
+	_RemoveTree(TEST_DIR);
+}
+
+
+static char g_aszFiles[16][MAX_PATH];
+static int g_nFiles;
+static int g_iFilesSize;
+
+
+static void _AddFile(char* pszFileName, WIN32_FIND_DATA* pfd, void* param)
+{
+	if (g_nFiles < 16)
+	{
+		strcpy(g_aszFiles[g_nFiles], pszFileName);
+	}
+
+	g_nFiles++;
+	g_iFilesSize += pfd->nFileSizeLow;
+}
+
+
+static void _MakeTree(void)
+{
+	_RemoveTree(TEST_DIR);
+
+	CreateDirectoryTree(TEST_DIR "\\s\\t");
+	WriteTestText(TEST_DIR "\\a", "1");
+	WriteTestText(TEST_DIR "\\s\\b", "22");
+	WriteTestText(TEST_DIR "\\s\\t\\c", "333");
+	WriteTestText(TEST_DIR "\\s\\t\\d", "4444");
+}
+
+
+#ifndef _WIN32
+// counts the file and makes the allocations after it fail
+
+static void _FailAllocations(char* pszFileName, WIN32_FIND_DATA* pfd, void* param)
+{
+	_AddFile(pszFileName, pfd, param);
+	ShimFailAllocations(0);
+}
+#endif
+
+
+static void TestDirectories(void)
+{
+	WIN32_FIND_DATA* pfd;
+	diriter_t* pit;
+	char szPath[MAX_PATH];
+	char* psz;
+	int n;
+
+	_MakeTree();
+
+	g_nFiles = 0;
+	g_iFilesSize = 0;
+	CHECK(ParseDirectory(TEST_DIR, true, _AddFile, NULL));
+	CHECK((g_nFiles == 4) && (g_iFilesSize == 10));
+
+	// the iterator walks in the same order
+	pit = BeginFiles(TEST_DIR, true);
+	CHECK(pit != NULL);
+
+	for (n = 0; (pit != NULL) && ((psz = NextFile(pit, &pfd)) != NULL); n++)
+	{
+		CHECK((n < g_nFiles) && (strcmp(psz, g_aszFiles[n]) == 0) && (pfd != NULL));
+	}
+
+	CHECK(n == 4);
+	CHECK(EndFiles(pit));
+
+	g_nFiles = 0;
+	CHECK(ParseDirectory(TEST_DIR, false, _AddFile, NULL));
+	CHECK(g_nFiles == 1);
+
+	CHECK(BeginFiles(TEST_DIR "\\missing", true) == NULL);
+
+#ifndef _WIN32
+	// a subdir that can't be listed is skipped, EndFiles() reports it,
+	// the frame stack needs to grow to reach the deepest one
+	strcpy(szPath, TEST_DIR "\\s");
+
+	for (n = 0; n < 10; n++)
+	{
+		strcat(szPath, "\\d");
+	}
+
+	CHECK(CreateDirectoryTree(szPath));
+	strcat(szPath, "\\f");
+	WriteTestText(szPath, "55555");
+
+	g_nFiles = 0;
+	CHECK(ParseDirectory(TEST_DIR, true, _AddFile, NULL));
+	CHECK(g_nFiles == 5);
+
+	g_nFiles = 0;
+	CHECK(ParseDirectory(TEST_DIR, true, _FailAllocations, NULL));
+	ShimFailAllocations(-1);
+	CHECK(g_nFiles == 4);
+
+	pit = BeginFiles(TEST_DIR, true);
+	ShimFailAllocations(0);
+
+	for (n = 0; (pit != NULL) && (NextFile(pit, &pfd) != NULL); n++)
+	{
+	}
+
+	ShimFailAllocations(-1);
+	CHECK(n == 4);
+	CHECK((pit != NULL) && !EndFiles(pit));
+#endif
+
+	_RemoveTree(TEST_DIR);
+}
+
+
+static void TestDirectoryIndex(void)
+{
+	dirindex_t* pdi;
+	char szPath[MAX_PATH];
+	int i;
+
+	_MakeTree();
+	DeleteFile("test_files.idx");
+
+	pdi = LoadDirectoryIndex("test_files.idx");
+	CHECK(pdi != NULL);
+	CHECK(UpdateDirectoryIndex(pdi, TEST_DIR));
+
+	g_nFiles = 0;
+	g_iFilesSize = 0;
+	CHECK(EnumDirectoryIndex(pdi, true, _AddFile, NULL));
+	CHECK((g_nFiles == 4) && (g_iFilesSize == 10));
+
+	g_nFiles = 0;
+	CHECK(EnumDirectoryIndex(pdi, false, _AddFile, NULL));
+	CHECK(g_nFiles == 1);
+
+	CHECK(SaveDirectoryIndex(pdi, "test_files.idx"));
+	FreeDirectoryIndex(pdi);
+
+	pdi = LoadDirectoryIndex("test_files.idx");
+	g_nFiles = 0;
+	g_iFilesSize = 0;
+	CHECK(EnumDirectoryIndex(pdi, true, _AddFile, NULL));
+	CHECK((g_nFiles == 4) && (g_iFilesSize == 10));
+
+	// the files of a dir come before those of its subdirs
+	CHECK(strcmp(g_aszFiles[0], TEST_DIR "\\a") == 0);
+	CHECK(strcmp(g_aszFiles[1], TEST_DIR "\\s\\b") == 0);
+
+	// a deep tree, the update keeps its own stack of the dirs to list
+	strcpy(szPath, TEST_DIR "\\s");
+
+	for (i = 0; i < 40; i++)
+	{
+		strcat(szPath, "\\d");
+	}
+
+	CHECK(CreateDirectoryTree(szPath));
+	strcat(szPath, "\\f");
+	WriteTestText(szPath, "55555");
+
+	CHECK(UpdateDirectoryIndex(pdi, TEST_DIR));
+	g_nFiles = 0;
+	g_iFilesSize = 0;
+	CHECK(EnumDirectoryIndex(pdi, true, _AddFile, NULL));
+	CHECK((g_nFiles == 5) && (g_iFilesSize == 15));
+
+	// a failed update keeps the previous index
+	CHECK(!UpdateDirectoryIndex(pdi, TEST_DIR "\\missing"));
+	g_nFiles = 0;
+	CHECK(EnumDirectoryIndex(pdi, true, _AddFile, NULL));
+	CHECK(g_nFiles == 5);
+
+	FreeDirectoryIndex(pdi);
+
+	_RemoveTree(TEST_DIR);
+}
+
+
+static char g_aszChanged[16][MAX_PATH];
+static int g_aiChanges[16];
+static int g_nChanged;
+
+
+static void _AddChange(char* pszFileName, int iChange, void* param)
+{
+	if (g_nChanged < 16)
+	{
+		strcpy(g_aszChanged[g_nChanged], pszFileName);
+		g_aiChanges[g_nChanged] = iChange;
+	}
+
+	g_nChanged++;
+}
+
+
+// the change reported for the file, -1 if none
+
+static int _FindChange(const char* pszFileName)
+{
+	int i;
+
+	for (i = 0; (i < g_nChanged) && (i < 16); i++)
+	{
+		if (strcmp(g_aszChanged[i], pszFileName) == 0)
+		{
+			return g_aiChanges[i];
+		}
+	}
+
+	return -1;
+}
+
+
+static void TestDirectoryWatch(void)
+{
+	dirwatch_t* pdw;
+	wchar_t szName[16];
+	int i;
+
+	_MakeTree();
+
+	pdw = CreateDirectoryWatch(TEST_DIR "\\", true, 20);
+	CHECK(pdw != NULL);
+
+	if (pdw == NULL)
+	{
+		return;
+	}
+
+	g_nChanged = 0;
+	CHECK(PollDirectoryWatch(pdw, 10, _AddChange, NULL) == 0);
+
+#ifndef _WIN32
+	// the events of a file merge, a file created and deleted again is never reported
+	ShimNotifyChange(FILE_ACTION_MODIFIED, L"a");
+	ShimNotifyChange(FILE_ACTION_MODIFIED, L"a");
+	ShimNotifyChange(FILE_ACTION_ADDED, L"tmp");
+	ShimNotifyChange(FILE_ACTION_REMOVED, L"tmp");
+	ShimNotifyChange(FILE_ACTION_REMOVED, L"gone");
+#else
+	WriteTestText(TEST_DIR "\\a", "11");
+	WriteTestText(TEST_DIR "\\tmp", "");
+	DeleteFile(TEST_DIR "\\tmp");
+	WriteTestText(TEST_DIR "\\gone", "");
+	DeleteFile(TEST_DIR "\\gone");
+	WriteTestText(TEST_DIR "\\gone", "");
+	DeleteFile(TEST_DIR "\\gone");
+#endif
+
+	CHECK(PollDirectoryWatch(pdw, 1000, _AddChange, NULL) >= 1);
+
+	for (i = 0; (i < g_nChanged) && (i < 16); i++)
+	{
+		CHECK(strstr(g_aszChanged[i], "tmp") == NULL);
+
+		if (strcmp(g_aszChanged[i], TEST_DIR "\\a") == 0)
+		{
+			CHECK(g_aiChanges[i] == WATCH_MODIFIED);
+		}
+	}
+
+	while (PollDirectoryWatch(pdw, 100, _AddChange, NULL) > 0)
+		;
+
+#ifndef _WIN32
+	// many names, the pending events grow and are found again by name
+	for (i = 0; i < 300; i++)
+	{
+		swprintf(szName, 16, L"f%d", i);
+		ShimNotifyChange(FILE_ACTION_ADDED, szName);
+		ShimNotifyChange(FILE_ACTION_MODIFIED, L"a");
+	}
+
+	for (i = 0; i < 300; i++)
+	{
+		swprintf(szName, 16, L"F%d", i);
+		ShimNotifyChange(FILE_ACTION_REMOVED, szName);
+	}
+
+	g_nChanged = 0;
+	CHECK(PollDirectoryWatch(pdw, 1000, _AddChange, NULL) == 1);
+	CHECK((g_nChanged == 1) && (g_aiChanges[0] == WATCH_MODIFIED));
+#endif
+
+	// a directory moved within the tree moves its files, a new one brings its files
+	CHECK(MoveFile(TEST_DIR "\\s", TEST_DIR "\\m"));
+	CreateDirectoryTree(TEST_DIR "\\n");
+	WriteTestText(TEST_DIR "\\n\\e", "5");
+
+#ifndef _WIN32
+	ShimNotifyChange(FILE_ACTION_RENAMED_OLD_NAME, L"s");
+	ShimNotifyChange(FILE_ACTION_RENAMED_NEW_NAME, L"m");
+	ShimNotifyChange(FILE_ACTION_ADDED, L"n");
+#endif
+
+	g_nChanged = 0;
+
+	for (i = 0; (i < 20) && (g_nChanged < 7); i++)
+	{
+		PollDirectoryWatch(pdw, 100, _AddChange, NULL);
+	}
+
+	CHECK(g_nChanged == 7);
+	CHECK(_FindChange(TEST_DIR "\\m\\b") == WATCH_CREATED);
+	CHECK(_FindChange(TEST_DIR "\\m\\t\\c") == WATCH_CREATED);
+	CHECK(_FindChange(TEST_DIR "\\m\\t\\d") == WATCH_CREATED);
+	CHECK(_FindChange(TEST_DIR "\\s\\b") == WATCH_DELETED);
+	CHECK(_FindChange(TEST_DIR "\\s\\t\\c") == WATCH_DELETED);
+	CHECK(_FindChange(TEST_DIR "\\s\\t\\d") == WATCH_DELETED);
+	CHECK(_FindChange(TEST_DIR "\\n\\e") == WATCH_CREATED);
+
+	FreeDirectoryWatch(pdw);
+
+	CHECK(CreateDirectoryWatch(TEST_DIR "\\missing", false, 10) == NULL);
+
+	_RemoveTree(TEST_DIR);
+}
+
+
+int main(void)
+{
+	RUN(TestReadFile);
+	RUN(TestParseIncremental);
+	RUN(TestParseTokens);
+	RUN(TestLineIndex);
+	RUN(TestPaths);
+	RUN(TestCreateDirectories);
+	RUN(TestDirectories);
+	RUN(TestDirectoryIndex);
+	RUN(TestDirectoryWatch);
+
+	return TEST_RESULT();
+}
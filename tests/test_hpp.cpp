@@ -0,0 +1,117 @@
+
+// the C++17 layer: the callables utils.hpp takes, each with a void and a bool result,
+// and the moves of Buffer and Bitmap
+
+#include <string>
+
+#include "test.h"
+#include "utils.hpp"
+
+#define TEST_DIR "test_hpp_dir"
+
+
+static void TestParseBuffer()
+{
+	char szText[64];
+	std::string s;
+	int n;
+
+	// string_view lines, void result
+	strcpy(szText, "one\ntwo\r\nthree");
+	utils::ParseBuffer(szText, (int)strlen(szText), [&](std::string_view line) { s.append(line).append("|"); });
+	CHECK(s == "one|two|three|");
+
+	// char* lines, false stops
+	strcpy(szText, "one\ntwo\r\nthree");
+	n = 0;
+	utils::ParseBuffer(szText, (int)strlen(szText), [&](char* pszLine) { n++; return strcmp(pszLine, "two") != 0; });
+	CHECK(n == 2);
+
+	WriteTestText("test_hpp.txt", "a\nb\n");
+	n = 0;
+	CHECK(utils::ParseFile("test_hpp.txt", [&](std::string_view line) { n += (line.size() == 1); }));
+	CHECK(n == 2);
+	CHECK(!utils::ParseFile("test_missing.txt", [](std::string_view) {}));
+}
+
+
+static void TestParseTokens()
+{
+	char szLine[64];
+	std::string s;
+	int n;
+
+	strcpy(szLine, "cmd arg1 arg2");
+	n = utils::ParseTokens(szLine, " ", [&](std::string_view arg) { s.append(arg).append("|"); });
+	CHECK((n == 3) && (s == "cmd|arg1|arg2|"));
+
+	strcpy(szLine, "cmd arg1 arg2");
+	n = utils::ParseTokens(szLine, " ", [](std::string_view arg) { return arg != "arg1"; });
+	CHECK(n == 2);
+}
+
+
+static void TestParseDirectory()
+{
+	int n;
+
+	CreateDirectoryTree(TEST_DIR);
+	WriteTestText(TEST_DIR "\\a", "1");
+	WriteTestText(TEST_DIR "\\b", "22");
+	WriteTestText(TEST_DIR "\\c", "333");
+
+	n = 0;
+	CHECK(utils::ParseDirectory(TEST_DIR, false, [&](std::string_view, const WIN32_FIND_DATA& fd) { n += (int)fd.nFileSizeLow; }));
+	CHECK(n == 6);
+
+	n = 0;
+	CHECK(utils::ParseDirectory(TEST_DIR, false, [&](std::string_view, const WIN32_FIND_DATA&) { return ++n < 2; }));
+	CHECK(n == 2);
+
+	CHECK(!utils::ParseDirectory(TEST_DIR "\\missing", false, [](std::string_view, const WIN32_FIND_DATA&) {}));
+
+	DeleteFile(TEST_DIR "\\a");
+	DeleteFile(TEST_DIR "\\b");
+	DeleteFile(TEST_DIR "\\c");
+	RemoveDirectory(TEST_DIR);
+}
+
+
+static void TestMoves()
+{
+	WriteTestText("test_hpp.txt", "abc");
+
+	utils::Buffer buffer("test_hpp.txt");
+	CHECK(buffer && (buffer.view() == "abc"));
+
+	utils::Buffer moved(std::move(buffer));
+	CHECK(!buffer && (buffer.size() == 0) && (moved.view() == "abc"));
+
+	buffer = std::move(moved);
+	CHECK(buffer && !moved && (buffer.view() == "abc"));
+
+	utils::Bitmap bitmap(4, 3, 3, 0);
+	bitmap_t* pbmp = bitmap.get();
+	CHECK((pbmp != NULL) && (bitmap->iWidth == 4));
+
+	utils::Bitmap other(std::move(bitmap));
+	CHECK(!bitmap && (other.get() == pbmp));
+
+	bitmap = utils::Bitmap(2, 2, 4, 0);
+	bitmap = std::move(other);
+	CHECK(!other && (bitmap.get() == pbmp));
+
+	bitmap.reset();
+	CHECK(!bitmap);
+}
+
+
+int main()
+{
+	RUN(TestParseBuffer);
+	RUN(TestParseTokens);
+	RUN(TestParseDirectory);
+	RUN(TestMoves);
+
+	return TEST_RESULT();
+}
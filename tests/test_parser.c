@@ -0,0 +1,370 @@
+
+// parser functions: ParseLine(N), CutComments(N), the char functions, the utf-8 variants
+// and the line and token iterators
+
+#include "test.h"
+
+
+static void TestParseLine(void)
+{
+	char sz[256];
+	char szCopy[256];
+	char* argv[8];
+	char* argvCopy[8];
+	char* pszEnd;
+	int n;
+	int nCopy;
+	int i;
+
+	strcpy(sz, "one \"two three\" four");
+	n = ParseLineN(8, argv, sz, (int)strlen(sz), " ", NULL);
+	CHECK(n == 3);
+	CHECK_STR(argv[0], "one");
+	CHECK_STR(argv[1], "two three");
+	CHECK_STR(argv[2], "four");
+
+	// every delimiter ends an arg
+	strcpy(sz, "a b  c");
+	n = ParseLineN(8, argv, sz, 6, " ", NULL);
+	CHECK(n == 4);
+	CHECK_STR(argv[2], "");
+	CHECK_STR(argv[3], "c");
+
+	strcpy(sz, "a b c d");
+	CHECK(ParseLineN(2, argv, sz, 7, " ", NULL) == UERR_OVERFLOW);
+
+	strcpy(sz, "a b c d");
+	n = ParseLineN(2, argv, sz, 7, " ", &pszEnd);
+	CHECK(n == 2);
+	CHECK_STR(pszEnd, "c d");
+
+	strcpy(sz, "a \"b c");
+	CHECK(ParseLineN(8, argv, sz, 6, " ", NULL) == UERR_FORMAT);
+
+	// only counts
+	strcpy(sz, "a b c d");
+	CHECK(ParseLineN(0, NULL, sz, 7, " ", NULL) == 4);
+
+	// nothing past iLen is read
+	memcpy(sz, "ab cdXXX", 8);
+	n = ParseLineN(8, argv, sz, 5, " ", NULL);
+	CHECK(n == 2);
+	CHECK_STR(argv[1], "cd");
+
+	// the same args as ParseLine()
+	strcpy(sz, "x,\"y\",\"\"z\"\",w");
+	strcpy(szCopy, sz);
+	n = ParseLine(8, argv, sz, ",", NULL);
+	nCopy = ParseLineN(8, argvCopy, szCopy, (int)strlen(szCopy), ",", NULL);
+	CHECK(n == nCopy);
+
+	for (i = 0; (i < n) && (i < nCopy); i++)
+	{
+		CHECK_STR(argv[i], argvCopy[i]);
+	}
+}
+
+
+static void TestCutComments(void)
+{
+	char sz[256];
+
+	strcpy(sz, "/*a*/b");
+	CutComments(sz, "/*", "*/");
+	CHECK_STR(sz, "b");
+
+	strcpy(sz, "x/**/y");
+	CutComments(sz, "/*", "*/");
+	CHECK_STR(sz, "xy");
+
+	strcpy(sz, "a//\nb");
+	CutComments(sz, "//", NULL);
+	CHECK_STR(sz, "a\nb");
+
+	strcpy(sz, "a/*x*/");
+	CutComments(sz, "/*", "*/");
+	CHECK_STR(sz, "a");
+
+	// quoted markers stay
+	strcpy(sz, "a/*x*/c\"/*q*/\"");
+	CHECK(CutCommentsN(sz, (int)strlen(sz), "/*", "*/") == 9);
+	CHECK_STR(sz, "ac\"/*q*/\"");
+
+	// a marker across iLen is not one
+	memcpy(sz, "ab/*zz*/", 8);
+	CHECK(CutCommentsN(sz, 3, "/*", "*/") == 3);
+	CHECK_STR(sz, "ab/");
+
+	// an open comment runs to the end
+	memcpy(sz, "a/*x*", 5);
+	CHECK(CutCommentsN(sz, 5, "/*", "*/") == 1);
+	CHECK_STR(sz, "a");
+
+	CHECK(CutCommentsN(sz, 3, "", NULL) == UERR_INVALIDARG);
+}
+
+
+// the marker skips (i += iC - 1) must land on the last char of the marker, markers that
+// touch, overlap or end the text, CutCommentsN() on every prefix must match CutComments()
+
+static void TestCommentMarkers(void)
+{
+	static const struct
+	{
+		const char* pszStart;
+		const char* pszEnd;
+		const char* pszText;
+		const char* pszCut;
+	} aCases[] =
+	{
+		{ "/*", "*/", "/**/", "" },
+		{ "/*", "*/", "/*/x", "" }, // "/*/" doesn't close
+		{ "/*", "*/", "a/**//**/b", "ab" },
+		{ "/*", "*/", "a*//*x*/", "a*/" },
+		{ "<!--", "-->", "<!---->x", "x" },
+		{ "<!--", "-->", "<!-->x-->y", "y" }, // the end can't reuse chars of the start
+		{ "<!--", "-->", "a<!-", "a<!-" },
+		{ "'", "'", "a'b'c''d", "acd" },
+		{ "'", "'", "a'b", "a" },
+		{ "//", NULL, "a//b\r\nc//", "a\r\nc" },
+		{ "//", NULL, "a///\nb", "a\nb" },
+		{ "#", NULL, "#\n#\nx", "\n\nx" },
+	};
+	char sz[64];
+	char szRef[64];
+	int iLen;
+	int i;
+	int n;
+
+	for (i = 0; i < (int)(sizeof(aCases) / sizeof(aCases[0])); i++)
+	{
+		strcpy(sz, aCases[i].pszText);
+		CutComments(sz, aCases[i].pszStart, aCases[i].pszEnd);
+		CHECK_STR(sz, aCases[i].pszCut);
+
+		for (iLen = 0; iLen <= (int)strlen(aCases[i].pszText); iLen++)
+		{
+			memset(sz, 'Z', sizeof(sz));
+			memcpy(sz, aCases[i].pszText, iLen);
+
+			memcpy(szRef, aCases[i].pszText, iLen);
+			szRef[iLen] = '\0';
+			CutComments(szRef, aCases[i].pszStart, aCases[i].pszEnd);
+
+			n = CutCommentsN(sz, iLen, aCases[i].pszStart, aCases[i].pszEnd);
+			CHECK(n == (int)strlen(szRef));
+			CHECK_STR(sz, szRef);
+		}
+	}
+}
+
+
+static void TestChars(void)
+{
+	char sz[256];
+
+	strcpy(sz, "  a  b \"c  d\" ");
+	CHECK(ContractChars(sz, " ", ' ') == 10);
+	CHECK_STR(sz, "a b \"c  d\"");
+
+	strcpy(sz, " a b ");
+	CHECK(CutChars(sz, " ") == 2);
+	CHECK_STR(sz, "ab");
+
+	strcpy(sz, "xx a xx");
+	CHECK(StripChars(sz, "x ") == 1);
+	CHECK_STR(sz, "a");
+
+	strcpy(sz, "xxxx");
+	CHECK(StripChars(sz, "x") == 0);
+
+	CHECK(FindChar('b', "abc") == 1);
+	CHECK(!IsChar('d', "abc"));
+}
+
+
+static void TestUtf8Chars(void)
+{
+	char sz[256];
+	char* argv[8];
+	char* pszEnd;
+	int n;
+
+	strcpy(sz, "a\xC2\xA0" "b \"x\xC2\xA0y\" c\xE3\x80\x81" "d");
+	CHECK(CutCharsUtf8(sz, "\xC2\xA0 \xE3\x80\x81") == (int)strlen("ab\"x\xC2\xA0y\"cd"));
+	CHECK_STR(sz, "ab\"x\xC2\xA0y\"cd");
+
+	// a continuation byte doesn't match a char ending with it
+	strcpy(sz, "x\xC3\xA0y");
+	CHECK(CutCharsUtf8(sz, "\xC2\xA0") == 4);
+	CHECK_STR(sz, "x\xC3\xA0y");
+
+	strcpy(sz, "x\xA0y");
+	CHECK(CutCharsUtf8(sz, " ") == UERR_FORMAT);
+	CHECK_STR(sz, "x\xA0y");
+
+	strcpy(sz, "  a \xE3\x80\x80\xE3\x80\x80 b\xE3\x80\x80 ");
+	CHECK(ContractCharsUtf8(sz, " \xE3\x80\x80", ' ') == 3);
+	CHECK_STR(sz, "a b");
+	CHECK(ContractCharsUtf8(sz, " ", 0xE9) == UERR_INVALIDARG);
+
+	strcpy(sz, "\xE3\x80\x80 \xC3\xA9t\xC3\xA9 \xE3\x80\x80");
+	CHECK(StripCharsUtf8(sz, " \xE3\x80\x80") == 5);
+	CHECK_STR(sz, "\xC3\xA9t\xC3\xA9");
+
+	strcpy(sz, "\xE3\x80\x80");
+	CHECK(StripCharsUtf8(sz, "\xE3\x80\x80") == 0);
+	CHECK(sz[0] == '\0');
+
+	strcpy(sz, "k\xE3\x80\x81v\xE3\x80\x81\"q\xE3\x80\x81r\"");
+	n = ParseLineUtf8(8, argv, sz, (int)strlen(sz), "\xE3\x80\x81", NULL);
+	CHECK(n == 3);
+	CHECK_STR(argv[2], "q\xE3\x80\x81r");
+
+	strcpy(sz, "a\xE3\x80\x81" "b\xE3\x80\x81" "c");
+	n = ParseLineUtf8(2, argv, sz, (int)strlen(sz), "\xE3\x80\x81", &pszEnd);
+	CHECK(n == 2);
+	CHECK_STR(pszEnd, "c");
+
+	// a delimiter cut by iLen is not valid
+	strcpy(sz, "a\xE3\x80\x81" "b");
+	CHECK(ParseLineUtf8(8, argv, sz, 3, "\xE3\x80\x81", NULL) == UERR_FORMAT);
+}
+
+
+// the lines ParseBuffer() gave before the iterators
+
+static int _RefLines(char* buffer, int iSize, char** apszLines)
+{
+	char* pszLine = buffer;
+	int n = 0;
+	int i;
+
+	for (i = 0; i <= iSize; i++)
+	{
+		if ((buffer[i] == '\n') || (buffer[i] == '\0'))
+		{
+			buffer[i] = '\0';
+			apszLines[n++] = pszLine;
+			pszLine = &buffer[i + 1];
+		}
+		else if (buffer[i] == '\r')
+		{
+			buffer[i] = '\0';
+		}
+	}
+
+	return n;
+}
+
+
+static void TestIterators(void)
+{
+	static const char szAlphabet[] = "ab \t\"\r\n";
+	char sz[64];
+	char szCopy[64];
+	char* apsz[80];
+	char* apszCopy[80];
+	char* argv[64];
+	lineiter_t itLines;
+	tokeniter_t itTokens;
+	char* psz;
+	int iLength;
+	int n;
+	int nCopy;
+	int i;
+	int t;
+
+	srand(9);
+
+	for (t = 0; t < 20000; t++)
+	{
+		iLength = rand() % 40;
+
+		for (i = 0; i < iLength; i++)
+		{
+			sz[i] = szAlphabet[rand() % ((t & 1)? 7: 8)];
+		}
+
+		sz[iLength] = '\0';
+		memcpy(szCopy, sz, iLength + 1);
+
+		n = _RefLines(sz, iLength, apsz);
+		BeginLines(&itLines, szCopy, iLength);
+
+		for (nCopy = 0; (psz = NextLine(&itLines)) != NULL; nCopy++)
+		{
+			apszCopy[nCopy] = psz;
+		}
+
+		CHECK(n == nCopy);
+
+		for (i = 0; (i < n) && (i < nCopy); i++)
+		{
+			CHECK((apsz[i] - sz) == (apszCopy[i] - szCopy));
+		}
+
+		for (i = 0; i < iLength; i++)
+		{
+			sz[i] = szAlphabet[rand() % 5];
+		}
+
+		sz[iLength] = '\0';
+		memcpy(szCopy, sz, iLength + 1);
+
+		n = ParseLine(64, argv, sz, " \t", NULL);
+		BeginTokens(&itTokens, szCopy, " \t");
+
+		for (nCopy = 0; (psz = NextToken(&itTokens)) != NULL; nCopy++)
+		{
+			apszCopy[nCopy] = psz;
+		}
+
+		CHECK(n == nCopy);
+
+		for (i = 0; (i < n) && (i < nCopy); i++)
+		{
+			CHECK((argv[i] - sz) == (apszCopy[i] - szCopy));
+		}
+
+		if (g_nFailed != 0)
+		{
+			break;
+		}
+	}
+}
+
+
+static int _CountLine(char* pszLine, void* param)
+{
+	(*(int*)param)++;
+
+	return 1;
+}
+
+
+static void TestParseBuffer(void)
+{
+	char sz[] = "one\r\ntwo\n\nthree";
+	int n;
+
+	n = 0;
+	ParseBuffer(sz, (int)strlen(sz), _CountLine, &n);
+	CHECK(n == 4);
+	CHECK_STR(sz, "one");
+	CHECK_STR(&sz[5], "two");
+}
+
+
+int main(void)
+{
+	RUN(TestParseLine);
+	RUN(TestCutComments);
+	RUN(TestCommentMarkers);
+	RUN(TestChars);
+	RUN(TestUtf8Chars);
+	RUN(TestIterators);
+	RUN(TestParseBuffer);
+
+	return TEST_RESULT();
+}
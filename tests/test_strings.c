@@ -0,0 +1,328 @@
+
+// utf-8 validation and transcoding, the ascii compares and the string table
+
+#include "test.h"
+
+
+// a byte at a time validator to check ValidateUtf8() against, length of the valid prefix
+
+static int _RefValidateUtf8(const byte_t* p, int n)
+{
+	unsigned int c;
+	unsigned int iMin;
+	int iLength;
+	int i;
+	int k;
+
+	for (i = 0; i < n; i += iLength)
+	{
+		c = p[i];
+
+		if (c < 0x80)
+		{
+			iLength = 1;
+			continue;
+		}
+
+		if ((c >= 0xC2) && (c <= 0xDF))
+		{
+			iLength = 2;
+			c &= 0x1F;
+			iMin = 0x80;
+		}
+		else if ((c >= 0xE0) && (c <= 0xEF))
+		{
+			iLength = 3;
+			c &= 0x0F;
+			iMin = 0x800;
+		}
+		else if ((c >= 0xF0) && (c <= 0xF4))
+		{
+			iLength = 4;
+			c &= 0x07;
+			iMin = 0x10000;
+		}
+		else
+		{
+			return i;
+		}
+
+		if (i + iLength > n)
+		{
+			return i;
+		}
+
+		for (k = 1; k < iLength; k++)
+		{
+			if ((p[i + k] & 0xC0) != 0x80)
+			{
+				return i;
+			}
+
+			c = (c << 6) | (p[i + k] & 0x3F);
+		}
+
+		if ((c < iMin) || (c > 0x10FFFF) || ((c >= 0xD800) && (c <= 0xDFFF)))
+		{
+			return i;
+		}
+	}
+
+	return n;
+}
+
+
+static void TestValidateUtf8(void)
+{
+	static const char* apszPieces[] =
+	{
+		"a", "bc", "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xED\x9F\xBF", "\xEF\xBF\xBD",
+		"\x80", "\xC0\xAF", "\xE0\x9F\xBF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xF8", "\xC3",
+		"\xE2\x82", "\xF0\x9F\x98", "\xFF", "\xC2\x80"
+	};
+	byte_t ab[300];
+	const char* psz;
+	int iLength;
+	int k;
+	int n;
+	int t;
+
+	CHECK(ValidateUtf8("abc", -1) == 3);
+	CHECK(ValidateUtf8("ab\xFF", -1) == 2);
+	CHECK(ValidateUtf8("", 0) == 0);
+
+	// random runs of valid and broken sequences, ascii heavy ones for the simd paths
+	srand(1);
+
+	for (t = 0; t < 50000; t++)
+	{
+		n = 0;
+
+		for ( ; ; )
+		{
+			k = ((t % 3 == 0) && (rand() % 50 != 0))? 0: (rand() % 4 == 0)? rand() % 7: rand() % 18;
+			psz = apszPieces[k];
+			iLength = (int)strlen(psz);
+
+			if (n + iLength > 280)
+			{
+				break;
+			}
+
+			memcpy(&ab[n], psz, iLength);
+			n += iLength;
+
+			if ((t % 5 == 0) && (k >= 7))
+			{
+				break;
+			}
+		}
+
+		if (t & 1)
+		{
+			n = (_RefValidateUtf8(ab, n) > 0)? _RefValidateUtf8(ab, n): rand() % (n + 1);
+		}
+
+		if (ValidateUtf8((const char*)ab, n) != _RefValidateUtf8(ab, n))
+		{
+			CHECK(ValidateUtf8((const char*)ab, n) == _RefValidateUtf8(ab, n));
+			break;
+		}
+	}
+}
+
+
+static int _StrLenW(const wchar_t* psz)
+{
+	int n;
+
+	for (n = 0; psz[n] != 0; n++)
+	{
+	}
+
+	return n;
+}
+
+
+static void TestTranscode(void)
+{
+	static const char szMixed[] = "abcdefghijklmnopq\xC3\xA9rst\xE2\x82\xAC uvwxyzabcdefghijk \xF0\x9F\x98\x80 end";
+	static const wchar_t szBadLead[] = { 'a', 0xD800, 'b', 0 };
+	static const wchar_t szBadTrail[] = { 0xDC00, 0 };
+	static const wchar_t szEdges[] = { 0x7F, 0x80, 0x7FF, 0x800, 0xFFFF, 0 };
+	char sz[1000];
+	char szBack[1000];
+	wchar_t szw[1000];
+	wchar_t* pszw;
+	char* psz;
+	int i;
+
+	for (i = 0; i < 999; i++)
+	{
+		sz[i] = 'a' + i % 26;
+	}
+
+	sz[999] = '\0';
+
+	CHECK(Utf8ToUtf16(sz, -1, NULL, 0) == 999);
+	CHECK(Utf8ToUtf16(sz, -1, szw, 1000) == 999);
+	CHECK((szw[998] == (wchar_t)sz[998]) && (szw[999] == 0));
+	CHECK(Utf16ToUtf8(szw, -1, szBack, 1000) == 999);
+	CHECK_STR(szBack, sz);
+	CHECK(Utf8ToUtf16(sz, -1, szw, 999) == UERR_OVERFLOW);
+	CHECK(Utf16ToUtf8(szw, -1, szBack, 999) == UERR_OVERFLOW);
+	CHECK(Utf8ToUtf16("", -1, szw, 0) == UERR_OVERFLOW);
+	CHECK(Utf8ToUtf16("", -1, szw, 1) == 0);
+
+	pszw = AllocStringUtf16(szMixed);
+	CHECK(pszw != NULL);
+
+	if (pszw != NULL)
+	{
+		CHECK((pszw[17] == 0xE9) && (pszw[21] == 0x20AC));
+		CHECK(_StrLenW(pszw) == Utf8ToUtf16(szMixed, -1, NULL, 0));
+		CHECK(Utf16ToUtf8(pszw, -1, NULL, 0) == (int)strlen(szMixed));
+
+		psz = AllocStringUtf8(pszw);
+		CHECK_STR(psz, szMixed);
+		FreeString(psz);
+		FreeStringW(pszw);
+	}
+
+	CHECK(Utf8ToUtf16("\xC0\xAF", -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf8ToUtf16("\xE0\x80\xAF", -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf8ToUtf16("\xED\xA0\x80", -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf8ToUtf16("\xF4\x90\x80\x80", -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf8ToUtf16("\xE2\x82", -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf8ToUtf16("\x80", -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf8ToUtf16("\xF4\x8F\xBF\xBF", -1, szw, 10) == 2);
+	CHECK((szw[0] == 0xDBFF) && (szw[1] == 0xDFFF));
+	CHECK(Utf8ToUtf16("\xF0\x9F\x98\x80", -1, szw, 2) == UERR_OVERFLOW);
+	CHECK(AllocStringUtf16("a\xFF") == NULL);
+
+	CHECK(Utf16ToUtf8(szBadLead, -1, NULL, 0) == UERR_FORMAT);
+	CHECK(Utf16ToUtf8(szBadTrail, -1, NULL, 0) == UERR_FORMAT);
+	CHECK(AllocStringUtf8(szBadLead) == NULL);
+	CHECK(Utf16ToUtf8(szEdges, -1, szBack, 100) == 11);
+	CHECK(memcmp(szBack, "\x7F\xC2\x80\xDF\xBF\xE0\xA0\x80\xEF\xBF\xBF", 11) == 0);
+
+	// bounded by iLength
+	CHECK(Utf8ToUtf16("abc\xC3\xA9xyz", 5, szw, 10) == 4);
+	CHECK((szw[3] == 0xE9) && (szw[4] == 0));
+	CHECK(Utf8ToUtf16("abc\xC3\xA9xyz", 4, szw, 10) == UERR_FORMAT);
+}
+
+
+static void TestAsciiStr(void)
+{
+	static const char* apsz[] = { "", "a", "Key", "KEY_name.Ext", "a somewhat longer string than sixteen bytes", "\xC3\xA9t\xC3\xA9" };
+	char szUpper[64];
+	int i;
+	int j;
+
+	for (i = 0; i < (int)(sizeof(apsz) / sizeof(apsz[0])); i++)
+	{
+		for (j = 0; apsz[i][j] != '\0'; j++)
+		{
+			szUpper[j] = ((apsz[i][j] >= 'a') && (apsz[i][j] <= 'z'))? apsz[i][j] - 32: apsz[i][j];
+		}
+
+		szUpper[j] = '\0';
+
+		CHECK(AsciiStrEq(apsz[i], szUpper));
+		CHECK(AsciiStrHash(apsz[i]) == AsciiStrHash(szUpper));
+		CHECK(AsciiStrPrefix(szUpper, apsz[i]));
+
+		for (j = 0; j < (int)(sizeof(apsz) / sizeof(apsz[0])); j++)
+		{
+			CHECK(AsciiStrEq(apsz[i], apsz[j]) == (i == j));
+		}
+	}
+
+	// only ascii is folded
+	CHECK(!AsciiStrEq("\xC3\xA9", "\xC3\x89"));
+	CHECK(AsciiStrPrefix("KEY_name", "key"));
+	CHECK(!AsciiStrPrefix("ke", "key"));
+	CHECK(AsciiStrEqW(L"Path\\File", L"PATH\\file"));
+	CHECK(AsciiStrHashW(L"Path") == AsciiStrHashW(L"pATH"));
+	CHECK(AsciiStrPrefixW(L"Path\\File", L"path\\"));
+}
+
+
+static void TestStringTable(void)
+{
+	strtable_t* pst;
+	const char* apsz[1000];
+	const char* psz;
+	char sz[32];
+	int nFailed;
+	int i;
+
+	pst = CreateStringTable(true);
+	CHECK(pst != NULL);
+
+	if (pst == NULL)
+	{
+		return;
+	}
+
+	psz = InternString(pst, "Alpha");
+	CHECK_STR(psz, "Alpha");
+	CHECK(InternString(pst, "ALPHA") == psz);
+	CHECK(InternStringN(pst, "alphabet", 5) == psz);
+	CHECK(InternString(pst, "beta") != psz);
+
+	// enough to grow the table a few times
+	for (i = 0; i < 1000; i++)
+	{
+		sprintf(sz, "name%d", i);
+		apsz[i] = InternString(pst, sz);
+		CHECK_STR(apsz[i], sz);
+	}
+
+	for (i = 0; i < 1000; i++)
+	{
+		sprintf(sz, "NAME%d", i);
+		CHECK(InternString(pst, sz) == apsz[i]);
+	}
+
+	FreeStringTable(pst);
+
+	pst = CreateStringTable(false);
+	CHECK(InternString(pst, "x") != InternString(pst, "X"));
+	FreeStringTable(pst);
+
+#ifndef _WIN32
+	// a table that can't grow refuses new strings and still finds the old ones
+	pst = CreateStringTable(false);
+	psz = InternString(pst, "first");
+	nFailed = 0;
+
+	ShimFailAllocations(0);
+
+	for (i = 0; i < 5000; i++)
+	{
+		sprintf(sz, "name%d", i);
+		nFailed += (InternString(pst, sz) == NULL);
+	}
+
+	CHECK((nFailed > 0) && (nFailed < 5000));
+	CHECK(InternString(pst, "first") == psz);
+
+	ShimFailAllocations(-1);
+
+	CHECK_STR(InternString(pst, "name4999"), "name4999");
+	FreeStringTable(pst);
+#endif
+}
+
+
+int main(void)
+{
+	RUN(TestValidateUtf8);
+	RUN(TestTranscode);
+	RUN(TestAsciiStr);
+	RUN(TestStringTable);
+
+	return TEST_RESULT();
+}
@@ -21,18 +21,67 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include <malloc.h>
+#include <limits.h>
 
 #include "utils.h"
 
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#define USE_SSE
+#endif
+
+#ifdef USE_SSE
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// the string scans read whole 16 byte blocks past the '\0' where that can't fault, address
+// sanitizer builds (the fuzz targets) take the char at a time paths instead
+#if defined(__SANITIZE_ADDRESS__)
+#define NO_OVERREAD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_OVERREAD
+#endif
+#endif
+
+// msvc allows any intrinsics anywhere, gcc wants them enabled per function
+#ifdef _MSC_VER
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
 
 //
 // allocators
 //
 
+#ifdef UTILS_MEMORY_STATS
+static memstats_t g_ms;
+// failed allocations and frees of NULL are not counted
+#define COUNT_ALLOC(p, iSize) (((p) != NULL)? (InterlockedIncrement(&g_ms.nAllocs), (void)InterlockedExchangeAdd64(&g_ms.iBytes, (LONGLONG)(iSize))): (void)0)
+#define COUNT_FREE(p) (((p) != NULL)? (void)InterlockedIncrement(&g_ms.nFrees): (void)0)
+#else
+#define COUNT_ALLOC(p, iSize) ((void)0)
+#define COUNT_FREE(p) ((void)0)
+#endif
+
+
 void* AllocMemory(size_t iSize)
 {
 	void* p = malloc(iSize);
 
+	COUNT_ALLOC(p, iSize);
+
 	if ( p == NULL )
 	{
 		if ( MessageBox( NULL, "Error allocating memory. Debug?", "AllocMemory", MB_YESNOCANCEL ) == IDYES )
@@ -47,10 +96,63 @@ void* AllocMemory(size_t iSize)
 
 void FreeMemory(void* p)
 {
+	COUNT_FREE(p);
+
 	free(p);
 }
 
 
+// iAlign must be a power of two
+
+void* AllocMemoryAligned(size_t iSize, size_t iAlign)
+{
+	void* p = _aligned_malloc(iSize, iAlign);
+
+	COUNT_ALLOC(p, iSize);
+
+	if ( p == NULL )
+	{
+		if ( MessageBox( NULL, "Error allocating memory. Debug?", "AllocMemoryAligned", MB_YESNOCANCEL ) == IDYES )
+		{
+			__debugbreak();
+		}
+	}
+
+	return p;
+}
+
+
+void FreeMemoryAligned(void* p)
+{
+	COUNT_FREE(p);
+
+	_aligned_free(p);
+}
+
+
+// counts allocations made through the functions above,
+// only when built with UTILS_MEMORY_STATS, zeroes otherwise
+
+void GetMemoryStats(memstats_t* pms)
+{
+#ifdef UTILS_MEMORY_STATS
+	*pms = g_ms;
+#else
+	memset(pms, 0, sizeof(memstats_t));
+#endif
+}
+
+
+void ResetMemoryStats(void)
+{
+#ifdef UTILS_MEMORY_STATS
+	InterlockedExchange(&g_ms.nAllocs, 0);
+	InterlockedExchange(&g_ms.nFrees, 0);
+	InterlockedExchange64(&g_ms.iBytes, 0);
+#endif
+}
+
+
 char* AllocString(const char* pszSrc)
 {
 	size_t iSize;
@@ -85,19 +187,111 @@ wchar_t* AllocStringW(const wchar_t* pszSrc)
 }
 
 
+// leading ascii run of psz widened or narrowed to pszDst (which may be NULL to only count),
+// returns its length, the simd paths need a 16 bit wchar_t as on windows
+
+static int _WidenAscii(const char* psz, int iLength, wchar_t* pszDst)
+{
+	int i = 0;
+
+#ifdef USE_SSE
+	__m128i v;
+
+	if (sizeof(wchar_t) == 2)
+	{
+		for ( ; i + 16 <= iLength; i += 16)
+		{
+			v = _mm_loadu_si128((const __m128i*)&psz[i]);
+
+			if (_mm_movemask_epi8(v) != 0)
+			{
+				break;
+			}
+
+			if (pszDst != NULL)
+			{
+				_mm_storeu_si128((__m128i*)&pszDst[i], _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+				_mm_storeu_si128((__m128i*)&pszDst[i + 8], _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+			}
+		}
+	}
+#endif
+
+	for ( ; (i < iLength) && !(psz[i] & 0x80); i++)
+	{
+		if (pszDst != NULL)
+		{
+			pszDst[i] = psz[i];
+		}
+	}
+
+	return i;
+}
+
+
+static int _NarrowAscii(const wchar_t* psz, int iLength, char* pszDst)
+{
+	int i = 0;
+
+#ifdef USE_SSE
+	__m128i v;
+
+	if (sizeof(wchar_t) == 2)
+	{
+		for ( ; i + 8 <= iLength; i += 8)
+		{
+			v = _mm_loadu_si128((const __m128i*)&psz[i]);
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xFF80)), _mm_setzero_si128())) != 0xFFFF)
+			{
+				break;
+			}
+
+			if (pszDst != NULL)
+			{
+				_mm_storel_epi64((__m128i*)&pszDst[i], _mm_packus_epi16(v, v));
+			}
+		}
+	}
+#endif
+
+	for ( ; (i < iLength) && ((unsigned int)psz[i] < 0x80); i++)
+	{
+		if (pszDst != NULL)
+		{
+			pszDst[i] = (char)psz[i];
+		}
+	}
+
+	return i;
+}
+
+
+// ansi code page, ascii is widened directly and the rest takes one MultiByteToWideChar
+
 wchar_t* AllocStringUnicode(const char* pszSrc)
 {
 	wchar_t* psz;
-	int iSize;
+	int iLength;
+	int i;
+
+	iLength = (int)strlen(pszSrc);
+	psz = (wchar_t*)AllocMemory((iLength + 1) * sizeof(wchar_t));
+
+	if (psz == NULL)
+	{
+		return NULL;
+	}
 
-	psz = NULL;
+	i = _WidenAscii(pszSrc, iLength, psz);
 
-	iSize = MultiByteToWideChar(CP_ACP, 0, pszSrc, -1, NULL, 0);
-	psz = (wchar_t*)AllocMemory((iSize+1)*sizeof(wchar_t));
+	// an ansi char never takes more than one utf-16 unit
+	if (i < iLength)
+	{
+		i += MultiByteToWideChar(CP_ACP, 0, &pszSrc[i], iLength - i, &psz[i], iLength - i);
+	}
 
-	MultiByteToWideChar(CP_ACP, 0, pszSrc, -1, psz, iSize);
-	
-	psz[iSize] = '\0';
+	psz[i] = '\0';
 
 	return psz;
 }
@@ -122,1146 +316,8724 @@ void FreeStringSafeW(const wchar_t* psz)
 
 
 //
-// path and filename funcs
+// profiling
 //
 
-#define IsPathSeparator(c) (((c) == '\\') || ((c) == '/'))
-//#define IsxxxFileName(s) (((s)[0] == '.') && (((s)[1] == '\0') || (((s)[1] == '.') && ((s)[2] == '\0'))))
+// built with UTILS_PROFILE the entry points below record their time,
+// call counts and a few counters, and the latest calls as trace events.
+// without it all of this compiles to nothing
 
+#ifdef UTILS_PROFILE
 
-char* GetExtension(const char* psz)
+#define PROF_MAX_EVENTS 65536
+
+typedef struct
 {
-	size_t i;
+	int iTimer;
+	DWORD dwThreadId;
+	LONGLONG iStart;
+	LONGLONG iDuration;
+} profevent_t;
 
-	i = strlen(psz);
+static struct
+{
+	profstats_t stats; // times in ticks until GetProfileStats()
+	LONGLONG iBase;
+	volatile LONG iNextEvent;
+	profevent_t aEvents[PROF_MAX_EVENTS];
+} g_prof;
 
-	for (; i > 0; --i)
-	{
-		if (psz[i] == '.')
-		{
-			return (char*)&psz[i+1];
-		}
-		else if (IsPathSeparator(psz[i]))
-		{
-			break;
-		}
-	}
+static const char* g_apszProfTimers[PROF_TIMERS] =
+{
+	"ReadFileToBuffer",
+	"ParseBuffer",
+	"ParseFile",
+	"ParseDirectory",
+	"callbacks",
+	"LoadBitmapFromFile",
+	"SaveBitmap"
+};
 
-	return NULL;
+
+static LONGLONG _ProfNow(void)
+{
+	LARGE_INTEGER li;
+
+	QueryPerformanceCounter(&li);
+
+	return li.QuadPart;
 }
 
 
-wchar_t* GetExtensionW(const wchar_t* psz)
+static void _ProfStop(int iTimer, LONGLONG iStart, bool_t bTrace)
 {
-	size_t i;
+	LONGLONG iDuration;
+	profevent_t* pev;
 
-	i = wcslen(psz);
+	iDuration = _ProfNow() - iStart;
 
-	for (; i > 0; --i)
+	InterlockedExchangeAdd64(&g_prof.stats.aiTime[iTimer], iDuration);
+	InterlockedIncrement64(&g_prof.stats.anCalls[iTimer]);
+
+	if (bTrace)
 	{
-		if (psz[i] == '.')
-		{
-			return (wchar_t*)&psz[i+1];
-		}
-		else if (IsPathSeparator(psz[i]))
-		{
-			break;
-		}
+		pev = &g_prof.aEvents[(InterlockedIncrement(&g_prof.iNextEvent) - 1) & (PROF_MAX_EVENTS - 1)];
+		pev->iTimer = iTimer;
+		pev->dwThreadId = GetCurrentThreadId();
+		pev->iStart = iStart;
+		pev->iDuration = iDuration;
 	}
-
-	return NULL;
 }
 
+#define PROF_LOCALS LONGLONG aiProfStart[2]
+#define PROF_START(i) (aiProfStart[i] = _ProfNow())
+#define PROF_STOP(iTimer, i) _ProfStop((iTimer), aiProfStart[i], true)
+#define PROF_STOP_QUIET(iTimer, i) _ProfStop((iTimer), aiProfStart[i], false)
+#define PROF_ADD(field, n) InterlockedExchangeAdd64(&g_prof.stats.field, (LONGLONG)(n))
 
-char* GetFileName(const char* psz)
+#else
+
+#define PROF_LOCALS
+#define PROF_START(i) ((void)0)
+#define PROF_STOP(iTimer, i) ((void)0)
+#define PROF_STOP_QUIET(iTimer, i) ((void)0)
+#define PROF_ADD(field, n) ((void)0)
+
+#endif // UTILS_PROFILE
+
+
+// times are in microseconds
+
+void GetProfileStats(profstats_t* pps)
 {
-	const char* pszFileName;
+#ifdef UTILS_PROFILE
+	LARGE_INTEGER liFreq;
 	int i;
 
-	pszFileName = psz;
+	QueryPerformanceFrequency(&liFreq);
 
-	for (i = 0; psz[i] != '\0'; i++)
+	*pps = g_prof.stats;
+
+	for (i = 0; i < PROF_TIMERS; i++)
 	{
-		if (IsPathSeparator(psz[i]))
-		{
-			pszFileName = &psz[i+1];
-		}
+		pps->aiTime[i] = (pps->aiTime[i] * 1000000) / liFreq.QuadPart;
 	}
+#else
+	memset(pps, 0, sizeof(profstats_t));
+#endif
+}
 
-	return (char*)pszFileName;
+
+void ResetProfileStats(void)
+{
+#ifdef UTILS_PROFILE
+	memset(&g_prof.stats, 0, sizeof(profstats_t));
+	g_prof.iNextEvent = 0;
+	g_prof.iBase = _ProfNow();
+#endif
 }
 
 
-wchar_t* GetFileNameW(const wchar_t* psz)
+// writes the recorded calls as chrome trace json (chrome://tracing, perfetto)
+
+bool_t SaveProfileTrace(const char* pszFileName)
 {
-	const wchar_t* pszFileName;
-	int i;
+#ifdef UTILS_PROFILE
+	LARGE_INTEGER liFreq;
+	profevent_t* pev;
+	FILE* stream;
+	LONG iLast;
+	LONG i;
 
-	pszFileName = psz;
+	stream = fopen(pszFileName, "w");
 
-	for (i = 0; psz[i] != '\0'; i++)
+	if (stream == NULL)
 	{
-		if (IsPathSeparator(psz[i]))
-		{
-			pszFileName = &psz[i+1];
-		}
+		return false;
 	}
 
-	return (wchar_t*)pszFileName;
-}
+	QueryPerformanceFrequency(&liFreq);
 
-/*
-void ConcatPath(char* buffer, const char* psz)
-{
-	int i;
-	
-	i = (int)strlen(buffer);
+	iLast = g_prof.iNextEvent;
 
-	while (i > 0)
+	fprintf(stream, "{\"traceEvents\":[\n");
+
+	for (i = max(iLast - PROF_MAX_EVENTS, 0); i < iLast; i++)
 	{
-		if (!IsPathSeparator(buffer[i-1]))
-		{
-			break;
-		}
-		i--;
+		pev = &g_prof.aEvents[i & (PROF_MAX_EVENTS - 1)];
+
+		fprintf(stream, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+			g_apszProfTimers[pev->iTimer], (unsigned int)GetCurrentProcessId(), (unsigned int)pev->dwThreadId,
+			(double)(pev->iStart - g_prof.iBase) * 1000000.0 / liFreq.QuadPart,
+			(double)pev->iDuration * 1000000.0 / liFreq.QuadPart,
+			(i + 1 < iLast)? ",": "");
 	}
 
-	buffer[i++] = PATH_SEPARATOR;
+	fprintf(stream, "],\"otherData\":{\"bytesRead\":%lld,\"lines\":%lld,\"tokens\":%lld,\"files\":%lld,\"pixels\":%lld}}\n",
+		g_prof.stats.iBytesRead, g_prof.stats.nLines, g_prof.stats.nTokens, g_prof.stats.nFiles, g_prof.stats.nPixels);
 
-	strcpy(&buffer[i], psz);
+	return (fclose(stream) == 0);
+#else
+	return false;
+#endif
 }
-*/
 
-bool_t CreateDirectoryTree(const char* pszPath)
+
+//
+// cpu features
+//
+
+#define CPU_SSSE3 0x01
+#define CPU_AVX2 0x02
+
+static int g_iCpuFeatures = -1;
+
+
+#ifdef USE_SSE
+
+static void _CpuId(int aiRegs[4], int iLeaf, int iSubLeaf)
 {
-	char szDir[MAX_PATH];
-	int i;
+#ifdef _MSC_VER
+	__cpuidex(aiRegs, iLeaf, iSubLeaf);
+#else
+	__cpuid_count(iLeaf, iSubLeaf, aiRegs[0], aiRegs[1], aiRegs[2], aiRegs[3]);
+#endif
+}
 
-	strcpy(szDir, pszPath);
 
-	for (i = 0; ; i++)
+static unsigned int _GetXCR0(void)
+{
+#ifdef _MSC_VER
+	return (unsigned int)_xgetbv(0);
+#else
+	unsigned int lo, hi;
+
+	__asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+
+	return lo;
+#endif
+}
+
+
+
+// index of the lowest and the highest set bit, m must not be 0
+
+static int _LowestBit(unsigned int m)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+
+	_BitScanForward(&i, m);
+
+	return (int)i;
+#else
+	return __builtin_ctz(m);
+#endif
+}
+
+
+#ifndef NO_OVERREAD // only _ScanPath_SSE2() needs it
+
+static int _HighestBit(unsigned int m)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+
+	_BitScanReverse(&i, m);
+
+	return (int)i;
+#else
+	return 31 - __builtin_clz(m);
+#endif
+}
+
+#endif
+
+#endif // USE_SSE
+
+
+static int _GetCpuFeatures(void)
+{
+	int iFeatures;
+
+	if (g_iCpuFeatures != -1)
 	{
-		char c = szDir[i];
-		
-		if (IsPathSeparator(c) || (c == '\0'))
+		return g_iCpuFeatures;
+	}
+
+	iFeatures = 0;
+
+#ifdef USE_SSE
+	{
+		int aiRegs[4];
+
+		_CpuId(aiRegs, 0, 0);
+
+		if (aiRegs[0] >= 1)
 		{
-			szDir[i] = '\0';
+			_CpuId(aiRegs, 1, 0);
 
+			if (aiRegs[2] & (1 << 9))
 			{
-				DWORD attrs = GetFileAttributesA(szDir);
+				iFeatures |= CPU_SSSE3;
+			}
 
-				if (attrs == (DWORD)-1)
-				{
-					if (!CreateDirectoryA(szDir, NULL))
-					{
-						return false;
-					}
-				}
-				else
+			// avx2 needs the os to save ymm state (osxsave + xcr0 bits 1,2)
+			if ((aiRegs[2] & (1 << 27)) && ((_GetXCR0() & 6) == 6))
+			{
+				_CpuId(aiRegs, 0, 0);
+
+				if (aiRegs[0] >= 7)
 				{
-					if (!(attrs & FILE_ATTRIBUTE_DIRECTORY))
+					_CpuId(aiRegs, 7, 0);
+
+					if (aiRegs[1] & (1 << 5))
 					{
-						return false;
+						iFeatures |= CPU_AVX2;
 					}
 				}
 			}
-			
-			if (c == '\0')
-			{
-				break;
-			}
-
-			szDir[i] = '\\';
 		}
 	}
+#endif
 
-	return true;
+	g_iCpuFeatures = iFeatures;
+
+	return iFeatures;
 }
 
 
-bool_t CreateDirectoryTreeW(const wchar_t* pszPath)
-{
-	wchar_t szDir[MAX_PATH];
-	int i;
-
-	wcscpy(szDir, pszPath);
+//
+// worker threads
+//
 
-	for (i = 0; ; i++)
-	{
-		wchar_t c = szDir[i];
-		
-		if (IsPathSeparator(c) || (c == '\0'))
-		{
-			szDir[i] = '\0';
+// jobs are split into bands which are taken by the pool threads
+// and by the calling thread itself. only one job runs at a time,
+// a job started while another one is running (or from inside a band)
+// simply runs on the calling thread
 
-			{
-				DWORD attrs = GetFileAttributesW(szDir);
+typedef void (*PFBANDCALLBACK)(int iFirst, int iLast, void* param);
 
-				if (attrs == (DWORD)-1)
-				{
-					if (!CreateDirectoryW(szDir, NULL))
-					{
-						return false;
-					}
-				}
-				else
-				{
-					if (!(attrs & FILE_ATTRIBUTE_DIRECTORY))
-					{
-						return false;
-					}
-				}
-			}
-			
-			if (c == '\0')
-			{
-				break;
-			}
+#define BAND_SIZE (256 * 1024) // bytes of work per band, about l2 sized
+#define BAND_BITS 20 // band count and next band in the claim word
+#define BAND_MASK ((1 << BAND_BITS) - 1)
 
-			szDir[i] = '\\';
-		}
+static struct
+{
+	volatile LONG iInit;
+	CRITICAL_SECTION cs;
+	HANDLE hWake;
+	HANDLE hDone;
+	HANDLE* ahThreads;
+	int nThreads;
+	int nThreadsWanted;
+	volatile LONG bQuit;
+
+	volatile LONG bBusy; // a job is running
+	volatile LONGLONG iClaim; // job generation << 40 | band count << 20 | next band, no bands between jobs
+	LONG iGeneration;
+	volatile LONG nPending;
+	int nBands;
+	int nItems;
+	int nBandItems;
+	PFBANDCALLBACK pfnBandCallback;
+	void* param;
+} g_pool;
+
+
+static void _InitPool(void)
+{
+	if (InterlockedCompareExchange(&g_pool.iInit, 1, 0) == 0)
+	{
+		InitializeCriticalSection(&g_pool.cs);
+		g_pool.iClaim = 0;
+		InterlockedExchange(&g_pool.iInit, 2);
 	}
 
-	return true;
+	while (InterlockedCompareExchange(&g_pool.iInit, 2, 2) != 2)
+	{
+		Sleep(0);
+	}
 }
 
 
+// a band is claimed with one compare exchange of the whole claim word, so a
+// claim loaded before the job ended (generation included) can't succeed
 
-//
-// parser (ANSI only)
-//
+static void _RunBands(void)
+{
+	LONGLONG iClaim;
+	int iBand;
+	int iFirst;
 
+	for (;;)
+	{
+		iClaim = InterlockedCompareExchange64(&g_pool.iClaim, 0, 0);
+		iBand = (int)(iClaim & BAND_MASK);
 
-int ToInt(const char* psz)
-{
-	return strtol(psz, NULL, 10);
-}
+		if (iBand >= (int)((iClaim >> BAND_BITS) & BAND_MASK))
+		{
+			break;
+		}
 
+		if (InterlockedCompareExchange64(&g_pool.iClaim, iClaim + 1, iClaim) != iClaim)
+		{
+			continue;
+		}
 
-unsigned int ToUInt(const char* psz)
-{
-	return strtoul(psz, NULL, 10);
-}
+		// the job can't end before this band does, so its fields hold
+		iFirst = iBand * g_pool.nBandItems;
 
+		g_pool.pfnBandCallback(iFirst, min(iFirst + g_pool.nBandItems, g_pool.nItems), g_pool.param);
 
-bool_t ToBool(const char* psz)
-{
-	if (FStrEq(psz, "true"))
-	{
-		return true;
-	}
-	else if (FStrEq(psz, "false"))
-	{
-		return false;
+		if (InterlockedDecrement(&g_pool.nPending) == 0)
+		{
+			SetEvent(g_pool.hDone);
+		}
 	}
-
-	return (ToInt(psz) != 0);
 }
 
 
-int FindString(const char* psz, char** apsz, int n)
+static DWORD WINAPI _WorkerThread(LPVOID param)
 {
-	int i;
-
-	for (i = 0; i < n; i++)
+	for (;;)
 	{
-		if (FStrEq(psz, apsz[i]))
+		WaitForSingleObject(g_pool.hWake, INFINITE);
+
+		if (g_pool.bQuit)
 		{
-			return i;
+			break;
 		}
+
+		_RunBands();
 	}
 
-	return -1;
+	return 0;
 }
 
 
-//  CutChars( pszSomeText, " \t" ); // will remove all spaces and tabs
-
-int CutChars(char* psz, const char* pszChars)
+static void _StopWorkerThreads(void)
 {
-	bool bQuote;
 	int i;
-	int j;
-	int n;
-
-	bQuote = false;
-	j = 0;
 
-	for (i = 0; psz[i] != '\0'; i++)
+	if (g_pool.nThreads == 0)
 	{
-		if (psz[i] == '\"')
-		{
-			bQuote = !bQuote;
-		}
-		else
-		{
-			if (!bQuote)
-			{
-				for (n = 0; pszChars[n] != '\0'; n++)
-				{
-					if (pszChars[n] == psz[i])
-					{
-						goto skip;
-					}
-				}
-			}
-		}
-
-		psz[j++] = psz[i];
+		return;
+	}
 
-skip:
+	InterlockedExchange(&g_pool.bQuit, 1);
+	ReleaseSemaphore(g_pool.hWake, g_pool.nThreads, NULL);
 
-		;
+	for (i = 0; i < g_pool.nThreads; i++)
+	{
+		WaitForSingleObject(g_pool.ahThreads[i], INFINITE);
+		CloseHandle(g_pool.ahThreads[i]);
 	}
 
-	psz[j] = '\0';
+	FreeMemory(g_pool.ahThreads);
+	CloseHandle(g_pool.hWake);
+	CloseHandle(g_pool.hDone);
 
-	return j;
+	g_pool.ahThreads = NULL;
+	g_pool.nThreads = 0;
+	g_pool.bQuit = 0;
 }
 
 
-//  ContractChars( pszSomeText, " \t", ' ' ); // spaces and tabs to single spaces
-
-int ContractChars(char* psz, const char* pszChars, int cToChar)
+static void _StartWorkerThreads(void)
 {
-	bool bQuote;
+	SYSTEM_INFO si;
+	int nThreads;
 	int i;
-	int j;
-	int n;
 
-	bQuote = false;
-	j = 0;
+	nThreads = g_pool.nThreadsWanted;
 
-	for (i = 0; psz[i] != '\0'; i++)
+	if (nThreads <= 0)
 	{
-		if (psz[i] == '\"')
-		{
-			bQuote = !bQuote;
-		}
-		else
-		{
-			if (!bQuote)
-			{
-				for (n = 0; pszChars[n] != '\0'; n++)
-				{
-					if (pszChars[n] == psz[i])
-					{
-						if ((j == 0) || (psz[j-1] == cToChar))
-						{
-							goto skip;
-						}
-						else
-						{
-							psz[i] = cToChar;
-						}
-					}
-				}
-			}
-		}
-
-		psz[j++] = psz[i];
+		GetSystemInfo(&si);
+		nThreads = (int)si.dwNumberOfProcessors;
+	}
 
-skip:
+	// the calling thread is one of the workers
+	nThreads--;
 
-		;
+	if (nThreads <= 0)
+	{
+		return;
 	}
 
-	if (j > 0)
+	g_pool.hWake = CreateSemaphore(NULL, 0, nThreads, NULL);
+	g_pool.hDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+	g_pool.ahThreads = (HANDLE*)AllocMemory(nThreads * sizeof(HANDLE));
+
+	for (i = 0; i < nThreads; i++)
 	{
-		if (psz[j-1] == cToChar)
+		g_pool.ahThreads[i] = CreateThread(NULL, 0, _WorkerThread, NULL, 0, NULL);
+
+		if (g_pool.ahThreads[i] == NULL)
 		{
-			j--;
+			break;
 		}
 	}
 
-	psz[j] = '\0';
-
-	return j;
+	g_pool.nThreads = i;
 }
 
 
-//  CutComments( pszSomeText, "/*", "*/" );
-//  CutComments( pszSomeText, "//", NULL );
+// 0 - one thread per cpu (default), 1 - everything runs on the calling thread
 
-int CutComments(char* psz, const char* pszCommentStart, const char* pszCommentEnd)
+void SetWorkerThreadCount(int nThreads)
 {
-	bool bQuote;
-	bool bComment;
-	char* pszCur;
-	int i;
-	int j;
-	int iC;
-
-	bQuote = false;
-	bComment = false;
-	i = 0;
-	j = 0;
-
-	for ( ; psz[i] != '\0'; i++)
-	{
-		if (bComment)
-		{
-			if (pszCommentEnd == NULL)
-			{
-				if (((psz[i] == '\r') && (psz[i+1] == '\n')) || (psz[i] == '\n'))
-				{
-					bComment = false;
-				}
-				else
-				{
-					continue;
-				}
-			}
-			else
-			{
-				pszCur = &psz[i];
-				iC = 0;
+	_InitPool();
 
-				for ( ; pszCommentEnd[iC] != '\0'; iC++)
-				{
-					if (pszCur[iC] != pszCommentEnd[iC])
-					{
-						goto skip_end;
-					}
-				}
+	EnterCriticalSection(&g_pool.cs);
 
-				i += iC;
-				bComment = false;
+	_StopWorkerThreads();
+	g_pool.nThreadsWanted = nThreads;
 
-skip_end:
+	LeaveCriticalSection(&g_pool.cs);
+}
 
-				continue;
-			}
-		}
 
-		if (psz[i] == '\"')
-		{
-			bQuote = !bQuote;
-		}
+int GetWorkerThreadCount(void)
+{
+	SYSTEM_INFO si;
 
-		if (!bQuote)
-		{
-			pszCur = &psz[i];
-			iC = 0;
+	if (g_pool.nThreadsWanted > 0)
+	{
+		return g_pool.nThreadsWanted;
+	}
 
-			for ( ; pszCommentStart[iC] != '\0'; iC++)
-			{
-				if (pszCur[iC] != pszCommentStart[iC])
-				{
-					goto skip_start;
-				}
-			}
+	GetSystemInfo(&si);
 
-			i += iC;
-			bComment = true;
+	return (int)si.dwNumberOfProcessors;
+}
 
-			continue;
-		}
 
-skip_start:
+void ShutdownWorkerThreads(void)
+{
+	_InitPool();
 
-		psz[j++] = psz[i];
-	}
+	EnterCriticalSection(&g_pool.cs);
 
-	psz[j] = '\0';
+	_StopWorkerThreads();
 
-	return j;
+	LeaveCriticalSection(&g_pool.cs);
 }
 
 
-int FindChar(int c, const char* psz)
+static void _ParallelBands(int nItems, int nBandItems, PFBANDCALLBACK pfnBandCallback, void* param)
 {
-	int i;
+	int nBands;
 
-	for (i = 0; psz[i] != '\0'; i++)
+	nBandItems = max(nBandItems, 1);
+
+	if ((nItems + nBandItems - 1) / nBandItems > BAND_MASK)
 	{
-		if (psz[i] == c)
-		{
-			return i;
-		}
+		nBandItems = (nItems + BAND_MASK - 1) / BAND_MASK;
 	}
 
-	return -1;
-}
-
-
-// strip chars from the left and the right
-// StripChars( "  asd asd! ", " " ); // will give "asd asd!"
-
-int StripChars(char* psz, const char* pszChars)
-{
-	int i, j;
+	nBands = (nItems + nBandItems - 1) / nBandItems;
 
-	for (i = 0; psz[i] != '\0'; i++)
+	if ((nBands <= 1) || (g_pool.nThreadsWanted == 1))
 	{
-		if (!IsChar(psz[i], pszChars))
+		if (nItems > 0)
 		{
-			break;
+			pfnBandCallback(0, nItems, param);
 		}
+		return;
 	}
 
-	for (j = 0; psz[i] != '\0'; i++, j++)
+	_InitPool();
+
+	// nested jobs (from a band, on any thread) and concurrent ones run inline.
+	// not the critical section, it would let the calling thread in again
+	if (InterlockedCompareExchange(&g_pool.bBusy, 1, 0) != 0)
 	{
-		psz[j] = psz[i];
+		pfnBandCallback(0, nItems, param);
+		return;
 	}
 
-	for ( ; j > 0; j--)
+	EnterCriticalSection(&g_pool.cs);
+
+	if ((g_pool.nThreads == 0) && (g_pool.nThreadsWanted != 1))
 	{
-		if (!IsChar(psz[j-1], pszChars))
-		{
-			break;
-		}
+		_StartWorkerThreads();
 	}
 
-	psz[j] = '\0';
+	if (g_pool.nThreads == 0)
+	{
+		LeaveCriticalSection(&g_pool.cs);
+		InterlockedExchange(&g_pool.bBusy, 0);
+		pfnBandCallback(0, nItems, param);
+		return;
+	}
 
-	return j;
+	g_pool.nBands = nBands;
+	g_pool.nItems = nItems;
+	g_pool.nBandItems = nBandItems;
+	g_pool.pfnBandCallback = pfnBandCallback;
+	g_pool.param = param;
+	g_pool.nPending = nBands;
+
+	// publishes the job under a new generation, late workers from the previous
+	// job see no bands until here and fail to claim with their old word after
+	g_pool.iGeneration = (g_pool.iGeneration + 1) & 0xFFFFFF;
+	InterlockedExchange64(&g_pool.iClaim, ((LONGLONG)g_pool.iGeneration << (2 * BAND_BITS)) | ((LONGLONG)nBands << BAND_BITS));
+
+	ReleaseSemaphore(g_pool.hWake, min(g_pool.nThreads, nBands - 1), NULL);
+
+	_RunBands();
+
+	WaitForSingleObject(g_pool.hDone, INFINITE);
+
+	InterlockedExchange64(&g_pool.iClaim, (LONGLONG)g_pool.iGeneration << (2 * BAND_BITS));
+
+	LeaveCriticalSection(&g_pool.cs);
+	InterlockedExchange(&g_pool.bBusy, 0);
 }
 
 
-int UnpackQuote(char* psz)
+// rows per band for the given row size
+static int _BandRows(int iRowSize)
 {
-	int i, j;
+	return max(BAND_SIZE / max(iRowSize, 1), 1);
+}
 
-	i = (int)strlen(psz);
 
-	if (i >= 2) // XXX:
-	{
-		if ((psz[0] == '\"') && (psz[i-1] == '\"'))
-		{
-			i -= 2;
+//
+// ascii case folding
+//
 
-			for (j = i; j > 0; j--)
-			{
-				psz[j-1] = psz[j];
-			}
+// locale free, only A-Z and a-z are folded, the simd paths read 16 bytes unaligned
+// wherever that can't cross into the next page and fall back to a char at a time near one
 
-			psz[i] = '\0';
-		}
-	}
+#ifndef NO_OVERREAD
+#define PAGE_SAFE_16(p) ((((size_t)(p)) & 4095) <= 4096 - 16)
+#else
+#define PAGE_SAFE_16(p) false
+#endif
 
-	return i;
+#ifdef USE_SSE
+
+static __m128i _FoldAscii_SSE2(__m128i v)
+{
+	__m128i m;
+
+	m = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+	return _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(0x20)));
 }
 
 
-int ParseLine(int argcMax, char* argv[], char* psz, const char* pszDelimiters, char** ppszEndPtr)
+static __m128i _FoldAsciiW_SSE2(__m128i v)
 {
-	int argc;
-	char* pszIndent;
-	char* pszQuoteStart;
-	char* pszQuoteEnd;
-	bool bSolid;
-	bool bMoreArgs;
-	int nQuotes;
-	int c;
-	int i;
-	//int n;
+	__m128i m;
 
-	argc = 0;
-	pszIndent = psz;
-	pszQuoteStart = NULL;
-	pszQuoteEnd = NULL;
-	bSolid = false;
-	bMoreArgs = false;
-	nQuotes = 0;
+	m = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16('A' - 1)), _mm_cmplt_epi16(v, _mm_set1_epi16('Z' + 1)));
 
-	for (i = 0; ; i++)
-	{
-		c = psz[i];
+	return _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi16(0x20)));
+}
 
-		if (c == '\"')
-		{
-			if (!bSolid)
-			{
-				pszQuoteStart = &psz[i];
-				bSolid = TRUE;
-			}
-			else
-			{
-				pszQuoteEnd = &psz[i];
-				bSolid = FALSE;
-				nQuotes++;
-			}
+#endif
 
-			continue;
-		}
 
-		if (!bSolid)
+static unsigned int _FoldAscii(unsigned int c)
+{
+	return ((c >= 'A') && (c <= 'Z'))? c + ('a' - 'A'): c;
+}
+
+
+// the first char that differs or ends psz2 decides, a prefix may end anywhere in psz1
+
+static bool_t _AsciiStrCmp(const char* psz1, const char* psz2, bool_t bPrefix)
+{
+	unsigned int c1;
+	unsigned int c2;
+	int i;
+	int j;
+#ifdef USE_SSE
+	__m128i a;
+	__m128i b;
+	unsigned int mDiff;
+	unsigned int mEnd;
+	unsigned int m;
+#endif
+
+	for (i = 0; ; i += 16)
+	{
+#ifdef USE_SSE
+		if (PAGE_SAFE_16(&psz1[i]) && PAGE_SAFE_16(&psz2[i]))
 		{
-			if ((c == '\0') || IsChar(c, pszDelimiters))
-			{
-				if (argc < argcMax)
-				{
-					psz[i] = '\0';
+			a = _mm_loadu_si128((const __m128i*)&psz1[i]);
+			b = _mm_loadu_si128((const __m128i*)&psz2[i]);
 
-					// cut quotes
-					if ((pszQuoteStart == pszIndent) && (pszQuoteEnd == &psz[i-1]))
-					{
-						if (nQuotes == 1)   // filter multiple quotation
-						{
-							pszIndent++;
-							*pszQuoteStart = '\0';
-							*pszQuoteEnd = '\0';
-						}
-					}
+			mDiff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_FoldAscii_SSE2(a), _FoldAscii_SSE2(b))) & 0xFFFF;
+			mEnd = _mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_setzero_si128()));
 
-					argv[argc] = pszIndent;
-					pszIndent = &psz[i+1];
-				}
-				else
-				{
-					if (argcMax != 0)
-					{
-						bMoreArgs = true;
-						break;
-					}
-				}
+			m = mDiff | mEnd;
 
-				argc++;
+			if (m != 0)
+			{
+				m &= 0 - m;
 
-				nQuotes = 0;
+				return ((mEnd & m) != 0) && (bPrefix || ((mDiff & m) == 0));
 			}
-		}
 
-		if (c == '\0')
-		{
-			break;
+			continue;
 		}
-	}
+#endif
 
-	if (ppszEndPtr != NULL)
-	{
-		if (bMoreArgs)
-		{
-			(*ppszEndPtr) = pszIndent;
-		}
-		else
+		for (j = i; j < i + 16; j++)
 		{
-			(*ppszEndPtr) = NULL;
+			c1 = _FoldAscii((byte_t)psz1[j]);
+			c2 = _FoldAscii((byte_t)psz2[j]);
+
+			if (c2 == '\0')
+			{
+				return (bPrefix || (c1 == '\0'));
+			}
+
+			if (c1 != c2)
+			{
+				return false;
+			}
 		}
 	}
-
-	return argc;
 }
 
 
-// the buffer must be allocated by ReadFileToBuffer()
-// or must include 0 at the [iSize] position
-void ParseBuffer(char* buffer, int iSize, PFLINECALLBACK pfnLineCallback, void* param)
+static bool_t _AsciiStrCmpW(const wchar_t* psz1, const wchar_t* psz2, bool_t bPrefix)
 {
-	char* pszLine;
+	unsigned int c1;
+	unsigned int c2;
 	int i;
-
-	pszLine = buffer;
-
-	for (i = 0; i <= iSize; i++)
+	int j;
+#ifdef USE_SSE
+	__m128i a;
+	__m128i b;
+	unsigned int mDiff;
+	unsigned int mEnd;
+	unsigned int m;
+#endif
+
+	for (i = 0; ; i += 8)
 	{
-		if ((buffer[i] == '\n') || (buffer[i] == '\0'))
+#ifdef USE_SSE
+		if ((sizeof(wchar_t) == 2) && PAGE_SAFE_16(&psz1[i]) && PAGE_SAFE_16(&psz2[i]))
 		{
-			buffer[i] = '\0';
+			a = _mm_loadu_si128((const __m128i*)&psz1[i]);
+			b = _mm_loadu_si128((const __m128i*)&psz2[i]);
+
+			// two mask bits per char
+			mDiff = ~_mm_movemask_epi8(_mm_cmpeq_epi16(_FoldAsciiW_SSE2(a), _FoldAsciiW_SSE2(b))) & 0xFFFF;
+			mEnd = _mm_movemask_epi8(_mm_cmpeq_epi16(b, _mm_setzero_si128()));
 
-			if (!pfnLineCallback(pszLine, param))
+			m = mDiff | mEnd;
+
+			if (m != 0)
 			{
-				break;
+				m &= 0 - m;
+
+				return ((mEnd & m) != 0) && (bPrefix || ((mDiff & m) == 0));
 			}
 
-			pszLine = &buffer[i+1];
+			continue;
 		}
-		else if (buffer[i] == '\r')
+#endif
+
+		for (j = i; j < i + 8; j++)
 		{
-			buffer[i] = '\0';
+			c1 = _FoldAscii((unsigned int)psz1[j]);
+			c2 = _FoldAscii((unsigned int)psz2[j]);
+
+			if (c2 == '\0')
+			{
+				return (bPrefix || (c1 == '\0'));
+			}
+
+			if (c1 != c2)
+			{
+				return false;
+			}
 		}
 	}
 }
 
 
-long _StreamSize(FILE* stream)
+bool_t AsciiStrEq(const char* psz1, const char* psz2)
 {
-	long iSize;
-	
-	fseek(stream, 0, SEEK_END);
+	return _AsciiStrCmp(psz1, psz2, false);
+}
 
-	iSize = ftell(stream);
 
-	fseek(stream, 0, SEEK_SET);
+bool_t AsciiStrPrefix(const char* psz, const char* pszPrefix)
+{
+	return _AsciiStrCmp(psz, pszPrefix, true);
+}
 
-	return iSize;
+
+bool_t AsciiStrEqW(const wchar_t* psz1, const wchar_t* psz2)
+{
+	return _AsciiStrCmpW(psz1, psz2, false);
 }
 
 
-char* _ReadStreamToBuffer(FILE* stream, int* piSize)
+bool_t AsciiStrPrefixW(const wchar_t* psz, const wchar_t* pszPrefix)
 {
-	char* buffer;
-	int iSize;
+	return _AsciiStrCmpW(psz, pszPrefix, true);
+}
 
-	iSize = _StreamSize(stream);
 
-	if (iSize != 0)
-	{
-		buffer = (char*)AllocMemory(iSize + 1);
+// the hash takes the folded string 16 bytes at a time, zero padded, so it does not
+// depend on alignment or on which path made the block
 
-		if (buffer != NULL)
-		{
-			if (fread(buffer, iSize, 1, stream))
-			{
-				buffer[iSize] = '\0';
+static ULONGLONG _HashBlock(ULONGLONG h, const byte_t* p)
+{
+	ULONGLONG a[2];
 
-				*piSize = iSize;
+	memcpy(a, p, sizeof(a));
 
-				return buffer;
-			}
+	h = (h ^ a[0]) * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	h = (h ^ a[1]) * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
 
-			FreeMemory(buffer);
-		}
-	}
+	return h;
+}
 
-	return NULL;
+
+static unsigned int _HashFinish(ULONGLONG h, int iLength)
+{
+	h ^= (ULONGLONG)iLength;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+
+	return (unsigned int)h;
 }
 
 
-char* ReadFileToBuffer(const char* pszFileName, int* piSize)
+unsigned int AsciiStrHash(const char* psz)
 {
-	FILE* stream = fopen(pszFileName, "rb");
+	ULONGLONG h = 0;
+	byte_t ab[16];
+	int i;
+	int j;
+#ifdef USE_SSE
+	__m128i v;
+	unsigned int mEnd;
+#endif
 
-	if (stream != NULL)
+	for (i = 0; ; i += 16)
 	{
-		char* buffer = _ReadStreamToBuffer(stream, piSize);
-
-		if (buffer != NULL)
+#ifdef USE_SSE
+		if (PAGE_SAFE_16(&psz[i]))
 		{
-			fclose(stream);
+			v = _mm_loadu_si128((const __m128i*)&psz[i]);
+			mEnd = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+			if (mEnd != 0)
+			{
+				// clear what follows the terminator
+				j = _LowestBit(mEnd);
+				v = _mm_and_si128(v, _mm_cmplt_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm_set1_epi8((char)j)));
+			}
+
+			_mm_storeu_si128((__m128i*)ab, _FoldAscii_SSE2(v));
+			h = _HashBlock(h, ab);
+
+			if (mEnd != 0)
+			{
+				return _HashFinish(h, i + j);
+			}
 
-			return buffer;
+			continue;
 		}
+#endif
 
-		fclose(stream);
-	}
+		for (j = 0; (j < 16) && (psz[i + j] != '\0'); j++)
+		{
+			ab[j] = (byte_t)_FoldAscii((byte_t)psz[i + j]);
+		}
 
-	return NULL;
+		memset(&ab[j], 0, 16 - j);
+		h = _HashBlock(h, ab);
+
+		if (j < 16)
+		{
+			return _HashFinish(h, i + j);
+		}
+	}
 }
 
 
-char* ReadFileToBufferW(const wchar_t* pszFileName, int* piSize)
+unsigned int AsciiStrHashW(const wchar_t* psz)
 {
-	FILE* stream = _wfopen(pszFileName, L"rb");
+	ULONGLONG h = 0;
+	WORD aw[8];
+	int i;
+	int j;
+#ifdef USE_SSE
+	__m128i v;
+	unsigned int mEnd;
+#endif
 
-	if (stream != NULL)
+	for (i = 0; ; i += 8)
 	{
-		char* buffer = _ReadStreamToBuffer(stream, piSize);
-
-		if (buffer != NULL)
+#ifdef USE_SSE
+		if ((sizeof(wchar_t) == 2) && PAGE_SAFE_16(&psz[i]))
 		{
-			fclose(stream);
+			v = _mm_loadu_si128((const __m128i*)&psz[i]);
+			mEnd = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+
+			if (mEnd != 0)
+			{
+				j = _LowestBit(mEnd) / 2;
+				v = _mm_and_si128(v, _mm_cmplt_epi16(_mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7), _mm_set1_epi16((short)j)));
+			}
+
+			_mm_storeu_si128((__m128i*)aw, _FoldAsciiW_SSE2(v));
+			h = _HashBlock(h, (const byte_t*)aw);
+
+			if (mEnd != 0)
+			{
+				return _HashFinish(h, i + j);
+			}
+
+			continue;
+		}
+#endif
 
-			return buffer;
+		for (j = 0; (j < 8) && (psz[i + j] != '\0'); j++)
+		{
+			aw[j] = (WORD)_FoldAscii((unsigned int)psz[i + j]);
 		}
 
-		fclose(stream);
-	}
+		memset(&aw[j], 0, (8 - j) * sizeof(WORD));
+		h = _HashBlock(h, (const byte_t*)aw);
 
-	return NULL;
+		if (j < 8)
+		{
+			return _HashFinish(h, i + j);
+		}
+	}
 }
 
 
-bool_t SaveToFile(const char* pszFileName, void* buffer, int iSize)
+//
+// string interning
+//
+
+#define STRING_CHUNK_SIZE 65536 // arena block, longer strings get their own
+
+typedef struct strchunk_s
 {
-	bool_t bSuccess;
-	FILE* stream;
+	struct strchunk_s* pNext;
+	int iUsed;
+	int iSize;
+	char data[1];
+} strchunk_t;
 
-	bSuccess = false;
+typedef struct strslot_s
+{
+	const char* psz; // NULL if empty
+	unsigned int iHash;
+	int iLength;
+} strslot_t;
 
-	stream = fopen(pszFileName, "wb");
+struct strtable_s
+{
+	CRITICAL_SECTION cs;
+	bool_t bIgnoreCase;
+	strslot_t* aSlots;
+	int iSlotMask;
+	int nStrings;
+	strchunk_t* pChunks;
+};
 
-	if (stream != NULL)
+
+static unsigned int _HashStringN(const char* psz, int iLength, bool_t bIgnoreCase)
+{
+	unsigned int h = 2166136261u;
+	int c;
+	int i;
+
+	for (i = 0; i < iLength; i++)
 	{
-		if (fwrite(buffer, iSize, 1, stream))
+		c = (byte_t)psz[i];
+
+		if (bIgnoreCase && (c >= 'A') && (c <= 'Z'))
 		{
-			bSuccess = true;
+			c += 'a' - 'A';
 		}
 
-		fclose(stream);
+		h = (h ^ c) * 16777619u;
 	}
 
-	return bSuccess;
+	return h;
 }
 
 
-bool_t ParseFile(const char* pszFileName, PFLINECALLBACK pfnLineCallback, void* param)
+static bool_t _StrEqN(const char* psz1, const char* psz2, int iLength, bool_t bIgnoreCase)
 {
-	char* buffer;
-	int iSize;
+	int c1;
+	int c2;
+	int i;
 
-	buffer = ReadFileToBuffer(pszFileName, &iSize);
+	if (!bIgnoreCase)
+	{
+		return (memcmp(psz1, psz2, iLength) == 0);
+	}
 
-	if (buffer != NULL)
+	for (i = 0; i < iLength; i++)
 	{
-		ParseBuffer(buffer, iSize, pfnLineCallback, param);
+		c1 = (byte_t)psz1[i];
+		c2 = (byte_t)psz2[i];
 
-		FreeMemory(buffer);
+		if ((c1 >= 'A') && (c1 <= 'Z'))
+		{
+			c1 += 'a' - 'A';
+		}
 
-		return true;
+		if ((c2 >= 'A') && (c2 <= 'Z'))
+		{
+			c2 += 'a' - 'A';
+		}
+
+		if (c1 != c2)
+		{
+			return false;
+		}
 	}
 
-	return false;
+	return true;
 }
 
 
-bool_t ParseFileW(const wchar_t* pszFileName, PFLINECALLBACK pfnLineCallback, void* param)
+strtable_t* CreateStringTable(bool_t bIgnoreCase)
 {
-	char* buffer;
-	int iSize;
-
-	buffer = ReadFileToBufferW(pszFileName, &iSize);
+	strtable_t* pst = (strtable_t*)AllocMemory(sizeof(strtable_t));
 
-	if (buffer != NULL)
+	if (pst == NULL)
 	{
-		ParseBuffer(buffer, iSize, pfnLineCallback, param);
+		return NULL;
+	}
 
-		FreeMemory(buffer);
+	memset(pst, 0, sizeof(strtable_t));
+	InitializeCriticalSection(&pst->cs);
+	pst->bIgnoreCase = bIgnoreCase;
+	pst->iSlotMask = 1023;
+	pst->aSlots = (strslot_t*)AllocMemory((pst->iSlotMask + 1) * sizeof(strslot_t));
 
-		return true;
+	if (pst->aSlots == NULL)
+	{
+		FreeStringTable(pst);
+		return NULL;
 	}
 
-	return false;
+	memset(pst->aSlots, 0, (pst->iSlotMask + 1) * sizeof(strslot_t));
+
+	return pst;
 }
 
 
-bool_t ParseDirectory(const char* pszPath, bool_t bSubDirs, PDFILECALLBACK pfnFileCallback, void* param)
+static bool_t _GrowStringTable(strtable_t* pst)
 {
-	HANDLE hFind;
-	WIN32_FIND_DATA fd;
-	char szSearchPath[MAX_PATH];
-	char szFileName[MAX_PATH];
+	strslot_t* aSlots;
+	int iSlotMask;
 	int i;
+	int j;
 
-	sprintf(szSearchPath, "%s\\*", pszPath);
+	iSlotMask = pst->iSlotMask * 2 + 1;
+	aSlots = (strslot_t*)AllocMemory((iSlotMask + 1) * sizeof(strslot_t));
 
-	hFind = FindFirstFile(szSearchPath, &fd);
-	if (hFind != INVALID_HANDLE_VALUE)
+	if (aSlots == NULL)
 	{
-		do
-		{
-			i = 0;
-			while (fd.cFileName[i] == '.')
-			{
-				i++;
-			}
-			if (fd.cFileName[i] == '\0')
-			{
-				continue;
-			}
+		return false;
+	}
 
-			sprintf(szFileName, "%s\\%s", pszPath, fd.cFileName);
+	memset(aSlots, 0, (iSlotMask + 1) * sizeof(strslot_t));
 
-			if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			{
-				if (bSubDirs)
-				{
-					ParseDirectory(szFileName, bSubDirs, pfnFileCallback, param);
-				}
-			}
-			else
-			{
-				pfnFileCallback(szFileName, &fd, param);
-			}
+	for (i = 0; i <= pst->iSlotMask; i++)
+	{
+		if (pst->aSlots[i].psz != NULL)
+		{
+			for (j = pst->aSlots[i].iHash & iSlotMask; aSlots[j].psz != NULL; j = (j + 1) & iSlotMask)
+				;
+
+			aSlots[j] = pst->aSlots[i];
 		}
-		while (FindNextFile(hFind, &fd));
+	}
 
-		FindClose(hFind);
+	FreeMemory(pst->aSlots);
 
-		return true;
-	}
+	pst->aSlots = aSlots;
+	pst->iSlotMask = iSlotMask;
 
-	return false;
+	return true;
 }
 
 
-//
-// bitmap support
-//
-
-/*
-bool_t LoadBitmapFromFile(const char* pszFileName, bitmap_t* pbmp)
+static char* _AllocFromStringArena(strtable_t* pst, int iSize)
 {
-	FILE* stream;
-	bool_t bSuccess = false;
-	int i;
-
-	memset(pbmp, 0, sizeof(bitmap_t));
-
-	stream = fopen(pszFileName, "rb");
+	strchunk_t* pChunk = pst->pChunks;
 
-	if (stream != NULL)
+	if ((pChunk == NULL) || (pChunk->iUsed + iSize > pChunk->iSize))
 	{
-		BITMAPFILEHEADER bmf;
-		BITMAPINFOHEADER bmi;
+		pChunk = (strchunk_t*)AllocMemory(sizeof(strchunk_t) + max(iSize, STRING_CHUNK_SIZE));
 
-		fread(&bmf, sizeof(BITMAPFILEHEADER), 1, stream);
-
-		if (bmf.bfType == 'MB')
+		if (pChunk == NULL)
 		{
-			fread(&bmi, sizeof(BITMAPINFOHEADER), 1, stream);
-			
-			if (bmi.biCompression == BI_RGB)
-			{
-				if ((bmi.biBitCount == 8) || (bmi.biBitCount == 24) || (bmi.biBitCount == 32))
-				{
-					pbmp->iWidth = bmi.biWidth;
-					pbmp->iHeight = (bmi.biHeight > 0)? bmi.biHeight: -bmi.biHeight;
-					pbmp->nBPP = bmi.biBitCount / 8;
-					pbmp->iPitch = DWORD_ALIGNED(pbmp->iWidth * pbmp->nBPP);
-					pbmp->pixels = (byte_t*)AllocMemory(pbmp->iPitch * pbmp->iHeight);
-
-					if (pbmp->nBPP == 1)
-					{
-						pbmp->nColors = (bmi.biClrUsed == 0)? 256: bmi.biClrUsed;
-						pbmp->pal = (RGBQUAD*)AllocMemory(pbmp->nColors * sizeof(RGBQUAD));
-						fread(pbmp->pal, pbmp->nColors * sizeof(RGBQUAD), 1, stream);
-					}
-
-					fseek(stream, bmf.bfOffBits, SEEK_SET);
+			return NULL;
+		}
 
-					if (bmi.biHeight > 0)
-					{
-						for (i = 0; i < pbmp->iHeight; i++)
-						{
-							fread(&pbmp->pixels[((pbmp->iHeight - 1) - i) * pbmp->iPitch], pbmp->iPitch, 1, stream);
-						}
-					}
-					else
-					{
-						for (i = 0; i < pbmp->iHeight; i++)
-						{
-							fread(&pbmp->pixels[i * pbmp->iPitch], pbmp->iPitch, 1, stream);
-						}
-					}
+		pChunk->iUsed = 0;
+		pChunk->iSize = max(iSize, STRING_CHUNK_SIZE);
 
-					bSuccess = true;
-				}
-			}
+		// an oversized string must not waste the space left in the current chunk
+		if ((iSize > STRING_CHUNK_SIZE) && (pst->pChunks != NULL))
+		{
+			pChunk->pNext = pst->pChunks->pNext;
+			pst->pChunks->pNext = pChunk;
+		}
+		else
+		{
+			pChunk->pNext = pst->pChunks;
+			pst->pChunks = pChunk;
 		}
-
-		fclose(stream);
 	}
 
-	return bSuccess;
+	pChunk->iUsed += iSize;
+
+	return &pChunk->data[pChunk->iUsed - iSize];
 }
 
-void FreeBitmap(bitmap_t* pbmp)
+
+// slot of the string or the empty one to put it in, the caller holds the lock
+
+static int _FindStringSlot(strtable_t* pst, const char* psz, int iLength, unsigned int iHash)
 {
-	if (pbmp->pixels != NULL)
-	{
-		FreeMemory(pbmp->pixels);
-	}
+	strslot_t* pSlot;
+	int i;
 
-	if (pbmp->nBPP == 1)
+	for (i = iHash & pst->iSlotMask; pst->aSlots[i].psz != NULL; i = (i + 1) & pst->iSlotMask)
 	{
-		if (pbmp->pal != NULL)
+		pSlot = &pst->aSlots[i];
+
+		if ((pSlot->iHash == iHash) && (pSlot->iLength == iLength) && _StrEqN(pSlot->psz, psz, iLength, pst->bIgnoreCase))
 		{
-			FreeMemory(pbmp->pal);
+			break;
 		}
 	}
+
+	return i;
 }
-*/
 
-bitmap_t* AllocBitmap( int iWidth, int iHeight, int nBPP, int nColors )
+
+// the first iLength chars of psz, they may contain no '\0'
+// NULL if out of memory
+
+const char* InternStringN(strtable_t* pst, const char* psz, int iLength)
 {
-	bitmap_t* pbmp = (bitmap_t*)AllocMemory( sizeof(bitmap_t) );
+	strslot_t* pSlot;
+	char* pszCopy;
+	unsigned int iHash;
 
-	pbmp->iWidth = iWidth;
-	pbmp->iHeight = iHeight;
-	pbmp->nBPP = nBPP;
-	pbmp->iPitch = DWORD_ALIGNED(pbmp->iWidth * pbmp->nBPP);
-	pbmp->pixels = (byte_t*)AllocMemory(pbmp->iPitch * pbmp->iHeight);
+	iHash = _HashStringN(psz, iLength, pst->bIgnoreCase);
 
-	if ( nColors )
+	EnterCriticalSection(&pst->cs);
+
+	pSlot = &pst->aSlots[_FindStringSlot(pst, psz, iLength, iHash)];
+	pszCopy = (char*)pSlot->psz;
+
+	// keep the table at most half full, one that can't grow takes no new strings,
+	// a full one would never find an empty slot
+	if ((pszCopy == NULL) && ((pst->nStrings + 1) * 2 > pst->iSlotMask))
 	{
-		pbmp->nColors = nColors;
-		pbmp->pal = (RGBQUAD*)AllocMemory(pbmp->nColors * sizeof(RGBQUAD));
+		pSlot = _GrowStringTable(pst)? &pst->aSlots[_FindStringSlot(pst, psz, iLength, iHash)]: NULL;
 	}
-	else
+
+	if ((pszCopy == NULL) && (pSlot != NULL))
 	{
-		pbmp->nColors = 0;
-		pbmp->pal = NULL;
-	}
+		pszCopy = _AllocFromStringArena(pst, iLength + 1);
 
-	return pbmp;
-}
+		if (pszCopy != NULL)
+		{
+			memcpy(pszCopy, psz, iLength);
+			pszCopy[iLength] = '\0';
 
+			pSlot->psz = pszCopy;
+			pSlot->iHash = iHash;
+			pSlot->iLength = iLength;
 
-bitmap_t* LoadBitmapFromFile(const char* pszFileName)
-{
-	FILE* stream;
-	bitmap_t* pbmp = NULL;
-	int i;
+			pst->nStrings++;
+		}
+	}
 
-	//memset(pbmp, 0, sizeof(bitmap_t));
+	LeaveCriticalSection(&pst->cs);
 
-	stream = fopen(pszFileName, "rb");
+	return pszCopy;
+}
 
-	if (stream != NULL)
-	{
-		BITMAPFILEHEADER bmf;
-		BITMAPINFOHEADER bmi;
 
-		fread(&bmf, sizeof(BITMAPFILEHEADER), 1, stream);
+// NULL if the string was never interned
 
-		if (bmf.bfType == 'MB')
-		{
-			fread(&bmi, sizeof(BITMAPINFOHEADER), 1, stream);
-			
-			if (bmi.biCompression == BI_RGB)
-			{
-				if ((bmi.biBitCount == 8) || (bmi.biBitCount == 24) || (bmi.biBitCount == 32))
-				{
-					// XXX: i'm too lazy to change this code to use AllocBitmap currently...
-					pbmp = (bitmap_t*)AllocMemory( sizeof(bitmap_t) );
-					pbmp->iWidth = bmi.biWidth;
-					pbmp->iHeight = (bmi.biHeight > 0)? bmi.biHeight: -bmi.biHeight;
-					pbmp->nBPP = bmi.biBitCount / 8;
-					pbmp->iPitch = DWORD_ALIGNED(pbmp->iWidth * pbmp->nBPP);
-					pbmp->pixels = (byte_t*)AllocMemory(pbmp->iPitch * pbmp->iHeight);
+static const char* _FindInternedStringN(strtable_t* pst, const char* psz, int iLength)
+{
+	const char* pszFound;
+	unsigned int iHash;
 
-					if (pbmp->nBPP == 1)
-					{
-						pbmp->nColors = (bmi.biClrUsed == 0)? 256: bmi.biClrUsed;
-						pbmp->pal = (RGBQUAD*)AllocMemory(pbmp->nColors * sizeof(RGBQUAD));
-						fread(pbmp->pal, pbmp->nColors * sizeof(RGBQUAD), 1, stream);
-					}
+	iHash = _HashStringN(psz, iLength, pst->bIgnoreCase);
 
-					fseek(stream, bmf.bfOffBits, SEEK_SET);
+	EnterCriticalSection(&pst->cs);
 
-					if (bmi.biHeight > 0)
-					{
-						for (i = 0; i < pbmp->iHeight; i++)
-						{
-							fread(&pbmp->pixels[((pbmp->iHeight - 1) - i) * pbmp->iPitch], pbmp->iPitch, 1, stream);
-						}
-					}
-					else
-					{
-						for (i = 0; i < pbmp->iHeight; i++)
-						{
-							fread(&pbmp->pixels[i * pbmp->iPitch], pbmp->iPitch, 1, stream);
-						}
-					}
-				}
-			}
-		}
+	pszFound = pst->aSlots[_FindStringSlot(pst, psz, iLength, iHash)].psz;
 
-		fclose(stream);
-	}
+	LeaveCriticalSection(&pst->cs);
 
-	return pbmp;
+	return pszFound;
 }
 
 
-void FreeBitmap(bitmap_t* pbmp)
+const char* InternString(strtable_t* pst, const char* psz)
 {
-	if (pbmp->pixels != NULL)
+	return InternStringN(pst, psz, (int)strlen(psz));
+}
+
+
+void FreeStringTable(strtable_t* pst)
+{
+	strchunk_t* pChunk;
+
+	while (pst->pChunks != NULL)
 	{
-		FreeMemory(pbmp->pixels);
+		pChunk = pst->pChunks;
+		pst->pChunks = pChunk->pNext;
+
+		FreeMemory(pChunk);
 	}
 
-	if (pbmp->nBPP == 1)
+	if (pst->aSlots != NULL)
 	{
-		if (pbmp->pal != NULL)
-		{
-			FreeMemory(pbmp->pal);
-		}
+		FreeMemory(pst->aSlots);
 	}
 
-	FreeMemory( pbmp );
+	DeleteCriticalSection(&pst->cs);
+
+	FreeMemory(pst);
 }
 
-/*
-void GenerateGrayscalePal(RGBQUAD* pa)
+
+//
+// utf-8 and utf-16
+//
+
+// one code point from psz, returns its length or 0 if it is not valid utf-8
+// (overlong forms, surrogates and values over 0x10FFFF are not)
+
+static int _DecodeUtf8(const byte_t* psz, int iLength, unsigned int* pc)
 {
+	unsigned int c = psz[0];
+	unsigned int iMin;
+	int n;
 	int i;
 
-	for (i = 0; i < 256; i++)
+	if (c < 0x80)
 	{
-		pa[i].rgbRed = pa[i].rgbGreen = pa[i].rgbRed = (unsigned)i;
-		pa[i].rgbReserved = 255;
+		*pc = c;
+		return 1;
 	}
-}
-*/
-
-bool_t SaveBitmap(const char* pszFileName, bitmap_t* pbmp)
-{
-	FILE* stream;
+	else if ((c >= 0xC2) && (c <= 0xDF))
+	{
+		n = 2;
+		c &= 0x1F;
+		iMin = 0x80;
+	}
+	else if ((c >= 0xE0) && (c <= 0xEF))
+	{
+		n = 3;
+		c &= 0x0F;
+		iMin = 0x800;
+	}
+	else if ((c >= 0xF0) && (c <= 0xF4))
+	{
+		n = 4;
+		c &= 0x07;
+		iMin = 0x10000;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if (n > iLength)
+	{
+		return 0;
+	}
+
+	for (i = 1; i < n; i++)
+	{
+		if ((psz[i] & 0xC0) != 0x80)
+		{
+			return 0;
+		}
+
+		c = (c << 6) | (psz[i] & 0x3F);
+	}
+
+	if ((c < iMin) || (c > 0x10FFFF) || ((c >= 0xD800) && (c <= 0xDFFF)))
+	{
+		return 0;
+	}
+
+	*pc = c;
+
+	return n;
+}
+
+
+#ifdef USE_SSE
+
+// keiser and lemire's lookup validation, each byte is checked against the three before it
+// with three nibble lookups, the bits say which errors each nibble allows
+
+#define U8_TOO_SHORT 0x01
+#define U8_TOO_LONG 0x02
+#define U8_OVERLONG_3 0x04
+#define U8_TOO_LARGE 0x08
+#define U8_SURROGATE 0x10
+#define U8_OVERLONG_2 0x20
+#define U8_TOO_LARGE_1000 0x40
+#define U8_OVERLONG_4 0x40
+#define U8_TWO_CONTS 0x80
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+// 16 bytes per step, returns the char boundary the scalar check has to go on from,
+// at or before the first block with an error
+
+TARGET_SSSE3 static int _ValidateUtf8_SSSE3(const byte_t* psz, int iLength)
+{
+	__m128i lut1;
+	__m128i lut2;
+	__m128i lut3;
+	__m128i incomplete;
+	__m128i nibble;
+	__m128i v;
+	__m128i prev;
+	__m128i prev1;
+	__m128i err;
+	int i;
+	int k;
+
+	lut1 = _mm_setr_epi8(
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		(char)U8_TWO_CONTS, (char)U8_TWO_CONTS, (char)U8_TWO_CONTS, (char)U8_TWO_CONTS,
+		U8_TOO_SHORT | U8_OVERLONG_2,
+		U8_TOO_SHORT,
+		U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+		U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+
+	lut2 = _mm_setr_epi8(
+		(char)(U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4),
+		(char)(U8_CARRY | U8_OVERLONG_2),
+		(char)U8_CARRY,
+		(char)U8_CARRY,
+		(char)(U8_CARRY | U8_TOO_LARGE),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+		(char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000));
+
+	lut3 = _mm_setr_epi8(
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		(char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4),
+		(char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE),
+		(char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+		(char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+
+	// a lead in the last three bytes that still wants continuations
+	incomplete = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		(char)0xEF, (char)0xDF, (char)0xBF);
+
+	nibble = _mm_set1_epi8(0x0F);
+	prev = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= iLength; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i*)&psz[i]);
+
+		if (_mm_movemask_epi8(v) == 0)
+		{
+			err = _mm_subs_epu8(prev, incomplete);
+		}
+		else
+		{
+			prev1 = _mm_alignr_epi8(v, prev, 15);
+
+			err = _mm_and_si128(_mm_and_si128(
+				_mm_shuffle_epi8(lut1, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+				_mm_shuffle_epi8(lut2, _mm_and_si128(prev1, nibble))),
+				_mm_shuffle_epi8(lut3, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+
+			// third and fourth bytes must be the continuations that two_conts flagged
+			err = _mm_xor_si128(err, _mm_and_si128(_mm_or_si128(
+				_mm_subs_epu8(_mm_alignr_epi8(v, prev, 14), _mm_set1_epi8(0xE0 - 0x80)),
+				_mm_subs_epu8(_mm_alignr_epi8(v, prev, 13), _mm_set1_epi8(0xF0 - 0x80))),
+				_mm_set1_epi8((char)0x80)));
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) != 0xFFFF)
+		{
+			break;
+		}
+
+		prev = v;
+	}
+
+	// back to the lead of a char the block boundary may have cut
+	for (k = 1; (k <= 3) && (k <= i); k++)
+	{
+		if ((psz[i - k] & 0xC0) != 0x80)
+		{
+			return (psz[i - k] >= 0xC0)? i - k: i;
+		}
+	}
+
+	return i;
+}
+
+#endif
+
+
+// returns the length of the valid utf-8 prefix, that is iLength (or strlen) for valid text
+
+int ValidateUtf8(const char* psz, int iLength)
+{
+	const byte_t* pb = (const byte_t*)psz;
+	unsigned int c;
+	int n;
+	int i = 0;
+
+	if (iLength < 0)
+	{
+		iLength = (int)strlen(psz);
+	}
+
+#ifdef USE_SSE
+	if (_GetCpuFeatures() & CPU_SSSE3)
+	{
+		i = _ValidateUtf8_SSSE3(pb, iLength);
+	}
+#endif
+
+	while (i < iLength)
+	{
+		if (!(pb[i] & 0x80))
+		{
+			i += _WidenAscii(&psz[i], iLength - i, NULL);
+			continue;
+		}
+
+		n = _DecodeUtf8(&pb[i], iLength - i, &c);
+
+		if (n == 0)
+		{
+			break;
+		}
+
+		i += n;
+	}
+
+	return i;
+}
+
+
+// iLength -1 for a terminated string, pszDst NULL to get the length,
+// iDstSize counts the terminator that is always written,
+// returns the length, UERR_FORMAT if psz is not valid or UERR_OVERFLOW
+
+int Utf8ToUtf16(const char* psz, int iLength, wchar_t* pszDst, int iDstSize)
+{
+	const byte_t* pb = (const byte_t*)psz;
+	unsigned int c;
+	int n;
+	int i;
+	int j;
+
+	if (iLength < 0)
+	{
+		iLength = (int)strlen(psz);
+	}
+
+	for (i = 0, j = 0; i < iLength; )
+	{
+		// runs of ascii go straight through
+		if (!(pb[i] & 0x80))
+		{
+			n = min(iLength - i, (pszDst != NULL)? iDstSize - 1 - j: INT_MAX);
+			n = _WidenAscii(&psz[i], n, (pszDst != NULL)? &pszDst[j]: NULL);
+
+			if (n == 0)
+			{
+				return UERR_OVERFLOW;
+			}
+
+			i += n;
+			j += n;
+
+			continue;
+		}
+
+		n = _DecodeUtf8(&pb[i], iLength - i, &c);
+
+		if (n == 0)
+		{
+			return UERR_FORMAT;
+		}
+
+		i += n;
+
+		if (pszDst != NULL)
+		{
+			if (j + ((c >= 0x10000)? 2: 1) > iDstSize - 1)
+			{
+				return UERR_OVERFLOW;
+			}
+
+			if (c >= 0x10000)
+			{
+				c -= 0x10000;
+				pszDst[j++] = (wchar_t)(0xD800 | (c >> 10));
+				pszDst[j++] = (wchar_t)(0xDC00 | (c & 0x3FF));
+			}
+			else
+			{
+				pszDst[j++] = (wchar_t)c;
+			}
+		}
+		else
+		{
+			j += (c >= 0x10000)? 2: 1;
+		}
+	}
+
+	if (pszDst != NULL)
+	{
+		if (iDstSize < 1)
+		{
+			return UERR_OVERFLOW;
+		}
+
+		pszDst[j] = '\0';
+	}
+
+	return j;
+}
+
+
+// same rules, lone surrogates are not valid
+
+int Utf16ToUtf8(const wchar_t* psz, int iLength, char* pszDst, int iDstSize)
+{
+	unsigned int c;
+	int n;
+	int i;
+	int j;
+
+	if (iLength < 0)
+	{
+		for (iLength = 0; psz[iLength] != '\0'; iLength++)
+			;
+	}
+
+	for (i = 0, j = 0; i < iLength; )
+	{
+		c = (unsigned int)psz[i];
+
+		if (c < 0x80)
+		{
+			n = min(iLength - i, (pszDst != NULL)? iDstSize - 1 - j: INT_MAX);
+			n = _NarrowAscii(&psz[i], n, (pszDst != NULL)? &pszDst[j]: NULL);
+
+			if (n == 0)
+			{
+				return UERR_OVERFLOW;
+			}
+
+			i += n;
+			j += n;
+
+			continue;
+		}
+
+		i++;
+
+		if ((c >= 0xD800) && (c <= 0xDBFF))
+		{
+			if ((i == iLength) || ((unsigned int)psz[i] < 0xDC00) || ((unsigned int)psz[i] > 0xDFFF))
+			{
+				return UERR_FORMAT;
+			}
+
+			c = 0x10000 + (((c & 0x3FF) << 10) | ((unsigned int)psz[i++] & 0x3FF));
+			n = 4;
+		}
+		else if ((c >= 0xDC00) && (c <= 0xDFFF))
+		{
+			return UERR_FORMAT;
+		}
+		else
+		{
+			n = (c < 0x800)? 2: 3;
+		}
+
+		if (pszDst != NULL)
+		{
+			if (j + n > iDstSize - 1)
+			{
+				return UERR_OVERFLOW;
+			}
+
+			switch (n)
+			{
+			case 2:
+				pszDst[j++] = (char)(0xC0 | (c >> 6));
+				break;
+			case 3:
+				pszDst[j++] = (char)(0xE0 | (c >> 12));
+				pszDst[j++] = (char)(0x80 | ((c >> 6) & 0x3F));
+				break;
+			default:
+				pszDst[j++] = (char)(0xF0 | (c >> 18));
+				pszDst[j++] = (char)(0x80 | ((c >> 12) & 0x3F));
+				pszDst[j++] = (char)(0x80 | ((c >> 6) & 0x3F));
+				break;
+			}
+
+			pszDst[j++] = (char)(0x80 | (c & 0x3F));
+		}
+		else
+		{
+			j += n;
+		}
+	}
+
+	if (pszDst != NULL)
+	{
+		if (iDstSize < 1)
+		{
+			return UERR_OVERFLOW;
+		}
+
+		pszDst[j] = '\0';
+	}
+
+	return j;
+}
+
+
+// NULL if psz is not valid utf-8
+
+wchar_t* AllocStringUtf16(const char* psz)
+{
+	wchar_t* pszDst;
+	int iLength;
+
+	iLength = (int)strlen(psz);
+
+	// never more units than bytes
+	pszDst = (wchar_t*)AllocMemory((iLength + 1) * sizeof(wchar_t));
+
+	if ((pszDst != NULL) && (Utf8ToUtf16(psz, iLength, pszDst, iLength + 1) < 0))
+	{
+		FreeMemory(pszDst);
+		pszDst = NULL;
+	}
+
+	return pszDst;
+}
+
+
+// NULL if psz is not valid utf-16
+
+char* AllocStringUtf8(const wchar_t* psz)
+{
+	char* pszDst;
+	int iLength;
+
+	iLength = Utf16ToUtf8(psz, -1, NULL, 0);
+
+	if (iLength < 0)
+	{
+		return NULL;
+	}
+
+	pszDst = (char*)AllocMemory(iLength + 1);
+
+	if (pszDst != NULL)
+	{
+		Utf16ToUtf8(psz, -1, pszDst, iLength + 1);
+	}
+
+	return pszDst;
+}
+
+
+//
+// path and filename funcs
+//
+
+#define IsPathSeparator(c) (((c) == '\\') || ((c) == '/'))
+//#define IsxxxFileName(s) (((s)[0] == '.') && (((s)[1] == '\0') || (((s)[1] == '.') && ((s)[2] == '\0'))))
+
+
+// length and the last separator and dot of a path in one pass, -1 if none
+
+#if defined(USE_SSE) && !defined(NO_OVERREAD)
+
+// aligned loads never cross into the next page, so reading past the '\0' is safe
+
+static int _ScanPath_SSE2(const char* psz, int* piLastSep, int* piLastDot)
+{
+	const char* p;
+	__m128i v;
+	unsigned int mValid;
+	unsigned int mZero;
+	unsigned int mSep;
+	unsigned int mDot;
+	int iBase;
+
+	p = (const char*)((size_t)psz & ~(size_t)15);
+	iBase = (int)(p - psz);
+	mValid = 0xFFFF << (psz - p);
+
+	*piLastSep = -1;
+	*piLastDot = -1;
+
+	for ( ; ; p += 16, iBase += 16, mValid = 0xFFFF)
+	{
+		v = _mm_load_si128((const __m128i*)p);
+
+		mZero = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & mValid;
+		mSep = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))) & mValid;
+		mDot = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.'))) & mValid;
+
+		if (mZero != 0)
+		{
+			// only what is before the terminator
+			mZero &= 0 - mZero;
+			mSep &= mZero - 1;
+			mDot &= mZero - 1;
+		}
+
+		if (mSep != 0)
+		{
+			*piLastSep = iBase + _HighestBit(mSep);
+		}
+
+		if (mDot != 0)
+		{
+			*piLastDot = iBase + _HighestBit(mDot);
+		}
+
+		if (mZero != 0)
+		{
+			return iBase + _LowestBit(mZero);
+		}
+	}
+}
+
+#endif // USE_SSE
+
+
+static int _ScanPath(const char* psz, int* piLastSep, int* piLastDot)
+{
+#if defined(USE_SSE) && !defined(NO_OVERREAD)
+	return _ScanPath_SSE2(psz, piLastSep, piLastDot);
+#else
+	int i;
+
+	*piLastSep = -1;
+	*piLastDot = -1;
+
+	for (i = 0; psz[i] != '\0'; i++)
+	{
+		if (IsPathSeparator(psz[i]))
+		{
+			*piLastSep = i;
+		}
+		else if (psz[i] == '.')
+		{
+			*piLastDot = i;
+		}
+	}
+
+	return i;
+#endif
+}
+
+
+char* GetExtension(const char* psz)
+{
+	int iLastSep;
+	int iLastDot;
+
+	_ScanPath(psz, &iLastSep, &iLastDot);
+
+	// a dot at [0] never counted
+	if ((iLastDot > iLastSep) && (iLastDot > 0))
+	{
+		return (char*)&psz[iLastDot+1];
+	}
+
+	return NULL;
+}
+
+
+wchar_t* GetExtensionW(const wchar_t* psz)
+{
+	size_t i;
+
+	i = wcslen(psz);
+
+	for (; i > 0; --i)
+	{
+		if (psz[i] == '.')
+		{
+			return (wchar_t*)&psz[i+1];
+		}
+		else if (IsPathSeparator(psz[i]))
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+char* GetFileName(const char* psz)
+{
+	int iLastSep;
+	int iLastDot;
+
+	_ScanPath(psz, &iLastSep, &iLastDot);
+
+	return (char*)&psz[iLastSep+1];
+}
+
+
+wchar_t* GetFileNameW(const wchar_t* psz)
+{
+	const wchar_t* pszFileName;
+	int i;
+
+	pszFileName = psz;
+
+	for (i = 0; psz[i] != '\0'; i++)
+	{
+		if (IsPathSeparator(psz[i]))
+		{
+			pszFileName = &psz[i+1];
+		}
+	}
+
+	return (wchar_t*)pszFileName;
+}
+
+// dir, name, stem and extension spans of a path in one pass,
+// a dot that starts the name (".bashrc") is not an extension
+
+void SplitPath(const char* psz, pathview_t* ppv)
+{
+	int iLastSep;
+	int iLastDot;
+
+	ppv->psz = psz;
+	ppv->iLength = _ScanPath(psz, &iLastSep, &iLastDot);
+	ppv->iDirLength = iLastSep + 1;
+	ppv->iNameLength = ppv->iLength - ppv->iDirLength;
+
+	if (iLastDot > iLastSep + 1)
+	{
+		ppv->iStemLength = iLastDot - ppv->iDirLength;
+		ppv->iExtLength = ppv->iLength - (iLastDot + 1);
+	}
+	else
+	{
+		ppv->iStemLength = ppv->iNameLength;
+		ppv->iExtLength = 0;
+	}
+}
+
+
+#define PATH_BAND_SIZE 4096 // paths per band
+
+typedef struct splitjob_s
+{
+	const char** apsz;
+	pathview_t* aViews;
+} splitjob_t;
+
+
+static void _SplitPathsBand(int iFirst, int iLast, void* param)
+{
+	splitjob_t* pjob = (splitjob_t*)param;
+	int i;
+
+	for (i = iFirst; i < iLast; i++)
+	{
+		SplitPath(pjob->apsz[i], &pjob->aViews[i]);
+	}
+}
+
+
+// large arrays are split on the worker threads
+
+void SplitPaths(const char** apsz, int nPaths, pathview_t* aViews)
+{
+	splitjob_t job;
+
+	job.apsz = apsz;
+	job.aViews = aViews;
+
+	_ParallelBands(nPaths, PATH_BAND_SIZE, _SplitPathsBand, &job);
+}
+
+
+// aiClass[i] gets the index of the extension of path i in apszExts (given without the dot,
+// ascii case is ignored) or -1, paths without an extension match ""
+
+void ClassifyPathsByExtension(const pathview_t* aViews, int nPaths, const char** apszExts, int nExts, int* aiClass)
+{
+	const pathview_t* ppv;
+	const char* pszExt;
+	int* aiSlots;
+	int aiStatic[64];
+	int iSlotMask;
+	int iLength;
+	int i;
+	int j;
+
+	for (iSlotMask = 16; iSlotMask < nExts * 2; iSlotMask *= 2)
+		;
+
+	aiSlots = (iSlotMask <= 64)? aiStatic: (int*)AllocMemory(iSlotMask * sizeof(int));
+	iSlotMask--;
+
+	if (aiSlots == NULL)
+	{
+		for (i = 0; i < nPaths; i++)
+		{
+			aiClass[i] = -1;
+		}
+
+		return;
+	}
+
+	memset(aiSlots, -1, (iSlotMask + 1) * sizeof(int));
+
+	// the first of duplicate extensions wins
+	for (i = 0; i < nExts; i++)
+	{
+		iLength = (int)strlen(apszExts[i]);
+
+		for (j = _HashStringN(apszExts[i], iLength, true) & iSlotMask; aiSlots[j] != -1; j = (j + 1) & iSlotMask)
+		{
+			if (((int)strlen(apszExts[aiSlots[j]]) == iLength) && _StrEqN(apszExts[aiSlots[j]], apszExts[i], iLength, true))
+			{
+				break;
+			}
+		}
+
+		if (aiSlots[j] == -1)
+		{
+			aiSlots[j] = i;
+		}
+	}
+
+	for (i = 0; i < nPaths; i++)
+	{
+		ppv = &aViews[i];
+		pszExt = &ppv->psz[ppv->iLength - ppv->iExtLength];
+		aiClass[i] = -1;
+
+		for (j = _HashStringN(pszExt, ppv->iExtLength, true) & iSlotMask; aiSlots[j] != -1; j = (j + 1) & iSlotMask)
+		{
+			if (_StrEqN(apszExts[aiSlots[j]], pszExt, ppv->iExtLength, true) && (apszExts[aiSlots[j]][ppv->iExtLength] == '\0'))
+			{
+				aiClass[i] = aiSlots[j];
+				break;
+			}
+		}
+	}
+
+	if (aiSlots != aiStatic)
+	{
+		FreeMemory(aiSlots);
+	}
+}
+
+/*
+void ConcatPath(char* buffer, const char* psz)
+{
+	int i;
+	
+	i = (int)strlen(buffer);
+
+	while (i > 0)
+	{
+		if (!IsPathSeparator(buffer[i-1]))
+		{
+			break;
+		}
+		i--;
+	}
+
+	buffer[i++] = PATH_SEPARATOR;
+
+	strcpy(&buffer[i], psz);
+}
+*/
+
+bool_t CreateDirectoryTree(const char* pszPath)
+{
+	char szDir[MAX_PATH];
+	int i;
+
+	strcpy(szDir, pszPath);
+
+	for (i = 0; ; i++)
+	{
+		char c = szDir[i];
+		
+		if (IsPathSeparator(c) || (c == '\0'))
+		{
+			szDir[i] = '\0';
+
+			{
+				DWORD attrs = GetFileAttributesA(szDir);
+
+				if (attrs == (DWORD)-1)
+				{
+					if (!CreateDirectoryA(szDir, NULL))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					if (!(attrs & FILE_ATTRIBUTE_DIRECTORY))
+					{
+						return false;
+					}
+				}
+			}
+			
+			if (c == '\0')
+			{
+				break;
+			}
+
+			szDir[i] = '\\';
+		}
+	}
+
+	return true;
+}
+
+
+// directories known to exist, so each one is probed only once
+
+struct dircache_s
+{
+	strtable_t* pst;
+};
+
+
+dircache_t* CreateDirectoryCache(void)
+{
+	dircache_t* pdc = (dircache_t*)AllocMemory(sizeof(dircache_t));
+
+	if (pdc != NULL)
+	{
+		pdc->pst = CreateStringTable(true);
+
+		if (pdc->pst == NULL)
+		{
+			FreeMemory(pdc);
+			return NULL;
+		}
+	}
+
+	return pdc;
+}
+
+
+void FreeDirectoryCache(dircache_t* pdc)
+{
+	FreeStringTable(pdc->pst);
+
+	FreeMemory(pdc);
+}
+
+
+// the first iLength chars of pszPath, which must be writable
+
+static bool_t _CreateDirectoryTreeCached(dircache_t* pdc, char* pszPath, int iLength)
+{
+	DWORD iAttributes;
+	bool_t bMissing;
+	int iStart;
+	int i;
+	char cSaved;
+	char c;
+
+	// strip trailing separators
+	while ((iLength > 1) && IsPathSeparator(pszPath[iLength - 1]))
+	{
+		iLength--;
+	}
+
+	if (iLength == 0)
+	{
+		return false;
+	}
+
+	if (_FindInternedStringN(pdc->pst, pszPath, iLength) != NULL)
+	{
+		return true;
+	}
+
+	// the longest known prefix
+	for (iStart = iLength - 1; iStart > 0; iStart--)
+	{
+		if (IsPathSeparator(pszPath[iStart]) && (_FindInternedStringN(pdc->pst, pszPath, iStart) != NULL))
+		{
+			break;
+		}
+	}
+
+	// below a created directory nothing exists yet
+	bMissing = false;
+
+	for (i = iStart + 1; i <= iLength; i++)
+	{
+		c = (i < iLength)? pszPath[i]: '\0';
+
+		if (!IsPathSeparator(c) && (c != '\0'))
+		{
+			continue;
+		}
+
+		// skip empty components and the "\\" of a root
+		if ((i == 0) || IsPathSeparator(pszPath[i - 1]))
+		{
+			continue;
+		}
+
+		cSaved = pszPath[i];
+		pszPath[i] = '\0';
+
+		iAttributes = bMissing? INVALID_FILE_ATTRIBUTES: GetFileAttributesA(pszPath);
+
+		if (iAttributes == INVALID_FILE_ATTRIBUTES)
+		{
+			if (CreateDirectoryA(pszPath, NULL))
+			{
+				bMissing = true;
+			}
+			else
+			{
+				// another thread may have created it meanwhile
+				iAttributes = (GetLastError() == ERROR_ALREADY_EXISTS)? GetFileAttributesA(pszPath): INVALID_FILE_ATTRIBUTES;
+
+				if ((iAttributes == INVALID_FILE_ATTRIBUTES) || !(iAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				{
+					pszPath[i] = cSaved;
+
+					return false;
+				}
+			}
+		}
+		else if (!(iAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			pszPath[i] = cSaved;
+
+			return false;
+		}
+
+		pszPath[i] = cSaved;
+
+		InternStringN(pdc->pst, pszPath, i);
+	}
+
+	return true;
+}
+
+
+bool_t CreateDirectoryTreeCached(dircache_t* pdc, const char* pszPath)
+{
+	pathbuf_t pb;
+	bool_t bSuccess;
+
+	InitPathBuffer(&pb, pszPath);
+
+	bSuccess = (pb.iLength == (int)strlen(pszPath)) && _CreateDirectoryTreeCached(pdc, pb.psz, pb.iLength);
+
+	FreePathBuffer(&pb);
+
+	return bSuccess;
+}
+
+
+typedef struct parentdir_s
+{
+	const char* psz;
+	int iLength;
+} parentdir_t;
+
+
+static int _CompareParentDirs(const void* p1, const void* p2)
+{
+	const parentdir_t* pd1 = (const parentdir_t*)p1;
+	const parentdir_t* pd2 = (const parentdir_t*)p2;
+	int i;
+
+	i = _strnicmp(pd1->psz, pd2->psz, min(pd1->iLength, pd2->iLength));
+
+	if (i == 0)
+	{
+		i = pd1->iLength - pd2->iLength;
+	}
+
+	return i;
+}
+
+
+// creates the parent directories of the given file paths, each once,
+// sorted so that siblings share the probes of their prefixes, pdc may be NULL
+
+bool_t CreateDirectoryTrees(dircache_t* pdc, const char** apszFileNames, int nFiles)
+{
+	dircache_t* pdcLocal;
+	parentdir_t* aDirs;
+	pathbuf_t pb;
+	bool_t bSuccess;
+	int nDirs;
+	int iLength;
+	int i;
+	int j;
+
+	pdcLocal = NULL;
+
+	if (pdc == NULL)
+	{
+		pdc = pdcLocal = CreateDirectoryCache();
+
+		if (pdc == NULL)
+		{
+			return false;
+		}
+	}
+
+	aDirs = (parentdir_t*)AllocMemory(max(nFiles, 1) * sizeof(parentdir_t));
+
+	if (aDirs == NULL)
+	{
+		if (pdcLocal != NULL)
+		{
+			FreeDirectoryCache(pdcLocal);
+		}
+
+		return false;
+	}
+
+	nDirs = 0;
+
+	for (i = 0; i < nFiles; i++)
+	{
+		iLength = (int)strlen(apszFileNames[i]);
+
+		while ((iLength > 0) && !IsPathSeparator(apszFileNames[i][iLength - 1]))
+		{
+			iLength--;
+		}
+
+		if (iLength > 0)
+		{
+			aDirs[nDirs].psz = apszFileNames[i];
+			aDirs[nDirs].iLength = iLength;
+			nDirs++;
+		}
+	}
+
+	qsort(aDirs, nDirs, sizeof(parentdir_t), _CompareParentDirs);
+
+	bSuccess = true;
+	InitPathBuffer(&pb, NULL);
+
+	for (i = 0; i < nDirs; i++)
+	{
+		if ((i > 0) && (_CompareParentDirs(&aDirs[i - 1], &aDirs[i]) == 0))
+		{
+			continue;
+		}
+
+		TruncatePath(&pb, 0);
+		j = AppendPath(&pb, aDirs[i].psz);
+
+		if (j < 0)
+		{
+			bSuccess = false;
+			continue;
+		}
+
+		if (!_CreateDirectoryTreeCached(pdc, pb.psz, aDirs[i].iLength))
+		{
+			bSuccess = false;
+		}
+	}
+
+	FreePathBuffer(&pb);
+	FreeMemory(aDirs);
+
+	if (pdcLocal != NULL)
+	{
+		FreeDirectoryCache(pdcLocal);
+	}
+
+	return bSuccess;
+}
+
+
+bool_t CreateDirectoryTreeW(const wchar_t* pszPath)
+{
+	wchar_t szDir[MAX_PATH];
+	int i;
+
+	wcscpy(szDir, pszPath);
+
+	for (i = 0; ; i++)
+	{
+		wchar_t c = szDir[i];
+		
+		if (IsPathSeparator(c) || (c == '\0'))
+		{
+			szDir[i] = '\0';
+
+			{
+				DWORD attrs = GetFileAttributesW(szDir);
+
+				if (attrs == (DWORD)-1)
+				{
+					if (!CreateDirectoryW(szDir, NULL))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					if (!(attrs & FILE_ATTRIBUTE_DIRECTORY))
+					{
+						return false;
+					}
+				}
+			}
+			
+			if (c == '\0')
+			{
+				break;
+			}
+
+			szDir[i] = '\\';
+		}
+	}
+
+	return true;
+}
+
+
+
+// a growing path, components are appended and cut off in place,
+// short paths stay in the embedded buffer and need no allocation
+
+void InitPathBuffer(pathbuf_t* ppb, const char* pszPath)
+{
+	ppb->psz = ppb->szBuffer;
+	ppb->iLength = 0;
+	ppb->iMaxLength = sizeof(ppb->szBuffer);
+	ppb->szBuffer[0] = '\0';
+
+	if (pszPath != NULL)
+	{
+		AppendPath(ppb, pszPath);
+	}
+}
+
+
+static bool_t _ReservePath(pathbuf_t* ppb, int iLength)
+{
+	char* psz;
+	int iMaxLength;
+
+	if (iLength < ppb->iMaxLength)
+	{
+		return true;
+	}
+
+	iMaxLength = max(ppb->iMaxLength * 2, iLength + 1);
+	psz = (char*)AllocMemory(iMaxLength);
+
+	if (psz == NULL)
+	{
+		return false;
+	}
+
+	memcpy(psz, ppb->psz, ppb->iLength + 1);
+
+	if (ppb->psz != ppb->szBuffer)
+	{
+		FreeMemory(ppb->psz);
+	}
+
+	ppb->psz = psz;
+	ppb->iMaxLength = iMaxLength;
+
+	return true;
+}
+
+
+// appends psz as is, returns the old length to truncate back to or -1
+
+int AppendPath(pathbuf_t* ppb, const char* psz)
+{
+	int iOldLength = ppb->iLength;
+	int iLength = (int)strlen(psz);
+
+	if (!_ReservePath(ppb, iOldLength + iLength))
+	{
+		return -1;
+	}
+
+	memcpy(&ppb->psz[iOldLength], psz, iLength + 1);
+	ppb->iLength += iLength;
+
+	return iOldLength;
+}
+
+
+// appends "\name", returns the old length to truncate back to or -1
+
+int PushPath(pathbuf_t* ppb, const char* pszName)
+{
+	int iOldLength = ppb->iLength;
+	int iLength = (int)strlen(pszName);
+	int c;
+
+	if (!_ReservePath(ppb, iOldLength + 1 + iLength))
+	{
+		return -1;
+	}
+
+	if (iOldLength > 0)
+	{
+		c = ppb->psz[iOldLength - 1];
+
+		if ((c != '\\') && (c != '/'))
+		{
+			ppb->psz[ppb->iLength++] = '\\';
+		}
+	}
+
+	memcpy(&ppb->psz[ppb->iLength], pszName, iLength + 1);
+	ppb->iLength += iLength;
+
+	return iOldLength;
+}
+
+
+void TruncatePath(pathbuf_t* ppb, int iLength)
+{
+	if (IsInRange(iLength, 0, ppb->iLength + 1))
+	{
+		ppb->iLength = iLength;
+		ppb->psz[iLength] = '\0';
+	}
+}
+
+
+void FreePathBuffer(pathbuf_t* ppb)
+{
+	if (ppb->psz != ppb->szBuffer)
+	{
+		FreeMemory(ppb->psz);
+	}
+
+	ppb->psz = ppb->szBuffer;
+	ppb->iLength = 0;
+	ppb->iMaxLength = sizeof(ppb->szBuffer);
+	ppb->szBuffer[0] = '\0';
+}
+
+
+//
+// parser (ANSI, and utf-8 where it says so)
+//
+
+
+int ToInt(const char* psz)
+{
+	return strtol(psz, NULL, 10);
+}
+
+
+unsigned int ToUInt(const char* psz)
+{
+	return strtoul(psz, NULL, 10);
+}
+
+
+bool_t ToBool(const char* psz)
+{
+	if (AsciiStrEq(psz, "true"))
+	{
+		return true;
+	}
+	else if (AsciiStrEq(psz, "false"))
+	{
+		return false;
+	}
+
+	return (ToInt(psz) != 0);
+}
+
+
+int FindString(const char* psz, char** apsz, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (AsciiStrEq(psz, apsz[i]))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+// length of the char at psz if it is one of pszChars, else 0, utf-8 sets are matched
+// by whole sequences, which in valid text can only start on a char boundary
+
+static int _MatchChar(const char* psz, const char* pszChars, bool_t bUtf8)
+{
+	byte_t c;
+	int i;
+	int n;
+
+	if (!bUtf8)
+	{
+		return IsChar(psz[0], pszChars)? 1: 0;
+	}
+
+	for (i = 0; pszChars[i] != '\0'; i += n)
+	{
+		c = (byte_t)pszChars[i];
+		n = (c < 0xC0)? 1: (c < 0xE0)? 2: (c < 0xF0)? 3: 4;
+
+		if (strncmp(psz, &pszChars[i], n) == 0)
+		{
+			return n;
+		}
+	}
+
+	return 0;
+}
+
+
+static bool_t _IsUtf8(const char* psz)
+{
+	int iLength = (int)strlen(psz);
+
+	return (ValidateUtf8(psz, iLength) == iLength);
+}
+
+
+static int _CutChars(char* psz, const char* pszChars, bool_t bUtf8)
+{
+	bool bQuote;
+	int i;
+	int j;
+	int n;
+
+	bQuote = false;
+	j = 0;
+
+	for (i = 0; psz[i] != '\0'; )
+	{
+		if (psz[i] == '\"')
+		{
+			bQuote = !bQuote;
+		}
+		else if (!bQuote)
+		{
+			n = _MatchChar(&psz[i], pszChars, bUtf8);
+
+			if (n != 0)
+			{
+				i += n;
+				continue;
+			}
+		}
+
+		psz[j++] = psz[i++];
+	}
+
+	psz[j] = '\0';
+
+	return j;
+}
+
+
+//  CutChars( pszSomeText, " \t" ); // will remove all spaces and tabs
+
+int CutChars(char* psz, const char* pszChars)
+{
+	return _CutChars(psz, pszChars, false);
+}
+
+
+static int _ContractChars(char* psz, const char* pszChars, int cToChar, bool_t bUtf8)
+{
+	bool bQuote;
+	int i;
+	int j;
+	int n;
+
+	bQuote = false;
+	j = 0;
+
+	for (i = 0; psz[i] != '\0'; )
+	{
+		if (psz[i] == '\"')
+		{
+			bQuote = !bQuote;
+		}
+		else if (!bQuote)
+		{
+			n = _MatchChar(&psz[i], pszChars, bUtf8);
+
+			if (n != 0)
+			{
+				if ((j != 0) && (psz[j-1] != cToChar))
+				{
+					psz[j++] = (char)cToChar;
+				}
+
+				i += n;
+				continue;
+			}
+		}
+
+		psz[j++] = psz[i++];
+	}
+
+	if (j > 0)
+	{
+		if (psz[j-1] == cToChar)
+		{
+			j--;
+		}
+	}
+
+	psz[j] = '\0';
+
+	return j;
+}
+
+
+//  ContractChars( pszSomeText, " \t", ' ' ); // spaces and tabs to single spaces
+
+int ContractChars(char* psz, const char* pszChars, int cToChar)
+{
+	return _ContractChars(psz, pszChars, cToChar, false);
+}
+
+
+// the utf-8 versions take multibyte chars in pszChars, return UERR_FORMAT
+// (leaving psz alone) if psz or pszChars are not valid utf-8
+
+int CutCharsUtf8(char* psz, const char* pszChars)
+{
+	if (!_IsUtf8(psz) || !_IsUtf8(pszChars))
+	{
+		return UERR_FORMAT;
+	}
+
+	return _CutChars(psz, pszChars, true);
+}
+
+
+// cToChar has to be ascii
+
+int ContractCharsUtf8(char* psz, const char* pszChars, int cToChar)
+{
+	if ((cToChar <= 0) || (cToChar >= 0x80))
+	{
+		return UERR_INVALIDARG;
+	}
+
+	if (!_IsUtf8(psz) || !_IsUtf8(pszChars))
+	{
+		return UERR_FORMAT;
+	}
+
+	return _ContractChars(psz, pszChars, cToChar, true);
+}
+
+
+//  CutComments( pszSomeText, "/*", "*/" );
+//  CutComments( pszSomeText, "//", NULL );
+
+int CutComments(char* psz, const char* pszCommentStart, const char* pszCommentEnd)
+{
+	bool bQuote;
+	bool bComment;
+	char* pszCur;
+	int i;
+	int j;
+	int iC;
+
+	bQuote = false;
+	bComment = false;
+	i = 0;
+	j = 0;
+
+	for ( ; psz[i] != '\0'; i++)
+	{
+		if (bComment)
+		{
+			if (pszCommentEnd == NULL)
+			{
+				if (((psz[i] == '\r') && (psz[i+1] == '\n')) || (psz[i] == '\n'))
+				{
+					bComment = false;
+				}
+				else
+				{
+					continue;
+				}
+			}
+			else
+			{
+				pszCur = &psz[i];
+				iC = 0;
+
+				for ( ; pszCommentEnd[iC] != '\0'; iC++)
+				{
+					if (pszCur[iC] != pszCommentEnd[iC])
+					{
+						goto skip_end;
+					}
+				}
+
+				i += iC - 1; // the loop steps over the last char
+				bComment = false;
+
+skip_end:
+
+				continue;
+			}
+		}
+
+		if (psz[i] == '\"')
+		{
+			bQuote = !bQuote;
+		}
+
+		if (!bQuote)
+		{
+			pszCur = &psz[i];
+			iC = 0;
+
+			for ( ; pszCommentStart[iC] != '\0'; iC++)
+			{
+				if (pszCur[iC] != pszCommentStart[iC])
+				{
+					goto skip_start;
+				}
+			}
+
+			i += iC - 1;
+			bComment = true;
+
+			continue;
+		}
+
+skip_start:
+
+		psz[j++] = psz[i];
+	}
+
+	psz[j] = '\0';
+
+	return j;
+}
+
+
+// length of pszMarker if psz starts with it, 0 otherwise, reads at most iLen chars
+
+static int _MatchMarkerN(const char* psz, int iLen, const char* pszMarker)
+{
+	int i;
+
+	for (i = 0; pszMarker[i] != '\0'; i++)
+	{
+		if ((i >= iLen) || (psz[i] != pszMarker[i]))
+		{
+			return 0;
+		}
+	}
+
+	return i;
+}
+
+
+// bKeepLines keeps the '\n's of block comments, so the lines after one keep their numbers
+
+static int _CutCommentsN(char* psz, int iLen, const char* pszCommentStart, const char* pszCommentEnd, bool bKeepLines)
+{
+	bool bQuote;
+	bool bComment;
+	int i;
+	int j;
+	int iC;
+
+	if ((psz == NULL) || (iLen < 0) || (pszCommentStart == NULL) || (pszCommentStart[0] == '\0'))
+	{
+		return UERR_INVALIDARG;
+	}
+
+	if ((pszCommentEnd != NULL) && (pszCommentEnd[0] == '\0'))
+	{
+		return UERR_INVALIDARG;
+	}
+
+	bQuote = false;
+	bComment = false;
+	j = 0;
+
+	for (i = 0; (i < iLen) && (psz[i] != '\0'); i++)
+	{
+		if (bComment)
+		{
+			if (pszCommentEnd == NULL)
+			{
+				if (((psz[i] == '\r') && (i + 1 < iLen) && (psz[i+1] == '\n')) || (psz[i] == '\n'))
+				{
+					bComment = false;
+				}
+				else
+				{
+					continue;
+				}
+			}
+			else
+			{
+				iC = _MatchMarkerN(&psz[i], iLen - i, pszCommentEnd);
+
+				if (iC != 0)
+				{
+					i += iC - 1;
+					bComment = false;
+				}
+				else if (bKeepLines && (psz[i] == '\n'))
+				{
+					psz[j++] = '\n';
+				}
+
+				continue;
+			}
+		}
+
+		if (psz[i] == '\"')
+		{
+			bQuote = !bQuote;
+		}
+
+		if (!bQuote)
+		{
+			iC = _MatchMarkerN(&psz[i], iLen - i, pszCommentStart);
+
+			if (iC != 0)
+			{
+				i += iC - 1;
+				bComment = true;
+
+				continue;
+			}
+		}
+
+		psz[j++] = psz[i];
+	}
+
+	psz[j] = '\0';
+
+	return j;
+}
+
+
+// CutComments() for untrusted text, reads at most iLen chars (stops at '\0'),
+// psz must have room for the terminator at [iLen]
+// returns the new length or UERR_INVALIDARG
+
+int CutCommentsN(char* psz, int iLen, const char* pszCommentStart, const char* pszCommentEnd)
+{
+	return _CutCommentsN(psz, iLen, pszCommentStart, pszCommentEnd, false);
+}
+
+
+int FindChar(int c, const char* psz)
+{
+	int i;
+
+	for (i = 0; psz[i] != '\0'; i++)
+	{
+		if (psz[i] == c)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+static int _StripChars(char* psz, const char* pszChars, bool_t bUtf8)
+{
+	int i, j, k, n;
+
+	for (i = 0; ; i += n)
+	{
+		n = _MatchChar(&psz[i], pszChars, bUtf8);
+
+		if (n == 0)
+		{
+			break;
+		}
+	}
+
+	for (j = 0; psz[i] != '\0'; i++, j++)
+	{
+		psz[j] = psz[i];
+	}
+
+	for ( ; j > 0; j = k)
+	{
+		// back to the start of the last char
+		for (k = j - 1; bUtf8 && (k > 0) && ((psz[k] & 0xC0) == 0x80); k--)
+			;
+
+		if (_MatchChar(&psz[k], pszChars, bUtf8) == 0)
+		{
+			break;
+		}
+	}
+
+	psz[j] = '\0';
+
+	return j;
+}
+
+
+// strip chars from the left and the right
+// StripChars( "  asd asd! ", " " ); // will give "asd asd!"
+
+int StripChars(char* psz, const char* pszChars)
+{
+	return _StripChars(psz, pszChars, false);
+}
+
+
+int StripCharsUtf8(char* psz, const char* pszChars)
+{
+	if (!_IsUtf8(psz) || !_IsUtf8(pszChars))
+	{
+		return UERR_FORMAT;
+	}
+
+	return _StripChars(psz, pszChars, true);
+}
+
+
+int UnpackQuote(char* psz)
+{
+	int i, j;
+
+	i = (int)strlen(psz);
+
+	if (i >= 2) // XXX:
+	{
+		if ((psz[0] == '\"') && (psz[i-1] == '\"'))
+		{
+			i -= 2;
+
+			for (j = i; j > 0; j--)
+			{
+				psz[j-1] = psz[j];
+			}
+
+			psz[i] = '\0';
+		}
+	}
+
+	return i;
+}
+
+
+int ParseLine(int argcMax, char* argv[], char* psz, const char* pszDelimiters, char** ppszEndPtr)
+{
+	int argc;
+	char* pszIndent;
+	char* pszQuoteStart;
+	char* pszQuoteEnd;
+	bool bSolid;
+	bool bMoreArgs;
+	int nQuotes;
+	int c;
+	int i;
+	//int n;
+
+	argc = 0;
+	pszIndent = psz;
+	pszQuoteStart = NULL;
+	pszQuoteEnd = NULL;
+	bSolid = false;
+	bMoreArgs = false;
+	nQuotes = 0;
+
+	for (i = 0; ; i++)
+	{
+		c = psz[i];
+
+		if (c == '\"')
+		{
+			if (!bSolid)
+			{
+				pszQuoteStart = &psz[i];
+				bSolid = TRUE;
+			}
+			else
+			{
+				pszQuoteEnd = &psz[i];
+				bSolid = FALSE;
+				nQuotes++;
+			}
+
+			continue;
+		}
+
+		if (!bSolid)
+		{
+			if ((c == '\0') || IsChar(c, pszDelimiters))
+			{
+				if (argc < argcMax)
+				{
+					psz[i] = '\0';
+
+					// cut quotes
+					if ((pszQuoteStart == pszIndent) && (pszQuoteEnd == &psz[i-1]))
+					{
+						if (nQuotes == 1)   // filter multiple quotation
+						{
+							pszIndent++;
+							*pszQuoteStart = '\0';
+							*pszQuoteEnd = '\0';
+						}
+					}
+
+					argv[argc] = pszIndent;
+					pszIndent = &psz[i+1];
+				}
+				else
+				{
+					if (argcMax != 0)
+					{
+						bMoreArgs = true;
+						break;
+					}
+				}
+
+				argc++;
+
+				nQuotes = 0;
+			}
+		}
+
+		if (c == '\0')
+		{
+			break;
+		}
+	}
+
+	if (ppszEndPtr != NULL)
+	{
+		if (bMoreArgs)
+		{
+			(*ppszEndPtr) = pszIndent;
+		}
+		else
+		{
+			(*ppszEndPtr) = NULL;
+		}
+	}
+
+	PROF_ADD(nTokens, argc);
+
+	return argc;
+}
+
+
+static int _ParseLineN(int argcMax, char* argv[], char* psz, int iLen, const char* pszDelimiters, char** ppszEndPtr, bool_t bUtf8)
+{
+	int argc;
+	int iIndent;
+	int iQuoteStart;
+	int iQuoteEnd;
+	bool bSolid;
+	int nQuotes;
+	int c;
+	int i;
+	int n;
+
+	if (ppszEndPtr != NULL)
+	{
+		(*ppszEndPtr) = NULL;
+	}
+
+	if ((psz == NULL) || (iLen < 0) || (argcMax < 0) || ((argcMax != 0) && (argv == NULL)))
+	{
+		return UERR_INVALIDARG;
+	}
+
+	if (bUtf8)
+	{
+		for (n = 0; (n < iLen) && (psz[n] != '\0'); n++)
+			;
+
+		if ((ValidateUtf8(psz, n) != n) || !_IsUtf8(pszDelimiters))
+		{
+			return UERR_FORMAT;
+		}
+
+		iLen = n;
+	}
+
+	argc = 0;
+	iIndent = 0;
+	iQuoteStart = -1;
+	iQuoteEnd = -1;
+	bSolid = false;
+	nQuotes = 0;
+
+	for (i = 0; ; i++)
+	{
+		c = (i < iLen)? psz[i]: '\0';
+
+		if (c == '\"')
+		{
+			if (!bSolid)
+			{
+				iQuoteStart = i;
+				bSolid = true;
+			}
+			else
+			{
+				iQuoteEnd = i;
+				bSolid = false;
+				nQuotes++;
+			}
+
+			continue;
+		}
+
+		n = 1;
+
+		if (c == '\0')
+		{
+			if (bSolid)
+			{
+				return UERR_FORMAT;
+			}
+		}
+		else if (bSolid)
+		{
+			continue;
+		}
+		else
+		{
+			// a utf-8 delimiter may take several bytes
+			n = _MatchChar(&psz[i], pszDelimiters, bUtf8);
+
+			if (n == 0)
+			{
+				continue;
+			}
+		}
+
+		if (argc < argcMax)
+		{
+			psz[i] = '\0';
+			argv[argc] = &psz[iIndent];
+
+			// cut quotes
+			if ((iQuoteStart == iIndent) && (iQuoteEnd == i - 1) && (nQuotes == 1))
+			{
+				psz[iQuoteStart] = '\0';
+				psz[iQuoteEnd] = '\0';
+				argv[argc]++;
+			}
+
+			iIndent = i + n;
+		}
+		else if (argcMax != 0)
+		{
+			if (ppszEndPtr == NULL)
+			{
+				return UERR_OVERFLOW;
+			}
+
+			(*ppszEndPtr) = &psz[iIndent];
+			break;
+		}
+
+		argc++;
+
+		nQuotes = 0;
+
+		if (c == '\0')
+		{
+			break;
+		}
+
+		i += n - 1;
+	}
+
+	PROF_ADD(nTokens, argc);
+
+	return argc;
+}
+
+
+// ParseLine() for untrusted text, reads at most iLen chars (stops at '\0'),
+// psz must have room for the terminator at [iLen]
+// returns argc, UERR_OVERFLOW if there are more than argcMax args and
+// ppszEndPtr is NULL, UERR_FORMAT on an unterminated quote
+
+int ParseLineN(int argcMax, char* argv[], char* psz, int iLen, const char* pszDelimiters, char** ppszEndPtr)
+{
+	return _ParseLineN(argcMax, argv, psz, iLen, pszDelimiters, ppszEndPtr, false);
+}
+
+
+// ParseLineN() for utf-8 text, delimiters may be multibyte chars,
+// UERR_FORMAT also if the text or the delimiters are not valid utf-8
+
+int ParseLineUtf8(int argcMax, char* argv[], char* psz, int iLen, const char* pszDelimiters, char** ppszEndPtr)
+{
+	return _ParseLineN(argcMax, argv, psz, iLen, pszDelimiters, ppszEndPtr, true);
+}
+
+
+void BeginTokens(tokeniter_t* pit, char* psz, const char* pszDelimiters)
+{
+	pit->psz = psz;
+	pit->pszDelimiters = pszDelimiters;
+	pit->iNext = 0;
+	pit->iLength = 0;
+}
+
+
+// the next arg ParseLine() would give, cut in place, NULL at the end
+
+char* NextToken(tokeniter_t* pit)
+{
+	char* psz = pit->psz;
+	int iStart;
+	int iQuoteStart;
+	int iQuoteEnd;
+	bool_t bSolid;
+	int nQuotes;
+	int c;
+	int i;
+
+	if (pit->iNext < 0)
+	{
+		return NULL;
+	}
+
+	iStart = pit->iNext;
+	iQuoteStart = -1;
+	iQuoteEnd = -1;
+	bSolid = false;
+	nQuotes = 0;
+
+	for (i = iStart; ; i++)
+	{
+		c = psz[i];
+
+		if (c == '\"')
+		{
+			if (!bSolid)
+			{
+				iQuoteStart = i;
+			}
+			else
+			{
+				iQuoteEnd = i;
+				nQuotes++;
+			}
+
+			bSolid = !bSolid;
+
+			continue;
+		}
+
+		// an open quote runs to the end and is dropped
+		if (c == '\0')
+		{
+			pit->iNext = -1;
+
+			if (bSolid)
+			{
+				return NULL;
+			}
+
+			break;
+		}
+
+		if (!bSolid && IsChar(c, pit->pszDelimiters))
+		{
+			pit->iNext = i + 1;
+			break;
+		}
+	}
+
+	psz[i] = '\0';
+	pit->iLength = i - iStart;
+
+	// cut quotes
+	if ((iQuoteStart == iStart) && (iQuoteEnd == i - 1) && (nQuotes == 1))
+	{
+		psz[iQuoteStart] = '\0';
+		psz[iQuoteEnd] = '\0';
+		iStart++;
+		pit->iLength -= 2;
+	}
+
+	return &psz[iStart];
+}
+
+
+// the buffer must be allocated by ReadFileToBuffer()
+// or must include 0 at the [iSize] position
+
+void BeginLines(lineiter_t* pit, char* buffer, int iSize)
+{
+	pit->buffer = buffer;
+	pit->iSize = iSize;
+	pit->iNext = 0;
+	pit->bOwned = false;
+	pit->iLength = 0;
+}
+
+
+bool_t BeginFileLines(lineiter_t* pit, const char* pszFileName)
+{
+	char* buffer;
+	int iSize;
+
+	buffer = ReadFileToBuffer(pszFileName, &iSize);
+
+	if (buffer == NULL)
+	{
+		BeginLines(pit, NULL, -1);
+		return false;
+	}
+
+	BeginLines(pit, buffer, iSize);
+	pit->bOwned = true;
+
+	return true;
+}
+
+
+// the next line cut in place as ParseBuffer() does, NULL at the end
+
+char* NextLine(lineiter_t* pit)
+{
+	char* buffer = pit->buffer;
+	char* pszLine;
+	int iEnd;
+	int i;
+
+	if (pit->iNext > pit->iSize)
+	{
+		return NULL;
+	}
+
+	iEnd = -1;
+
+	for (i = pit->iNext; (buffer[i] != '\n') && (buffer[i] != '\0'); i++)
+	{
+		if (buffer[i] == '\r')
+		{
+			buffer[i] = '\0';
+
+			if (iEnd < 0)
+			{
+				iEnd = i;
+			}
+		}
+	}
+
+	buffer[i] = '\0';
+
+	pszLine = &buffer[pit->iNext];
+	pit->iLength = ((iEnd < 0)? i: iEnd) - pit->iNext;
+	pit->iNext = i + 1;
+
+	return pszLine;
+}
+
+
+void EndLines(lineiter_t* pit)
+{
+	if (pit->bOwned)
+	{
+		FreeMemory(pit->buffer);
+	}
+
+	BeginLines(pit, NULL, -1);
+}
+
+
+void ParseBuffer(char* buffer, int iSize, PFLINECALLBACK pfnLineCallback, void* param)
+{
+	lineiter_t it;
+	char* pszLine;
+	int bContinue;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	BeginLines(&it, buffer, iSize);
+
+	while ((pszLine = NextLine(&it)) != NULL)
+	{
+		PROF_ADD(nLines, 1);
+		PROF_START(1);
+
+		bContinue = pfnLineCallback(pszLine, param);
+
+		PROF_STOP_QUIET(PROF_CALLBACKS, 1);
+
+		if (!bContinue)
+		{
+			break;
+		}
+	}
+
+	PROF_STOP(PROF_PARSEBUFFER, 0);
+}
+
+
+long _StreamSize(FILE* stream)
+{
+	long iSize;
+	
+	fseek(stream, 0, SEEK_END);
+
+	iSize = ftell(stream);
+
+	fseek(stream, 0, SEEK_SET);
+
+	return iSize;
+}
+
+
+char* _ReadStreamToBuffer(FILE* stream, int* piSize)
+{
+	char* buffer;
+	int iSize;
+
+	iSize = _StreamSize(stream);
+
+	// ftell fails with -1 on files over 2 gb
+	if ((iSize > 0) && (iSize < INT_MAX))
+	{
+		buffer = (char*)AllocMemory(iSize + 1);
+
+		if (buffer != NULL)
+		{
+			if (fread(buffer, iSize, 1, stream))
+			{
+				buffer[iSize] = '\0';
+
+				PROF_ADD(iBytesRead, iSize);
+
+				*piSize = iSize;
+
+				return buffer;
+			}
+
+			FreeMemory(buffer);
+		}
+	}
+
+	return NULL;
+}
+
+
+char* ReadFileToBuffer(const char* pszFileName, int* piSize)
+{
+	FILE* stream;
+	char* buffer;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	buffer = NULL;
+	stream = fopen(pszFileName, "rb");
+
+	if (stream != NULL)
+	{
+		buffer = _ReadStreamToBuffer(stream, piSize);
+
+		fclose(stream);
+	}
+
+	PROF_STOP(PROF_READFILE, 0);
+
+	return buffer;
+}
+
+
+char* ReadFileToBufferW(const wchar_t* pszFileName, int* piSize)
+{
+	FILE* stream;
+	char* buffer;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	buffer = NULL;
+	stream = _wfopen(pszFileName, L"rb");
+
+	if (stream != NULL)
+	{
+		buffer = _ReadStreamToBuffer(stream, piSize);
+
+		fclose(stream);
+	}
+
+	PROF_STOP(PROF_READFILE, 0);
+
+	return buffer;
+}
+
+
+// read only view of a whole file, no copy and pages are loaded on demand
+
+bool_t MapFileToMemory(const char* pszFileName, mappedfile_t* pmf)
+{
+	LARGE_INTEGER iSize;
+
+	pmf->hMapping = NULL;
+	pmf->pData = NULL;
+	pmf->iSize = 0;
+
+	pmf->hFile = CreateFile(pszFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (pmf->hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	// empty files can't be mapped
+	if (GetFileSizeEx(pmf->hFile, &iSize) && (iSize.QuadPart > 0) && ((ULONGLONG)iSize.QuadPart <= (size_t)-1))
+	{
+		pmf->hMapping = CreateFileMapping(pmf->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (pmf->hMapping != NULL)
+		{
+			pmf->pData = (const byte_t*)MapViewOfFile(pmf->hMapping, FILE_MAP_READ, 0, 0, 0);
+			pmf->iSize = (size_t)iSize.QuadPart;
+		}
+	}
+
+	if (pmf->pData == NULL)
+	{
+		UnmapFile(pmf);
+		return false;
+	}
+
+	return true;
+}
+
+
+void UnmapFile(mappedfile_t* pmf)
+{
+	if (pmf->pData != NULL)
+	{
+		UnmapViewOfFile(pmf->pData);
+	}
+
+	if (pmf->hMapping != NULL)
+	{
+		CloseHandle(pmf->hMapping);
+	}
+
+	if (pmf->hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(pmf->hFile);
+	}
+
+	pmf->hFile = INVALID_HANDLE_VALUE;
+	pmf->hMapping = NULL;
+	pmf->pData = NULL;
+	pmf->iSize = 0;
+}
+
+
+bool_t SaveToFile(const char* pszFileName, void* buffer, int iSize)
+{
+	bool_t bSuccess;
+	FILE* stream;
+
+	bSuccess = false;
+
+	stream = fopen(pszFileName, "wb");
+
+	if (stream != NULL)
+	{
+		if (fwrite(buffer, iSize, 1, stream))
+		{
+			bSuccess = true;
+		}
+
+		fclose(stream);
+	}
+
+	return bSuccess;
+}
+
+
+bool_t ParseFile(const char* pszFileName, PFLINECALLBACK pfnLineCallback, void* param)
+{
+	bool_t bSuccess;
+	char* buffer;
+	int iSize;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	bSuccess = false;
+	buffer = ReadFileToBuffer(pszFileName, &iSize);
+
+	if (buffer != NULL)
+	{
+		ParseBuffer(buffer, iSize, pfnLineCallback, param);
+
+		FreeMemory(buffer);
+
+		bSuccess = true;
+	}
+
+	PROF_STOP(PROF_PARSEFILE, 0);
+
+	return bSuccess;
+}
+
+
+bool_t ParseFileW(const wchar_t* pszFileName, PFLINECALLBACK pfnLineCallback, void* param)
+{
+	char* buffer;
+	int iSize;
+
+	buffer = ReadFileToBufferW(pszFileName, &iSize);
+
+	if (buffer != NULL)
+	{
+		ParseBuffer(buffer, iSize, pfnLineCallback, param);
+
+		FreeMemory(buffer);
+
+		return true;
+	}
+
+	return false;
+}
+
+
+//
+// incremental reparse
+//
+
+#define DIFF_WINDOW 64 // lines searched ahead to resync after an insert or delete
+
+typedef struct linehash_s
+{
+	ULONGLONG iHash;
+	int iOffset; // in the buffer of the run
+	int iLength;
+} linehash_t;
+
+struct parsestate_s
+{
+	linehash_t* aLines;
+	int nLines;
+};
+
+
+parsestate_t* CreateParseState(void)
+{
+	parsestate_t* pps = (parsestate_t*)AllocMemory(sizeof(parsestate_t));
+
+	if (pps != NULL)
+	{
+		pps->aLines = NULL;
+		pps->nLines = 0;
+	}
+
+	return pps;
+}
+
+
+void FreeParseState(parsestate_t* pps)
+{
+	if (pps->aLines != NULL)
+	{
+		FreeMemory(pps->aLines);
+	}
+
+	FreeMemory(pps);
+}
+
+
+// splits the buffer into lines the way ParseBuffer() does and hashes them
+
+static linehash_t* _HashLines(char* buffer, int iSize, int* pnLines)
+{
+	linehash_t* aLines;
+	linehash_t* aGrown;
+	ULONGLONG iHash;
+	int nMaxLines;
+	int nLines;
+	int iStart;
+	int iEnd;
+	int i;
+
+	nMaxLines = 64;
+	nLines = 0;
+	aLines = (linehash_t*)AllocMemory(nMaxLines * sizeof(linehash_t));
+
+	if (aLines == NULL)
+	{
+		return NULL;
+	}
+
+	iHash = 14695981039346656037ULL; // fnv-1a
+	iStart = 0;
+	iEnd = -1;
+
+	for (i = 0; i <= iSize; i++)
+	{
+		if ((buffer[i] == '\n') || (buffer[i] == '\0'))
+		{
+			buffer[i] = '\0';
+
+			if (nLines == nMaxLines)
+			{
+				aGrown = (linehash_t*)AllocMemory(nMaxLines * 2 * sizeof(linehash_t));
+
+				if (aGrown == NULL)
+				{
+					FreeMemory(aLines);
+					return NULL;
+				}
+
+				memcpy(aGrown, aLines, nLines * sizeof(linehash_t));
+				FreeMemory(aLines);
+
+				aLines = aGrown;
+				nMaxLines *= 2;
+			}
+
+			aLines[nLines].iHash = iHash;
+			aLines[nLines].iOffset = iStart;
+			aLines[nLines].iLength = ((iEnd != -1)? iEnd: i) - iStart;
+			nLines++;
+
+			iHash = 14695981039346656037ULL;
+			iStart = i + 1;
+			iEnd = -1;
+		}
+		else if (buffer[i] == '\r')
+		{
+			// the callback sees the line up to here
+			buffer[i] = '\0';
+
+			if (iEnd == -1)
+			{
+				iEnd = i;
+			}
+		}
+		else if (iEnd == -1)
+		{
+			iHash = (iHash ^ (byte_t)buffer[i]) * 1099511628211ULL;
+		}
+	}
+
+	*pnLines = nLines;
+
+	return aLines;
+}
+
+
+#define LINES_EQUAL(a, b) (((a).iHash == (b).iHash) && ((a).iLength == (b).iLength))
+
+// calls pfnLineCallback only for the lines that differ from the previous run,
+// applying the calls in order at iLine to the previous lines gives the new ones,
+// the state is only updated after a full pass, if the callback stops the next run
+// reports the changes again against the same previous lines
+
+void ParseBufferIncremental(parsestate_t* pps, char* buffer, int iSize, PFLINEDIFFCALLBACK pfnLineCallback, void* param)
+{
+	linehash_t* aOld;
+	linehash_t* aNew;
+	int nOld;
+	int nNew;
+	int iOldEnd;
+	int iNewEnd;
+	int nSkip;
+	bool_t bStopped;
+	int i;
+	int j;
+	int k;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	aNew = _HashLines(buffer, iSize, &nNew);
+
+	if (aNew == NULL)
+	{
+		PROF_STOP(PROF_PARSEBUFFER, 0);
+		return;
+	}
+
+	aOld = pps->aLines;
+	nOld = pps->nLines;
+
+	// common head and tail
+	for (i = 0; (i < nOld) && (i < nNew) && LINES_EQUAL(aOld[i], aNew[i]); i++)
+		;
+
+	for (k = 0; (k < nOld - i) && (k < nNew - i) && LINES_EQUAL(aOld[nOld - 1 - k], aNew[nNew - 1 - k]); k++)
+		;
+
+	iOldEnd = nOld - k;
+	iNewEnd = nNew - k;
+	j = i;
+	bStopped = true;
+
+	PROF_START(1);
+
+	// j is both the new line and the position in the partly updated old lines
+	while ((i < iOldEnd) || (j < iNewEnd))
+	{
+		if (j == iNewEnd)
+		{
+			nSkip = -1;
+		}
+		else if (i == iOldEnd)
+		{
+			nSkip = 1;
+		}
+		else if (LINES_EQUAL(aOld[i], aNew[j]))
+		{
+			i++;
+			j++;
+			continue;
+		}
+		else
+		{
+			// resync on the nearest line found again on the other side
+			nSkip = 0;
+
+			for (k = 1; (k <= DIFF_WINDOW) && (nSkip == 0); k++)
+			{
+				if ((j + k < iNewEnd) && LINES_EQUAL(aOld[i], aNew[j + k]))
+				{
+					nSkip = k;
+				}
+				else if ((i + k < iOldEnd) && LINES_EQUAL(aOld[i + k], aNew[j]))
+				{
+					nSkip = -k;
+				}
+			}
+		}
+
+		if (nSkip > 0)
+		{
+			for (k = 0; k < nSkip; k++, j++)
+			{
+				PROF_ADD(nLines, 1);
+
+				if (!pfnLineCallback(&buffer[aNew[j].iOffset], j, LINE_INSERTED, param))
+				{
+					goto stop;
+				}
+			}
+		}
+		else if (nSkip < 0)
+		{
+			for (k = 0; k < -nSkip; k++, i++)
+			{
+				if (!pfnLineCallback(NULL, j, LINE_DELETED, param))
+				{
+					goto stop;
+				}
+			}
+		}
+		else
+		{
+			PROF_ADD(nLines, 1);
+
+			if (!pfnLineCallback(&buffer[aNew[j].iOffset], j, LINE_CHANGED, param))
+			{
+				goto stop;
+			}
+
+			i++;
+			j++;
+		}
+	}
+
+	bStopped = false;
+
+stop:
+
+	PROF_STOP_QUIET(PROF_CALLBACKS, 1);
+
+	if (bStopped)
+	{
+		FreeMemory(aNew);
+	}
+	else
+	{
+		if (aOld != NULL)
+		{
+			FreeMemory(aOld);
+		}
+
+		pps->aLines = aNew;
+		pps->nLines = nNew;
+	}
+
+	PROF_STOP(PROF_PARSEBUFFER, 0);
+}
+
+
+bool_t ParseFileIncremental(parsestate_t* pps, const char* pszFileName, PFLINEDIFFCALLBACK pfnLineCallback, void* param)
+{
+	bool_t bSuccess;
+	FILE* stream;
+	char* buffer;
+	char szEmpty[1];
+	int iSize;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	bSuccess = false;
+	stream = fopen(pszFileName, "rb");
+
+	if (stream != NULL)
+	{
+		// ReadFileToBuffer() has no buffer for an empty file, but an emptied file
+		// still deletes the lines of the previous run
+		if (_StreamSize(stream) == 0)
+		{
+			szEmpty[0] = '\0';
+			ParseBufferIncremental(pps, szEmpty, 0, pfnLineCallback, param);
+
+			bSuccess = true;
+		}
+		else
+		{
+			buffer = _ReadStreamToBuffer(stream, &iSize);
+
+			if (buffer != NULL)
+			{
+				ParseBufferIncremental(pps, buffer, iSize, pfnLineCallback, param);
+
+				FreeMemory(buffer);
+
+				bSuccess = true;
+			}
+		}
+
+		fclose(stream);
+	}
+
+	PROF_STOP(PROF_PARSEFILE, 0);
+
+	return bSuccess;
+}
+
+
+//
+// directory walker, depth first without recursion
+//
+
+typedef struct dirframe_s
+{
+	HANDLE hFind;
+	bool_t bWide; // opened through a \\?\ path
+	bool_t bValid; // fd holds the next entry
+	int iPathLength;
+	WIN32_FIND_DATA fd;
+} dirframe_t;
+
+typedef struct dirwalk_s
+{
+	pathbuf_t pb; // of the current file
+	dirframe_t* aFrames;
+	int nFrames;
+	int nMaxFrames;
+	bool_t bSubDirs;
+	bool_t bFailed; // a subdir could not be listed
+	WIN32_FIND_DATA fd; // of the current file
+} dirwalk_t;
+
+
+static void _FindDataFromW(WIN32_FIND_DATA* pfd, const WIN32_FIND_DATAW* pfdw)
+{
+	pfd->dwFileAttributes = pfdw->dwFileAttributes;
+	pfd->ftCreationTime = pfdw->ftCreationTime;
+	pfd->ftLastAccessTime = pfdw->ftLastAccessTime;
+	pfd->ftLastWriteTime = pfdw->ftLastWriteTime;
+	pfd->nFileSizeHigh = pfdw->nFileSizeHigh;
+	pfd->nFileSizeLow = pfdw->nFileSizeLow;
+
+	// names are 255 chars at most
+	if (!WideCharToMultiByte(CP_ACP, 0, pfdw->cFileName, -1, pfd->cFileName, MAX_PATH, NULL, NULL))
+	{
+		pfd->cFileName[0] = '?';
+		pfd->cFileName[1] = '\0';
+	}
+
+	pfd->cAlternateFileName[0] = '\0';
+}
+
+
+// the ansi functions stop at MAX_PATH, longer paths go through the wide ones as \\?\ paths
+
+static HANDLE _FindFirstFileLong(const char* pszPath, int iLength, bool_t* pbWide, WIN32_FIND_DATA* pfd)
+{
+	WIN32_FIND_DATAW fdw;
+	wchar_t* pszWide;
+	wchar_t* pszFull;
+	wchar_t* pszLong;
+	HANDLE hFind;
+	int iWideLength;
+	int iFullLength;
+
+	*pbWide = (iLength >= MAX_PATH);
+
+	if (!*pbWide)
+	{
+		return FindFirstFile(pszPath, pfd);
+	}
+
+	hFind = INVALID_HANDLE_VALUE;
+	pszFull = NULL;
+	pszLong = NULL;
+
+	iWideLength = MultiByteToWideChar(CP_ACP, 0, pszPath, -1, NULL, 0);
+	pszWide = (wchar_t*)AllocMemory(iWideLength * sizeof(wchar_t));
+
+	if (pszWide != NULL)
+	{
+		MultiByteToWideChar(CP_ACP, 0, pszPath, -1, pszWide, iWideLength);
+
+		// \\?\ paths must be absolute and can't contain / or .. parts
+		iFullLength = GetFullPathNameW(pszWide, 0, NULL, NULL);
+
+		if (iFullLength != 0)
+		{
+			pszFull = (wchar_t*)AllocMemory(iFullLength * sizeof(wchar_t));
+			pszLong = (wchar_t*)AllocMemory((iFullLength + 8) * sizeof(wchar_t));
+		}
+
+		if ((pszFull != NULL) && (pszLong != NULL) && GetFullPathNameW(pszWide, iFullLength, pszFull, NULL))
+		{
+			if ((pszFull[0] == '\\') && (pszFull[1] == '\\') && (pszFull[2] == '?'))
+			{
+				wcscpy(pszLong, pszFull);
+			}
+			else if ((pszFull[0] == '\\') && (pszFull[1] == '\\'))
+			{
+				// \\server\share -> \\?\UNC\server\share
+				wcscpy(pszLong, L"\\\\?\\UNC");
+				wcscat(pszLong, &pszFull[1]);
+			}
+			else
+			{
+				wcscpy(pszLong, L"\\\\?\\");
+				wcscat(pszLong, pszFull);
+			}
+
+			hFind = FindFirstFileW(pszLong, &fdw);
+		}
+
+		FreeMemory(pszWide);
+	}
+
+	if (pszFull != NULL)
+	{
+		FreeMemory(pszFull);
+	}
+
+	if (pszLong != NULL)
+	{
+		FreeMemory(pszLong);
+	}
+
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		_FindDataFromW(pfd, &fdw);
+	}
+
+	return hFind;
+}
+
+
+static BOOL _FindNextFileLong(HANDLE hFind, bool_t bWide, WIN32_FIND_DATA* pfd)
+{
+	WIN32_FIND_DATAW fdw;
+
+	if (!bWide)
+	{
+		return FindNextFile(hFind, pfd);
+	}
+
+	if (!FindNextFileW(hFind, &fdw))
+	{
+		return FALSE;
+	}
+
+	_FindDataFromW(pfd, &fdw);
+
+	return TRUE;
+}
+
+
+// opens the directory in pdw->pb
+
+static bool_t _PushDirFrame(dirwalk_t* pdw)
+{
+	dirframe_t* pf;
+	int iLength;
+
+	if (pdw->nFrames == pdw->nMaxFrames)
+	{
+		pf = (dirframe_t*)AllocMemory((pdw->nMaxFrames * 2 + 8) * sizeof(dirframe_t));
+
+		if (pf == NULL)
+		{
+			return false;
+		}
+
+		if (pdw->aFrames != NULL)
+		{
+			memcpy(pf, pdw->aFrames, pdw->nFrames * sizeof(dirframe_t));
+			FreeMemory(pdw->aFrames);
+		}
+
+		pdw->aFrames = pf;
+		pdw->nMaxFrames = pdw->nMaxFrames * 2 + 8;
+	}
+
+	pf = &pdw->aFrames[pdw->nFrames];
+
+	iLength = PushPath(&pdw->pb, "*");
+
+	if (iLength < 0)
+	{
+		return false;
+	}
+
+	pf->hFind = _FindFirstFileLong(pdw->pb.psz, pdw->pb.iLength, &pf->bWide, &pf->fd);
+	pf->iPathLength = iLength;
+	pf->bValid = true;
+
+	TruncatePath(&pdw->pb, iLength);
+
+	if (pf->hFind == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	pdw->nFrames++;
+
+	return true;
+}
+
+
+static bool_t _BeginDirWalk(dirwalk_t* pdw, const char* pszPath, bool_t bSubDirs)
+{
+	pdw->aFrames = NULL;
+	pdw->nFrames = 0;
+	pdw->nMaxFrames = 0;
+	pdw->bSubDirs = bSubDirs;
+	pdw->bFailed = false;
+
+	InitPathBuffer(&pdw->pb, pszPath);
+
+	return _PushDirFrame(pdw);
+}
+
+
+// next file, its path is in pdw->pb until the next call, NULL at the end
+
+static WIN32_FIND_DATA* _NextDirWalk(dirwalk_t* pdw)
+{
+	dirframe_t* pf;
+	bool_t bFile;
+	bool_t bDescend;
+	int i;
+
+	while (pdw->nFrames > 0)
+	{
+		pf = &pdw->aFrames[pdw->nFrames - 1];
+
+		if (!pf->bValid)
+		{
+			FindClose(pf->hFind);
+			pdw->nFrames--;
+
+			continue;
+		}
+
+		TruncatePath(&pdw->pb, pf->iPathLength);
+
+		bFile = false;
+		bDescend = false;
+
+		i = 0;
+		while (pf->fd.cFileName[i] == '.')
+		{
+			i++;
+		}
+
+		if (pf->fd.cFileName[i] == '\0')
+		{
+			// . and ..
+		}
+		else if (PushPath(&pdw->pb, pf->fd.cFileName) < 0)
+		{
+			pdw->bFailed = true;
+		}
+		else if (pf->fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			bDescend = pdw->bSubDirs;
+		}
+		else
+		{
+			pdw->fd = pf->fd;
+			bFile = true;
+		}
+
+		// the frame may move when a child is pushed
+		pf->bValid = (bool_t)_FindNextFileLong(pf->hFind, pf->bWide, &pf->fd);
+
+		// the walk goes on without it, the caller learns at the end
+		if (bDescend && !_PushDirFrame(pdw))
+		{
+			pdw->bFailed = true;
+		}
+
+		if (bFile)
+		{
+			return &pdw->fd;
+		}
+	}
+
+	return NULL;
+}
+
+
+static void _EndDirWalk(dirwalk_t* pdw)
+{
+	while (pdw->nFrames > 0)
+	{
+		FindClose(pdw->aFrames[--pdw->nFrames].hFind);
+	}
+
+	if (pdw->aFrames != NULL)
+	{
+		FreeMemory(pdw->aFrames);
+		pdw->aFrames = NULL;
+	}
+
+	FreePathBuffer(&pdw->pb);
+}
+
+
+// true if pszPath could be listed, subdirs that could not are skipped (EndFiles() reports them)
+
+bool_t ParseDirectory(const char* pszPath, bool_t bSubDirs, PDFILECALLBACK pfnFileCallback, void* param)
+{
+	dirwalk_t dw;
+	WIN32_FIND_DATA* pfd;
+	bool_t bSuccess;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	bSuccess = _BeginDirWalk(&dw, pszPath, bSubDirs);
+
+	if (bSuccess)
+	{
+		while ((pfd = _NextDirWalk(&dw)) != NULL)
+		{
+			PROF_ADD(nFiles, 1);
+			PROF_START(1);
+
+			pfnFileCallback(dw.pb.psz, pfd, param);
+
+			PROF_STOP_QUIET(PROF_CALLBACKS, 1);
+		}
+	}
+
+	_EndDirWalk(&dw);
+
+	PROF_STOP(PROF_PARSEDIRECTORY, 0);
+
+	return bSuccess;
+}
+
+
+struct diriter_s
+{
+	dirwalk_t dw;
+};
+
+
+// NULL if the directory can't be listed
+
+diriter_t* BeginFiles(const char* pszPath, bool_t bSubDirs)
+{
+	diriter_t* pit;
+
+	pit = (diriter_t*)AllocMemory(sizeof(diriter_t));
+
+	if (pit == NULL)
+	{
+		return NULL;
+	}
+
+	if (!_BeginDirWalk(&pit->dw, pszPath, bSubDirs))
+	{
+		_EndDirWalk(&pit->dw);
+		FreeMemory(pit);
+
+		return NULL;
+	}
+
+	return pit;
+}
+
+
+// the next file in ParseDirectory() order, the name and find data hold until the next call,
+// ppfd may be NULL, NULL at the end
+
+char* NextFile(diriter_t* pit, WIN32_FIND_DATA** ppfd)
+{
+	WIN32_FIND_DATA* pfd;
+
+	pfd = _NextDirWalk(&pit->dw);
+
+	if (ppfd != NULL)
+	{
+		*ppfd = pfd;
+	}
+
+	return (pfd != NULL)? pit->dw.pb.psz: NULL;
+}
+
+
+// false if a subdir could not be listed
+
+bool_t EndFiles(diriter_t* pit)
+{
+	bool_t bSuccess = !pit->dw.bFailed;
+
+	_EndDirWalk(&pit->dw);
+	FreeMemory(pit);
+
+	return bSuccess;
+}
+
+
+//
+// directory watch
+//
+
+#define WATCH_BUFFER_SIZE 65536 // bytes of change records per read, the limit over the network
+#define WATCH_MAX_NAMES 4096 // interned names kept while nothing is pending
+
+typedef struct watchentry_s
+{
+	const char* pszFileName; // interned, the same name is the same address
+	int iChange; // -1 if the events cancelled out
+	DWORD iTime; // of the last event, restarts the debounce
+} watchentry_t;
+
+struct dirwatch_s
+{
+	HANDLE hDir;
+	OVERLAPPED ov;
+	bool_t bSubDirs;
+	bool_t bPending; // a read is queued
+	bool_t bOverflow; // changes were lost
+	int iDebounce;
+	char* pszPath;
+	pathbuf_t pbName; // of the record being read
+	strtable_t* pstNames;
+	watchentry_t* aEntries;
+	int nEntries;
+	int nMaxEntries;
+	int* aIndex; // entry + 1 by name, 0 if empty, at most half full
+	int iIndexMask;
+	DWORD aBuffer[WATCH_BUFFER_SIZE / sizeof(DWORD)];
+};
+
+
+static void _QueueWatchRead(dirwatch_t* pdw)
+{
+	HANDLE hEvent = pdw->ov.hEvent;
+
+	memset(&pdw->ov, 0, sizeof(OVERLAPPED));
+	pdw->ov.hEvent = hEvent;
+
+	ResetEvent(hEvent);
+
+	pdw->bPending = (bool_t)ReadDirectoryChangesW(pdw->hDir, pdw->aBuffer, sizeof(pdw->aBuffer), pdw->bSubDirs,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+		NULL, &pdw->ov, NULL);
+}
+
+
+// slot in aIndex of the interned name or the empty one to put it in
+
+static int _FindWatchSlot(dirwatch_t* pdw, const char* pszFileName)
+{
+	int i;
+
+	for (i = (int)((unsigned int)((size_t)pszFileName >> 3) * 2654435761u) & pdw->iIndexMask; pdw->aIndex[i] != 0; i = (i + 1) & pdw->iIndexMask)
+	{
+		if (pdw->aEntries[pdw->aIndex[i] - 1].pszFileName == pszFileName)
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+
+static void _IndexWatchEntries(dirwatch_t* pdw)
+{
+	int i;
+
+	memset(pdw->aIndex, 0, (pdw->iIndexMask + 1) * sizeof(int));
+
+	for (i = 0; i < pdw->nEntries; i++)
+	{
+		pdw->aIndex[_FindWatchSlot(pdw, pdw->aEntries[i].pszFileName)] = i + 1;
+	}
+}
+
+
+static bool_t _GrowWatchEntries(dirwatch_t* pdw)
+{
+	watchentry_t* aEntries;
+	int* aIndex;
+	int nMaxEntries;
+	int iIndexSize;
+
+	nMaxEntries = pdw->nMaxEntries * 2 + 16;
+
+	for (iIndexSize = 64; iIndexSize < nMaxEntries * 2; iIndexSize *= 2)
+		;
+
+	aEntries = (watchentry_t*)AllocMemory(nMaxEntries * sizeof(watchentry_t));
+	aIndex = (int*)AllocMemory(iIndexSize * sizeof(int));
+
+	if ((aEntries == NULL) || (aIndex == NULL))
+	{
+		if (aEntries != NULL)
+		{
+			FreeMemory(aEntries);
+		}
+
+		if (aIndex != NULL)
+		{
+			FreeMemory(aIndex);
+		}
+
+		return false;
+	}
+
+	if (pdw->aEntries != NULL)
+	{
+		memcpy(aEntries, pdw->aEntries, pdw->nEntries * sizeof(watchentry_t));
+		FreeMemory(pdw->aEntries);
+		FreeMemory(pdw->aIndex);
+	}
+
+	pdw->aEntries = aEntries;
+	pdw->nMaxEntries = nMaxEntries;
+	pdw->aIndex = aIndex;
+	pdw->iIndexMask = iIndexSize - 1;
+
+	_IndexWatchEntries(pdw);
+
+	return true;
+}
+
+
+// merges the event with a pending one of the same file, returns the interned name
+
+static const char* _AddWatchEvent(dirwatch_t* pdw, const char* pszName, int iLength, int iChange)
+{
+	watchentry_t* pe;
+	const char* pszFileName;
+	int iSlot;
+
+	pszFileName = InternStringN(pdw->pstNames, pszName, iLength);
+
+	if (pszFileName == NULL)
+	{
+		pdw->bOverflow = true;
+		return NULL;
+	}
+
+	iSlot = _FindWatchSlot(pdw, pszFileName);
+
+	if (pdw->aIndex[iSlot] != 0)
+	{
+		pe = &pdw->aEntries[pdw->aIndex[iSlot] - 1];
+
+		if (pe->iChange == -1)
+		{
+			pe->iChange = iChange;
+		}
+		else if ((pe->iChange == WATCH_CREATED) && (iChange == WATCH_DELETED))
+		{
+			// never seen by the caller, dropped when it settles
+			pe->iChange = -1;
+		}
+		else if ((pe->iChange == WATCH_DELETED) && (iChange == WATCH_CREATED))
+		{
+			pe->iChange = WATCH_MODIFIED;
+		}
+		else if (pe->iChange != WATCH_CREATED)
+		{
+			pe->iChange = iChange;
+		}
+
+		pe->iTime = GetTickCount();
+
+		return pszFileName;
+	}
+
+	if (pdw->nEntries == pdw->nMaxEntries)
+	{
+		if (!_GrowWatchEntries(pdw))
+		{
+			pdw->bOverflow = true;
+			return pszFileName;
+		}
+
+		iSlot = _FindWatchSlot(pdw, pszFileName);
+	}
+
+	pe = &pdw->aEntries[pdw->nEntries++];
+	pe->pszFileName = pszFileName;
+	pe->iChange = iChange;
+	pe->iTime = GetTickCount();
+
+	pdw->aIndex[iSlot] = pdw->nEntries;
+
+	return pszFileName;
+}
+
+
+// a directory created or moved in brings its files, one moved within the tree also takes
+// the files of its old name, which is not a file to report itself
+
+static void _AddWatchDirectory(dirwatch_t* pdw, const char* pszDirName, const char* pszOldName)
+{
+	dirwalk_t dw;
+	pathbuf_t pbOld;
+	int iLength;
+	int iOldLength;
+	int iSlot;
+
+	if (pszOldName != NULL)
+	{
+		iSlot = _FindWatchSlot(pdw, pszOldName);
+
+		if (pdw->aIndex[iSlot] != 0)
+		{
+			pdw->aEntries[pdw->aIndex[iSlot] - 1].iChange = -1;
+		}
+	}
+
+	InitPathBuffer(&pbOld, pszOldName);
+	iOldLength = pbOld.iLength;
+
+	if (_BeginDirWalk(&dw, pszDirName, true))
+	{
+		iLength = dw.pb.iLength;
+
+		while (_NextDirWalk(&dw) != NULL)
+		{
+			_AddWatchEvent(pdw, dw.pb.psz, dw.pb.iLength, WATCH_CREATED);
+
+			if ((pszOldName != NULL) && (AppendPath(&pbOld, &dw.pb.psz[iLength]) >= 0))
+			{
+				_AddWatchEvent(pdw, pbOld.psz, pbOld.iLength, WATCH_DELETED);
+				TruncatePath(&pbOld, iOldLength);
+			}
+		}
+	}
+
+	_EndDirWalk(&dw);
+	FreePathBuffer(&pbOld);
+}
+
+
+static void _ReadWatchEvents(dirwatch_t* pdw, DWORD iBytes)
+{
+	FILE_NOTIFY_INFORMATION* pfni;
+	const char* pszFileName;
+	const char* pszOldName;
+	DWORD iAttributes;
+	int iPathLength;
+	int iNameLength;
+	int iChange;
+
+	if (iBytes == 0)
+	{
+		// the system buffer overflowed
+		pdw->bOverflow = true;
+		return;
+	}
+
+	iPathLength = (int)strlen(pdw->pszPath);
+	pfni = (FILE_NOTIFY_INFORMATION*)pdw->aBuffer;
+	pszOldName = NULL;
+
+	for ( ; ; )
+	{
+		switch (pfni->Action)
+		{
+		case FILE_ACTION_ADDED:
+		case FILE_ACTION_RENAMED_NEW_NAME:
+			iChange = WATCH_CREATED;
+			break;
+		case FILE_ACTION_REMOVED:
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			iChange = WATCH_DELETED;
+			break;
+		default:
+			iChange = WATCH_MODIFIED;
+			break;
+		}
+
+		TruncatePath(&pdw->pbName, iPathLength);
+		iNameLength = WideCharToMultiByte(CP_ACP, 0, pfni->FileName, pfni->FileNameLength / sizeof(WCHAR), NULL, 0, NULL, NULL);
+		pszFileName = NULL;
+
+		if (_ReservePath(&pdw->pbName, iPathLength + 1 + iNameLength))
+		{
+			pdw->pbName.psz[iPathLength] = '\\';
+			WideCharToMultiByte(CP_ACP, 0, pfni->FileName, pfni->FileNameLength / sizeof(WCHAR), &pdw->pbName.psz[iPathLength + 1], iNameLength, NULL, NULL);
+			pdw->pbName.iLength = iPathLength + 1 + iNameLength;
+			pdw->pbName.psz[pdw->pbName.iLength] = '\0';
+
+			pszFileName = _AddWatchEvent(pdw, pdw->pbName.psz, pdw->pbName.iLength, iChange);
+		}
+
+		// without subdirectories the files of a new one are not watched
+		if ((pszFileName != NULL) && (iChange == WATCH_CREATED) && pdw->bSubDirs)
+		{
+			iAttributes = GetFileAttributes(pszFileName);
+
+			if ((iAttributes != INVALID_FILE_ATTRIBUTES) && (iAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			{
+				_AddWatchDirectory(pdw, pszFileName, (pfni->Action == FILE_ACTION_RENAMED_NEW_NAME)? pszOldName: NULL);
+			}
+		}
+
+		pszOldName = (pfni->Action == FILE_ACTION_RENAMED_OLD_NAME)? pszFileName: NULL;
+
+		if (pfni->NextEntryOffset == 0)
+		{
+			break;
+		}
+
+		pfni = (FILE_NOTIFY_INFORMATION*)((byte_t*)pfni + pfni->NextEntryOffset);
+	}
+}
+
+
+// reports the events that have settled, skips directories
+
+static int _ReportWatchEvents(dirwatch_t* pdw, PFWATCHCALLBACK pfnWatchCallback, void* param)
+{
+	watchentry_t* pe;
+	strtable_t* pst;
+	DWORD iNow;
+	DWORD iAttributes;
+	int nReported;
+	int i;
+	int j;
+
+	nReported = 0;
+
+	if (pdw->bOverflow)
+	{
+		pdw->bOverflow = false;
+		pfnWatchCallback(pdw->pszPath, WATCH_OVERFLOW, param);
+		nReported++;
+	}
+
+	iNow = GetTickCount();
+
+	for (i = 0, j = 0; i < pdw->nEntries; i++)
+	{
+		pe = &pdw->aEntries[i];
+
+		if ((iNow - pe->iTime) < (DWORD)pdw->iDebounce)
+		{
+			pdw->aEntries[j++] = *pe;
+			continue;
+		}
+
+		if ((pe->iChange == WATCH_CREATED) || (pe->iChange == WATCH_MODIFIED))
+		{
+			iAttributes = GetFileAttributes(pe->pszFileName);
+
+			if (iAttributes == INVALID_FILE_ATTRIBUTES)
+			{
+				pe->iChange = (pe->iChange == WATCH_CREATED)? -1: WATCH_DELETED;
+			}
+			else if (iAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				pe->iChange = -1;
+			}
+		}
+
+		if (pe->iChange != -1)
+		{
+			pfnWatchCallback((char*)pe->pszFileName, pe->iChange, param);
+			nReported++;
+		}
+	}
+
+	if (j != pdw->nEntries)
+	{
+		pdw->nEntries = j;
+		_IndexWatchEntries(pdw);
+	}
+
+	// the names are not freed one by one, start over once nothing refers to them
+	if ((pdw->nEntries == 0) && (pdw->pstNames->nStrings > WATCH_MAX_NAMES))
+	{
+		pst = CreateStringTable(true);
+
+		if (pst != NULL)
+		{
+			FreeStringTable(pdw->pstNames);
+			pdw->pstNames = pst;
+		}
+	}
+
+	return nReported;
+}
+
+
+dirwatch_t* CreateDirectoryWatch(const char* pszPath, bool_t bSubDirs, int iDebounceMs)
+{
+	dirwatch_t* pdw;
+	int iLength;
+
+	pdw = (dirwatch_t*)AllocMemory(sizeof(dirwatch_t));
+
+	if (pdw == NULL)
+	{
+		return NULL;
+	}
+
+	memset(pdw, 0, sizeof(dirwatch_t));
+	InitPathBuffer(&pdw->pbName, NULL);
+
+	pdw->bSubDirs = bSubDirs;
+	pdw->iDebounce = max(iDebounceMs, 0);
+	pdw->pszPath = AllocString(pszPath);
+	pdw->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pdw->hDir = CreateFile(pszPath, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+
+	if ((pdw->pszPath != NULL) && (pdw->ov.hEvent != NULL) && (pdw->hDir != INVALID_HANDLE_VALUE))
+	{
+		// names are reported as path\name
+		iLength = (int)strlen(pdw->pszPath);
+
+		if ((iLength > 0) && ((pdw->pszPath[iLength - 1] == '\\') || (pdw->pszPath[iLength - 1] == '/')))
+		{
+			pdw->pszPath[iLength - 1] = '\0';
+		}
+
+		pdw->pstNames = CreateStringTable(true);
+
+		if ((pdw->pstNames != NULL) && _GrowWatchEntries(pdw) && (AppendPath(&pdw->pbName, pdw->pszPath) >= 0))
+		{
+			_QueueWatchRead(pdw);
+		}
+	}
+
+	if (!pdw->bPending)
+	{
+		FreeDirectoryWatch(pdw);
+		return NULL;
+	}
+
+	return pdw;
+}
+
+
+// waits up to iTimeoutMs (-1 - forever) until a change has settled,
+// returns the number of reported changes or -1 if the watch failed
+
+int PollDirectoryWatch(dirwatch_t* pdw, int iTimeoutMs, PFWATCHCALLBACK pfnWatchCallback, void* param)
+{
+	DWORD iStart;
+	DWORD iElapsed;
+	DWORD iWait;
+	DWORD iDue;
+	DWORD iBytes;
+	int nReported;
+	int i;
+
+	iStart = GetTickCount();
+
+	for ( ; ; )
+	{
+		if (!pdw->bPending)
+		{
+			_QueueWatchRead(pdw);
+
+			if (!pdw->bPending)
+			{
+				return -1;
+			}
+		}
+
+		nReported = _ReportWatchEvents(pdw, pfnWatchCallback, param);
+
+		if (nReported != 0)
+		{
+			return nReported;
+		}
+
+		iElapsed = GetTickCount() - iStart;
+
+		if (iTimeoutMs < 0)
+		{
+			iWait = INFINITE;
+		}
+		else if (iElapsed >= (DWORD)iTimeoutMs)
+		{
+			return 0;
+		}
+		else
+		{
+			iWait = iTimeoutMs - iElapsed;
+		}
+
+		// wake up when the first pending change settles
+		for (i = 0; i < pdw->nEntries; i++)
+		{
+			iElapsed = GetTickCount() - pdw->aEntries[i].iTime;
+			iDue = (iElapsed < (DWORD)pdw->iDebounce)? pdw->iDebounce - iElapsed: 0;
+			iWait = min(iWait, iDue);
+		}
+
+		if (WaitForSingleObject(pdw->ov.hEvent, iWait) == WAIT_OBJECT_0)
+		{
+			pdw->bPending = false;
+
+			if (GetOverlappedResult(pdw->hDir, &pdw->ov, &iBytes, FALSE))
+			{
+				_ReadWatchEvents(pdw, iBytes);
+			}
+			else
+			{
+				pdw->bOverflow = true;
+			}
+		}
+	}
+}
+
+
+typedef struct watchparse_s
+{
+	PDFILECALLBACK pfnFileCallback;
+	PFLINECALLBACK pfnLineCallback;
+	void* param;
+} watchparse_t;
+
+
+static void _WatchParseCallback(char* pszFileName, int iChange, void* param)
+{
+	watchparse_t* pwp = (watchparse_t*)param;
+	WIN32_FIND_DATA fd;
+	HANDLE hFind;
+
+	if ((iChange != WATCH_CREATED) && (iChange != WATCH_MODIFIED))
+	{
+		return;
+	}
+
+	if (pwp->pfnFileCallback != NULL)
+	{
+		hFind = FindFirstFile(pszFileName, &fd);
+
+		if (hFind != INVALID_HANDLE_VALUE)
+		{
+			FindClose(hFind);
+
+			pwp->pfnFileCallback(pszFileName, &fd, pwp->param);
+		}
+	}
+
+	if (pwp->pfnLineCallback != NULL)
+	{
+		ParseFile(pszFileName, pwp->pfnLineCallback, pwp->param);
+	}
+}
+
+
+// runs the file callback and/or ParseFile() with the line callback
+// for each created or modified file, deletions are not passed on
+
+int PollDirectoryWatchFiles(dirwatch_t* pdw, int iTimeoutMs, PDFILECALLBACK pfnFileCallback, PFLINECALLBACK pfnLineCallback, void* param)
+{
+	watchparse_t wp;
+
+	wp.pfnFileCallback = pfnFileCallback;
+	wp.pfnLineCallback = pfnLineCallback;
+	wp.param = param;
+
+	return PollDirectoryWatch(pdw, iTimeoutMs, _WatchParseCallback, &wp);
+}
+
+
+void FreeDirectoryWatch(dirwatch_t* pdw)
+{
+	DWORD iBytes;
+
+	if (pdw->bPending)
+	{
+		// the buffer must outlive the read
+		CancelIo(pdw->hDir);
+		GetOverlappedResult(pdw->hDir, &pdw->ov, &iBytes, TRUE);
+	}
+
+	if ((pdw->hDir != NULL) && (pdw->hDir != INVALID_HANDLE_VALUE))
+	{
+		CloseHandle(pdw->hDir);
+	}
+
+	if (pdw->ov.hEvent != NULL)
+	{
+		CloseHandle(pdw->ov.hEvent);
+	}
+
+	if (pdw->aEntries != NULL)
+	{
+		FreeMemory(pdw->aEntries);
+		FreeMemory(pdw->aIndex);
+	}
+
+	if (pdw->pstNames != NULL)
+	{
+		FreeStringTable(pdw->pstNames);
+	}
+
+	FreePathBuffer(&pdw->pbName);
+	FreeStringSafe(pdw->pszPath);
+
+	FreeMemory(pdw);
+}
+
+
+//
+// directory index
+//
+
+// the file is the flat image of the index: header, dirs, entries, strings,
+// offsets are into the strings and the dirs are in depth first order
+
+#define DIRINDEX_MAGIC		'UIDX'
+#define DIRINDEX_VERSION	1
+
+typedef struct idxheader_s
+{
+	DWORD iMagic;
+	DWORD iVersion;
+	DWORD nDirs;
+	DWORD nEntries;
+	DWORD iStringsSize;
+	DWORD iReserved;
+} idxheader_t;
+
+typedef struct idxdir_s
+{
+	DWORD iPath;
+	DWORD iFirstEntry;
+	DWORD nEntries; // files and subdirs
+	DWORD iReserved;
+	FILETIME ftWrite;
+} idxdir_t;
+
+typedef struct idxentry_s
+{
+	DWORD iName;
+	DWORD iAttributes;
+	FILETIME ftWrite;
+	ULONGLONG iSize;
+} idxentry_t;
+
+struct dirindex_s
+{
+	mappedfile_t mf;
+	char* pszFileName; // that is mapped
+	byte_t* pData; // when not mapped
+	const idxheader_t* pHeader;
+	const idxdir_t* aDirs;
+	const idxentry_t* aEntries;
+	const char* pszStrings;
+};
+
+// index under construction
+typedef struct idxbuilder_s
+{
+	dirindex_t* pdiPrev;
+	int* aiPrevHash; // of pdiPrev dirs by path, -1 is empty
+	int iPrevHashMask;
+	idxdir_t* aDirs;
+	int nDirs;
+	int nMaxDirs;
+	idxentry_t* aEntries;
+	int nEntries;
+	int nMaxEntries;
+	char* pszStrings;
+	int iStringsSize;
+	int iMaxStringsSize;
+	DWORD* aiPending; // paths of the dirs still to list, the next one last
+	int nPending;
+	int nMaxPending;
+	pathbuf_t pb; // of the dir being listed, the strings move as they grow
+} idxbuilder_t;
+
+
+static bool_t _SetIndexData(dirindex_t* pdi, const byte_t* pData, size_t iSize)
+{
+	const idxheader_t* pHeader = (const idxheader_t*)pData;
+	ULONGLONG iNeeded;
+	DWORD i;
+
+	if ((iSize < sizeof(idxheader_t)) || (pHeader->iMagic != DIRINDEX_MAGIC) || (pHeader->iVersion != DIRINDEX_VERSION))
+	{
+		return false;
+	}
+
+	iNeeded = sizeof(idxheader_t) + (ULONGLONG)pHeader->nDirs * sizeof(idxdir_t) +
+		(ULONGLONG)pHeader->nEntries * sizeof(idxentry_t) + pHeader->iStringsSize;
+
+	if (iNeeded != iSize)
+	{
+		return false;
+	}
+
+	pdi->pHeader = pHeader;
+	pdi->aDirs = (const idxdir_t*)(pHeader + 1);
+	pdi->aEntries = (const idxentry_t*)(pdi->aDirs + pHeader->nDirs);
+	pdi->pszStrings = (const char*)(pdi->aEntries + pHeader->nEntries);
+
+	// a damaged file must not send us out of it
+	if ((pHeader->iStringsSize != 0) && (pdi->pszStrings[pHeader->iStringsSize - 1] != '\0'))
+	{
+		return false;
+	}
+
+	for (i = 0; i < pHeader->nDirs; i++)
+	{
+		if ((pdi->aDirs[i].iPath >= pHeader->iStringsSize) || (pdi->aDirs[i].iFirstEntry > pHeader->nEntries) ||
+			(pdi->aDirs[i].nEntries > pHeader->nEntries - pdi->aDirs[i].iFirstEntry))
+		{
+			return false;
+		}
+	}
+
+	for (i = 0; i < pHeader->nEntries; i++)
+	{
+		if (pdi->aEntries[i].iName >= pHeader->iStringsSize)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static void _ClearIndexData(dirindex_t* pdi)
+{
+	if (pdi->mf.pData != NULL)
+	{
+		UnmapFile(&pdi->mf);
+	}
+
+	if (pdi->pData != NULL)
+	{
+		FreeMemory(pdi->pData);
+		pdi->pData = NULL;
+	}
+
+	FreeStringSafe(pdi->pszFileName);
+	pdi->pszFileName = NULL;
+
+	pdi->pHeader = NULL;
+	pdi->aDirs = NULL;
+	pdi->aEntries = NULL;
+	pdi->pszStrings = NULL;
+}
+
+
+// empty index if the file is missing or not a valid index
+
+dirindex_t* LoadDirectoryIndex(const char* pszIndexFile)
+{
+	dirindex_t* pdi;
+
+	pdi = (dirindex_t*)AllocMemory(sizeof(dirindex_t));
+
+	if (pdi == NULL)
+	{
+		return NULL;
+	}
+
+	memset(pdi, 0, sizeof(dirindex_t));
+	pdi->mf.hFile = INVALID_HANDLE_VALUE;
+
+	if ((pszIndexFile != NULL) && MapFileToMemory(pszIndexFile, &pdi->mf))
+	{
+		if (_SetIndexData(pdi, pdi->mf.pData, pdi->mf.iSize))
+		{
+			pdi->pszFileName = AllocString(pszIndexFile);
+		}
+		else
+		{
+			_ClearIndexData(pdi);
+		}
+	}
+
+	return pdi;
+}
+
+
+static bool_t _GrowArray(void** pp, int* pnMax, int nNeeded, int iItemSize)
+{
+	void* pGrown;
+	int nMax;
+
+	if (nNeeded <= *pnMax)
+	{
+		return true;
+	}
+
+	nMax = max(*pnMax * 2, max(nNeeded, 64));
+	pGrown = AllocMemory((size_t)nMax * iItemSize);
+
+	if (pGrown == NULL)
+	{
+		return false;
+	}
+
+	if (*pp != NULL)
+	{
+		memcpy(pGrown, *pp, (size_t)*pnMax * iItemSize);
+		FreeMemory(*pp);
+	}
+
+	*pp = pGrown;
+	*pnMax = nMax;
+
+	return true;
+}
+
+
+static int _AddIndexString(idxbuilder_t* pib, const char* psz)
+{
+	int iLength = (int)strlen(psz) + 1;
+	int iOffset = pib->iStringsSize;
+
+	if (!_GrowArray((void**)&pib->pszStrings, &pib->iMaxStringsSize, iOffset + iLength, 1))
+	{
+		return -1;
+	}
+
+	memcpy(&pib->pszStrings[iOffset], psz, iLength);
+	pib->iStringsSize += iLength;
+
+	return iOffset;
+}
+
+
+
+
+static const idxdir_t* _FindPrevDir(idxbuilder_t* pib, const char* pszPath)
+{
+	const idxdir_t* pDir;
+	int i;
+
+	if (pib->aiPrevHash == NULL)
+	{
+		return NULL;
+	}
+
+	for (i = AsciiStrHash(pszPath) & pib->iPrevHashMask; pib->aiPrevHash[i] != -1; i = (i + 1) & pib->iPrevHashMask)
+	{
+		pDir = &pib->pdiPrev->aDirs[pib->aiPrevHash[i]];
+
+		if (AsciiStrEq(&pib->pdiPrev->pszStrings[pDir->iPath], pszPath))
+		{
+			return pDir;
+		}
+	}
+
+	return NULL;
+}
+
+
+// lists one dir, a dir is only listed again if its time changed, that is when files
+// were added, removed or renamed in it, its subdirs are pushed on aiPending
+
+static bool_t _IndexDirectory(idxbuilder_t* pib, DWORD iPath)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	WIN32_FIND_DATA fd;
+	HANDLE hFind;
+	const idxdir_t* pPrev;
+	idxentry_t* pe;
+	bool_t bSuccess;
+	int iPathLength;
+	int iDir;
+	int iFirst;
+	int iOffset;
+	int i;
+
+	TruncatePath(&pib->pb, 0);
+
+	if (AppendPath(&pib->pb, &pib->pszStrings[iPath]) < 0)
+	{
+		return false;
+	}
+
+	iPathLength = pib->pb.iLength;
+
+	if (!GetFileAttributesEx(pib->pb.psz, GetFileExInfoStandard, &fad) || !(fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		return false;
+	}
+
+	if (!_GrowArray((void**)&pib->aDirs, &pib->nMaxDirs, pib->nDirs + 1, sizeof(idxdir_t)))
+	{
+		return false;
+	}
+
+	iDir = pib->nDirs++;
+	iFirst = pib->nEntries;
+	pib->aDirs[iDir].iPath = iPath;
+	pib->aDirs[iDir].iFirstEntry = iFirst;
+	pib->aDirs[iDir].nEntries = 0;
+	pib->aDirs[iDir].iReserved = 0;
+	pib->aDirs[iDir].ftWrite = fad.ftLastWriteTime;
+
+	pPrev = _FindPrevDir(pib, pib->pb.psz);
+
+	if ((pPrev != NULL) && (CompareFileTime(&pPrev->ftWrite, &fad.ftLastWriteTime) == 0))
+	{
+		if (!_GrowArray((void**)&pib->aEntries, &pib->nMaxEntries, pib->nEntries + pPrev->nEntries, sizeof(idxentry_t)))
+		{
+			return false;
+		}
+
+		for (i = 0; i < (int)pPrev->nEntries; i++)
+		{
+			pe = &pib->aEntries[pib->nEntries];
+			*pe = pib->pdiPrev->aEntries[pPrev->iFirstEntry + i];
+			iOffset = _AddIndexString(pib, &pib->pdiPrev->pszStrings[pe->iName]);
+
+			if (iOffset < 0)
+			{
+				return false;
+			}
+
+			pe->iName = iOffset;
+			pib->nEntries++;
+		}
+	}
+	else
+	{
+		if (AppendPath(&pib->pb, "\\*") < 0)
+		{
+			return false;
+		}
+
+		hFind = FindFirstFile(pib->pb.psz, &fd);
+
+		TruncatePath(&pib->pb, iPathLength);
+
+		if (hFind == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		bSuccess = true;
+
+		do
+		{
+			i = 0;
+			while (fd.cFileName[i] == '.')
+			{
+				i++;
+			}
+			if (fd.cFileName[i] == '\0')
+			{
+				continue;
+			}
+
+			if (!_GrowArray((void**)&pib->aEntries, &pib->nMaxEntries, pib->nEntries + 1, sizeof(idxentry_t)) ||
+				((iOffset = _AddIndexString(pib, fd.cFileName)) < 0))
+			{
+				bSuccess = false;
+				break;
+			}
+
+			pe = &pib->aEntries[pib->nEntries++];
+			pe->iName = iOffset;
+			pe->iAttributes = fd.dwFileAttributes;
+			pe->ftWrite = fd.ftLastWriteTime;
+			pe->iSize = ((ULONGLONG)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+		}
+		while (FindNextFile(hFind, &fd));
+
+		FindClose(hFind);
+
+		if (!bSuccess)
+		{
+			return false;
+		}
+	}
+
+	pib->aDirs[iDir].nEntries = pib->nEntries - iFirst;
+
+	// subdirs are checked even in an unchanged dir, pushed last first so they are
+	// listed in order and the dirs stay in depth first order
+	for (i = pib->nEntries - 1; i >= iFirst; i--)
+	{
+		if (pib->aEntries[i].iAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (PushPath(&pib->pb, &pib->pszStrings[pib->aEntries[i].iName]) < 0)
+			{
+				return false;
+			}
+
+			iOffset = _AddIndexString(pib, pib->pb.psz);
+
+			TruncatePath(&pib->pb, iPathLength);
+
+			if ((iOffset < 0) || !_GrowArray((void**)&pib->aiPending, &pib->nMaxPending, pib->nPending + 1, sizeof(DWORD)))
+			{
+				return false;
+			}
+
+			pib->aiPending[pib->nPending++] = iOffset;
+		}
+	}
+
+	return true;
+}
+
+
+// depth first without recursion, fails if any dir fails
+
+static bool_t _IndexTree(idxbuilder_t* pib, const char* pszPath)
+{
+	int iPath;
+
+	iPath = _AddIndexString(pib, pszPath);
+
+	if ((iPath < 0) || !_GrowArray((void**)&pib->aiPending, &pib->nMaxPending, 1, sizeof(DWORD)))
+	{
+		return false;
+	}
+
+	pib->aiPending[0] = iPath;
+	pib->nPending = 1;
+
+	while (pib->nPending > 0)
+	{
+		if (!_IndexDirectory(pib, pib->aiPending[--pib->nPending]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// rescans pszPath, listing only the directories whose time changed since the last update,
+// sizes and times of files in unchanged directories are not refreshed, if any directory
+// can't be listed it fails and the previous index is kept
+
+bool_t UpdateDirectoryIndex(dirindex_t* pdi, const char* pszPath)
+{
+	idxbuilder_t ib;
+	dirindex_t di;
+	idxheader_t* pHeader;
+	byte_t* pData;
+	size_t iSize;
+	bool_t bSuccess;
+	int i;
+	int j;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	memset(&ib, 0, sizeof(idxbuilder_t));
+	InitPathBuffer(&ib.pb, NULL);
+	ib.pdiPrev = pdi;
+
+	if ((pdi->pHeader != NULL) && (pdi->pHeader->nDirs != 0))
+	{
+		for (ib.iPrevHashMask = 1; ib.iPrevHashMask < (int)pdi->pHeader->nDirs * 2; ib.iPrevHashMask *= 2)
+			;
+
+		ib.aiPrevHash = (int*)AllocMemory(ib.iPrevHashMask * sizeof(int));
+		ib.iPrevHashMask--;
+
+		if (ib.aiPrevHash != NULL)
+		{
+			memset(ib.aiPrevHash, -1, (ib.iPrevHashMask + 1) * sizeof(int));
+
+			for (i = 0; i < (int)pdi->pHeader->nDirs; i++)
+			{
+				for (j = AsciiStrHash(&pdi->pszStrings[pdi->aDirs[i].iPath]) & ib.iPrevHashMask; ib.aiPrevHash[j] != -1; j = (j + 1) & ib.iPrevHashMask)
+					;
+
+				ib.aiPrevHash[j] = i;
+			}
+		}
+	}
+
+	bSuccess = _IndexTree(&ib, pszPath);
+	pData = NULL;
+
+	if (bSuccess)
+	{
+		iSize = sizeof(idxheader_t) + ib.nDirs * sizeof(idxdir_t) + ib.nEntries * sizeof(idxentry_t) + ib.iStringsSize;
+		pData = (byte_t*)AllocMemory(iSize);
+		bSuccess = (pData != NULL);
+	}
+
+	if (bSuccess)
+	{
+		pHeader = (idxheader_t*)pData;
+		pHeader->iMagic = DIRINDEX_MAGIC;
+		pHeader->iVersion = DIRINDEX_VERSION;
+		pHeader->nDirs = ib.nDirs;
+		pHeader->nEntries = ib.nEntries;
+		pHeader->iStringsSize = ib.iStringsSize;
+		pHeader->iReserved = 0;
+
+		memcpy(pHeader + 1, ib.aDirs, ib.nDirs * sizeof(idxdir_t));
+		if (ib.nEntries != 0)
+		{
+			memcpy((idxdir_t*)(pHeader + 1) + ib.nDirs, ib.aEntries, ib.nEntries * sizeof(idxentry_t));
+		}
+
+		memcpy(pData + iSize - ib.iStringsSize, ib.pszStrings, ib.iStringsSize);
+
+		// checked before the previous index is dropped, that one stays on failure
+		memset(&di, 0, sizeof(dirindex_t));
+		bSuccess = _SetIndexData(&di, pData, iSize);
+
+		if (bSuccess)
+		{
+			_ClearIndexData(pdi);
+
+			pdi->pData = pData;
+			pdi->pHeader = di.pHeader;
+			pdi->aDirs = di.aDirs;
+			pdi->aEntries = di.aEntries;
+			pdi->pszStrings = di.pszStrings;
+		}
+		else
+		{
+			FreeMemory(pData);
+		}
+	}
+
+	if (ib.aiPrevHash != NULL)
+	{
+		FreeMemory(ib.aiPrevHash);
+	}
+
+	if (ib.aDirs != NULL)
+	{
+		FreeMemory(ib.aDirs);
+	}
+
+	if (ib.aEntries != NULL)
+	{
+		FreeMemory(ib.aEntries);
+	}
+
+	if (ib.pszStrings != NULL)
+	{
+		FreeMemory(ib.pszStrings);
+	}
+
+	if (ib.aiPending != NULL)
+	{
+		FreeMemory(ib.aiPending);
+	}
+
+	FreePathBuffer(&ib.pb);
+
+	PROF_STOP(PROF_PARSEDIRECTORY, 0);
+
+	return bSuccess;
+}
+
+
+bool_t SaveDirectoryIndex(dirindex_t* pdi, const char* pszIndexFile)
+{
+	if (pdi->pHeader == NULL)
+	{
+		return false;
+	}
+
+	// unchanged since it was loaded, and the file can't be written while mapped
+	if ((pdi->pszFileName != NULL) && FStrEq(pdi->pszFileName, pszIndexFile))
+	{
+		return true;
+	}
+
+	return SaveToFile(pszIndexFile, (void*)pdi->pHeader, (int)(sizeof(idxheader_t) + pdi->pHeader->nDirs * sizeof(idxdir_t) +
+		pdi->pHeader->nEntries * sizeof(idxentry_t) + pdi->pHeader->iStringsSize));
+}
+
+
+// like ParseDirectory() but served from the index, from the root of the last update,
+// the files of a dir come before those of its subdirs and
+// only the attributes, size, write time and name are set in the find data
+
+bool_t EnumDirectoryIndex(dirindex_t* pdi, bool_t bSubDirs, PDFILECALLBACK pfnFileCallback, void* param)
+{
+	WIN32_FIND_DATA fd;
+	const idxdir_t* pDir;
+	const idxentry_t* pe;
+	char* pszFileName;
+	int iMaxLength;
+	int iPathLength;
+	int iLength;
+	int nDirs;
+	int i;
+	int j;
+	PROF_LOCALS;
+
+	if ((pdi->pHeader == NULL) || (pdi->pHeader->nDirs == 0))
+	{
+		return false;
+	}
+
+	PROF_START(0);
+
+	pszFileName = NULL;
+	iMaxLength = 0;
+	nDirs = bSubDirs? pdi->pHeader->nDirs: 1;
+
+	memset(&fd, 0, sizeof(WIN32_FIND_DATA));
+
+	for (i = 0; i < nDirs; i++)
+	{
+		pDir = &pdi->aDirs[i];
+		iPathLength = (int)strlen(&pdi->pszStrings[pDir->iPath]);
+
+		for (j = 0; j < (int)pDir->nEntries; j++)
+		{
+			pe = &pdi->aEntries[pDir->iFirstEntry + j];
+
+			if (pe->iAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				continue;
+			}
+
+			iLength = iPathLength + 1 + (int)strlen(&pdi->pszStrings[pe->iName]) + 1;
+
+			if (iLength > iMaxLength)
+			{
+				FreeStringSafe(pszFileName);
+
+				iMaxLength = max(iLength, 2 * MAX_PATH);
+				pszFileName = (char*)AllocMemory(iMaxLength);
+
+				if (pszFileName == NULL)
+				{
+					PROF_STOP(PROF_PARSEDIRECTORY, 0);
+					return false;
+				}
+			}
+
+			memcpy(pszFileName, &pdi->pszStrings[pDir->iPath], iPathLength);
+			pszFileName[iPathLength] = '\\';
+			strcpy(&pszFileName[iPathLength + 1], &pdi->pszStrings[pe->iName]);
+
+			fd.dwFileAttributes = pe->iAttributes;
+			fd.ftLastWriteTime = pe->ftWrite;
+			fd.nFileSizeHigh = (DWORD)(pe->iSize >> 32);
+			fd.nFileSizeLow = (DWORD)pe->iSize;
+			strncpy(fd.cFileName, &pdi->pszStrings[pe->iName], MAX_PATH - 1);
+
+			PROF_ADD(nFiles, 1);
+			PROF_START(1);
+
+			pfnFileCallback(pszFileName, &fd, param);
+
+			PROF_STOP_QUIET(PROF_CALLBACKS, 1);
+		}
+	}
+
+	FreeStringSafe(pszFileName);
+
+	PROF_STOP(PROF_PARSEDIRECTORY, 0);
+
+	return true;
+}
+
+
+void FreeDirectoryIndex(dirindex_t* pdi)
+{
+	_ClearIndexData(pdi);
+
+	FreeMemory(pdi);
+}
+
+
+//
+// token cache
+//
+
+// the file is the flat image of the tokens: header, lines, args, strings,
+// args are offsets into the strings and each line has a run of them
+
+#define TOKCACHE_MAGIC		'UTKC'
+#define TOKCACHE_VERSION	2
+
+typedef struct tokheader_s
+{
+	DWORD iMagic;
+	DWORD iVersion;
+	ULONGLONG iSourceSize;
+	FILETIME ftSource;
+	ULONGLONG iSourceHash;
+	ULONGLONG iSpecHash;
+	DWORD nLines;
+	DWORD nArgs;
+	DWORD iStringsSize;
+	DWORD nMaxArgs; // of a line
+} tokheader_t;
+
+typedef struct tokline_s
+{
+	DWORD iLine;
+	DWORD iFirstArg;
+	DWORD nArgs;
+} tokline_t;
+
+// tokens under construction
+typedef struct tokbuilder_s
+{
+	const parsespec_t* pspec;
+	char** argv;
+	int iLine;
+	tokline_t* aLines;
+	int nLines;
+	int nMaxLines;
+	DWORD* aArgs;
+	int nArgs;
+	int nMaxArgs;
+	char* pszStrings;
+	int iStringsSize;
+	int iMaxStringsSize;
+	int nMaxLineArgs;
+	bool_t bFailed;
+} tokbuilder_t;
+
+
+static ULONGLONG _HashBytes(const void* p, size_t iSize)
+{
+	const byte_t* pb = (const byte_t*)p;
+	ULONGLONG h = 0;
+	byte_t ab[16];
+	size_t i;
+
+	for (i = 0; i + 16 <= iSize; i += 16)
+	{
+		h = _HashBlock(h, &pb[i]);
+	}
+
+	memset(ab, 0, sizeof(ab));
+	memcpy(ab, &pb[i], iSize - i);
+
+	return _HashBlock(h, ab) ^ (ULONGLONG)iSize;
+}
+
+
+static ULONGLONG _HashSpecString(ULONGLONG h, const char* psz)
+{
+	// NULL and "" must differ
+	return (h * 31) ^ ((psz != NULL)? _HashBytes(psz, strlen(psz) + 1): 1);
+}
+
+
+static ULONGLONG _HashParseSpec(const parsespec_t* pspec)
+{
+	ULONGLONG h;
+
+	h = _HashSpecString(0, pspec->pszCommentStart);
+	h = _HashSpecString(h, pspec->pszCommentEnd);
+	h = _HashSpecString(h, pspec->pszContract);
+	h = _HashSpecString(h, pspec->pszDelimiters);
+
+	return (h * 31) ^ (((ULONGLONG)pspec->cContract << 32) | (DWORD)pspec->argcMax);
+}
+
+
+static const tokheader_t* _CheckTokenCache(const byte_t* pData, size_t iSize)
+{
+	const tokheader_t* pHeader = (const tokheader_t*)pData;
+	const tokline_t* aLines;
+	const DWORD* aArgs;
+	const char* pszStrings;
+	ULONGLONG iNeeded;
+	DWORD i;
+
+	if ((iSize < sizeof(tokheader_t)) || (pHeader->iMagic != TOKCACHE_MAGIC) || (pHeader->iVersion != TOKCACHE_VERSION))
+	{
+		return NULL;
+	}
+
+	iNeeded = sizeof(tokheader_t) + (ULONGLONG)pHeader->nLines * sizeof(tokline_t) +
+		(ULONGLONG)pHeader->nArgs * sizeof(DWORD) + pHeader->iStringsSize;
+
+	if ((iNeeded != iSize) || (pHeader->iStringsSize >= INT_MAX) || (pHeader->nMaxArgs > pHeader->nArgs))
+	{
+		return NULL;
+	}
+
+	aLines = (const tokline_t*)(pHeader + 1);
+	aArgs = (const DWORD*)(aLines + pHeader->nLines);
+	pszStrings = (const char*)(aArgs + pHeader->nArgs);
+
+	// a damaged file must not send us out of it
+	if ((pHeader->iStringsSize != 0) && (pszStrings[pHeader->iStringsSize - 1] != '\0'))
+	{
+		return NULL;
+	}
+
+	for (i = 0; i < pHeader->nLines; i++)
+	{
+		if ((aLines[i].iFirstArg > pHeader->nArgs) || (aLines[i].nArgs > pHeader->nArgs - aLines[i].iFirstArg) ||
+			(aLines[i].nArgs > pHeader->nMaxArgs))
+		{
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < pHeader->nArgs; i++)
+	{
+		if (aArgs[i] >= pHeader->iStringsSize)
+		{
+			return NULL;
+		}
+	}
+
+	return pHeader;
+}
+
+
+// pszStrings is a writable copy of the strings, the callbacks get to change them
+
+static bool_t _ReplayTokens(const tokheader_t* pHeader, char* pszStrings, PFTOKENCALLBACK pfnTokenCallback, void* param)
+{
+	const tokline_t* aLines;
+	const DWORD* aArgs;
+	char** argv;
+	DWORD i;
+	DWORD j;
+
+	aLines = (const tokline_t*)(pHeader + 1);
+	aArgs = (const DWORD*)(aLines + pHeader->nLines);
+
+	argv = (char**)AllocMemory((pHeader->nMaxArgs + 1) * sizeof(char*));
+
+	if (argv == NULL)
+	{
+		return false;
+	}
+
+	for (i = 0; i < pHeader->nLines; i++)
+	{
+		for (j = 0; j < aLines[i].nArgs; j++)
+		{
+			argv[j] = &pszStrings[aArgs[aLines[i].iFirstArg + j]];
+		}
+
+		argv[j] = NULL;
+
+		if (!pfnTokenCallback((int)aLines[i].nArgs, argv, (int)aLines[i].iLine, param))
+		{
+			break;
+		}
+	}
+
+	FreeMemory(argv);
+
+	return true;
+}
+
+
+static int _TokenizeLine(char* pszLine, void* param)
+{
+	tokbuilder_t* ptb = (tokbuilder_t*)param;
+	const parsespec_t* pspec = ptb->pspec;
+	tokline_t* pLine;
+	int iLine;
+	int iLength;
+	int argc;
+	int i;
+
+	iLine = ptb->iLine++;
+
+	if (pspec->pszContract != NULL)
+	{
+		ContractChars(pszLine, pspec->pszContract, pspec->cContract);
+	}
+
+	if (pszLine[0] == '\0')
+	{
+		return 1;
+	}
+
+	argc = ParseLine(pspec->argcMax, ptb->argv, pszLine, pspec->pszDelimiters, NULL);
+
+	if (!_GrowArray((void**)&ptb->aLines, &ptb->nMaxLines, ptb->nLines + 1, sizeof(tokline_t)) ||
+		!_GrowArray((void**)&ptb->aArgs, &ptb->nMaxArgs, ptb->nArgs + argc, sizeof(DWORD)))
+	{
+		ptb->bFailed = true;
+		return 0;
+	}
+
+	pLine = &ptb->aLines[ptb->nLines++];
+	pLine->iLine = iLine;
+	pLine->iFirstArg = ptb->nArgs;
+	pLine->nArgs = argc;
+
+	for (i = 0; i < argc; i++)
+	{
+		iLength = (int)strlen(ptb->argv[i]) + 1;
+
+		if (!_GrowArray((void**)&ptb->pszStrings, &ptb->iMaxStringsSize, ptb->iStringsSize + iLength, 1))
+		{
+			ptb->bFailed = true;
+			return 0;
+		}
+
+		memcpy(&ptb->pszStrings[ptb->iStringsSize], ptb->argv[i], iLength);
+		ptb->aArgs[ptb->nArgs++] = ptb->iStringsSize;
+		ptb->iStringsSize += iLength;
+	}
+
+	ptb->nMaxLineArgs = max(ptb->nMaxLineArgs, argc);
+
+	return 1;
+}
+
+
+// tokenizes the buffer (which is changed) into the flat image of a cache file
+
+static tokheader_t* _TokenizeBuffer(char* buffer, int iSize, const parsespec_t* pspec)
+{
+	tokbuilder_t tb;
+	tokheader_t* pHeader;
+	byte_t* p;
+
+	memset(&tb, 0, sizeof(tb));
+	tb.pspec = pspec;
+	tb.argv = (char**)AllocMemory(pspec->argcMax * sizeof(char*));
+	pHeader = NULL;
+
+	if (tb.argv == NULL)
+	{
+		return NULL;
+	}
+
+	if (pspec->pszCommentStart != NULL)
+	{
+		iSize = _CutCommentsN(buffer, iSize, pspec->pszCommentStart, pspec->pszCommentEnd, true);
+	}
+
+	if (iSize >= 0)
+	{
+		ParseBuffer(buffer, iSize, _TokenizeLine, &tb);
+	}
+
+	if ((iSize >= 0) && !tb.bFailed)
+	{
+		pHeader = (tokheader_t*)AllocMemory(sizeof(tokheader_t) + tb.nLines * sizeof(tokline_t) +
+			tb.nArgs * sizeof(DWORD) + tb.iStringsSize);
+	}
+
+	if (pHeader != NULL)
+	{
+		memset(pHeader, 0, sizeof(tokheader_t));
+		pHeader->iMagic = TOKCACHE_MAGIC;
+		pHeader->iVersion = TOKCACHE_VERSION;
+		pHeader->iSpecHash = _HashParseSpec(pspec);
+		pHeader->nLines = tb.nLines;
+		pHeader->nArgs = tb.nArgs;
+		pHeader->iStringsSize = tb.iStringsSize;
+		pHeader->nMaxArgs = tb.nMaxLineArgs;
+
+		p = (byte_t*)(pHeader + 1);
+
+		if (tb.nLines != 0)
+		{
+			memcpy(p, tb.aLines, tb.nLines * sizeof(tokline_t));
+			p += tb.nLines * sizeof(tokline_t);
+		}
+
+		if (tb.nArgs != 0)
+		{
+			memcpy(p, tb.aArgs, tb.nArgs * sizeof(DWORD));
+			p += tb.nArgs * sizeof(DWORD);
+		}
+
+		if (tb.iStringsSize != 0)
+		{
+			memcpy(p, tb.pszStrings, tb.iStringsSize);
+		}
+	}
+
+	FreeMemory(tb.argv);
+
+	if (tb.aLines != NULL)
+	{
+		FreeMemory(tb.aLines);
+	}
+
+	if (tb.aArgs != NULL)
+	{
+		FreeMemory(tb.aArgs);
+	}
+
+	if (tb.pszStrings != NULL)
+	{
+		FreeMemory(tb.pszStrings);
+	}
+
+	return pHeader;
+}
+
+
+static int _TokenCacheSize(const tokheader_t* pHeader)
+{
+	return (int)(sizeof(tokheader_t) + pHeader->nLines * sizeof(tokline_t) + pHeader->nArgs * sizeof(DWORD) + pHeader->iStringsSize);
+}
+
+
+static char* _TokenStrings(const tokheader_t* pHeader)
+{
+	return (char*)pHeader + _TokenCacheSize(pHeader) - pHeader->iStringsSize;
+}
+
+
+// a cache that only differs in the file time is replayed and its time updated
+
+static bool_t _ReplayTokenCache(mappedfile_t* pmf, const char* pszCacheFile, const FILETIME* pftSource, PFTOKENCALLBACK pfnTokenCallback, void* param)
+{
+	const tokheader_t* pHeader = (const tokheader_t*)pmf->pData;
+	tokheader_t* pCopy;
+	char* pszStrings;
+	bool_t bSuccess;
+
+	// a writable copy of the strings, or of the whole file if it is written back
+	if (CompareFileTime(&pHeader->ftSource, pftSource) == 0)
+	{
+		pszStrings = (char*)AllocMemory(pHeader->iStringsSize + 1);
+		bSuccess = false;
+
+		if (pszStrings != NULL)
+		{
+			memcpy(pszStrings, _TokenStrings(pHeader), pHeader->iStringsSize);
+			bSuccess = _ReplayTokens(pHeader, pszStrings, pfnTokenCallback, param);
+
+			FreeMemory(pszStrings);
+		}
+
+		UnmapFile(pmf);
+
+		return bSuccess;
+	}
+
+	pCopy = (tokheader_t*)AllocMemory(pmf->iSize);
+
+	if (pCopy == NULL)
+	{
+		UnmapFile(pmf);
+		return false;
+	}
+
+	memcpy(pCopy, pHeader, pmf->iSize);
+	UnmapFile(pmf);
+
+	pCopy->ftSource = *pftSource;
+	SaveToFile(pszCacheFile, pCopy, _TokenCacheSize(pCopy));
+
+	bSuccess = _ReplayTokens(pCopy, _TokenStrings(pCopy), pfnTokenCallback, param);
+
+	FreeMemory(pCopy);
+
+	return bSuccess;
+}
+
+
+// replays pszCacheFile while it matches the file's size and time and the spec,
+// and if only the time is off but the content hash is the same, otherwise the file
+// is tokenized and the cache written, pszCacheFile may be NULL for no cache
+
+bool_t ParseFileCached(const char* pszFileName, const char* pszCacheFile, const parsespec_t* pspec, PFTOKENCALLBACK pfnTokenCallback, void* param)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	const tokheader_t* pCached;
+	tokheader_t* pHeader;
+	mappedfile_t mf;
+	ULONGLONG iSourceSize;
+	ULONGLONG iSourceHash;
+	char* buffer;
+	int iSize;
+	bool_t bSuccess;
+
+	if ((pspec->argcMax <= 0) || (pspec->pszDelimiters == NULL) || !GetFileAttributesEx(pszFileName, GetFileExInfoStandard, &fad))
+	{
+		return false;
+	}
+
+	iSourceSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	pCached = NULL;
+	buffer = NULL;
+
+	if ((pszCacheFile != NULL) && MapFileToMemory(pszCacheFile, &mf))
+	{
+		pCached = _CheckTokenCache(mf.pData, mf.iSize);
+
+		if ((pCached != NULL) && ((pCached->iSourceSize != iSourceSize) || (pCached->iSpecHash != _HashParseSpec(pspec))))
+		{
+			pCached = NULL;
+		}
+
+		if ((pCached != NULL) && (CompareFileTime(&pCached->ftSource, &fad.ftLastWriteTime) == 0))
+		{
+			return _ReplayTokenCache(&mf, pszCacheFile, &fad.ftLastWriteTime, pfnTokenCallback, param);
+		}
+
+		if (pCached == NULL)
+		{
+			UnmapFile(&mf);
+		}
+	}
+
+	buffer = ReadFileToBuffer(pszFileName, &iSize);
+
+	if (buffer == NULL)
+	{
+		// empty files can't be read but have no tokens anyway
+		if (iSourceSize == 0)
+		{
+			buffer = AllocString("");
+			iSize = 0;
+		}
+
+		if (buffer == NULL)
+		{
+			if (pCached != NULL)
+			{
+				UnmapFile(&mf);
+			}
+
+			return false;
+		}
+	}
+
+	iSourceHash = _HashBytes(buffer, iSize);
+
+	if (pCached != NULL)
+	{
+		if (pCached->iSourceHash == iSourceHash)
+		{
+			FreeMemory(buffer);
+
+			return _ReplayTokenCache(&mf, pszCacheFile, &fad.ftLastWriteTime, pfnTokenCallback, param);
+		}
+
+		UnmapFile(&mf);
+	}
+
+	pHeader = _TokenizeBuffer(buffer, iSize, pspec);
+
+	FreeMemory(buffer);
+
+	if (pHeader == NULL)
+	{
+		return false;
+	}
+
+	pHeader->iSourceSize = iSourceSize;
+	pHeader->ftSource = fad.ftLastWriteTime;
+	pHeader->iSourceHash = iSourceHash;
+
+	if (pszCacheFile != NULL)
+	{
+		SaveToFile(pszCacheFile, pHeader, _TokenCacheSize(pHeader));
+	}
+
+	bSuccess = _ReplayTokens(pHeader, _TokenStrings(pHeader), pfnTokenCallback, param);
+
+	FreeMemory(pHeader);
+
+	return bSuccess;
+}
+
+
+bool_t ParseFileTokens(const char* pszFileName, const parsespec_t* pspec, PFTOKENCALLBACK pfnTokenCallback, void* param)
+{
+	return ParseFileCached(pszFileName, NULL, pspec, pfnTokenCallback, param);
+}
+
+
+//
+// line index
+//
+
+// line starts are kept as the low 32 bits of their offset plus the full offset of every
+// LINEINDEX_BLOCK-th line, so a lookup is two reads, the file is the flat image: header,
+// bases, starts, the start after the last line is kept too and is the size of the text
+
+#define LINEINDEX_MAGIC		'ULIX'
+#define LINEINDEX_VERSION	1
+#define LINEINDEX_SHIFT		6
+#define LINEINDEX_BLOCK		(1 << LINEINDEX_SHIFT)
+#define LINEINDEX_CHUNK		BAND_SIZE // bytes of text per band
+
+typedef struct lixheader_s
+{
+	DWORD iMagic;
+	DWORD iVersion;
+	ULONGLONG iSourceSize;
+	FILETIME ftSource;
+	DWORD nLines;
+	DWORD nBlocks;
+} lixheader_t;
+
+struct lineindex_s
+{
+	mappedfile_t mfText; // when opened from a file
+	mappedfile_t mfIndex; // when the index file was good
+	byte_t* pData; // when built
+	const char* pText;
+	size_t iSize;
+	const lixheader_t* pHeader;
+	const ULONGLONG* aBase;
+	const DWORD* aStart;
+};
+
+typedef struct lixjob_s
+{
+	const char* pText;
+	size_t iSize;
+	ULONGLONG* anNewlines; // of each chunk, then of the chunks before it
+	ULONGLONG* aBase;
+	DWORD* aStart;
+} lixjob_t;
+
+
+static ULONGLONG _CountNewlines(const char* p, size_t iSize)
+{
+	ULONGLONG n = 0;
+	size_t i = 0;
+#ifdef USE_SSE
+	__m128i nl;
+	__m128i acc;
+	int k;
+
+	nl = _mm_set1_epi8('\n');
+
+	while (i + 16 <= iSize)
+	{
+		acc = _mm_setzero_si128();
+
+		// the byte counters hold up to 255 blocks
+		for (k = 0; (k < 255) && (i + 16 <= iSize); k++, i += 16)
+		{
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&p[i]), nl));
+		}
+
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		n += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+#endif
+
+	for ( ; i < iSize; i++)
+	{
+		n += (p[i] == '\n');
+	}
+
+	return n;
+}
+
+
+static void _CountNewlinesBand(int iFirst, int iLast, void* param)
+{
+	lixjob_t* pjob = (lixjob_t*)param;
+	size_t iOffset;
+	int i;
+
+	for (i = iFirst; i < iLast; i++)
+	{
+		iOffset = (size_t)i * LINEINDEX_CHUNK;
+		pjob->anNewlines[i] = _CountNewlines(&pjob->pText[iOffset], min(pjob->iSize - iOffset, LINEINDEX_CHUNK));
+	}
+}
+
+
+static void _StoreLineStart(lixjob_t* pjob, ULONGLONG iLine, size_t iStart)
+{
+	pjob->aStart[iLine] = (DWORD)iStart;
+
+	if ((iLine & (LINEINDEX_BLOCK - 1)) == 0)
+	{
+		pjob->aBase[iLine >> LINEINDEX_SHIFT] = iStart;
+	}
+}
+
+
+// the line after the n-th newline of the text is line n + 1
+
+static void _StoreLinesBand(int iFirst, int iLast, void* param)
+{
+	lixjob_t* pjob = (lixjob_t*)param;
+	ULONGLONG iLine;
+	size_t iOffset;
+	size_t iEnd;
+	size_t i;
+	int j;
+#ifdef USE_SSE
+	__m128i nl;
+	unsigned int m;
+
+	nl = _mm_set1_epi8('\n');
+#endif
+
+	for (j = iFirst; j < iLast; j++)
+	{
+		iLine = pjob->anNewlines[j] + 1;
+		iOffset = (size_t)j * LINEINDEX_CHUNK;
+		iEnd = iOffset + min(pjob->iSize - iOffset, LINEINDEX_CHUNK);
+		i = iOffset;
+
+#ifdef USE_SSE
+		for ( ; i + 16 <= iEnd; i += 16)
+		{
+			m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&pjob->pText[i]), nl));
+
+			for ( ; m != 0; m &= m - 1)
+			{
+				_StoreLineStart(pjob, iLine++, i + _LowestBit(m) + 1);
+			}
+		}
+#endif
+
+		for ( ; i < iEnd; i++)
+		{
+			if (pjob->pText[i] == '\n')
+			{
+				_StoreLineStart(pjob, iLine++, i + 1);
+			}
+		}
+	}
+}
+
+
+// builds the image of an index file, NULL if the text has too many lines or the lines of
+// a block span 4 gb
+
+static lixheader_t* _BuildLineIndex(const char* pText, size_t iSize)
+{
+	lixheader_t* pHeader;
+	lixjob_t job;
+	ULONGLONG nNewlines;
+	ULONGLONG nLines;
+	ULONGLONG iEnd;
+	int nChunks;
+	int i;
+
+	if ((ULONGLONG)iSize / LINEINDEX_CHUNK >= INT_MAX)
+	{
+		return NULL;
+	}
+
+	nChunks = (int)((iSize + LINEINDEX_CHUNK - 1) / LINEINDEX_CHUNK);
+
+	job.pText = pText;
+	job.iSize = iSize;
+	job.anNewlines = (ULONGLONG*)AllocMemory((nChunks + 1) * sizeof(ULONGLONG));
+
+	if (job.anNewlines == NULL)
+	{
+		return NULL;
+	}
+
+	_ParallelBands(nChunks, 1, _CountNewlinesBand, &job);
+
+	for (i = 0, nNewlines = 0; i < nChunks; i++)
+	{
+		nLines = job.anNewlines[i];
+		job.anNewlines[i] = nNewlines;
+		nNewlines += nLines;
+	}
+
+	// a last line without a newline counts too
+	nLines = nNewlines + (((iSize != 0) && (pText[iSize - 1] != '\n'))? 1: 0);
+	pHeader = NULL;
+
+	if (nLines < INT_MAX)
+	{
+		pHeader = (lixheader_t*)AllocMemory(sizeof(lixheader_t) +
+			(size_t)((nLines >> LINEINDEX_SHIFT) + 1) * sizeof(ULONGLONG) + (size_t)(nLines + 1) * sizeof(DWORD));
+	}
+
+	if (pHeader != NULL)
+	{
+		memset(pHeader, 0, sizeof(lixheader_t));
+		pHeader->iMagic = LINEINDEX_MAGIC;
+		pHeader->iVersion = LINEINDEX_VERSION;
+		pHeader->iSourceSize = iSize;
+		pHeader->nLines = (DWORD)nLines;
+		pHeader->nBlocks = (DWORD)(nLines >> LINEINDEX_SHIFT) + 1;
+
+		job.aBase = (ULONGLONG*)(pHeader + 1);
+		job.aStart = (DWORD*)(job.aBase + pHeader->nBlocks);
+
+		_StoreLineStart(&job, 0, 0);
+		_ParallelBands(nChunks, 1, _StoreLinesBand, &job);
+
+		if (nLines != nNewlines)
+		{
+			_StoreLineStart(&job, nLines, iSize);
+		}
+
+		for (i = 0; i < (int)pHeader->nBlocks; i++)
+		{
+			iEnd = (i + 1 < (int)pHeader->nBlocks)? job.aBase[i + 1]: iSize;
+
+			if (iEnd - job.aBase[i] > 0xFFFFFFFF)
+			{
+				FreeMemory(pHeader);
+				pHeader = NULL;
+				break;
+			}
+		}
+	}
+
+	FreeMemory(job.anNewlines);
+
+	return pHeader;
+}
+
+
+static size_t _LineIndexSize(const lixheader_t* pHeader)
+{
+	return sizeof(lixheader_t) + (size_t)pHeader->nBlocks * sizeof(ULONGLONG) + ((size_t)pHeader->nLines + 1) * sizeof(DWORD);
+}
+
+
+static bool_t _CheckLineIndex(const lixheader_t* pHeader, size_t iSize, ULONGLONG iSourceSize, const FILETIME* pftSource)
+{
+	// the lookups check the offsets, so a damaged file can't send us out of the text
+	return (iSize >= sizeof(lixheader_t)) && (pHeader->iMagic == LINEINDEX_MAGIC) && (pHeader->iVersion == LINEINDEX_VERSION) &&
+		(pHeader->iSourceSize == iSourceSize) && (CompareFileTime(&pHeader->ftSource, pftSource) == 0) &&
+		(pHeader->nLines < INT_MAX) && (pHeader->nBlocks == (pHeader->nLines >> LINEINDEX_SHIFT) + 1) &&
+		(_LineIndexSize(pHeader) == iSize);
+}
+
+
+static void _SetLineIndex(lineindex_t* pli, const lixheader_t* pHeader)
+{
+	pli->pHeader = pHeader;
+	pli->aBase = (const ULONGLONG*)(pHeader + 1);
+	pli->aStart = (const DWORD*)(pli->aBase + pHeader->nBlocks);
+}
+
+
+static lineindex_t* _AllocLineIndex(void)
+{
+	lineindex_t* pli;
+
+	pli = (lineindex_t*)AllocMemory(sizeof(lineindex_t));
+
+	if (pli != NULL)
+	{
+		memset(pli, 0, sizeof(lineindex_t));
+		pli->mfText.hFile = INVALID_HANDLE_VALUE;
+		pli->mfIndex.hFile = INVALID_HANDLE_VALUE;
+	}
+
+	return pli;
+}
+
+
+// the text is not copied and must stay until the index is freed
+
+lineindex_t* BuildLineIndex(const char* pText, size_t iSize)
+{
+	lineindex_t* pli;
+
+	pli = _AllocLineIndex();
+
+	if (pli == NULL)
+	{
+		return NULL;
+	}
+
+	pli->pText = pText;
+	pli->iSize = iSize;
+	pli->pData = (byte_t*)_BuildLineIndex(pText, iSize);
+
+	if (pli->pData == NULL)
+	{
+		FreeLineIndex(pli);
+		return NULL;
+	}
+
+	_SetLineIndex(pli, (const lixheader_t*)pli->pData);
+
+	return pli;
+}
+
+
+// maps the file, the index is loaded from pszIndexFile if that is still good, else it is
+// built and saved there, pszIndexFile may be NULL
+
+lineindex_t* OpenLineIndex(const char* pszFileName, const char* pszIndexFile)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	lineindex_t* pli;
+	lixheader_t* pHeader;
+	ULONGLONG iSize;
+
+	if (!GetFileAttributesEx(pszFileName, GetFileExInfoStandard, &fad))
+	{
+		return NULL;
+	}
+
+	pli = _AllocLineIndex();
+
+	if (pli == NULL)
+	{
+		return NULL;
+	}
+
+	iSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+
+	// empty files can't be mapped
+	if (iSize == 0)
+	{
+		pli->pText = "";
+	}
+	else if (MapFileToMemory(pszFileName, &pli->mfText) && (pli->mfText.iSize == iSize))
+	{
+		pli->pText = (const char*)pli->mfText.pData;
+		pli->iSize = pli->mfText.iSize;
+	}
+	else
+	{
+		FreeLineIndex(pli);
+		return NULL;
+	}
+
+	if ((pszIndexFile != NULL) && MapFileToMemory(pszIndexFile, &pli->mfIndex))
+	{
+		if (_CheckLineIndex((const lixheader_t*)pli->mfIndex.pData, pli->mfIndex.iSize, iSize, &fad.ftLastWriteTime))
+		{
+			_SetLineIndex(pli, (const lixheader_t*)pli->mfIndex.pData);
+			return pli;
+		}
+
+		// stale, and it can't be written while mapped
+		UnmapFile(&pli->mfIndex);
+	}
+
+	pHeader = _BuildLineIndex(pli->pText, pli->iSize);
+
+	if (pHeader == NULL)
+	{
+		FreeLineIndex(pli);
+		return NULL;
+	}
+
+	pHeader->ftSource = fad.ftLastWriteTime;
+	pli->pData = (byte_t*)pHeader;
+	_SetLineIndex(pli, pHeader);
+
+	if ((pszIndexFile != NULL) && (_LineIndexSize(pHeader) < INT_MAX))
+	{
+		SaveToFile(pszIndexFile, pHeader, (int)_LineIndexSize(pHeader));
+	}
+
+	return pli;
+}
+
+
+int GetLineCount(const lineindex_t* pli)
+{
+	return (int)pli->pHeader->nLines;
+}
+
+
+static ULONGLONG _LineStart(const lineindex_t* pli, int iLine)
+{
+	ULONGLONG iBase = pli->aBase[iLine >> LINEINDEX_SHIFT];
+
+	return iBase + (DWORD)(pli->aStart[iLine] - (DWORD)iBase);
+}
+
+
+// lines iFirst to iLast as they are in the text, without the newline (and '\r') of the last
+
+const char* GetIndexedLines(const lineindex_t* pli, int iFirst, int iLast, size_t* piLength)
+{
+	ULONGLONG iStart;
+	ULONGLONG iEnd;
+
+	if ((iFirst < 0) || (iFirst > iLast) || (iLast >= (int)pli->pHeader->nLines))
+	{
+		return NULL;
+	}
+
+	iStart = _LineStart(pli, iFirst);
+	iEnd = _LineStart(pli, iLast + 1);
+
+	if ((iStart > iEnd) || (iEnd > pli->iSize))
+	{
+		return NULL;
+	}
+
+	if ((iEnd > iStart) && (pli->pText[iEnd - 1] == '\n'))
+	{
+		iEnd--;
+	}
+
+	if ((iEnd > iStart) && (pli->pText[iEnd - 1] == '\r'))
+	{
+		iEnd--;
+	}
+
+	*piLength = (size_t)(iEnd - iStart);
+
+	return &pli->pText[iStart];
+}
+
+
+// not terminated, NULL if there is no such line
+
+const char* GetIndexedLine(const lineindex_t* pli, int iLine, int* piLength)
+{
+	const char* psz;
+	size_t iLength;
+
+	psz = GetIndexedLines(pli, iLine, iLine, &iLength);
+
+	if ((psz == NULL) || (iLength > INT_MAX))
+	{
+		return NULL;
+	}
+
+	*piLength = (int)iLength;
+
+	return psz;
+}
+
+
+void FreeLineIndex(lineindex_t* pli)
+{
+	if (pli->mfIndex.pData != NULL)
+	{
+		UnmapFile(&pli->mfIndex);
+	}
+
+	if (pli->mfText.pData != NULL)
+	{
+		UnmapFile(&pli->mfText);
+	}
+
+	if (pli->pData != NULL)
+	{
+		FreeMemory(pli->pData);
+	}
+
+	FreeMemory(pli);
+}
+
+
+//
+// bitmap support
+//
+
+/*
+bool_t LoadBitmapFromFile(const char* pszFileName, bitmap_t* pbmp)
+{
+	FILE* stream;
+	bool_t bSuccess = false;
+	int i;
+
+	memset(pbmp, 0, sizeof(bitmap_t));
+
+	stream = fopen(pszFileName, "rb");
+
+	if (stream != NULL)
+	{
+		BITMAPFILEHEADER bmf;
+		BITMAPINFOHEADER bmi;
+
+		fread(&bmf, sizeof(BITMAPFILEHEADER), 1, stream);
+
+		if (bmf.bfType == 'MB')
+		{
+			fread(&bmi, sizeof(BITMAPINFOHEADER), 1, stream);
+			
+			if (bmi.biCompression == BI_RGB)
+			{
+				if ((bmi.biBitCount == 8) || (bmi.biBitCount == 24) || (bmi.biBitCount == 32))
+				{
+					pbmp->iWidth = bmi.biWidth;
+					pbmp->iHeight = (bmi.biHeight > 0)? bmi.biHeight: -bmi.biHeight;
+					pbmp->nBPP = bmi.biBitCount / 8;
+					pbmp->iPitch = DWORD_ALIGNED(pbmp->iWidth * pbmp->nBPP);
+					pbmp->pixels = (byte_t*)AllocMemory(pbmp->iPitch * pbmp->iHeight);
+
+					if (pbmp->nBPP == 1)
+					{
+						pbmp->nColors = (bmi.biClrUsed == 0)? 256: bmi.biClrUsed;
+						pbmp->pal = (RGBQUAD*)AllocMemory(pbmp->nColors * sizeof(RGBQUAD));
+						fread(pbmp->pal, pbmp->nColors * sizeof(RGBQUAD), 1, stream);
+					}
+
+					fseek(stream, bmf.bfOffBits, SEEK_SET);
+
+					if (bmi.biHeight > 0)
+					{
+						for (i = 0; i < pbmp->iHeight; i++)
+						{
+							fread(&pbmp->pixels[((pbmp->iHeight - 1) - i) * pbmp->iPitch], pbmp->iPitch, 1, stream);
+						}
+					}
+					else
+					{
+						for (i = 0; i < pbmp->iHeight; i++)
+						{
+							fread(&pbmp->pixels[i * pbmp->iPitch], pbmp->iPitch, 1, stream);
+						}
+					}
+
+					bSuccess = true;
+				}
+			}
+		}
+
+		fclose(stream);
+	}
+
+	return bSuccess;
+}
+
+void FreeBitmap(bitmap_t* pbmp)
+{
+	if (pbmp->pixels != NULL)
+	{
+		FreeMemory(pbmp->pixels);
+	}
+
+	if (pbmp->nBPP == 1)
+	{
+		if (pbmp->pal != NULL)
+		{
+			FreeMemory(pbmp->pal);
+		}
+	}
+}
+*/
+
+// rows are padded to iRowAlign bytes (a power of two, 4 at least),
+// pixels start at a cache line or at iRowAlign if that is larger.
+// on failure nothing stays allocated
+
+static bool_t _InitBitmap( bitmap_t* pbmp, int iWidth, int iHeight, int nBPP, int nColors, int iRowAlign )
+{
+	iRowAlign = max(iRowAlign, 4);
+
+	pbmp->iWidth = iWidth;
+	pbmp->iHeight = iHeight;
+	pbmp->nBPP = nBPP;
+	pbmp->iPitch = ALIGNED(pbmp->iWidth * pbmp->nBPP, iRowAlign);
+	pbmp->pixels = (byte_t*)AllocMemoryAligned(pbmp->iPitch * pbmp->iHeight, max(iRowAlign, CACHE_LINE_SIZE));
+	pbmp->pAlignedPixels = pbmp->pixels;
+
+	if ( nColors )
+	{
+		pbmp->nColors = nColors;
+		pbmp->pal = (RGBQUAD*)AllocMemory(pbmp->nColors * sizeof(RGBQUAD));
+	}
+	else
+	{
+		pbmp->nColors = 0;
+		pbmp->pal = NULL;
+	}
+
+	if ((pbmp->pixels == NULL) || ((nColors != 0) && (pbmp->pal == NULL)))
+	{
+		FreeMemoryAligned(pbmp->pixels);
+		FreeMemory(pbmp->pal);
+		return false;
+	}
+
+	return true;
+}
+
+
+bitmap_t* AllocBitmapEx( int iWidth, int iHeight, int nBPP, int nColors, int iRowAlign )
+{
+	bitmap_t* pbmp;
+
+	// ALIGNED() and the aligned allocation need a power of two
+	if ((iRowAlign <= 0) || ((iRowAlign & (iRowAlign - 1)) != 0))
+	{
+		return NULL;
+	}
+
+	pbmp = (bitmap_t*)AllocMemory( sizeof(bitmap_t) );
+
+	if ( pbmp == NULL )
+	{
+		return NULL;
+	}
+
+	if ( !_InitBitmap( pbmp, iWidth, iHeight, nBPP, nColors, iRowAlign ) )
+	{
+		FreeMemory( pbmp );
+		return NULL;
+	}
+
+	return pbmp;
+}
+
+
+bitmap_t* AllocBitmap( int iWidth, int iHeight, int nBPP, int nColors )
+{
+	return AllocBitmapEx( iWidth, iHeight, nBPP, nColors, 4 );
+}
+
+
+// validates everything LoadBitmapFromFileEx() trusts before it allocates,
+// sizes are computed in 64 bits and must fit both an int and the file
+
+static int _CheckBitmapHeaders(const BITMAPFILEHEADER* pbmf, const BITMAPINFOHEADER* pbmi, LONGLONG iFileSize)
+{
+	LONGLONG iHeaderEnd;
+	LONGLONG iFileRowSize;
+	LONGLONG iDataSize;
+	int nColors;
+
+	if (pbmf->bfType != 'MB')
+	{
+		return UERR_FORMAT;
+	}
+
+	if ((pbmi->biSize < sizeof(BITMAPINFOHEADER)) || (pbmi->biSize > iFileSize))
+	{
+		return UERR_FORMAT;
+	}
+
+	if (pbmi->biCompression != BI_RGB)
+	{
+		return UERR_UNSUPPORTED;
+	}
+
+	if ((pbmi->biBitCount != 8) && (pbmi->biBitCount != 24) && (pbmi->biBitCount != 32))
+	{
+		return UERR_UNSUPPORTED;
+	}
+
+	if ((pbmi->biWidth <= 0) || (pbmi->biHeight == 0) || (pbmi->biHeight == INT_MIN))
+	{
+		return UERR_FORMAT;
+	}
+
+	iFileRowSize = (((LONGLONG)pbmi->biWidth * (pbmi->biBitCount / 8)) + 3) & ~(LONGLONG)3;
+
+	if (iFileRowSize > INT_MAX)
+	{
+		return UERR_OVERFLOW;
+	}
+
+	iDataSize = iFileRowSize * ((pbmi->biHeight > 0)? pbmi->biHeight: -pbmi->biHeight);
+
+	if (iDataSize > INT_MAX)
+	{
+		return UERR_OVERFLOW;
+	}
+
+	iHeaderEnd = sizeof(BITMAPFILEHEADER) + pbmi->biSize;
+
+	if (pbmi->biBitCount == 8)
+	{
+		if (pbmi->biClrUsed > 256)
+		{
+			return UERR_FORMAT;
+		}
+
+		nColors = (pbmi->biClrUsed == 0)? 256: pbmi->biClrUsed;
+		iHeaderEnd += nColors * sizeof(RGBQUAD);
+	}
+
+	if (pbmf->bfOffBits < iHeaderEnd)
+	{
+		return UERR_FORMAT;
+	}
+
+	if (pbmf->bfOffBits + iDataSize > iFileSize)
+	{
+		return UERR_TRUNCATED;
+	}
+
+	return UERR_OK;
+}
+
+
+// for files from untrusted sources, piError gets UERR_OK or the reason of the failure
+
+bitmap_t* LoadBitmapFromFileEx(const char* pszFileName, int* piError)
+{
+	FILE* stream;
+	BITMAPFILEHEADER bmf;
+	BITMAPINFOHEADER bmi;
+	bitmap_t* pbmp = NULL;
+	long iFileSize;
+	int iFileRowSize;
+	int iError;
+	int i;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	stream = fopen(pszFileName, "rb");
+
+	if (stream == NULL)
+	{
+		iError = UERR_IO;
+	}
+	else
+	{
+		iFileSize = _StreamSize(stream);
+
+		if (iFileSize < 0)
+		{
+			iError = UERR_IO;
+		}
+		else if (!fread(&bmf, sizeof(BITMAPFILEHEADER), 1, stream) || !fread(&bmi, sizeof(BITMAPINFOHEADER), 1, stream))
+		{
+			iError = UERR_TRUNCATED;
+		}
+		else
+		{
+			iError = _CheckBitmapHeaders(&bmf, &bmi, iFileSize);
+		}
+
+		if (iError == UERR_OK)
+		{
+			pbmp = AllocBitmap(bmi.biWidth, (bmi.biHeight > 0)? bmi.biHeight: -bmi.biHeight, bmi.biBitCount / 8,
+				(bmi.biBitCount == 8)? ((bmi.biClrUsed == 0)? 256: bmi.biClrUsed): 0);
+
+			if (pbmp == NULL)
+			{
+				iError = UERR_NOMEM;
+			}
+			else if (pbmp->nBPP == 1)
+			{
+				// the palette follows the info header, which may be a v4/v5 one
+				fseek(stream, sizeof(BITMAPFILEHEADER) + bmi.biSize, SEEK_SET);
+
+				if (!fread(pbmp->pal, pbmp->nColors * sizeof(RGBQUAD), 1, stream))
+				{
+					iError = UERR_TRUNCATED;
+				}
+			}
+		}
+
+		if (iError == UERR_OK)
+		{
+			fseek(stream, bmf.bfOffBits, SEEK_SET);
+
+			// file rows are dword aligned, ours may be wider
+			iFileRowSize = DWORD_ALIGNED(pbmp->iWidth * pbmp->nBPP);
+
+			if (bmi.biHeight > 0)
+			{
+				for (i = 0; (i < pbmp->iHeight) && (iError == UERR_OK); i++)
+				{
+					if (!fread(&pbmp->pixels[((pbmp->iHeight - 1) - i) * pbmp->iPitch], iFileRowSize, 1, stream))
+					{
+						iError = UERR_TRUNCATED;
+					}
+				}
+			}
+			else if (iFileRowSize == pbmp->iPitch)
+			{
+				if (fread(pbmp->pixels, iFileRowSize, pbmp->iHeight, stream) != (size_t)pbmp->iHeight)
+				{
+					iError = UERR_TRUNCATED;
+				}
+			}
+			else
+			{
+				for (i = 0; (i < pbmp->iHeight) && (iError == UERR_OK); i++)
+				{
+					if (!fread(&pbmp->pixels[i * pbmp->iPitch], iFileRowSize, 1, stream))
+					{
+						iError = UERR_TRUNCATED;
+					}
+				}
+			}
+
+			PROF_ADD(nPixels, pbmp->iWidth * pbmp->iHeight);
+		}
+
+		if ((iError != UERR_OK) && (pbmp != NULL))
+		{
+			FreeBitmap(pbmp);
+			pbmp = NULL;
+		}
+
+		fclose(stream);
+	}
+
+	if (piError != NULL)
+	{
+		(*piError) = iError;
+	}
+
+	PROF_STOP(PROF_LOADBITMAP, 0);
+
+	return pbmp;
+}
+
+
+bitmap_t* LoadBitmapFromFile(const char* pszFileName)
+{
+	return LoadBitmapFromFileEx(pszFileName, NULL);
+}
+
+
+// pixels AllocBitmap() made are aligned, pixels attached by hand are plain
+
+void FreeBitmap(bitmap_t* pbmp)
+{
+	if (pbmp->pixels != NULL)
+	{
+		if (pbmp->pixels == pbmp->pAlignedPixels)
+		{
+			FreeMemoryAligned(pbmp->pixels);
+		}
+		else
+		{
+			FreeMemory(pbmp->pixels);
+		}
+	}
+
+	if (pbmp->pal != NULL)
+	{
+		FreeMemory(pbmp->pal);
+	}
+
+	FreeMemory( pbmp );
+}
+
+/*
+void GenerateGrayscalePal(RGBQUAD* pa)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		pa[i].rgbRed = pa[i].rgbGreen = pa[i].rgbRed = (unsigned)i;
+		pa[i].rgbReserved = 255;
+	}
+}
+*/
+
+bool_t SaveBitmap(const char* pszFileName, bitmap_t* pbmp)
+{
+	FILE* stream;
 	BITMAPFILEHEADER bmf;
 	BITMAPINFOHEADER bmi;
+	static const byte_t abPadding[4];
 	int iDataSize;
 	int iPaletteSize;
 	int iHeaderSize;
 	int iFileSize;
-	int iPitchDiff;
+	int iRowSize;
+	int iPadding;
 	int bInvertOrder;
+	bool_t bSuccess;
+	int i;
+	PROF_LOCALS;
+
+	PROF_START(0);
+
+	bSuccess = false;
+
+	if (pbmp->iHeight < 0)
+	{
+		pbmp->iHeight = -pbmp->iHeight;
+		bInvertOrder = 1;
+	}
+	else
+	{
+		bInvertOrder = 0;
+	}
+
+	stream = fopen(pszFileName, "wb");
+
+	if (stream != NULL)
+	{
+		// the file wants dword aligned rows whatever our pitch is
+		iRowSize = pbmp->iWidth * pbmp->nBPP;
+		iPadding = DWORD_ALIGNED(iRowSize) - iRowSize;
+
+		iPaletteSize = (pbmp->nBPP == 1)? pbmp->nColors * sizeof(RGBQUAD): 0;
+		iHeaderSize = DWORD_ALIGNED(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + iPaletteSize);
+		iDataSize = (iRowSize + iPadding) * pbmp->iHeight;
+		iFileSize = iHeaderSize + iDataSize;
+
+		memset(&bmf, 0, sizeof(BITMAPFILEHEADER));
+		bmf.bfType = 'MB';
+		bmf.bfSize = iFileSize;
+		bmf.bfOffBits = iHeaderSize;
+		fwrite(&bmf, sizeof(BITMAPFILEHEADER), 1, stream);
+
+		memset(&bmi, 0, sizeof(BITMAPINFOHEADER));
+		bmi.biSize = sizeof(BITMAPINFOHEADER);
+		bmi.biWidth = pbmp->iWidth;
+		bmi.biHeight = bInvertOrder? pbmp->iHeight: -pbmp->iHeight;
+		bmi.biPlanes = 1;
+		bmi.biBitCount = pbmp->nBPP * 8;
+		bmi.biClrUsed = (pbmp->nColors == 256)? 0: pbmp->nColors;
+		fwrite(&bmi, sizeof(BITMAPINFOHEADER), 1, stream);
+
+		if (pbmp->nBPP == 1)
+		{
+			// if (pbmp->pal != NULL)
+			fwrite(pbmp->pal, iPaletteSize, 1, stream);
+		}
+
+		fseek(stream, iHeaderSize, SEEK_SET);
+
+		if (pbmp->iPitch == iRowSize + iPadding)
+		{
+			fwrite(pbmp->pixels, iDataSize, 1, stream);
+		}
+		else
+		{
+			for (i = 0; i < pbmp->iHeight; i++)
+			{
+				fwrite(&pbmp->pixels[i * pbmp->iPitch], iRowSize, 1, stream);
+				if (iPadding)
+				{
+					fwrite(abPadding, iPadding, 1, stream);
+				}
+			}
+		}
+
+		fclose(stream);
+
+		bSuccess = true;
+	}
+
+	PROF_STOP(PROF_SAVEBITMAP, 0);
+
+	return bSuccess;
+}
+
+
+bool_t SaveBitmapIndirect(const char* pszFileName, int iWidth, int iHeight, int nBPP, int iPitch, byte_t* pixels, int nColors, RGBQUAD* pal)
+{
+	bitmap_t bmp =
+	{
+		iWidth,
+		iHeight,
+		nBPP,
+		iPitch,
+		pixels,
+		nColors,
+		pal,
+		NULL
+	};
+
+	return SaveBitmap(pszFileName, &bmp);
+}
+
+
+
+//
+// bitmap format conversion
+//
+
+typedef void (*PFCONVERTROW)(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut);
+
+
+static void _ConvertRowCopy(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	(void)lut;
+
+	memcpy(pDst, pSrc, n);
+}
+
+
+static void _ConvertRow8To24(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	DWORD c;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		c = lut[pSrc[i]];
+		pDst[0] = (byte_t)c;
+		pDst[1] = (byte_t)(c >> 8);
+		pDst[2] = (byte_t)(c >> 16);
+		pDst += 3;
+	}
+}
+
+
+static void _ConvertRow8To32(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		((DWORD*)pDst)[i] = lut[pSrc[i]];
+	}
+}
+
+
+static void _ConvertRow24To32(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	int i;
+
+	(void)lut;
+
+	for (i = 0; i < n; i++)
+	{
+		pDst[0] = pSrc[0];
+		pDst[1] = pSrc[1];
+		pDst[2] = pSrc[2];
+		pDst[3] = 255;
+		pDst += 4;
+		pSrc += 3;
+	}
+}
+
+
+static void _ConvertRow32To24(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	int i;
+
+	(void)lut;
+
+	for (i = 0; i < n; i++)
+	{
+		pDst[0] = pSrc[0];
+		pDst[1] = pSrc[1];
+		pDst[2] = pSrc[2];
+		pDst += 3;
+		pSrc += 4;
+	}
+}
+
+
+#ifdef USE_SSE
+
+// 16 pixels per step: 48 source bytes spread to 64
+TARGET_SSSE3 static void _ConvertRow24To32_SSSE3(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	__m128i mask;
+	__m128i alpha;
+	__m128i a, b, c;
+	int i;
+
+	mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	alpha = _mm_set1_epi32((int)0xFF000000);
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		a = _mm_loadu_si128((const __m128i*)&pSrc[0]);
+		b = _mm_loadu_si128((const __m128i*)&pSrc[16]);
+		c = _mm_loadu_si128((const __m128i*)&pSrc[32]);
+
+		_mm_storeu_si128((__m128i*)&pDst[0], _mm_or_si128(_mm_shuffle_epi8(a, mask), alpha));
+		_mm_storeu_si128((__m128i*)&pDst[16], _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask), alpha));
+		_mm_storeu_si128((__m128i*)&pDst[32], _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask), alpha));
+		_mm_storeu_si128((__m128i*)&pDst[48], _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), mask), alpha));
+
+		pSrc += 48;
+		pDst += 64;
+	}
+
+	_ConvertRow24To32(pDst, pSrc, n - i, lut);
+}
+
+
+// 16 pixels per step: 64 source bytes packed to 48
+TARGET_SSSE3 static void _ConvertRow32To24_SSSE3(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	__m128i mask;
+	__m128i a, b, c, d;
+	int i;
+
+	mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&pSrc[0]), mask);
+		b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&pSrc[16]), mask);
+		c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&pSrc[32]), mask);
+		d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&pSrc[48]), mask);
+
+		_mm_storeu_si128((__m128i*)&pDst[0], _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128((__m128i*)&pDst[16], _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128((__m128i*)&pDst[32], _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+
+		pSrc += 64;
+		pDst += 48;
+	}
+
+	_ConvertRow32To24(pDst, pSrc, n - i, lut);
+}
+
+
+// 8 pixels per step, the 32 byte load reads 8 bytes ahead so stop early
+TARGET_AVX2 static void _ConvertRow24To32_AVX2(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	__m256i idx;
+	__m256i mask;
+	__m256i alpha;
+	__m256i v;
+	int i;
+
+	idx = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	mask = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	alpha = _mm256_set1_epi32((int)0xFF000000);
+
+	for (i = 0; i + 11 <= n; i += 8)
+	{
+		v = _mm256_loadu_si256((const __m256i*)pSrc);
+		v = _mm256_permutevar8x32_epi32(v, idx);
+		v = _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha);
+		_mm256_storeu_si256((__m256i*)pDst, v);
+
+		pSrc += 24;
+		pDst += 32;
+	}
+
+	_ConvertRow24To32_SSSE3(pDst, pSrc, n - i, lut);
+}
+
+
+// 8 pixels per step, the 32 byte store writes 8 bytes ahead so stop early
+TARGET_AVX2 static void _ConvertRow32To24_AVX2(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	__m256i idx;
+	__m256i mask;
+	__m256i v;
+	int i;
+
+	idx = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	mask = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	for (i = 0; i + 11 <= n; i += 8)
+	{
+		v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)pSrc), mask);
+		v = _mm256_permutevar8x32_epi32(v, idx);
+		_mm256_storeu_si256((__m256i*)pDst, v);
+
+		pSrc += 32;
+		pDst += 24;
+	}
+
+	_ConvertRow32To24_SSSE3(pDst, pSrc, n - i, lut);
+}
+
+
+TARGET_AVX2 static void _ConvertRow8To32_AVX2(byte_t* pDst, const byte_t* pSrc, int n, const DWORD* lut)
+{
+	__m256i idx;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&pSrc[i]));
+		_mm256_storeu_si256((__m256i*)&pDst[i * 4], _mm256_i32gather_epi32((const int*)lut, idx, 4));
+	}
+
+	_ConvertRow8To32(&pDst[i * 4], &pSrc[i], n - i, lut);
+}
+
+#endif // USE_SSE
+
+
+static PFCONVERTROW _GetConvertRowFunc(int nDstBPP, int nSrcBPP)
+{
+	int iFeatures;
+
+	iFeatures = _GetCpuFeatures();
+
+	if (nDstBPP == nSrcBPP)
+	{
+		return _ConvertRowCopy;
+	}
+
+	if (nSrcBPP == 1)
+	{
+		if (nDstBPP == 3)
+		{
+			return _ConvertRow8To24;
+		}
+		else if (nDstBPP == 4)
+		{
+#ifdef USE_SSE
+			if (iFeatures & CPU_AVX2)
+			{
+				return _ConvertRow8To32_AVX2;
+			}
+#endif
+			return _ConvertRow8To32;
+		}
+	}
+	else if ((nSrcBPP == 3) && (nDstBPP == 4))
+	{
+#ifdef USE_SSE
+		if (iFeatures & CPU_AVX2)
+		{
+			return _ConvertRow24To32_AVX2;
+		}
+		if (iFeatures & CPU_SSSE3)
+		{
+			return _ConvertRow24To32_SSSE3;
+		}
+#endif
+		return _ConvertRow24To32;
+	}
+	else if ((nSrcBPP == 4) && (nDstBPP == 3))
+	{
+#ifdef USE_SSE
+		if (iFeatures & CPU_AVX2)
+		{
+			return _ConvertRow32To24_AVX2;
+		}
+		if (iFeatures & CPU_SSSE3)
+		{
+			return _ConvertRow32To24_SSSE3;
+		}
+#endif
+		return _ConvertRow32To24;
+	}
+
+	return NULL;
+}
+
+
+typedef struct
+{
+	bitmap_t* pbmpDst;
+	bitmap_t* pbmpSrc;
+	PFCONVERTROW pfnConvertRow;
+	const DWORD* lut;
+	int iWidth;
+} convertjob_t;
+
+
+static void _ConvertBand(int iFirst, int iLast, void* param)
+{
+	convertjob_t* pjob = (convertjob_t*)param;
+	int i;
+
+	for (i = iFirst; i < iLast; i++)
+	{
+		pjob->pfnConvertRow(&pjob->pbmpDst->pixels[i * pjob->pbmpDst->iPitch], &pjob->pbmpSrc->pixels[i * pjob->pbmpSrc->iPitch], pjob->iWidth, pjob->lut);
+	}
+}
+
+
+// converts pixels between 8 (paletted), 24 and 32 bit formats,
+// both bitmaps must have the same size, dst->nBPP selects the target format.
+// paletted pixels are expanded through src->pal with alpha set to 255,
+// converting to 8 bit is only possible from 8 bit (a plain copy)
+
+bool_t ConvertBitmap(bitmap_t* pbmpDst, bitmap_t* pbmpSrc)
+{
+	PFCONVERTROW pfnConvertRow;
+	convertjob_t job;
+	DWORD lut[256];
+	int iRowSize;
+	int i;
+
+	if ((pbmpDst->iWidth != pbmpSrc->iWidth) || (pbmpDst->iHeight != pbmpSrc->iHeight))
+	{
+		return false;
+	}
+
+	pfnConvertRow = _GetConvertRowFunc(pbmpDst->nBPP, pbmpSrc->nBPP);
+
+	if (pfnConvertRow == NULL)
+	{
+		return false;
+	}
+
+	if ((pbmpSrc->nBPP == 1) && (pbmpDst->nBPP != 1))
+	{
+		if ((pbmpSrc->pal == NULL) || (pbmpSrc->nColors <= 0))
+		{
+			return false;
+		}
+
+		memset(lut, 0, sizeof(lut));
+
+		for (i = 0; (i < pbmpSrc->nColors) && (i < 256); i++)
+		{
+			lut[i] = pbmpSrc->pal[i].rgbBlue | (pbmpSrc->pal[i].rgbGreen << 8) | (pbmpSrc->pal[i].rgbRed << 16) | 0xFF000000;
+		}
+	}
+
+	job.pbmpDst = pbmpDst;
+	job.pbmpSrc = pbmpSrc;
+	job.pfnConvertRow = pfnConvertRow;
+	job.lut = lut;
+	job.iWidth = pbmpSrc->iWidth;
+
+	if (pfnConvertRow == _ConvertRowCopy)
+	{
+		job.iWidth *= pbmpSrc->nBPP;
+
+		if ((pbmpSrc->nBPP == 1) && (pbmpDst->pal != NULL) && (pbmpSrc->pal != NULL) && (pbmpDst->pal != pbmpSrc->pal))
+		{
+			memcpy(pbmpDst->pal, pbmpSrc->pal, min(pbmpDst->nColors, pbmpSrc->nColors) * sizeof(RGBQUAD));
+		}
+	}
+
+	iRowSize = pbmpSrc->iWidth * max(pbmpSrc->nBPP, pbmpDst->nBPP);
+
+	// no padding on either side and not worth splitting, the whole image is a single row
+	if ((pbmpSrc->iPitch == pbmpSrc->iWidth * pbmpSrc->nBPP) && (pbmpDst->iPitch == pbmpDst->iWidth * pbmpDst->nBPP) &&
+		(pbmpSrc->iHeight <= _BandRows(iRowSize)))
+	{
+		if (pbmpSrc->iHeight > 0)
+		{
+			pfnConvertRow(pbmpDst->pixels, pbmpSrc->pixels, job.iWidth * pbmpSrc->iHeight, lut);
+		}
+
+		return true;
+	}
+
+	_ParallelBands(pbmpSrc->iHeight, _BandRows(iRowSize), _ConvertBand, &job);
+
+	return true;
+}
+
+
+bitmap_t* AllocConvertedBitmap(bitmap_t* pbmp, int nBPP)
+{
+	bitmap_t* pbmpNew;
+
+	if (_GetConvertRowFunc(nBPP, pbmp->nBPP) == NULL)
+	{
+		return NULL;
+	}
+
+	pbmpNew = AllocBitmap(pbmp->iWidth, pbmp->iHeight, nBPP, (nBPP == 1)? pbmp->nColors: 0);
+
+	if (pbmpNew == NULL)
+	{
+		return NULL;
+	}
+
+	if (!ConvertBitmap(pbmpNew, pbmp))
+	{
+		FreeBitmap(pbmpNew);
+		return NULL;
+	}
+
+	return pbmpNew;
+}
+
+
+//
+// bitmap processing
+//
+
+// clips the rectangle against both bitmaps, overlapping rectangles
+// of the same pixels are handled, views included
+
+bool_t BlitBitmap(bitmap_t* pbmpDst, int xDst, int yDst, bitmap_t* pbmpSrc, int xSrc, int ySrc, int iWidth, int iHeight)
+{
+	byte_t* pDst;
+	byte_t* pSrc;
+	byte_t* pDstEnd;
+	byte_t* pSrcEnd;
+	int iRowSize;
+	int i;
+
+	if (pbmpDst->nBPP != pbmpSrc->nBPP)
+	{
+		return false;
+	}
+
+	if (xSrc < 0) { xDst -= xSrc; iWidth += xSrc; xSrc = 0; }
+	if (ySrc < 0) { yDst -= ySrc; iHeight += ySrc; ySrc = 0; }
+	if (xDst < 0) { xSrc -= xDst; iWidth += xDst; xDst = 0; }
+	if (yDst < 0) { ySrc -= yDst; iHeight += yDst; yDst = 0; }
+
+	iWidth = min(iWidth, min(pbmpSrc->iWidth - xSrc, pbmpDst->iWidth - xDst));
+	iHeight = min(iHeight, min(pbmpSrc->iHeight - ySrc, pbmpDst->iHeight - yDst));
+
+	if ((iWidth <= 0) || (iHeight <= 0))
+	{
+		return true;
+	}
+
+	iRowSize = iWidth * pbmpSrc->nBPP;
+	pDst = &pbmpDst->pixels[yDst * pbmpDst->iPitch + xDst * pbmpDst->nBPP];
+	pSrc = &pbmpSrc->pixels[ySrc * pbmpSrc->iPitch + xSrc * pbmpSrc->nBPP];
+
+	pDstEnd = &pDst[(iHeight - 1) * pbmpDst->iPitch + iRowSize];
+	pSrcEnd = &pSrc[(iHeight - 1) * pbmpSrc->iPitch + iRowSize];
+
+	if ((pDst > pSrc) && (pDst < pSrcEnd) && (pSrc < pDstEnd))
+	{
+		// copy bottom up so source rows are read before they are overwritten
+		for (i = iHeight - 1; i >= 0; i--)
+		{
+			memmove(&pDst[i * pbmpDst->iPitch], &pSrc[i * pbmpSrc->iPitch], iRowSize);
+		}
+	}
+	else
+	{
+		for (i = 0; i < iHeight; i++)
+		{
+			memmove(&pDst[i * pbmpDst->iPitch], &pSrc[i * pbmpSrc->iPitch], iRowSize);
+		}
+	}
+
+	return true;
+}
+
+
+void FlipBitmapVertical(bitmap_t* pbmp)
+{
+	byte_t tmp[4096];
+	byte_t* pTop;
+	byte_t* pBottom;
+	int iRowSize;
+	int iChunk;
+	int i, j;
+
+	iRowSize = pbmp->iWidth * pbmp->nBPP;
+
+	for (i = 0; i < pbmp->iHeight / 2; i++)
+	{
+		pTop = &pbmp->pixels[i * pbmp->iPitch];
+		pBottom = &pbmp->pixels[(pbmp->iHeight - 1 - i) * pbmp->iPitch];
+
+		// swap through a small buffer that stays in l1
+		for (j = 0; j < iRowSize; j += iChunk)
+		{
+			iChunk = min(iRowSize - j, (int)sizeof(tmp));
+
+			memcpy(tmp, &pTop[j], iChunk);
+			memcpy(&pTop[j], &pBottom[j], iChunk);
+			memcpy(&pBottom[j], tmp, iChunk);
+		}
+	}
+}
+
+
+static void _FlipBytes(byte_t* p, int i, int j)
+{
+	byte_t c;
+
+	for ( ; i < j; i++, j--)
+	{
+		c = p[i];
+		p[i] = p[j];
+		p[j] = c;
+	}
+}
+
+
+#ifdef USE_SSE
+
+// swaps reversed 16 byte blocks from both ends
+TARGET_SSSE3 static void _FlipRow8_SSSE3(byte_t* p, int n)
+{
+	__m128i mask;
+	__m128i a, b;
+	int i, j;
+
+	mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+	for (i = 0, j = n - 16; i + 16 <= j; i += 16, j -= 16)
+	{
+		a = _mm_loadu_si128((const __m128i*)&p[i]);
+		b = _mm_loadu_si128((const __m128i*)&p[j]);
+		_mm_storeu_si128((__m128i*)&p[i], _mm_shuffle_epi8(b, mask));
+		_mm_storeu_si128((__m128i*)&p[j], _mm_shuffle_epi8(a, mask));
+	}
+
+	_FlipBytes(p, i, j + 15);
+}
+
+#endif
+
+
+static void _FlipRow8(byte_t* p, int n)
+{
+#ifdef USE_SSE
+	if (_GetCpuFeatures() & CPU_SSSE3)
+	{
+		_FlipRow8_SSSE3(p, n);
+		return;
+	}
+#endif
+
+	_FlipBytes(p, 0, n - 1);
+}
+
+
+static void _FlipRow24(byte_t* p, int n)
+{
+	byte_t c[3];
+	int i, j;
+
+	for (i = 0, j = n - 1; i < j; i++, j--)
+	{
+		memcpy(c, &p[i * 3], 3);
+		memcpy(&p[i * 3], &p[j * 3], 3);
+		memcpy(&p[j * 3], c, 3);
+	}
+}
+
+
+static void _FlipRow32(byte_t* p, int n)
+{
+	DWORD* pdw;
+	DWORD c;
+	int i, j;
+
+	pdw = (DWORD*)p;
+	i = 0;
+	j = n - 1;
+
+#ifdef USE_SSE
+	for ( ; i + 4 <= j - 3; i += 4, j -= 4)
+	{
+		__m128i a, b;
+
+		a = _mm_loadu_si128((const __m128i*)&pdw[i]);
+		b = _mm_loadu_si128((const __m128i*)&pdw[j - 3]);
+		_mm_storeu_si128((__m128i*)&pdw[i], _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3)));
+		_mm_storeu_si128((__m128i*)&pdw[j - 3], _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 1, 2, 3)));
+	}
+#endif
+
+	for ( ; i < j; i++, j--)
+	{
+		c = pdw[i];
+		pdw[i] = pdw[j];
+		pdw[j] = c;
+	}
+}
+
+
+static void _FlipBand(int iFirst, int iLast, void* param)
+{
+	bitmap_t* pbmp = (bitmap_t*)param;
+	int i;
+
+	for (i = iFirst; i < iLast; i++)
+	{
+		byte_t* p = &pbmp->pixels[i * pbmp->iPitch];
+
+		switch (pbmp->nBPP)
+		{
+		case 1: _FlipRow8(p, pbmp->iWidth); break;
+		case 3: _FlipRow24(p, pbmp->iWidth); break;
+		case 4: _FlipRow32(p, pbmp->iWidth); break;
+		}
+	}
+}
+
+
+void FlipBitmapHorizontal(bitmap_t* pbmp)
+{
+	_ParallelBands(pbmp->iHeight, _BandRows(pbmp->iWidth * pbmp->nBPP), _FlipBand, pbmp);
+}
+
+
+// fills pbmpView to describe a part of pbmp, no pixels are copied.
+// the view shares pixels and palette with pbmp, do not FreeBitmap() it
+
+bool_t GetBitmapView(bitmap_t* pbmpView, bitmap_t* pbmp, int x, int y, int iWidth, int iHeight)
+{
+	if ((x < 0) || (y < 0) || (iWidth < 0) || (iHeight < 0) || (x + iWidth > pbmp->iWidth) || (y + iHeight > pbmp->iHeight))
+	{
+		return false;
+	}
+
+	pbmpView->iWidth = iWidth;
+	pbmpView->iHeight = iHeight;
+	pbmpView->nBPP = pbmp->nBPP;
+	pbmpView->iPitch = pbmp->iPitch;
+	pbmpView->pixels = &pbmp->pixels[y * pbmp->iPitch + x * pbmp->nBPP];
+	pbmpView->nColors = pbmp->nColors;
+	pbmpView->pal = pbmp->pal;
+	pbmpView->pAlignedPixels = NULL;
+
+	return true;
+}
+
+
+static bool_t _ScalePointRows(bitmap_t* pbmpDst, bitmap_t* pbmpSrc, int y0, int y1)
+{
+	int* aiOffset;
+	byte_t* pDst;
+	byte_t* pSrc;
+	int nBPP;
+	int x, y;
+
+	nBPP = pbmpSrc->nBPP;
+	aiOffset = (int*)AllocMemory(pbmpDst->iWidth * sizeof(int));
+
+	if (aiOffset == NULL)
+	{
+		return false;
+	}
+
+	for (x = 0; x < pbmpDst->iWidth; x++)
+	{
+		aiOffset[x] = (int)(((__int64)x * pbmpSrc->iWidth) / pbmpDst->iWidth) * nBPP;
+	}
+
+	for (y = y0; y < y1; y++)
+	{
+		pDst = &pbmpDst->pixels[y * pbmpDst->iPitch];
+		pSrc = &pbmpSrc->pixels[(int)(((__int64)y * pbmpSrc->iHeight) / pbmpDst->iHeight) * pbmpSrc->iPitch];
+
+		switch (nBPP)
+		{
+		case 1:
+			for (x = 0; x < pbmpDst->iWidth; x++)
+			{
+				pDst[x] = pSrc[aiOffset[x]];
+			}
+			break;
+		case 4:
+			for (x = 0; x < pbmpDst->iWidth; x++)
+			{
+				((DWORD*)pDst)[x] = *(DWORD*)&pSrc[aiOffset[x]];
+			}
+			break;
+		default:
+			for (x = 0; x < pbmpDst->iWidth; x++)
+			{
+				memcpy(&pDst[x * nBPP], &pSrc[aiOffset[x]], nBPP);
+			}
+			break;
+		}
+	}
+
+	FreeMemory(aiOffset);
+
+	return true;
+}
+
+
+#define SCALE_TILE 4096 // source bytes a box tile sums at a time, the sums stay in l1
+
+
+// piSum[i] += p[i]
+
+static void _AddRowSums(unsigned int* piSum, const byte_t* p, int n)
+{
+	int i = 0;
+
+#ifdef USE_SSE
+	for ( ; i + 16 <= n; i += 16)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i v = _mm_loadu_si128((const __m128i*)&p[i]);
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i* ps = (__m128i*)&piSum[i];
+
+		_mm_storeu_si128(&ps[0], _mm_add_epi32(_mm_loadu_si128(&ps[0]), _mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(&ps[1], _mm_add_epi32(_mm_loadu_si128(&ps[1]), _mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(&ps[2], _mm_add_epi32(_mm_loadu_si128(&ps[2]), _mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(&ps[3], _mm_add_epi32(_mm_loadu_si128(&ps[3]), _mm_unpackhi_epi16(hi, zero)));
+	}
+#endif
+
+	for ( ; i < n; i++)
+	{
+		piSum[i] += p[i];
+	}
+}
+
+
+// averages the source area covered by each destination pixel.
+// a destination row is done in column tiles: the source rows behind a tile
+// are summed first, then the tile's pixels are taken from the sums.
+// a pixel's sum can pass 32 bits when it covers more than 2^24 source pixels
+
+static bool_t _ScaleBoxRows(bitmap_t* pbmpDst, bitmap_t* pbmpSrc, int y0, int y1)
+{
+	ULONGLONG aiPixel[4];
+	unsigned int* aiSum;
+	int* aiX;
+	byte_t* pDst;
+	int nBPP;
+	int nTile;
+	int sy0, sy1;
+	int sx0, sx1;
+	int sxa, sxb;
+	int xa, xb;
+	__int64 iArea;
+	int x, y, i, c;
+
+	nBPP = pbmpSrc->nBPP;
+	aiX = (int*)AllocMemory((pbmpDst->iWidth + 1) * sizeof(int));
+
+	if (aiX == NULL)
+	{
+		return false;
+	}
+
+	// a tile holds at least one destination pixel
+	nTile = SCALE_TILE;
+
+	for (x = 0; x <= pbmpDst->iWidth; x++)
+	{
+		aiX[x] = (int)(((__int64)x * pbmpSrc->iWidth) / pbmpDst->iWidth);
+
+		if (x > 0)
+		{
+			nTile = max(nTile, (aiX[x] - aiX[x - 1] + 1) * nBPP);
+		}
+	}
+
+	aiSum = (unsigned int*)AllocMemory(nTile * sizeof(unsigned int));
+
+	if (aiSum == NULL)
+	{
+		FreeMemory(aiX);
+		return false;
+	}
+
+	for (y = y0; y < y1; y++)
+	{
+		sy0 = (int)(((__int64)y * pbmpSrc->iHeight) / pbmpDst->iHeight);
+		sy1 = max((int)(((__int64)(y + 1) * pbmpSrc->iHeight) / pbmpDst->iHeight), sy0 + 1);
+		pDst = &pbmpDst->pixels[y * pbmpDst->iPitch];
+
+		for (xa = 0; xa < pbmpDst->iWidth; xa = xb)
+		{
+			sxa = aiX[xa];
+
+			for (xb = xa + 1; (xb < pbmpDst->iWidth) && ((max(aiX[xb + 1], aiX[xb] + 1) - sxa) * nBPP <= nTile); xb++)
+			{
+			}
+
+			sxb = max(aiX[xb], aiX[xb - 1] + 1);
+
+			memset(aiSum, 0, (sxb - sxa) * nBPP * sizeof(unsigned int));
+
+			for (i = sy0; i < sy1; i++)
+			{
+				_AddRowSums(aiSum, &pbmpSrc->pixels[i * pbmpSrc->iPitch + sxa * nBPP], (sxb - sxa) * nBPP);
+			}
+
+			for (x = xa; x < xb; x++)
+			{
+				sx0 = aiX[x];
+				sx1 = max(aiX[x + 1], sx0 + 1);
+				iArea = (__int64)(sx1 - sx0) * (sy1 - sy0);
+
+				memset(aiPixel, 0, sizeof(aiPixel));
+
+				for (i = (sx0 - sxa) * nBPP; i < (sx1 - sxa) * nBPP; i += nBPP)
+				{
+					for (c = 0; c < nBPP; c++)
+					{
+						aiPixel[c] += aiSum[i + c];
+					}
+				}
+
+				for (c = 0; c < nBPP; c++)
+				{
+					pDst[x * nBPP + c] = (byte_t)((aiPixel[c] + iArea / 2) / iArea);
+				}
+			}
+		}
+	}
+
+	FreeMemory(aiSum);
+	FreeMemory(aiX);
+
+	return true;
+}
+
+
+// pv[i] = p0[i] * (256 - fy) + p1[i] * fy, at most 255 * 256 so it fits a WORD
+
+static void _BlendRows(WORD* pv, const byte_t* p0, const byte_t* p1, int n, int fy)
+{
+	int i = 0;
+
+#ifdef USE_SSE
+	for ( ; i + 16 <= n; i += 16)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i w0 = _mm_set1_epi16((short)(256 - fy));
+		__m128i w1 = _mm_set1_epi16((short)fy);
+		__m128i a = _mm_loadu_si128((const __m128i*)&p0[i]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&p1[i]);
+
+		_mm_storeu_si128((__m128i*)&pv[i], _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1)));
+		_mm_storeu_si128((__m128i*)&pv[i + 8], _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1)));
+	}
+#endif
+
+	for ( ; i < n; i++)
+	{
+		pv[i] = (WORD)(p0[i] * (256 - fy) + p1[i] * fy);
+	}
+}
+
+
+// maps pixel centers, source weights are 8 bit fixed point.
+// the two source rows are blended into a WORD row first, then the
+// destination pixels are taken from it, the rounding is the same as
+// blending each pixel's four source pixels at once
+
+static bool_t _ScaleBilinearRows(bitmap_t* pbmpDst, bitmap_t* pbmpSrc, int y0, int y1)
+{
+	WORD* pv;
+	int* aiX;
+	int* aiFX;
+	byte_t* pDst;
+	byte_t* pSrc0;
+	byte_t* pSrc1;
+	int iRowSize;
+	int nBPP;
+	int sx, sy;
+	int fx, fy;
+	int x, y, c;
+
+	nBPP = pbmpSrc->nBPP;
+	iRowSize = pbmpSrc->iWidth * nBPP;
+	aiX = (int*)AllocMemory(pbmpDst->iWidth * sizeof(int) * 2);
+
+	// one spare pixel for the zero weighted right neighbour of the last column
+	pv = (WORD*)AllocMemory((iRowSize + 4) * sizeof(WORD));
+
+	if ((aiX == NULL) || (pv == NULL))
+	{
+		FreeMemory(aiX);
+		FreeMemory(pv);
+		return false;
+	}
+
+	memset(&pv[iRowSize], 0, 4 * sizeof(WORD));
+	aiFX = &aiX[pbmpDst->iWidth];
+
+	for (x = 0; x < pbmpDst->iWidth; x++)
+	{
+		sx = (int)((((__int64)x * 2 + 1) * pbmpSrc->iWidth * 128) / pbmpDst->iWidth) - 128;
+		sx = max(sx, 0);
+
+		if ((sx >> 8) >= pbmpSrc->iWidth - 1)
+		{
+			aiX[x] = (pbmpSrc->iWidth - 1) * nBPP;
+			aiFX[x] = 0;
+		}
+		else
+		{
+			aiX[x] = (sx >> 8) * nBPP;
+			aiFX[x] = sx & 255;
+		}
+	}
+
+	for (y = y0; y < y1; y++)
+	{
+		sy = (int)((((__int64)y * 2 + 1) * pbmpSrc->iHeight * 128) / pbmpDst->iHeight) - 128;
+		sy = max(sy, 0);
+		fy = sy & 255;
+		sy >>= 8;
+
+		if (sy >= pbmpSrc->iHeight - 1)
+		{
+			sy = pbmpSrc->iHeight - 1;
+			fy = 0;
+		}
+
+		pSrc0 = &pbmpSrc->pixels[sy * pbmpSrc->iPitch];
+		pSrc1 = (fy != 0)? &pSrc0[pbmpSrc->iPitch]: pSrc0;
+		pDst = &pbmpDst->pixels[y * pbmpDst->iPitch];
+
+		_BlendRows(pv, pSrc0, pSrc1, iRowSize, fy);
+
+#ifdef USE_SSE
+		if (nBPP == 4)
+		{
+			// madd is signed, so the WORDs are biased by -32768 and the bias is added back
+			__m128i flip = _mm_set1_epi16((short)0x8000);
+			__m128i round = _mm_set1_epi32(32768 * 256 + 32768);
+			__m128i v;
+
+			for (x = 0; x < pbmpDst->iWidth; x++)
+			{
+				fx = aiFX[x];
+				v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&pv[aiX[x]]), flip);
+				v = _mm_madd_epi16(_mm_unpacklo_epi16(v, _mm_srli_si128(v, 8)), _mm_set1_epi32((fx << 16) | (256 - fx)));
+				v = _mm_srli_epi32(_mm_add_epi32(v, round), 16);
+				v = _mm_packs_epi32(v, v);
+				((DWORD*)pDst)[x] = (DWORD)_mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+			}
+
+			continue;
+		}
+#endif
+
+		for (x = 0; x < pbmpDst->iWidth; x++)
+		{
+			WORD* p = &pv[aiX[x]];
+			int iNext = (aiFX[x] != 0)? nBPP: 0;
+
+			fx = aiFX[x];
+
+			for (c = 0; c < nBPP; c++)
+			{
+				pDst[x * nBPP + c] = (byte_t)((p[c] * (256 - fx) + p[c + iNext] * fx + 32768) >> 16);
+			}
+		}
+	}
+
+	FreeMemory(pv);
+	FreeMemory(aiX);
+
+	return true;
+}
+
+
+typedef struct
+{
+	bitmap_t* pbmpDst;
+	bitmap_t* pbmpSrc;
+	bool_t (*pfnScaleRows)(bitmap_t* pbmpDst, bitmap_t* pbmpSrc, int y0, int y1);
+	LONG bFailed; // a band could not allocate its tables
+} scalejob_t;
+
+
+static void _ScaleBand(int iFirst, int iLast, void* param)
+{
+	scalejob_t* pjob = (scalejob_t*)param;
+
+	if (!pjob->pfnScaleRows(pjob->pbmpDst, pjob->pbmpSrc, iFirst, iLast))
+	{
+		InterlockedExchange(&pjob->bFailed, 1);
+	}
+}
+
+
+// resizes pbmpSrc into pbmpDst (both sizes are taken as is),
+// SCALE_BOX is meant for downscaling, SCALE_BOX and SCALE_BILINEAR need 24 or 32 bit
+
+bool_t ScaleBitmap(bitmap_t* pbmpDst, bitmap_t* pbmpSrc, int iFilter)
+{
+	scalejob_t job;
+	int iRowSize;
+
+	if (pbmpDst->nBPP != pbmpSrc->nBPP)
+	{
+		return false;
+	}
+
+	if ((pbmpDst->iWidth <= 0) || (pbmpDst->iHeight <= 0) || (pbmpSrc->iWidth <= 0) || (pbmpSrc->iHeight <= 0))
+	{
+		return false;
+	}
+
+	if ((pbmpSrc->nBPP == 1) && (iFilter != SCALE_POINT))
+	{
+		return false;
+	}
+
+	job.pbmpDst = pbmpDst;
+	job.pbmpSrc = pbmpSrc;
+	job.bFailed = 0;
+
+	switch (iFilter)
+	{
+	case SCALE_POINT:
+		job.pfnScaleRows = _ScalePointRows;
+		break;
+	case SCALE_BOX:
+		job.pfnScaleRows = _ScaleBoxRows;
+		break;
+	case SCALE_BILINEAR:
+		job.pfnScaleRows = _ScaleBilinearRows;
+		break;
+	default:
+		return false;
+	}
+
+	// a box band reads all source rows behind its destination rows
+	iRowSize = pbmpDst->iWidth * pbmpDst->nBPP;
+
+	if (iFilter == SCALE_BOX)
+	{
+		iRowSize = max(iRowSize, (int)(((__int64)pbmpSrc->iWidth * pbmpSrc->iHeight * pbmpSrc->nBPP) / pbmpDst->iHeight));
+	}
+
+	_ParallelBands(pbmpDst->iHeight, _BandRows(iRowSize), _ScaleBand, &job);
+
+	if (job.bFailed)
+	{
+		return false;
+	}
+
+	if ((pbmpSrc->nBPP == 1) && (pbmpDst->pal != NULL) && (pbmpSrc->pal != NULL) && (pbmpDst->pal != pbmpSrc->pal))
+	{
+		memcpy(pbmpDst->pal, pbmpSrc->pal, min(pbmpDst->nColors, pbmpSrc->nColors) * sizeof(RGBQUAD));
+	}
+
+	return true;
+}
+
+
+//
+// bitmap pool
+//
+
+// pooled bitmaps carry their list links behind the bitmap_t,
+// so FreeBitmap() still works on them
+
+typedef struct poolbmp_s
+{
+	bitmap_t bmp;
+	struct poolbmp_s* pNext; // lru
+	struct poolbmp_s* pPrev;
+	struct poolbmp_s* pNextKey; // same bucket
+	struct poolbmp_s* pPrevKey;
+	size_t iSize;
+} poolbmp_t;
+
+#define POOL_BUCKETS 64
+
+struct bmppool_s
+{
+	CRITICAL_SECTION cs;
+	poolbmp_t* apBuckets[POOL_BUCKETS];
+	poolbmp_t* pHead; // most recently released
+	poolbmp_t* pTail;
+	size_t iBytes;
+	size_t iMaxBytes;
+};
+
+
+static int _PoolBucket(int iWidth, int iHeight, int nBPP, int nColors)
+{
+	unsigned int h;
+
+	h = (unsigned int)iWidth * 0x9E3779B1u;
+	h ^= (unsigned int)iHeight * 0x85EBCA77u;
+	h ^= (unsigned int)(nBPP | (nColors << 4)) * 0xC2B2AE3Du;
+
+	return (int)((h >> 16) % POOL_BUCKETS);
+}
+
+
+static void _PoolUnlink(bmppool_t* pbp, poolbmp_t* p)
+{
+	if (p->pPrev != NULL) p->pPrev->pNext = p->pNext; else pbp->pHead = p->pNext;
+	if (p->pNext != NULL) p->pNext->pPrev = p->pPrev; else pbp->pTail = p->pPrev;
+
+	if (p->pPrevKey != NULL)
+	{
+		p->pPrevKey->pNextKey = p->pNextKey;
+	}
+	else
+	{
+		pbp->apBuckets[_PoolBucket(p->bmp.iWidth, p->bmp.iHeight, p->bmp.nBPP, p->bmp.nColors)] = p->pNextKey;
+	}
+
+	if (p->pNextKey != NULL)
+	{
+		p->pNextKey->pPrevKey = p->pPrevKey;
+	}
+
+	pbp->iBytes -= p->iSize;
+}
+
+
+// drops the least recently released bitmaps until at most iMaxBytes are kept
+static void _PoolTrim(bmppool_t* pbp, size_t iMaxBytes)
+{
+	poolbmp_t* p;
+
+	while ((pbp->iBytes > iMaxBytes) && (pbp->pTail != NULL))
+	{
+		p = pbp->pTail;
+		_PoolUnlink(pbp, p);
+		FreeBitmap(&p->bmp);
+	}
+}
+
+
+// iMaxBytes limits the memory held by released bitmaps
+
+bmppool_t* CreateBitmapPool(size_t iMaxBytes)
+{
+	bmppool_t* pbp = (bmppool_t*)AllocMemory(sizeof(bmppool_t));
+
+	if (pbp == NULL)
+	{
+		return NULL;
+	}
+
+	memset(pbp, 0, sizeof(bmppool_t));
+	InitializeCriticalSection(&pbp->cs);
+	pbp->iMaxBytes = iMaxBytes;
+
+	return pbp;
+}
+
+
+bitmap_t* AllocBitmapFromPool(bmppool_t* pbp, int iWidth, int iHeight, int nBPP, int nColors)
+{
+	poolbmp_t* p;
+
+	EnterCriticalSection(&pbp->cs);
+
+	for (p = pbp->apBuckets[_PoolBucket(iWidth, iHeight, nBPP, nColors)]; p != NULL; p = p->pNextKey)
+	{
+		if ((p->bmp.iWidth == iWidth) && (p->bmp.iHeight == iHeight) && (p->bmp.nBPP == nBPP) && (p->bmp.nColors == nColors))
+		{
+			_PoolUnlink(pbp, p);
+			LeaveCriticalSection(&pbp->cs);
+
+			return &p->bmp;
+		}
+	}
+
+	LeaveCriticalSection(&pbp->cs);
+
+	p = (poolbmp_t*)AllocMemory(sizeof(poolbmp_t));
+
+	if (p == NULL)
+	{
+		return NULL;
+	}
+
+	if (!_InitBitmap(&p->bmp, iWidth, iHeight, nBPP, nColors, 4))
+	{
+		FreeMemory(p);
+		return NULL;
+	}
+
+	p->iSize = sizeof(poolbmp_t) + p->bmp.iPitch * p->bmp.iHeight + p->bmp.nColors * sizeof(RGBQUAD);
+
+	return &p->bmp;
+}
+
+
+// pbmp must come from AllocBitmapFromPool() of the same pool,
+// pixels and palette are kept as is
+
+void ReleaseBitmapToPool(bmppool_t* pbp, bitmap_t* pbmp)
+{
+	poolbmp_t* p = (poolbmp_t*)pbmp;
+	int iBucket;
+
+	if (p->iSize > pbp->iMaxBytes)
+	{
+		FreeBitmap(pbmp);
+		return;
+	}
+
+	EnterCriticalSection(&pbp->cs);
+
+	iBucket = _PoolBucket(pbmp->iWidth, pbmp->iHeight, pbmp->nBPP, pbmp->nColors);
+
+	p->pPrev = NULL;
+	p->pNext = pbp->pHead;
+	if (pbp->pHead != NULL) pbp->pHead->pPrev = p; else pbp->pTail = p;
+	pbp->pHead = p;
+
+	p->pPrevKey = NULL;
+	p->pNextKey = pbp->apBuckets[iBucket];
+	if (p->pNextKey != NULL) p->pNextKey->pPrevKey = p;
+	pbp->apBuckets[iBucket] = p;
+
+	pbp->iBytes += p->iSize;
+
+	_PoolTrim(pbp, pbp->iMaxBytes);
+
+	LeaveCriticalSection(&pbp->cs);
+}
+
+
+void TrimBitmapPool(bmppool_t* pbp, size_t iMaxBytes)
+{
+	EnterCriticalSection(&pbp->cs);
+
+	_PoolTrim(pbp, iMaxBytes);
+
+	LeaveCriticalSection(&pbp->cs);
+}
+
+
+size_t GetBitmapPoolSize(bmppool_t* pbp)
+{
+	size_t iBytes;
+
+	EnterCriticalSection(&pbp->cs);
+	iBytes = pbp->iBytes;
+	LeaveCriticalSection(&pbp->cs);
+
+	return iBytes;
+}
+
+
+// bitmaps still in use are not touched, FreeBitmap() them
+
+void FreeBitmapPool(bmppool_t* pbp)
+{
+	_PoolTrim(pbp, 0);
+	DeleteCriticalSection(&pbp->cs);
+	FreeMemory(pbp);
+}
+
+
+//
+// qoi output
+//
+
+// https://qoiformat.org/ - lossless, about the size of png at a fraction of its cost.
+// the image is encoded in row bands on the worker threads: a band starts from
+// the pixel before it and an index rebuilt from the pixels behind it, slots
+// that cannot be recovered cheaply are simply not used, so band output
+// concatenates into a valid stream. groups of bands are written as they finish
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF		0x40
+#define QOI_OP_LUMA		0x80
+#define QOI_OP_RUN		0xc0
+#define QOI_OP_RGB		0xfe
+#define QOI_OP_RGBA		0xff
+
+#define QOI_HASH(c) ((((c) & 0xff) * 3 + (((c) >> 8) & 0xff) * 5 + (((c) >> 16) & 0xff) * 7 + ((c) >> 24) * 11) & 63)
+#define QOI_LOOKBACK 4096 // pixels scanned to rebuild the index of a band
+
+typedef struct
+{
+	bitmap_t* pbmp;
+	DWORD lut[256];
+	int bBottomUp;
+	int nBandRows;
+	int iFirstBand;
+	byte_t** apOut;
+	int* aiOutSize;
+} qoijob_t;
+
+
+// pixel as r,g,b,a bytes
+static __inline DWORD _QOIPixel(qoijob_t* pjob, int x, int y)
+{
+	bitmap_t* pbmp = pjob->pbmp;
+	byte_t* p;
+
+	if (pjob->bBottomUp)
+	{
+		y = pbmp->iHeight - 1 - y;
+	}
+
+	p = &pbmp->pixels[y * pbmp->iPitch + x * pbmp->nBPP];
+
+	switch (pbmp->nBPP)
+	{
+	case 1: return pjob->lut[p[0]];
+	case 3: return p[2] | (p[1] << 8) | (p[0] << 16) | 0xFF000000;
+	default: return p[2] | (p[1] << 8) | (p[0] << 16) | ((DWORD)p[3] << 24);
+	}
+}
+
+
+static void _EncodeQOIBand(qoijob_t* pjob, int iBand)
+{
+	DWORD aIndex[64];
+	byte_t abValid[64];
+	DWORD px, pxPrev;
+	byte_t* pOut;
+	byte_t* p;
+	int iWidth;
+	int nValid;
+	int iRun;
+	int iLast;
+	int x, y, i;
+
+	iWidth = pjob->pbmp->iWidth;
+	pOut = pjob->apOut[iBand];
+	p = pOut;
+	iRun = 0;
+
+	if (iWidth <= 0)
+	{
+		pjob->aiOutSize[iBand] = 0;
+		return;
+	}
+
+	memset(abValid, 0, sizeof(abValid));
+
+	y = (pjob->iFirstBand + iBand) * pjob->nBandRows;
+	iLast = min(y + pjob->nBandRows, pjob->pbmp->iHeight);
+
+	if (y == 0)
+	{
+		// the decoder starts with a zeroed index
+		memset(aIndex, 0, sizeof(aIndex));
+		memset(abValid, 1, sizeof(abValid));
+		pxPrev = 0xFF000000;
+	}
+	else
+	{
+		pxPrev = _QOIPixel(pjob, iWidth - 1, y - 1);
+
+		// the decoder holds the last pixel seen for each hash
+		for (i = 0, nValid = 0; (i < QOI_LOOKBACK) && (i < y * iWidth) && (nValid < 64); i++)
+		{
+			px = _QOIPixel(pjob, iWidth - 1 - (i % iWidth), y - 1 - (i / iWidth));
+
+			if (!abValid[QOI_HASH(px)])
+			{
+				abValid[QOI_HASH(px)] = 1;
+				aIndex[QOI_HASH(px)] = px;
+				nValid++;
+			}
+		}
+	}
+
+	for ( ; y < iLast; y++)
+	{
+		for (x = 0; x < iWidth; x++)
+		{
+			px = _QOIPixel(pjob, x, y);
+
+			if (px == pxPrev)
+			{
+				if (++iRun == 62)
+				{
+					*p++ = QOI_OP_RUN | (iRun - 1);
+					iRun = 0;
+				}
+				continue;
+			}
+
+			if (iRun > 0)
+			{
+				*p++ = QOI_OP_RUN | (iRun - 1);
+				iRun = 0;
+			}
+
+			i = QOI_HASH(px);
+
+			if (abValid[i] && (aIndex[i] == px))
+			{
+				*p++ = QOI_OP_INDEX | i;
+			}
+			else
+			{
+				aIndex[i] = px;
+				abValid[i] = 1;
+
+				if ((px >> 24) == (pxPrev >> 24))
+				{
+					signed char dr = (signed char)((px & 0xff) - (pxPrev & 0xff));
+					signed char dg = (signed char)(((px >> 8) & 0xff) - ((pxPrev >> 8) & 0xff));
+					signed char db = (signed char)(((px >> 16) & 0xff) - ((pxPrev >> 16) & 0xff));
+					signed char dr_dg = dr - dg;
+					signed char db_dg = db - dg;
+
+					if ((dr > -3) && (dr < 2) && (dg > -3) && (dg < 2) && (db > -3) && (db < 2))
+					{
+						*p++ = QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+					}
+					else if ((dg > -33) && (dg < 32) && (dr_dg > -9) && (dr_dg < 8) && (db_dg > -9) && (db_dg < 8))
+					{
+						*p++ = QOI_OP_LUMA | (dg + 32);
+						*p++ = ((dr_dg + 8) << 4) | (db_dg + 8);
+					}
+					else
+					{
+						*p++ = QOI_OP_RGB;
+						*p++ = (byte_t)px;
+						*p++ = (byte_t)(px >> 8);
+						*p++ = (byte_t)(px >> 16);
+					}
+				}
+				else
+				{
+					*p++ = QOI_OP_RGBA;
+					*p++ = (byte_t)px;
+					*p++ = (byte_t)(px >> 8);
+					*p++ = (byte_t)(px >> 16);
+					*p++ = (byte_t)(px >> 24);
+				}
+			}
+
+			pxPrev = px;
+		}
+	}
+
+	if (iRun > 0)
+	{
+		*p++ = QOI_OP_RUN | (iRun - 1);
+	}
+
+	pjob->aiOutSize[iBand] = (int)(p - pOut);
+}
+
+
+static void _EncodeQOIBands(int iFirst, int iLast, void* param)
+{
 	int i;
 
-	if (pbmp->iHeight < 0)
+	for (i = iFirst; i < iLast; i++)
 	{
-		pbmp->iHeight = -pbmp->iHeight;
-		bInvertOrder = 1;
+		_EncodeQOIBand((qoijob_t*)param, i);
 	}
-	else
+}
+
+
+static void _PutBigEndian(byte_t* p, DWORD v)
+{
+	p[0] = (byte_t)(v >> 24);
+	p[1] = (byte_t)(v >> 16);
+	p[2] = (byte_t)(v >> 8);
+	p[3] = (byte_t)v;
+}
+
+
+bool_t SaveBitmapQOI(const char* pszFileName, bitmap_t* pbmp)
+{
+	static const byte_t abEnd[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	FILE* stream;
+	qoijob_t job;
+	byte_t abHeader[14];
+	bool_t bSuccess;
+	int iHeight;
+	int nBands;
+	int nGroup;
+	int iBandSize;
+	int i;
+
+	if ((pbmp->nBPP != 1) && (pbmp->nBPP != 3) && (pbmp->nBPP != 4))
 	{
-		bInvertOrder = 0;
+		return false;
+	}
+
+	if ((pbmp->nBPP == 1) && (pbmp->pal == NULL))
+	{
+		return false;
 	}
 
 	stream = fopen(pszFileName, "wb");
 
-	if (stream != NULL)
+	if (stream == NULL)
 	{
-		iPaletteSize = (pbmp->nBPP == 1)? pbmp->nColors * sizeof(RGBQUAD): 0;
-		iHeaderSize = DWORD_ALIGNED(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + iPaletteSize);
-		iPitchDiff = DWORD_ALIGNED(pbmp->iPitch) - pbmp->iPitch;
-		iDataSize = (pbmp->iPitch + iPitchDiff) * pbmp->iHeight;
-		iFileSize = iHeaderSize + iDataSize;
+		return false;
+	}
 
-		memset(&bmf, 0, sizeof(BITMAPFILEHEADER));
-		bmf.bfType = 'MB';
-		bmf.bfSize = iFileSize;
-		bmf.bfOffBits = iHeaderSize;
-		fwrite(&bmf, sizeof(BITMAPFILEHEADER), 1, stream);
+	// same convention as SaveBitmap(), negative height means the rows go bottom up
+	iHeight = (pbmp->iHeight < 0)? -pbmp->iHeight: pbmp->iHeight;
 
-		memset(&bmi, 0, sizeof(BITMAPINFOHEADER));
-		bmi.biSize = sizeof(BITMAPINFOHEADER);
-		bmi.biWidth = pbmp->iWidth;
-		bmi.biHeight = bInvertOrder? pbmp->iHeight: -pbmp->iHeight;
-		bmi.biPlanes = 1;
-		bmi.biBitCount = pbmp->nBPP * 8;
-		bmi.biClrUsed = (pbmp->nColors == 256)? 0: pbmp->nColors;
-		fwrite(&bmi, sizeof(BITMAPINFOHEADER), 1, stream);
+	job.pbmp = pbmp;
+	job.bBottomUp = (pbmp->iHeight < 0);
 
-		if (pbmp->nBPP == 1)
+	if (pbmp->nBPP == 1)
+	{
+		memset(job.lut, 0, sizeof(job.lut));
+
+		for (i = 0; (i < pbmp->nColors) && (i < 256); i++)
 		{
-			// if (pbmp->pal != NULL)
-			fwrite(pbmp->pal, iPaletteSize, 1, stream);
+			job.lut[i] = pbmp->pal[i].rgbRed | (pbmp->pal[i].rgbGreen << 8) | (pbmp->pal[i].rgbBlue << 16) | 0xFF000000;
 		}
+	}
 
-		fseek(stream, iHeaderSize, SEEK_SET);
+	memcpy(abHeader, "qoif", 4);
+	_PutBigEndian(&abHeader[4], pbmp->iWidth);
+	_PutBigEndian(&abHeader[8], iHeight);
+	abHeader[12] = (pbmp->nBPP == 4)? 4: 3;
+	abHeader[13] = 0;
+
+	bSuccess = (fwrite(abHeader, sizeof(abHeader), 1, stream) == 1);
+
+	job.nBandRows = _BandRows(pbmp->iWidth * 4);
+	nBands = (iHeight + job.nBandRows - 1) / job.nBandRows;
+	nGroup = min(max(GetWorkerThreadCount() * 2, 1), max(nBands, 1));
+
+	// worst case is an rgba op for every pixel
+	iBandSize = job.nBandRows * pbmp->iWidth * 5 + 1;
+
+	job.apOut = (byte_t**)AllocMemory(nGroup * (sizeof(byte_t*) + sizeof(int)));
+	job.aiOutSize = (int*)&job.apOut[nGroup];
+	job.apOut[0] = (byte_t*)AllocMemory((size_t)nGroup * iBandSize);
+
+	for (i = 1; i < nGroup; i++)
+	{
+		job.apOut[i] = job.apOut[i - 1] + iBandSize;
+	}
+
+	// mutate a local copy so the callers bitmap keeps its sign
+	{
+		bitmap_t bmp = *pbmp;
 
-		for (i = 0; i < pbmp->iHeight; i++)
+		bmp.iHeight = iHeight;
+		job.pbmp = &bmp;
+
+		for (job.iFirstBand = 0; bSuccess && (job.iFirstBand < nBands); job.iFirstBand += nGroup)
 		{
-			fwrite(&pbmp->pixels[i * pbmp->iPitch], pbmp->iPitch, 1, stream);
-			if (iPitchDiff)
+			int n = min(nGroup, nBands - job.iFirstBand);
+
+			_ParallelBands(n, 1, _EncodeQOIBands, &job);
+
+			for (i = 0; i < n; i++)
 			{
-				fwrite(pbmp->pixels, iPitchDiff, 1, stream);
+				if (fwrite(job.apOut[i], job.aiOutSize[i], 1, stream) != 1)
+				{
+					bSuccess = false;
+					break;
+				}
 			}
 		}
+	}
 
-		fclose(stream);
+	if (bSuccess)
+	{
+		bSuccess = (fwrite(abEnd, sizeof(abEnd), 1, stream) == 1);
+	}
 
-		return true;
+	FreeMemory(job.apOut[0]);
+	FreeMemory(job.apOut);
+
+	if (fclose(stream) != 0)
+	{
+		bSuccess = false;
 	}
 
-	return false;
+	return bSuccess;
 }
 
 
-bool_t SaveBitmapIndirect(const char* pszFileName, int iWidth, int iHeight, int nBPP, int iPitch, byte_t* pixels, int nColors, RGBQUAD* pal)
+bool_t SaveBitmapIndirectQOI(const char* pszFileName, int iWidth, int iHeight, int nBPP, int iPitch, byte_t* pixels, int nColors, RGBQUAD* pal)
 {
 	bitmap_t bmp =
 	{
@@ -1271,9 +9043,345 @@ bool_t SaveBitmapIndirect(const char* pszFileName, int iWidth, int iHeight, int
 		iPitch,
 		pixels,
 		nColors,
-		pal
+		pal,
+		NULL
 	};
 
-	return SaveBitmap(pszFileName, &bmp);
+	return SaveBitmapQOI(pszFileName, &bmp);
+}
+
+
+//
+// bitmap cache
+//
+
+// bitmaps are shared between callers and keyed by path, file size and
+// write time, so a changed file is decoded again on the next load.
+// released bitmaps stay cached until the byte budget pushes them out
+
+typedef struct cachebmp_s
+{
+	bitmap_t bmp;
+	char* pszFileName;
+	unsigned int iHash;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	FILETIME ftLastWriteTime;
+	LONG nRefs;
+	bool_t bStale; // out of the table, freed on the last release
+	size_t iSize;
+	struct cachebmp_s* pNext; // lru
+	struct cachebmp_s* pPrev;
+	struct cachebmp_s* pNextHash;
+} cachebmp_t;
+
+#define CACHE_BUCKETS 1024
+#define CACHE_DEFAULT_BUDGET (256 * 1024 * 1024)
+
+static struct
+{
+	volatile LONG iInit;
+	CRITICAL_SECTION cs;
+	cachebmp_t* apBuckets[CACHE_BUCKETS];
+	cachebmp_t* pHead;
+	cachebmp_t* pTail;
+	size_t iBytes;
+	size_t iMaxBytes;
+} g_cache;
+
+
+static void _InitBitmapCache(void)
+{
+	if (InterlockedCompareExchange(&g_cache.iInit, 1, 0) == 0)
+	{
+		InitializeCriticalSection(&g_cache.cs);
+		g_cache.iMaxBytes = CACHE_DEFAULT_BUDGET;
+		InterlockedExchange(&g_cache.iInit, 2);
+	}
+
+	while (g_cache.iInit != 2)
+	{
+		Sleep(0);
+	}
+}
+
+
+static void _CacheRemove(cachebmp_t* p)
+{
+	cachebmp_t** pp;
+
+	for (pp = &g_cache.apBuckets[p->iHash % CACHE_BUCKETS]; *pp != NULL; pp = &(*pp)->pNextHash)
+	{
+		if (*pp == p)
+		{
+			*pp = p->pNextHash;
+			break;
+		}
+	}
+
+	if (p->pPrev != NULL) p->pPrev->pNext = p->pNext; else g_cache.pHead = p->pNext;
+	if (p->pNext != NULL) p->pNext->pPrev = p->pPrev; else g_cache.pTail = p->pPrev;
+
+	g_cache.iBytes -= p->iSize;
+	p->bStale = true;
+}
+
+
+static void _CacheFree(cachebmp_t* p)
+{
+	FreeString(p->pszFileName);
+	FreeBitmap(&p->bmp);
 }
 
+
+static void _CacheTrim(size_t iMaxBytes)
+{
+	cachebmp_t* p;
+	cachebmp_t* pPrev;
+
+	for (p = g_cache.pTail; (p != NULL) && (g_cache.iBytes > iMaxBytes); p = pPrev)
+	{
+		pPrev = p->pPrev;
+
+		if (p->nRefs == 0)
+		{
+			_CacheRemove(p);
+			_CacheFree(p);
+		}
+	}
+}
+
+
+static void _CacheTouch(cachebmp_t* p)
+{
+	if (g_cache.pHead == p)
+	{
+		return;
+	}
+
+	p->pPrev->pNext = p->pNext;
+	if (p->pNext != NULL) p->pNext->pPrev = p->pPrev; else g_cache.pTail = p->pPrev;
+
+	p->pPrev = NULL;
+	p->pNext = g_cache.pHead;
+	g_cache.pHead->pPrev = p;
+	g_cache.pHead = p;
+}
+
+
+static cachebmp_t* _CacheFind(const char* pszFileName, unsigned int iHash, WIN32_FILE_ATTRIBUTE_DATA* pfad)
+{
+	cachebmp_t* p;
+
+	for (p = g_cache.apBuckets[iHash % CACHE_BUCKETS]; p != NULL; p = p->pNextHash)
+	{
+		if ((p->iHash == iHash) && AsciiStrEq(p->pszFileName, pszFileName))
+		{
+			if ((p->nFileSizeLow == pfad->nFileSizeLow) && (p->nFileSizeHigh == pfad->nFileSizeHigh) &&
+				(CompareFileTime(&p->ftLastWriteTime, &pfad->ftLastWriteTime) == 0))
+			{
+				return p;
+			}
+
+			// the file has changed, users of the old bitmap keep it until released
+			_CacheRemove(p);
+
+			if (p->nRefs == 0)
+			{
+				_CacheFree(p);
+			}
+
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+
+// the returned bitmap is shared and read only, ReleaseCachedBitmap() it
+
+bitmap_t* LoadBitmapCached(const char* pszFileName)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	unsigned int iHash;
+	cachebmp_t* p;
+	bitmap_t* pbmp;
+
+	if (!GetFileAttributesExA(pszFileName, GetFileExInfoStandard, &fad))
+	{
+		return NULL;
+	}
+
+	_InitBitmapCache();
+
+	iHash = AsciiStrHash(pszFileName);
+
+	EnterCriticalSection(&g_cache.cs);
+
+	p = _CacheFind(pszFileName, iHash, &fad);
+
+	if (p != NULL)
+	{
+		p->nRefs++;
+		_CacheTouch(p);
+		LeaveCriticalSection(&g_cache.cs);
+
+		return &p->bmp;
+	}
+
+	LeaveCriticalSection(&g_cache.cs);
+
+	// decode without holding the lock
+	pbmp = LoadBitmapFromFile(pszFileName);
+
+	if (pbmp == NULL)
+	{
+		return NULL;
+	}
+
+	EnterCriticalSection(&g_cache.cs);
+
+	// another thread may have loaded it meanwhile
+	p = _CacheFind(pszFileName, iHash, &fad);
+
+	if (p != NULL)
+	{
+		p->nRefs++;
+		_CacheTouch(p);
+		LeaveCriticalSection(&g_cache.cs);
+
+		FreeBitmap(pbmp);
+
+		return &p->bmp;
+	}
+
+	p = (cachebmp_t*)AllocMemory(sizeof(cachebmp_t));
+
+	if (p != NULL)
+	{
+		p->pszFileName = AllocString(pszFileName);
+
+		if (p->pszFileName == NULL)
+		{
+			FreeMemory(p);
+			p = NULL;
+		}
+	}
+
+	if (p == NULL)
+	{
+		LeaveCriticalSection(&g_cache.cs);
+		FreeBitmap(pbmp);
+
+		return NULL;
+	}
+
+	p->bmp = *pbmp;
+	FreeMemory(pbmp);
+
+	p->iHash = iHash;
+	p->nFileSizeHigh = fad.nFileSizeHigh;
+	p->nFileSizeLow = fad.nFileSizeLow;
+	p->ftLastWriteTime = fad.ftLastWriteTime;
+	p->nRefs = 1;
+	p->bStale = false;
+	p->iSize = sizeof(cachebmp_t) + p->bmp.iPitch * p->bmp.iHeight + p->bmp.nColors * sizeof(RGBQUAD);
+
+	p->pNextHash = g_cache.apBuckets[iHash % CACHE_BUCKETS];
+	g_cache.apBuckets[iHash % CACHE_BUCKETS] = p;
+
+	p->pPrev = NULL;
+	p->pNext = g_cache.pHead;
+	if (g_cache.pHead != NULL) g_cache.pHead->pPrev = p; else g_cache.pTail = p;
+	g_cache.pHead = p;
+
+	g_cache.iBytes += p->iSize;
+
+	_CacheTrim(g_cache.iMaxBytes);
+
+	LeaveCriticalSection(&g_cache.cs);
+
+	return &p->bmp;
+}
+
+
+void ReleaseCachedBitmap(bitmap_t* pbmp)
+{
+	cachebmp_t* p = (cachebmp_t*)pbmp;
+
+	EnterCriticalSection(&g_cache.cs);
+
+	if (--p->nRefs == 0)
+	{
+		if (p->bStale)
+		{
+			_CacheFree(p);
+		}
+		else
+		{
+			_CacheTrim(g_cache.iMaxBytes);
+		}
+	}
+
+	LeaveCriticalSection(&g_cache.cs);
+}
+
+
+// bitmaps in use are not counted out, they stay until released
+
+void SetBitmapCacheBudget(size_t iMaxBytes)
+{
+	_InitBitmapCache();
+
+	EnterCriticalSection(&g_cache.cs);
+
+	g_cache.iMaxBytes = iMaxBytes;
+	_CacheTrim(iMaxBytes);
+
+	LeaveCriticalSection(&g_cache.cs);
+}
+
+
+// NULL drops everything, bitmaps in use live on until released
+
+void InvalidateBitmapCache(const char* pszFileName)
+{
+	cachebmp_t* p;
+	cachebmp_t* pNext;
+
+	_InitBitmapCache();
+
+	EnterCriticalSection(&g_cache.cs);
+
+	for (p = g_cache.pHead; p != NULL; p = pNext)
+	{
+		pNext = p->pNext;
+
+		if ((pszFileName == NULL) || AsciiStrEq(p->pszFileName, pszFileName))
+		{
+			_CacheRemove(p);
+
+			if (p->nRefs == 0)
+			{
+				_CacheFree(p);
+			}
+		}
+	}
+
+	LeaveCriticalSection(&g_cache.cs);
+}
+
+
+size_t GetBitmapCacheSize(void)
+{
+	size_t iBytes;
+
+	_InitBitmapCache();
+
+	EnterCriticalSection(&g_cache.cs);
+	iBytes = g_cache.iBytes;
+	LeaveCriticalSection(&g_cache.cs);
+
+	return iBytes;
+}
@@ -36,6 +36,8 @@
 #define DWORD_ALIGNED(v) ((((unsigned int)(v)) + 3) & (-4))
 #define ALIGNED(v, a) ((((v) + ((a) - 1)) / (a)) * (a))
 
+#define CACHE_LINE_SIZE 64
+
 
 #define FStrEq(a, b) (_stricmp((a),(b)) == 0)
 #define FWStrEq(a, b) (wcsicmp((a),(b)) == 0)
@@ -63,6 +65,16 @@ typedef enum { false, true } bool;
 
 
 
+// error codes of the checked functions for untrusted input (...N, ...Ex)
+#define UERR_OK				0
+#define UERR_INVALIDARG		-1
+#define UERR_IO				-2
+#define UERR_FORMAT			-3 // malformed input
+#define UERR_UNSUPPORTED	-4 // valid, but not handled
+#define UERR_TRUNCATED		-5
+#define UERR_OVERFLOW		-6 // size or count out of range
+#define UERR_NOMEM			-7
+
 //
 // custom allocators
 //
@@ -70,15 +82,90 @@ typedef enum { false, true } bool;
 
 void* AllocMemory(size_t iSize);
 void FreeMemory(void* p);
+void* AllocMemoryAligned(size_t iSize, size_t iAlign);
+void FreeMemoryAligned(void* p);
+
+// define UTILS_MEMORY_STATS when building utils.c to count allocations
+typedef struct memstats_s
+{
+	LONG nAllocs;
+	LONG nFrees;
+	LONGLONG iBytes; // total allocated
+} memstats_t;
+
+void GetMemoryStats(memstats_t* pms);
+void ResetMemoryStats(void);
 
 char* AllocString(const char* psz);
 wchar_t* AllocStringW(const wchar_t* psz);
-wchar_t* AllocStringUnicode(const char* pszSrc);
+wchar_t* AllocStringUnicode(const char* pszSrc); // ansi code page
+wchar_t* AllocStringUtf16(const char* psz); // NULL if not valid utf-8
+char* AllocStringUtf8(const wchar_t* psz); // NULL if not valid utf-16
 void FreeStringSafe(const char* psz);
 #define FreeString FreeStringSafe
 void FreeStringSafeW(const wchar_t* psz);
 #define FreeStringW FreeStringSafeW
 
+// FStrEq() without the locale, folds ascii only
+bool_t AsciiStrEq(const char* psz1, const char* psz2);
+bool_t AsciiStrPrefix(const char* psz, const char* pszPrefix);
+unsigned int AsciiStrHash(const char* psz); // equal for AsciiStrEq strings
+bool_t AsciiStrEqW(const wchar_t* psz1, const wchar_t* psz2);
+bool_t AsciiStrPrefixW(const wchar_t* psz, const wchar_t* pszPrefix);
+unsigned int AsciiStrHashW(const wchar_t* psz);
+
+// interned strings, one copy of each kept until the table is freed, so equal strings
+// (ignoring ascii case if asked) give the same pointer, thread safe
+typedef struct strtable_s strtable_t;
+strtable_t* CreateStringTable(bool_t bIgnoreCase); // the first spelling is kept
+const char* InternString(strtable_t* pst, const char* psz); // NULL if out of memory
+const char* InternStringN(strtable_t* pst, const char* psz, int iLength);
+void FreeStringTable(strtable_t* pst);
+
+// validated utf-8 <-> utf-16, iLength -1 for terminated strings, pszDst NULL to get the length,
+// iDstSize includes the terminator, return the length, UERR_FORMAT or UERR_OVERFLOW
+int Utf8ToUtf16(const char* psz, int iLength, wchar_t* pszDst, int iDstSize);
+int Utf16ToUtf8(const wchar_t* psz, int iLength, char* pszDst, int iDstSize);
+
+//
+// profiling, define UTILS_PROFILE when building utils.c
+//
+
+enum
+{
+	PROF_READFILE,
+	PROF_PARSEBUFFER,
+	PROF_PARSEFILE,
+	PROF_PARSEDIRECTORY,
+	PROF_CALLBACKS, // user line and file callbacks
+	PROF_LOADBITMAP,
+	PROF_SAVEBITMAP,
+	PROF_TIMERS
+};
+
+typedef struct profstats_s
+{
+	LONGLONG aiTime[PROF_TIMERS]; // microseconds
+	LONGLONG anCalls[PROF_TIMERS];
+	LONGLONG iBytesRead;
+	LONGLONG nLines;
+	LONGLONG nTokens;
+	LONGLONG nFiles;
+	LONGLONG nPixels;
+} profstats_t;
+
+void GetProfileStats(profstats_t* pps);
+void ResetProfileStats(void);
+bool_t SaveProfileTrace(const char* pszFileName); // chrome trace json
+
+//
+// worker threads used by the bitmap functions
+//
+
+void SetWorkerThreadCount(int nThreads); // 0 - one per cpu (default), 1 - no threads
+int GetWorkerThreadCount(void);
+void ShutdownWorkerThreads(void);
+
 //
 // file name and path functions
 //
@@ -88,14 +175,52 @@ wchar_t* GetExtensionW(const wchar_t* psz);
 char* GetFileName(const char* psz);
 wchar_t* GetFileNameW(const wchar_t* psz);
 
+// parts of a path without copying, dir is psz[0, iDirLength) with its separator,
+// the name follows it and the extension (without the dot) ends the path
+typedef struct pathview_s
+{
+	const char* psz;
+	int iLength;
+	int iDirLength;
+	int iNameLength;
+	int iStemLength; // name without the extension
+	int iExtLength; // 0 if none
+} pathview_t;
+
+void SplitPath(const char* psz, pathview_t* ppv); // one pass
+void SplitPaths(const char** apsz, int nPaths, pathview_t* aViews);
+void ClassifyPathsByExtension(const pathview_t* aViews, int nPaths, const char** apszExts, int nExts, int* aiClass); // index or -1
+
 //void ConcatPath(char* buffer, const char* psz);
 
+// path of any length built in place, don't copy the struct
+typedef struct pathbuf_s
+{
+	char* psz;
+	int iLength;
+	int iMaxLength;
+	char szBuffer[MAX_PATH]; // until it gets longer
+} pathbuf_t;
+
+void InitPathBuffer(pathbuf_t* ppb, const char* pszPath); // pszPath may be NULL
+int AppendPath(pathbuf_t* ppb, const char* psz); // returns the old length or -1
+int PushPath(pathbuf_t* ppb, const char* pszName); // adds "\name", returns the old length or -1
+void TruncatePath(pathbuf_t* ppb, int iLength);
+void FreePathBuffer(pathbuf_t* ppb);
+
 bool_t CreateDirectoryTree(const char* pszPath);
 bool_t CreateDirectoryTreeW(const wchar_t* pszPath);
 
+// remembers the directories that exist, for writing many files
+typedef struct dircache_s dircache_t;
+dircache_t* CreateDirectoryCache(void);
+bool_t CreateDirectoryTreeCached(dircache_t* pdc, const char* pszPath);
+bool_t CreateDirectoryTrees(dircache_t* pdc, const char** apszFileNames, int nFiles); // parents of the files, pdc may be NULL
+void FreeDirectoryCache(dircache_t* pdc);
+
 
 //
-// parser (ANSI only)
+// parser (ANSI, and utf-8 where it says so)
 //
 
 int ToInt(const char* psz);
@@ -107,16 +232,50 @@ int FindString(const char* psz, char** apsz, int nItems);
 int CutChars(char* psz, const char* pszChars);
 int ContractChars(char* psz, const char* pszChars, int cToChar);
 int CutComments(char* psz, const char* pszCommentStart, const char* pszCommentEnd);
+int CutCommentsN(char* psz, int iLen, const char* pszCommentStart, const char* pszCommentEnd); // new length or UERR_
 int FindChar(int c, const char* pszChars);
 #define IsChar(c,psz) (FindChar((c),(psz))!=-1)
 int StripChars(char* psz, const char* pszChars);
 int UnpackQuote(char* psz);
 
 int ParseLine(int argcMax, char* argv[], char* psz, const char* pszDelimiters, char** ppszEndPtr);
+int ParseLineN(int argcMax, char* argv[], char* psz, int iLen, const char* pszDelimiters, char** ppszEndPtr); // argc or UERR_
+
+// utf-8 text, the char sets and delimiters may hold multibyte chars, UERR_FORMAT if anything is
+// not valid utf-8, CutComments works on valid utf-8 as it is
+int ValidateUtf8(const char* psz, int iLength); // length of the valid prefix, iLength -1 for strlen
+int CutCharsUtf8(char* psz, const char* pszChars);
+int ContractCharsUtf8(char* psz, const char* pszChars, int cToChar); // cToChar ascii
+int StripCharsUtf8(char* psz, const char* pszChars);
+int ParseLineUtf8(int argcMax, char* argv[], char* psz, int iLen, const char* pszDelimiters, char** ppszEndPtr); // like ParseLineN
+
+// pull style ParseLine(), the args are cut in place the same way
+typedef struct tokeniter_s
+{
+	char* psz;
+	const char* pszDelimiters;
+	int iNext; // -1 at the end
+	int iLength; // of the last token
+} tokeniter_t;
+
+void BeginTokens(tokeniter_t* pit, char* psz, const char* pszDelimiters);
+char* NextToken(tokeniter_t* pit); // NULL at the end
 
 char* ReadFileToBuffer(const char* pszFileName, int* piSize);
 char* ReadFileToBufferW(const wchar_t* pszFileName, int* piSize);
 
+// read only view of a file
+typedef struct mappedfile_s
+{
+	HANDLE hFile;
+	HANDLE hMapping;
+	const byte_t* pData;
+	size_t iSize;
+} mappedfile_t;
+
+bool_t MapFileToMemory(const char* pszFileName, mappedfile_t* pmf); // fails on empty files
+void UnmapFile(mappedfile_t* pmf);
+
 bool_t SaveToFile(const char* pszFileName, void* buffer, int iSize);
 //void SaveToFileW(const char* pszFileName, void* buffer int iSize);
 
@@ -125,10 +284,93 @@ void ParseBuffer(char* buffer, int iSize, PFLINECALLBACK pfnLineCallback, void*
 bool_t ParseFile(const char* pszFileName, PFLINECALLBACK pfnLineCallback, void* param);
 bool_t ParseFileW(const wchar_t* pszFileName, PFLINECALLBACK pfnLineCallback, void* param);
 
+// pull style ParseBuffer(), the lines are cut in place the same way
+typedef struct lineiter_s
+{
+	char* buffer;
+	int iSize;
+	int iNext; // start of the next line
+	bool_t bOwned; // read by BeginFileLines()
+	int iLength; // of the last line
+} lineiter_t;
+
+void BeginLines(lineiter_t* pit, char* buffer, int iSize); // buffer as for ParseBuffer()
+bool_t BeginFileLines(lineiter_t* pit, const char* pszFileName);
+char* NextLine(lineiter_t* pit); // NULL at the end
+void EndLines(lineiter_t* pit);
+
+// incremental reparse, the state keeps line hashes of the previous run and only
+// changed lines are passed on, iLine is 0 based, pszLine is NULL for deleted lines
+#define LINE_INSERTED	0
+#define LINE_CHANGED	1
+#define LINE_DELETED	2
+typedef struct parsestate_s parsestate_t;
+typedef int (*PFLINEDIFFCALLBACK)(char* pszLine, int iLine, int iChange, void* param); // return 0 to stop, 1 to continue
+parsestate_t* CreateParseState(void);
+void ParseBufferIncremental(parsestate_t* pps, char* buffer, int iSize, PFLINEDIFFCALLBACK pfnLineCallback, void* param);
+bool_t ParseFileIncremental(parsestate_t* pps, const char* pszFileName, PFLINEDIFFCALLBACK pfnLineCallback, void* param);
+void FreeParseState(parsestate_t* pps);
+
 typedef void (*PDFILECALLBACK)(char* pszFileName, WIN32_FIND_DATA* pfd, void* param);
 bool_t ParseDirectory(const char* pszPath, bool_t bSubDirs, PDFILECALLBACK pfnFileCallback, void* param);
 bool_t ParseDirectoryW(const wchar_t* pszPath, bool_t bSubDirs, PDFILECALLBACK pfnFileCallback, void* param);
 
+// pull style ParseDirectory()
+typedef struct diriter_s diriter_t;
+diriter_t* BeginFiles(const char* pszPath, bool_t bSubDirs);
+char* NextFile(diriter_t* pit, WIN32_FIND_DATA** ppfd); // NULL at the end
+bool_t EndFiles(diriter_t* pit); // false if a subdirectory could not be listed
+
+// directory watch (ReadDirectoryChangesW), files only, the events of a file are merged
+// and reported once no new ones came for iDebounceMs, a directory created or moved in
+// reports its files (with bSubDirs), a deleted name may be a directory moved out
+#define WATCH_CREATED	0
+#define WATCH_MODIFIED	1
+#define WATCH_DELETED	2
+#define WATCH_OVERFLOW	3 // changes were lost, pszFileName is the root to rescan
+typedef struct dirwatch_s dirwatch_t;
+typedef void (*PFWATCHCALLBACK)(char* pszFileName, int iChange, void* param);
+dirwatch_t* CreateDirectoryWatch(const char* pszPath, bool_t bSubDirs, int iDebounceMs);
+int PollDirectoryWatch(dirwatch_t* pdw, int iTimeoutMs, PFWATCHCALLBACK pfnWatchCallback, void* param); // -1 waits forever
+int PollDirectoryWatchFiles(dirwatch_t* pdw, int iTimeoutMs, PDFILECALLBACK pfnFileCallback, PFLINECALLBACK pfnLineCallback, void* param);
+void FreeDirectoryWatch(dirwatch_t* pdw);
+
+// on-disk index of a directory tree, refreshed by comparing directory times so unchanged
+// directories are not listed again, a missing or damaged index file loads empty
+typedef struct dirindex_s dirindex_t;
+dirindex_t* LoadDirectoryIndex(const char* pszIndexFile); // the file is mapped, not read
+bool_t UpdateDirectoryIndex(dirindex_t* pdi, const char* pszPath);
+bool_t SaveDirectoryIndex(dirindex_t* pdi, const char* pszIndexFile);
+bool_t EnumDirectoryIndex(dirindex_t* pdi, bool_t bSubDirs, PDFILECALLBACK pfnFileCallback, void* param);
+void FreeDirectoryIndex(dirindex_t* pdi);
+
+// tokenized text files: comments are cut from the whole file (a block comment still
+// ends the line it starts on), then on each line the pszContract chars are contracted
+// and the non empty lines are split by ParseLine()
+typedef struct parsespec_s
+{
+	const char* pszCommentStart; // NULL for none
+	const char* pszCommentEnd; // NULL for line comments
+	const char* pszContract; // NULL for none
+	int cContract;
+	const char* pszDelimiters;
+	int argcMax; // further args of a line are dropped
+} parsespec_t;
+typedef int (*PFTOKENCALLBACK)(int argc, char* argv[], int iLine, void* param); // return 0 to stop, 1 to continue
+bool_t ParseFileTokens(const char* pszFileName, const parsespec_t* pspec, PFTOKENCALLBACK pfnTokenCallback, void* param);
+// the same, replayed from a binary cache file while the text and the spec are unchanged
+bool_t ParseFileCached(const char* pszFileName, const char* pszCacheFile, const parsespec_t* pspec, PFTOKENCALLBACK pfnTokenCallback, void* param);
+
+// offsets of the lines of a text for random access, built in parallel, the lines
+// given back point into the text and are not terminated
+typedef struct lineindex_s lineindex_t;
+lineindex_t* BuildLineIndex(const char* pText, size_t iSize); // pText must stay until the index is freed
+lineindex_t* OpenLineIndex(const char* pszFileName, const char* pszIndexFile); // the file is mapped, the index kept in pszIndexFile if not NULL
+int GetLineCount(const lineindex_t* pli);
+const char* GetIndexedLine(const lineindex_t* pli, int iLine, int* piLength); // without "\r\n", NULL if out of range
+const char* GetIndexedLines(const lineindex_t* pli, int iFirst, int iLast, size_t* piLength); // iFirst to iLast, as in the text
+void FreeLineIndex(lineindex_t* pli);
+
 
 //
 // bitmap support
@@ -143,15 +385,54 @@ typedef struct bitmap_s
 	byte_t* pixels;
 	int nColors;
 	RGBQUAD* pal;
+	byte_t* pAlignedPixels; // pixels from AllocBitmap(), other pixels are FreeMemory()'d
 } bitmap_t;
 
 bitmap_t* AllocBitmap( int iWidth, int iHeight, int nBPP, int nColors ); // need testing
+bitmap_t* AllocBitmapEx( int iWidth, int iHeight, int nBPP, int nColors, int iRowAlign ); // a power of two, e.g. 32 or 64 for simd
 bitmap_t* LoadBitmapFromFile(const char* pszFileName);
-void FreeBitmap(bitmap_t* pbmp);
+bitmap_t* LoadBitmapFromFileEx(const char* pszFileName, int* piError); // checks the headers, piError gets UERR_
+void FreeBitmap(bitmap_t* pbmp); // pixels and pal attached by hand must come from AllocMemory()
 
 bool_t SaveBitmap(const char* pszFileName, bitmap_t* pbmp);
 bool_t SaveBitmapIndirect(const char* pszFileName, int iWidth, int iHeight, int nBPP, int iPitch, byte_t* pixels, int nColors, RGBQUAD* pal);
 
+// lossless qoi (qoiformat.org) instead of bmp, a fraction of the size
+bool_t SaveBitmapQOI(const char* pszFileName, bitmap_t* pbmp);
+bool_t SaveBitmapIndirectQOI(const char* pszFileName, int iWidth, int iHeight, int nBPP, int iPitch, byte_t* pixels, int nColors, RGBQUAD* pal);
+
+// 8 (paletted) -> 24/32, 24 <-> 32, same format copy
+bool_t ConvertBitmap(bitmap_t* pbmpDst, bitmap_t* pbmpSrc);
+bitmap_t* AllocConvertedBitmap(bitmap_t* pbmp, int nBPP);
+
+bool_t BlitBitmap(bitmap_t* pbmpDst, int xDst, int yDst, bitmap_t* pbmpSrc, int xSrc, int ySrc, int iWidth, int iHeight);
+void FlipBitmapVertical(bitmap_t* pbmp);
+void FlipBitmapHorizontal(bitmap_t* pbmp);
+bool_t GetBitmapView(bitmap_t* pbmpView, bitmap_t* pbmp, int x, int y, int iWidth, int iHeight); // shares pixels, no FreeBitmap()
+
+#define SCALE_POINT		0
+#define SCALE_BOX		1 // downscale only
+#define SCALE_BILINEAR	2
+
+bool_t ScaleBitmap(bitmap_t* pbmpDst, bitmap_t* pbmpSrc, int iFilter);
+
+// recycles released bitmaps of the same width, height, nBPP and nColors
+typedef struct bmppool_s bmppool_t;
+
+bmppool_t* CreateBitmapPool(size_t iMaxBytes);
+bitmap_t* AllocBitmapFromPool(bmppool_t* pbp, int iWidth, int iHeight, int nBPP, int nColors);
+void ReleaseBitmapToPool(bmppool_t* pbp, bitmap_t* pbmp);
+void TrimBitmapPool(bmppool_t* pbp, size_t iMaxBytes);
+size_t GetBitmapPoolSize(bmppool_t* pbp);
+void FreeBitmapPool(bmppool_t* pbp);
+
+// shared decoded bitmaps keyed by path, size and write time, thread safe
+bitmap_t* LoadBitmapCached(const char* pszFileName); // read only
+void ReleaseCachedBitmap(bitmap_t* pbmp);
+void SetBitmapCacheBudget(size_t iMaxBytes);
+void InvalidateBitmapCache(const char* pszFileName); // NULL for all
+size_t GetBitmapCacheSize(void);
+
 
 #ifdef __cplusplus
 }
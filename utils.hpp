@@ -0,0 +1,289 @@
+
+// Copyright (c) 2009-2020, Ilya Lyutin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+// header only C++17 layer over utils.h
+// the parse funcs are templates on the callable and loop over the pull
+// iterators, so a lambda is inlined instead of called through a pointer
+
+#ifndef _UTIL_HPP
+#define _UTIL_HPP
+
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "utils.h"
+
+namespace utils
+{
+
+namespace detail
+{
+
+// the callable may return void, or false to stop
+template <typename F, typename... A>
+inline bool Call(F& fn, A&&... args)
+{
+	if constexpr (std::is_void_v<std::invoke_result_t<F&, A...>>)
+	{
+		fn(std::forward<A>(args)...);
+		return true;
+	}
+	else
+	{
+		return static_cast<bool>(fn(std::forward<A>(args)...));
+	}
+}
+
+} // namespace detail
+
+
+// file read by ReadFileToBuffer(), freed with FreeMemory()
+
+class Buffer
+{
+public:
+	Buffer() : m_buffer(NULL), m_iSize(0) {}
+	explicit Buffer(const char* pszFileName) : m_iSize(0) { m_buffer = ReadFileToBuffer(pszFileName, &m_iSize); }
+	explicit Buffer(const wchar_t* pszFileName) : m_iSize(0) { m_buffer = ReadFileToBufferW(pszFileName, &m_iSize); }
+	~Buffer() { reset(); }
+
+	Buffer(const Buffer&) = delete;
+	Buffer& operator=(const Buffer&) = delete;
+
+	Buffer(Buffer&& other) noexcept : m_buffer(other.m_buffer), m_iSize(other.m_iSize)
+	{
+		other.m_buffer = NULL;
+		other.m_iSize = 0;
+	}
+
+	Buffer& operator=(Buffer&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			std::swap(m_buffer, other.m_buffer);
+			std::swap(m_iSize, other.m_iSize);
+		}
+
+		return *this;
+	}
+
+	char* data() const { return m_buffer; }
+	int size() const { return m_iSize; }
+	std::string_view view() const { return std::string_view(m_buffer, (m_buffer != NULL)? m_iSize: 0); }
+	explicit operator bool() const { return m_buffer != NULL; }
+
+	void reset()
+	{
+		if (m_buffer != NULL)
+		{
+			FreeMemory(m_buffer);
+		}
+
+		m_buffer = NULL;
+		m_iSize = 0;
+	}
+
+private:
+	char* m_buffer;
+	int m_iSize;
+};
+
+
+// owned bitmap_t, freed with FreeBitmap()
+// not for LoadBitmapCached() or pool bitmaps, those have their own release
+
+class Bitmap
+{
+public:
+	Bitmap() : m_pbmp(NULL) {}
+	explicit Bitmap(bitmap_t* pbmp) : m_pbmp(pbmp) {} // takes ownership
+	explicit Bitmap(const char* pszFileName) : m_pbmp(LoadBitmapFromFile(pszFileName)) {}
+	Bitmap(int iWidth, int iHeight, int iBpp, int nColors) : m_pbmp(AllocBitmap(iWidth, iHeight, iBpp, nColors)) {}
+	~Bitmap() { reset(); }
+
+	Bitmap(const Bitmap&) = delete;
+	Bitmap& operator=(const Bitmap&) = delete;
+
+	Bitmap(Bitmap&& other) noexcept : m_pbmp(other.release()) {}
+
+	Bitmap& operator=(Bitmap&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset(other.release());
+		}
+
+		return *this;
+	}
+
+	bitmap_t* get() const { return m_pbmp; }
+	bitmap_t* operator->() const { return m_pbmp; }
+	explicit operator bool() const { return m_pbmp != NULL; }
+
+	bitmap_t* release()
+	{
+		bitmap_t* pbmp = m_pbmp;
+
+		m_pbmp = NULL;
+
+		return pbmp;
+	}
+
+	void reset(bitmap_t* pbmp = NULL)
+	{
+		if (m_pbmp != NULL)
+		{
+			FreeBitmap(m_pbmp);
+		}
+
+		m_pbmp = pbmp;
+	}
+
+	bool Save(const char* pszFileName) const { return SaveBitmap(pszFileName, m_pbmp) != 0; }
+
+private:
+	bitmap_t* m_pbmp;
+};
+
+
+// ParseBuffer() with fn(std::string_view line), or fn(char* pszLine) to work
+// on the line in place, the buffer is cut as ParseBuffer() does
+
+template <typename F>
+inline void ParseBuffer(char* buffer, int iSize, F&& fn)
+{
+	lineiter_t it;
+	char* pszLine;
+
+	BeginLines(&it, buffer, iSize);
+
+	while ((pszLine = NextLine(&it)) != NULL)
+	{
+		bool bContinue;
+
+		if constexpr (std::is_invocable_v<F&, std::string_view>)
+		{
+			bContinue = detail::Call(fn, std::string_view(pszLine, it.iLength));
+		}
+		else
+		{
+			bContinue = detail::Call(fn, pszLine);
+		}
+
+		if (!bContinue)
+		{
+			break;
+		}
+	}
+}
+
+
+template <typename F>
+inline void ParseBuffer(Buffer& buffer, F&& fn)
+{
+	if (buffer)
+	{
+		ParseBuffer(buffer.data(), buffer.size(), std::forward<F>(fn));
+	}
+}
+
+
+template <typename F>
+inline bool ParseFile(const char* pszFileName, F&& fn)
+{
+	Buffer buffer(pszFileName);
+
+	if (!buffer)
+	{
+		return false;
+	}
+
+	ParseBuffer(buffer, std::forward<F>(fn));
+
+	return true;
+}
+
+
+// ParseLine() with fn(std::string_view arg), returns the number of args given
+
+template <typename F>
+inline int ParseTokens(char* psz, const char* pszDelimiters, F&& fn)
+{
+	tokeniter_t it;
+	char* pszToken;
+	int n;
+
+	BeginTokens(&it, psz, pszDelimiters);
+	n = 0;
+
+	while ((pszToken = NextToken(&it)) != NULL)
+	{
+		n++;
+
+		if (!detail::Call(fn, std::string_view(pszToken, it.iLength)))
+		{
+			break;
+		}
+	}
+
+	return n;
+}
+
+
+// directory walk with fn(std::string_view path, const WIN32_FIND_DATA& fd),
+// false if pszPath or one of its subdirs could not be listed
+
+template <typename F>
+inline bool ParseDirectory(const char* pszPath, bool bSubDirs, F&& fn)
+{
+	struct guard_t
+	{
+		diriter_t* pit;
+		~guard_t() { if (pit != NULL) EndFiles(pit); }
+	} guard = { BeginFiles(pszPath, bSubDirs) };
+	WIN32_FIND_DATA* pfd;
+	char* pszFile;
+
+	if (guard.pit == NULL)
+	{
+		return false;
+	}
+
+	while ((pszFile = NextFile(guard.pit, &pfd)) != NULL)
+	{
+		if (!detail::Call(fn, std::string_view(pszFile), static_cast<const WIN32_FIND_DATA&>(*pfd)))
+		{
+			break;
+		}
+	}
+
+	diriter_t* pit = guard.pit;
+	guard.pit = NULL;
+
+	return EndFiles(pit) != 0;
+}
+
+} // namespace utils
+
+#endif // _UTIL_HPP